@@ -250,6 +250,14 @@ endif
 
 ifneq ($(TARGET_BUILD_VARIANT),user)
     LOCAL_SRC_FILES += unittest.c
+    LOCAL_STATIC_LIBRARIES += libelfloader-$(TARGET_BUILD_VARIANT)
+    LOCAL_C_INCLUDES += $(addprefix $(LOCAL_PATH)/,libfastboot)
+ifeq ($(TARGET_USE_TRUSTY),true)
+    LOCAL_C_INCLUDES += \
+	$(addprefix $(LOCAL_PATH)/,libqltipc/ql-tipc/include) \
+	$(addprefix $(LOCAL_PATH)/,libqltipc/ql-tipc/arch/x86) \
+	$(addprefix $(LOCAL_PATH)/,libqltipc/interface/include)
+endif
 endif
 
 LOCAL_CFLAGS := $(SHARED_CFLAGS)
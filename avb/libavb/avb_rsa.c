@@ -37,17 +37,68 @@
 #include "avb_util.h"
 #include "avb_vbmeta_image.h"
 
+/* Arithmetic is done on the widest limbs for which the compiler provides
+ * a double-width type.
+ */
+#if defined(__SIZEOF_INT128__)
+typedef uint64_t avb_limb;
+typedef unsigned __int128 avb_dlimb;
+#else
+typedef uint32_t avb_limb;
+typedef uint64_t avb_dlimb;
+#endif
+
+#define AVB_LIMB_BITS (8 * sizeof(avb_limb))
+#define AVB_RSA_MAX_BITS 8192
+#define AVB_RSA_MAX_LIMBS (AVB_RSA_MAX_BITS / AVB_LIMB_BITS)
+
 typedef struct IAvbKey {
-  unsigned int len; /* Length of n[] in number of uint32_t */
-  uint32_t n0inv;   /* -1 / n[0] mod 2^32 */
-  uint32_t* n;      /* modulus as array (host-byte order) */
-  uint32_t* rr;     /* R^2 as array (host-byte order) */
+  unsigned int len;                  /* Length of n[] in number of limbs */
+  avb_limb n0inv;                    /* -1 / n[0] mod 2^AVB_LIMB_BITS */
+  avb_limb n[AVB_RSA_MAX_LIMBS];     /* modulus as array (host-byte order) */
+  avb_limb rr[AVB_RSA_MAX_LIMBS];    /* R^2 as array (host-byte order) */
 } IAvbKey;
 
-static IAvbKey* iavb_parse_key_data(const uint8_t* data, size_t length) {
+/* Convert a big endian byte array of |len| limbs to a little endian limb
+ * array.
+ */
+static void be_bytes_to_limbs(avb_limb* out,
+                              const uint8_t* in,
+                              unsigned int len) {
+  unsigned int i, j;
+
+  for (i = 0; i < len; i++) {
+    const uint8_t* p = in + (len - 1 - i) * sizeof(avb_limb);
+    avb_limb v = 0;
+    for (j = 0; j < sizeof(avb_limb); j++) {
+      v = (v << 8) | p[j];
+    }
+    out[i] = v;
+  }
+}
+
+/* Convert a little endian limb array of |len| limbs to a big endian byte
+ * array.
+ */
+static void limbs_to_be_bytes(uint8_t* out,
+                              const avb_limb* in,
+                              unsigned int len) {
+  unsigned int i, j;
+
+  for (i = len; i;) {
+    avb_limb v = in[--i];
+    for (j = sizeof(avb_limb); j;) {
+      *out++ = (uint8_t)(v >> (8 * --j));
+    }
+  }
+}
+
+static bool iavb_parse_key_data(IAvbKey* key,
+                                const uint8_t* data,
+                                size_t length) {
   AvbRSAPublicKeyHeader h;
-  IAvbKey* key = NULL;
   size_t expected_length;
+  avb_limb inv;
   unsigned int i;
   const uint8_t* n;
   const uint8_t* rr;
@@ -55,117 +106,215 @@ static IAvbKey* iavb_parse_key_data(const uint8_t* data, size_t length) {
   if (!avb_rsa_public_key_header_validate_and_byteswap(
           (const AvbRSAPublicKeyHeader*)data, &h)) {
     avb_error("Invalid key.\n");
-    goto fail;
+    return false;
   }
 
   if (!(h.key_num_bits == 2048 || h.key_num_bits == 4096 ||
         h.key_num_bits == 8192)) {
     avb_error("Unexpected key length.\n");
-    goto fail;
+    return false;
   }
 
   expected_length = sizeof(AvbRSAPublicKeyHeader) + 2 * h.key_num_bits / 8;
   if (length != expected_length) {
     avb_error("Key does not match expected length.\n");
-    goto fail;
+    return false;
   }
 
   n = data + sizeof(AvbRSAPublicKeyHeader);
   rr = data + sizeof(AvbRSAPublicKeyHeader) + h.key_num_bits / 8;
 
-  /* Store n and rr following the key header so we only have to do one
-   * allocation.
-   */
-  key = (IAvbKey*)(avb_malloc(sizeof(IAvbKey) + 2 * h.key_num_bits / 8));
-  if (key == NULL) {
-    goto fail;
-  }
-
-  key->len = h.key_num_bits / 32;
-  key->n0inv = h.n0inv;
-  key->n = (uint32_t*)(key + 1); /* Skip ahead sizeof(IAvbKey) bytes. */
-  key->rr = key->n + key->len;
-
   /* Crypto-code below (modpowF4() and friends) expects the key in
    * little-endian format (rather than the format we're storing the
    * key in), so convert it.
    */
-  for (i = 0; i < key->len; i++) {
-    key->n[i] = avb_be32toh(((uint32_t*)n)[key->len - i - 1]);
-    key->rr[i] = avb_be32toh(((uint32_t*)rr)[key->len - i - 1]);
+  key->len = h.key_num_bits / AVB_LIMB_BITS;
+  be_bytes_to_limbs(key->n, n, key->len);
+  be_bytes_to_limbs(key->rr, rr, key->len);
+
+  if (!(key->n[0] & 1)) {
+    avb_error("Invalid key.\n");
+    return false;
+  }
+
+  /* The header only carries -1 / n[0] mod 2^32, compute the inverse for
+   * the limb size with Newton's iteration: each step doubles the number
+   * of correct bits, starting with 3 bits for n[0] * n[0] = 1 mod 8.
+   */
+  inv = key->n[0];
+  for (i = 3; i < AVB_LIMB_BITS; i *= 2) {
+    inv *= 2 - key->n[0] * inv;
   }
-  return key;
+  key->n0inv = -inv;
 
-fail:
-  if (key != NULL) {
-    avb_free(key);
+  if ((uint32_t)key->n0inv != h.n0inv) {
+    avb_error("Invalid key.\n");
+    return false;
   }
-  return NULL;
-}
 
-static void iavb_free_parsed_key(IAvbKey* key) {
-  avb_free(key);
+  return true;
 }
 
-/* a[] -= mod */
-static void subM(const IAvbKey* key, uint32_t* a) {
-  int64_t A = 0;
+/* a[] -= mod if mask is all ones, a[] is unchanged if mask is zero. */
+static void subM(const IAvbKey* key, avb_limb* a, avb_limb mask) {
+  avb_limb borrow = 0;
+  avb_dlimb A;
   uint32_t i;
   for (i = 0; i < key->len; ++i) {
-    A += (uint64_t)a[i] - key->n[i];
-    a[i] = (uint32_t)A;
-    A >>= 32;
+    A = (avb_dlimb)a[i] - (key->n[i] & mask) - borrow;
+    a[i] = (avb_limb)A;
+    borrow = (avb_limb)(A >> AVB_LIMB_BITS) & 1;
   }
 }
 
-/* return a[] >= mod */
-static int geM(const IAvbKey* key, uint32_t* a) {
+/* return a[] >= mod, in constant time */
+static avb_limb geM(const IAvbKey* key, const avb_limb* a) {
+  avb_limb borrow = 0;
+  avb_dlimb A;
   uint32_t i;
-  for (i = key->len; i;) {
-    --i;
-    if (a[i] < key->n[i]) {
-      return 0;
-    }
-    if (a[i] > key->n[i]) {
-      return 1;
-    }
+  for (i = 0; i < key->len; ++i) {
+    A = (avb_dlimb)a[i] - key->n[i] - borrow;
+    borrow = (avb_limb)(A >> AVB_LIMB_BITS) & 1;
   }
-  return 1; /* equal */
+  return borrow ^ 1;
 }
 
 /* montgomery c[] += a * b[] / R % mod */
 static void montMulAdd(const IAvbKey* key,
-                       uint32_t* c,
-                       const uint32_t a,
-                       const uint32_t* b) {
-  uint64_t A = (uint64_t)a * b[0] + c[0];
-  uint32_t d0 = (uint32_t)A * key->n0inv;
-  uint64_t B = (uint64_t)d0 * key->n[0] + (uint32_t)A;
+                       avb_limb* c,
+                       const avb_limb a,
+                       const avb_limb* b) {
+  avb_dlimb A = (avb_dlimb)a * b[0] + c[0];
+  avb_limb d0 = (avb_limb)A * key->n0inv;
+  avb_dlimb B = (avb_dlimb)d0 * key->n[0] + (avb_limb)A;
+  uint32_t i;
+
+  for (i = 1; i < key->len; ++i) {
+    A = (A >> AVB_LIMB_BITS) + (avb_dlimb)a * b[i] + c[i];
+    B = (B >> AVB_LIMB_BITS) + (avb_dlimb)d0 * key->n[i] + (avb_limb)A;
+    c[i - 1] = (avb_limb)B;
+  }
+
+  A = (A >> AVB_LIMB_BITS) + (B >> AVB_LIMB_BITS);
+
+  c[i - 1] = (avb_limb)A;
+
+  subM(key, c, -(avb_limb)(A >> AVB_LIMB_BITS));
+}
+
+#if defined(__x86_64__) && defined(__SIZEOF_INT128__)
+/* c[] += a * b[], returns the carry limb.  len must be a multiple of 4.
+ * The carry chains of the low and high halves of the products are kept
+ * apart in CF and OF with ADCX and ADOX, so the loop must not touch any
+ * other flag.
+ */
+static avb_limb mulAdd_adx(avb_limb* c,
+                           const avb_limb* b,
+                           avb_limb a,
+                           unsigned int len) {
+  unsigned long count = len;
+  avb_limb carry;
+
+  __asm__ volatile(
+      "xor %%r8d, %%r8d\n\t"
+      "1:\n\t"
+      "mulx 0(%[b]), %%rax, %%r9\n\t"
+      "adcx 0(%[c]), %%rax\n\t"
+      "adox %%r8, %%rax\n\t"
+      "mov %%rax, 0(%[c])\n\t"
+      "mulx 8(%[b]), %%rax, %%r8\n\t"
+      "adcx 8(%[c]), %%rax\n\t"
+      "adox %%r9, %%rax\n\t"
+      "mov %%rax, 8(%[c])\n\t"
+      "mulx 16(%[b]), %%rax, %%r9\n\t"
+      "adcx 16(%[c]), %%rax\n\t"
+      "adox %%r8, %%rax\n\t"
+      "mov %%rax, 16(%[c])\n\t"
+      "mulx 24(%[b]), %%rax, %%r8\n\t"
+      "adcx 24(%[c]), %%rax\n\t"
+      "adox %%r9, %%rax\n\t"
+      "mov %%rax, 24(%[c])\n\t"
+      "lea 32(%[b]), %[b]\n\t"
+      "lea 32(%[c]), %[c]\n\t"
+      "lea -4(%[count]), %[count]\n\t"
+      "jrcxz 2f\n\t"
+      "jmp 1b\n\t"
+      "2:\n\t"
+      "mov $0, %%eax\n\t"
+      "adcx %%rax, %%r8\n\t"
+      "adox %%rax, %%r8\n\t"
+      "mov %%r8, %[carry]\n\t"
+      : [c] "+r"(c), [b] "+r"(b), [count] "+c"(count), [carry] "=r"(carry)
+      : "d"(a)
+      : "rax", "r8", "r9", "cc", "memory");
+
+  return carry;
+}
+
+/* montgomery c[] += a * b[] / R % mod, MULX/ADCX/ADOX version */
+static void montMulAdd_adx(const IAvbKey* key,
+                           avb_limb* c,
+                           const avb_limb a,
+                           const avb_limb* b) {
+  avb_limb hi, top, d0;
   uint32_t i;
 
+  hi = mulAdd_adx(c, b, a, key->len);
+  d0 = c[0] * key->n0inv;
+  top = mulAdd_adx(c, key->n, d0, key->len);
+
+  /* c[0] is now zero, divide by the limb size. */
   for (i = 1; i < key->len; ++i) {
-    A = (A >> 32) + (uint64_t)a * b[i] + c[i];
-    B = (B >> 32) + (uint64_t)d0 * key->n[i] + (uint32_t)A;
-    c[i - 1] = (uint32_t)B;
+    c[i - 1] = c[i];
   }
+  top += hi;
+  c[i - 1] = top;
+
+  subM(key, c, -(avb_limb)(top < hi));
+}
 
-  A = (A >> 32) + (B >> 32);
+#define CPUID_EBX_BMI2 (1 << 8)
+#define CPUID_EBX_ADX (1 << 19)
 
-  c[i - 1] = (uint32_t)A;
+static bool has_adx(void) {
+  static int adx = -1;
+  uint32_t reg[4];
 
-  if (A >> 32) {
-    subM(key, c);
+  if (adx == -1) {
+    cpuid(0, reg);
+    adx = reg[0] >= 7;
+    if (adx) {
+      /* BMI2 provides MULX, ADX provides ADCX and ADOX. */
+      cpuid(7, reg);
+      adx = (reg[1] & CPUID_EBX_BMI2) && (reg[1] & CPUID_EBX_ADX);
+    }
   }
+
+  return adx;
+}
+#else
+static bool has_adx(void) {
+  return false;
 }
+#define montMulAdd_adx montMulAdd
+#endif
 
 /* montgomery c[] = a[] * b[] / R % mod */
-static void montMul(const IAvbKey* key, uint32_t* c, uint32_t* a, uint32_t* b) {
+static void montMul(const IAvbKey* key,
+                    avb_limb* c,
+                    const avb_limb* a,
+                    const avb_limb* b,
+                    bool adx) {
   uint32_t i;
   for (i = 0; i < key->len; ++i) {
     c[i] = 0;
   }
   for (i = 0; i < key->len; ++i) {
-    montMulAdd(key, c, a[i], b);
+    if (adx) {
+      montMulAdd_adx(key, c, a[i], b);
+    } else {
+      montMulAdd(key, c, a[i], b);
+    }
   }
 }
 
@@ -173,56 +322,28 @@ static void montMul(const IAvbKey* key, uint32_t* c, uint32_t* a, uint32_t* b) {
  * Input and output big-endian byte array in inout.
  */
 static void modpowF4(const IAvbKey* key, uint8_t* inout) {
-  uint32_t* a = (uint32_t*)avb_malloc(key->len * sizeof(uint32_t));
-  uint32_t* aR = (uint32_t*)avb_malloc(key->len * sizeof(uint32_t));
-  uint32_t* aaR = (uint32_t*)avb_malloc(key->len * sizeof(uint32_t));
-  if (a == NULL || aR == NULL || aaR == NULL) {
-    goto out;
-  }
-
-  uint32_t* aaa = aaR; /* Re-use location. */
+  avb_limb a[AVB_RSA_MAX_LIMBS];
+  avb_limb aR[AVB_RSA_MAX_LIMBS];
+  avb_limb aaR[AVB_RSA_MAX_LIMBS];
+  avb_limb* aaa = aaR; /* Re-use location. */
+  bool adx = has_adx() && (key->len % 4) == 0;
   int i;
 
-  /* Convert from big endian byte array to little endian word array. */
-  for (i = 0; i < (int)key->len; ++i) {
-    uint32_t tmp = (inout[((key->len - 1 - i) * 4) + 0] << 24) |
-                   (inout[((key->len - 1 - i) * 4) + 1] << 16) |
-                   (inout[((key->len - 1 - i) * 4) + 2] << 8) |
-                   (inout[((key->len - 1 - i) * 4) + 3] << 0);
-    a[i] = tmp;
-  }
+  /* Convert from big endian byte array to little endian limb array. */
+  be_bytes_to_limbs(a, inout, key->len);
 
-  montMul(key, aR, a, key->rr); /* aR = a * RR / R mod M   */
+  montMul(key, aR, a, key->rr, adx); /* aR = a * RR / R mod M   */
   for (i = 0; i < 16; i += 2) {
-    montMul(key, aaR, aR, aR);  /* aaR = aR * aR / R mod M */
-    montMul(key, aR, aaR, aaR); /* aR = aaR * aaR / R mod M */
+    montMul(key, aaR, aR, aR, adx);  /* aaR = aR * aR / R mod M */
+    montMul(key, aR, aaR, aaR, adx); /* aR = aaR * aaR / R mod M */
   }
-  montMul(key, aaa, aR, a); /* aaa = aR * a / R mod M */
+  montMul(key, aaa, aR, a, adx); /* aaa = aR * a / R mod M */
 
   /* Make sure aaa < mod; aaa is at most 1x mod too large. */
-  if (geM(key, aaa)) {
-    subM(key, aaa);
-  }
+  subM(key, aaa, -geM(key, aaa));
 
   /* Convert to bigendian byte array */
-  for (i = (int)key->len - 1; i >= 0; --i) {
-    uint32_t tmp = aaa[i];
-    *inout++ = (uint8_t)(tmp >> 24);
-    *inout++ = (uint8_t)(tmp >> 16);
-    *inout++ = (uint8_t)(tmp >> 8);
-    *inout++ = (uint8_t)(tmp >> 0);
-  }
-
-out:
-  if (a != NULL) {
-    avb_free(a);
-  }
-  if (aR != NULL) {
-    avb_free(aR);
-  }
-  if (aaR != NULL) {
-    avb_free(aaR);
-  }
+  limbs_to_be_bytes(inout, aaa, key->len);
 }
 
 /* Verify a RSA PKCS1.5 signature against an expected hash.
@@ -236,8 +357,8 @@ bool avb_rsa_verify(const uint8_t* key,
                     size_t hash_num_bytes,
                     const uint8_t* padding,
                     size_t padding_num_bytes) {
-  uint8_t* buf = NULL;
-  IAvbKey* parsed_key = NULL;
+  uint8_t buf[AVB_RSA_MAX_BITS / 8];
+  IAvbKey parsed_key;
   bool success = false;
 
   if (key == NULL || sig == NULL || hash == NULL || padding == NULL) {
@@ -245,13 +366,12 @@ bool avb_rsa_verify(const uint8_t* key,
     goto out;
   }
 
-  parsed_key = iavb_parse_key_data(key, key_num_bytes);
-  if (parsed_key == NULL) {
+  if (!iavb_parse_key_data(&parsed_key, key, key_num_bytes)) {
     avb_error("Error parsing key.\n");
     goto out;
   }
 
-  if (sig_num_bytes != (parsed_key->len * sizeof(uint32_t))) {
+  if (sig_num_bytes != (parsed_key.len * sizeof(avb_limb))) {
     avb_error("Signature length does not match key length.\n");
     goto out;
   }
@@ -261,14 +381,9 @@ bool avb_rsa_verify(const uint8_t* key,
     goto out;
   }
 
-  buf = (uint8_t*)avb_malloc(sig_num_bytes);
-  if (buf == NULL) {
-    avb_error("Error allocating memory.\n");
-    goto out;
-  }
   avb_memcpy(buf, sig, sig_num_bytes);
 
-  modpowF4(parsed_key, buf);
+  modpowF4(&parsed_key, buf);
 
   /* Check padding bytes.
    *
@@ -289,11 +404,5 @@ bool avb_rsa_verify(const uint8_t* key,
   success = true;
 
 out:
-  if (parsed_key != NULL) {
-    iavb_free_parsed_key(parsed_key);
-  }
-  if (buf != NULL) {
-    avb_free(buf);
-  }
   return success;
 }
@@ -31,6 +31,10 @@
 #include "lib.h"
 #include "log.h"
 #include "security.h"
+#include "android.h"
+#include "misc_cache.h"
+#include "prefetch.h"
+#include "block_cache.h"
 #ifdef USE_TPM
 #include "tpm2_security.h"
 #endif
@@ -40,6 +44,25 @@ extern char _binary_avb_pk_end;
 #define avb_pk (&_binary_avb_pk_start)
 #define avb_pk_size ((size_t)&_binary_avb_pk_end - (size_t)&_binary_avb_pk_start)
 
+/* The A/B metadata lives in the head of the misc partition which is
+ * read once and written back by the misc cache.
+ */
+static bool is_misc_cached(const char* partition_name,
+                           int64_t offset_from_partition,
+                           size_t num_bytes) {
+  return avb_strcmp(partition_name, "misc") == 0 &&
+         offset_from_partition >= 0 &&
+         (uint64_t)offset_from_partition <= MISC_CACHE_SIZE &&
+         num_bytes <= (uint64_t)(MISC_CACHE_SIZE - offset_from_partition);
+}
+
+static AvbIOResult misc_cache_result(EFI_STATUS efi_ret) {
+  if (efi_ret == EFI_NOT_FOUND) {
+    return AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
+  }
+  return EFI_ERROR(efi_ret) ? AVB_IO_RESULT_ERROR_IO : AVB_IO_RESULT_OK;
+}
+
 static AvbIOResult read_from_partition(__attribute__((unused)) AvbOps* ops,
                                        const char* partition_name,
                                        int64_t offset_from_partition,
@@ -55,6 +78,12 @@ static AvbIOResult read_from_partition(__attribute__((unused)) AvbOps* ops,
   avb_assert(buf != NULL);
   avb_assert(out_num_read != NULL);
 
+  if (is_misc_cached(partition_name, offset_from_partition, num_bytes)) {
+    *out_num_read = num_bytes;
+    return misc_cache_result(
+        misc_cache_read(offset_from_partition, buf, num_bytes));
+  }
+
   label = stra_to_str((const CHAR8 *)partition_name);
 
   if (!label) {
@@ -88,11 +117,14 @@ static AvbIOResult read_from_partition(__attribute__((unused)) AvbOps* ops,
   else
     *out_num_read = num_bytes;
 
-  efi_ret = uefi_call_wrapper(
-      gpart.dio->ReadDisk,
-      5,
+  efi_ret = prefetch_read(label, offset_from_partition, *out_num_read, buf);
+  if (!EFI_ERROR(efi_ret)) {
+    return AVB_IO_RESULT_OK;
+  }
+
+  efi_ret = block_cache_read(
+      gpart.bio,
       gpart.dio,
-      gpart.bio->Media->MediaId,
       (gpart.part.starting_lba * gpart.bio->Media->BlockSize) +
           offset_from_partition,
       *out_num_read,
@@ -106,6 +138,70 @@ static AvbIOResult read_from_partition(__attribute__((unused)) AvbOps* ops,
   return AVB_IO_RESULT_OK;
 }
 
+static AvbIOResult get_preloaded_partition(AvbOps* ops,
+                                           const char* partition,
+                                           size_t num_bytes,
+                                           uint8_t** out_pointer,
+                                           size_t* out_num_bytes_preloaded) {
+  uint8_t* header;
+  uint8_t* buf;
+  size_t num_read;
+  AvbIOResult ret;
+  CHAR16 *label;
+
+  *out_pointer = NULL;
+  *out_num_bytes_preloaded = 0;
+
+  if (num_bytes < ANDROID_IMAGE_PLAN_HEADER_SIZE ||
+      !android_image_plannable(partition)) {
+    return AVB_IO_RESULT_OK;
+  }
+
+  /* The image might already have been prefetched in place. */
+  label = stra_to_str((const CHAR8 *)partition);
+  if (!label) {
+    error(L"out of memory");
+    return AVB_IO_RESULT_ERROR_OOM;
+  }
+  buf = prefetch_get_planned(label, num_bytes);
+  FreePool(label);
+  if (buf != NULL) {
+    *out_pointer = buf;
+    *out_num_bytes_preloaded = num_bytes;
+    return AVB_IO_RESULT_OK;
+  }
+
+  /* Read the image headers to plan where to load the image.  If it
+   * cannot be planned, let libavb load the partition as usual.
+   */
+  header = avb_malloc(ANDROID_IMAGE_PLAN_HEADER_SIZE);
+  if (header == NULL) {
+    return AVB_IO_RESULT_ERROR_OOM;
+  }
+
+  ret = read_from_partition(
+      ops, partition, 0, ANDROID_IMAGE_PLAN_HEADER_SIZE, header, &num_read);
+  if (ret == AVB_IO_RESULT_OK && num_read == ANDROID_IMAGE_PLAN_HEADER_SIZE) {
+    buf = android_image_plan(partition, header, num_read, num_bytes);
+  } else {
+    buf = NULL;
+  }
+  avb_free(header);
+  if (buf == NULL) {
+    return AVB_IO_RESULT_OK;
+  }
+
+  ret = read_from_partition(ops, partition, 0, num_bytes, buf, &num_read);
+  if (ret != AVB_IO_RESULT_OK) {
+    android_image_plan_free(buf);
+    return ret;
+  }
+
+  *out_pointer = buf;
+  *out_num_bytes_preloaded = num_read;
+  return AVB_IO_RESULT_OK;
+}
+
 static AvbIOResult write_to_partition(__attribute__((unused)) AvbOps* ops,
                                       const char* partition_name,
                                       int64_t offset_from_partition,
@@ -119,6 +215,11 @@ static AvbIOResult write_to_partition(__attribute__((unused)) AvbOps* ops,
   avb_assert(partition_name != NULL);
   avb_assert(buf != NULL);
 
+  if (is_misc_cached(partition_name, offset_from_partition, num_bytes)) {
+    return misc_cache_result(
+        misc_cache_write(offset_from_partition, buf, num_bytes));
+  }
+
   label = stra_to_str((const CHAR8 *)partition_name);
   if (!label) {
     error(L"out of memory");
@@ -151,6 +252,12 @@ static AvbIOResult write_to_partition(__attribute__((unused)) AvbOps* ops,
     return AVB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
   }
 
+  /* Do not let the misc cache hide or overwrite this change. */
+  if (avb_strcmp(partition_name, "misc") == 0) {
+    misc_cache_flush();
+    misc_cache_invalidate();
+  }
+
   efi_ret = uefi_call_wrapper(
       gpart.dio->WriteDisk,
       5,
@@ -160,6 +267,11 @@ static AvbIOResult write_to_partition(__attribute__((unused)) AvbOps* ops,
           offset_from_partition,
       num_bytes,
       (void *)buf);
+  block_cache_invalidate(
+      gpart.bio,
+      (gpart.part.starting_lba * gpart.bio->Media->BlockSize) +
+          offset_from_partition,
+      num_bytes);
 
   if (EFI_ERROR(efi_ret)) {
     avb_error("Could not write to Disk.\n");
@@ -228,6 +340,141 @@ static AvbIOResult validate_vbmeta_public_key(
   return AVB_IO_RESULT_OK;
 }
 
+/* Storage of the rollback indexes: the TPM holds all its slots in a
+ * single NV index, the EFI variables hold one slot each. */
+#ifdef USE_TPM
+static const UEFIAvbRollbackStorage default_rollback_storage = {
+  .count = TPM2_ROLLBACK_INDEX_COUNT,
+  .read = read_rollback_indexes_tpm2,
+  .write = write_rollback_indexes_tpm2
+};
+#else
+static EFI_STATUS read_efi_rollback_indexes(size_t first, size_t count,
+                                            uint64_t* out_rollback_indexes) {
+  EFI_STATUS ret;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    ret = read_efi_rollback_index(first + i, &out_rollback_indexes[i]);
+    if (EFI_ERROR(ret))
+      return ret;
+  }
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS write_efi_rollback_indexes(size_t first, size_t count,
+                                             const uint64_t* rollback_indexes) {
+  EFI_STATUS ret;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    ret = write_efi_rollback_index(first + i, rollback_indexes[i]);
+    if (EFI_ERROR(ret))
+      return ret;
+  }
+  return EFI_SUCCESS;
+}
+
+static const UEFIAvbRollbackStorage default_rollback_storage = {
+  .count = 0,
+  .read = read_efi_rollback_indexes,
+  .write = write_efi_rollback_indexes
+};
+#endif
+
+/* Write-back cache of the stored rollback indexes, shared by all the
+ * AvbOps instances of the boot session.  Each slot is read from the
+ * storage at most once and the writes are only committed by
+ * uefi_avb_ops_flush_rollback_indexes().  With a TPM, all the slots
+ * are read at once and the dirty slots are written back with a single
+ * NV write. */
+static struct {
+  const UEFIAvbRollbackStorage* storage;
+  uint32_t valid;
+  uint32_t dirty;
+  uint64_t index[AVB_MAX_NUMBER_OF_ROLLBACK_INDEX_LOCATIONS];
+} rollback_cache = { .storage = &default_rollback_storage };
+
+void uefi_avb_ops_set_rollback_storage(const UEFIAvbRollbackStorage* storage) {
+  memset(&rollback_cache, 0, sizeof(rollback_cache));
+  rollback_cache.storage = storage ? storage : &default_rollback_storage;
+}
+
+static EFI_STATUS rollback_cache_load(size_t slot) {
+  const UEFIAvbRollbackStorage* storage = rollback_cache.storage;
+  size_t first = slot, count = 1;
+  EFI_STATUS ret;
+
+  if (slot >= AVB_MAX_NUMBER_OF_ROLLBACK_INDEX_LOCATIONS)
+    return EFI_INVALID_PARAMETER;
+
+  if (rollback_cache.valid & (1U << slot))
+    return EFI_SUCCESS;
+
+  if (storage->count) {
+    if (slot >= storage->count) {
+      error(L"The rollback index slot is too large for the storage: %d", slot);
+      return EFI_INVALID_PARAMETER;
+    }
+    first = 0;
+    count = storage->count;
+  }
+
+  ret = storage->read(first, count, &rollback_cache.index[first]);
+  if (ret == EFI_NOT_FOUND) {
+    memset(&rollback_cache.index[first], 0, count * sizeof(*rollback_cache.index));
+    ret = EFI_SUCCESS;
+  }
+  if (EFI_ERROR(ret))
+    return ret;
+
+  if (count == AVB_MAX_NUMBER_OF_ROLLBACK_INDEX_LOCATIONS)
+    rollback_cache.valid = ~0U;
+  else
+    rollback_cache.valid |= ((1U << count) - 1) << first;
+  return EFI_SUCCESS;
+}
+
+AvbIOResult uefi_avb_ops_flush_rollback_indexes(void) {
+  const UEFIAvbRollbackStorage* storage = rollback_cache.storage;
+  EFI_STATUS ret;
+  size_t first, last;
+
+  if (!rollback_cache.dirty)
+    return AVB_IO_RESULT_OK;
+
+  for (first = 0; !(rollback_cache.dirty & (1U << first)); first++)
+    ;
+  for (last = AVB_MAX_NUMBER_OF_ROLLBACK_INDEX_LOCATIONS - 1;
+       !(rollback_cache.dirty & (1U << last)); last--)
+    ;
+
+  if (storage->count) {
+    /* All the slots in between are valid: the whole storage has
+       been loaded before the first write. */
+    ret = storage->write(first, last - first + 1, &rollback_cache.index[first]);
+    if (EFI_ERROR(ret)) {
+      efi_perror(ret, L"Couldn't write rollback indexes");
+      return AVB_IO_RESULT_ERROR_IO;
+    }
+    rollback_cache.dirty = 0;
+    return AVB_IO_RESULT_OK;
+  }
+
+  for (; first <= last; first++) {
+    if (!(rollback_cache.dirty & (1U << first)))
+      continue;
+    ret = storage->write(first, 1, &rollback_cache.index[first]);
+    if (EFI_ERROR(ret)) {
+      efi_perror(ret, L"Couldn't write rollback index");
+      return AVB_IO_RESULT_ERROR_IO;
+    }
+    rollback_cache.dirty &= ~(1U << first);
+  }
+
+  return AVB_IO_RESULT_OK;
+}
+
 static AvbIOResult read_rollback_index(__attribute__((unused)) AvbOps* ops,
                                        size_t rollback_index_slot,
                                        uint64_t* out_rollback_index) {
@@ -236,26 +483,19 @@ static AvbIOResult read_rollback_index(__attribute__((unused)) AvbOps* ops,
   if (out_rollback_index == NULL)
     return ret;
 
-  if (is_live_boot())
-    ret = EFI_NOT_FOUND;
-  else {
-#ifdef USE_TPM
-    ret = read_rollback_index_tpm2(rollback_index_slot, out_rollback_index);
-#else
-    ret = read_efi_rollback_index(rollback_index_slot, out_rollback_index);
-#endif
-  }
-
-  if (ret == EFI_NOT_FOUND) {
+  if (is_live_boot()) {
     *out_rollback_index = 0;
-    ret = EFI_SUCCESS;
+    return AVB_IO_RESULT_OK;
   }
+
+  ret = rollback_cache_load(rollback_index_slot);
   if (EFI_ERROR(ret)) {
     efi_perror(ret, L"Couldn't read rollback index");
     return AVB_IO_RESULT_ERROR_IO;
   }
 
-  return ret;
+  *out_rollback_index = rollback_cache.index[rollback_index_slot];
+  return AVB_IO_RESULT_OK;
 }
 
 static AvbIOResult write_rollback_index(__attribute__((unused)) AvbOps* ops,
@@ -267,20 +507,20 @@ static AvbIOResult write_rollback_index(__attribute__((unused)) AvbOps* ops,
     return ret;
 
   if (is_live_boot())
-    ret = EFI_SUCCESS;
-  else {
-#ifdef USE_TPM
-    ret = write_rollback_index_tpm2(rollback_index_slot, rollback_index);
-#else
-    ret = write_efi_rollback_index(rollback_index_slot, rollback_index);
-#endif
-  }
+    return AVB_IO_RESULT_OK;
+
+  ret = rollback_cache_load(rollback_index_slot);
   if (EFI_ERROR(ret)) {
     efi_perror(ret, L"Couldn't write rollback index");
     return AVB_IO_RESULT_ERROR_IO;
   }
 
-  return ret;
+  if (rollback_cache.index[rollback_index_slot] != rollback_index) {
+    rollback_cache.index[rollback_index_slot] = rollback_index;
+    rollback_cache.dirty |= 1U << rollback_index_slot;
+  }
+
+  return AVB_IO_RESULT_OK;
 }
 
 static AvbIOResult read_is_device_unlocked(__attribute__((unused)) AvbOps* ops, bool* out_is_unlocked) {
@@ -373,6 +613,7 @@ AvbOps* uefi_avb_ops_new(void) {
   data->block_io = gparti.bio;
   data->disk_io  = gparti.dio;
   data->ops.read_from_partition = read_from_partition;
+  data->ops.get_preloaded_partition = get_preloaded_partition;
   data->ops.write_to_partition = write_to_partition;
   data->ops.get_size_of_partition = get_size_of_partition;
   data->ops.validate_vbmeta_public_key = validate_vbmeta_public_key;
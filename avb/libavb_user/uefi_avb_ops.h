@@ -41,4 +41,24 @@ AvbOps* uefi_avb_ops_new(void);
 /* Frees the AvbOps allocated with uefi_avb_ops_new(). */
 void uefi_avb_ops_free(AvbOps* ops);
 
+/* Writes the rollback indexes updated through the write_rollback_index
+ * operation back to their storage. */
+AvbIOResult uefi_avb_ops_flush_rollback_indexes(void);
+
+/* Storage of the rollback indexes behind the write-back cache of the
+ * read_rollback_index and write_rollback_index operations.  When
+ * |count| is zero, each slot is read and written on its own, otherwise
+ * the storage holds |count| slots, all read at once, and the dirty
+ * slots are written back as a single range. */
+typedef struct UEFIAvbRollbackStorage {
+  size_t count;
+  EFI_STATUS (*read)(size_t first, size_t count, uint64_t* out_rollback_indexes);
+  EFI_STATUS (*write)(size_t first, size_t count, const uint64_t* rollback_indexes);
+} UEFIAvbRollbackStorage;
+
+/* Empties the rollback index cache, dropping the unflushed writes, and
+ * uses |storage| behind it, or the TPM or EFI variables storage when
+ * |storage| is NULL.  Used by the unit tests. */
+void uefi_avb_ops_set_rollback_storage(const UEFIAvbRollbackStorage* storage);
+
 #endif /* UEFI_AVB_OPS_H_ */
@@ -182,6 +182,7 @@ set(LIB_FASTBOOT_SOURCES
 
 set(LIB_KERNELFLINGER_SOURCES
 	${LIB_KERNELFLINGER_SOURCE}/android.c
+	${LIB_KERNELFLINGER_SOURCE}/cmdline.c
 	${LIB_KERNELFLINGER_SOURCE}/efilinux.c
 	${LIB_KERNELFLINGER_SOURCE}/acpi.c
 	${LIB_KERNELFLINGER_SOURCE}/acpi_image.c
@@ -206,6 +207,10 @@ set(LIB_KERNELFLINGER_SOURCES
 	${LIB_KERNELFLINGER_SOURCE}/watchdog.c
 	${LIB_KERNELFLINGER_SOURCE}/life_cycle.c
 	${LIB_KERNELFLINGER_SOURCE}/qsort.c
+	${LIB_KERNELFLINGER_SOURCE}/crc32.c
+	${LIB_KERNELFLINGER_SOURCE}/misc_cache.c
+	${LIB_KERNELFLINGER_SOURCE}/prefetch.c
+	${LIB_KERNELFLINGER_SOURCE}/block_cache.c
 	${LIB_KERNELFLINGER_SOURCE}/nvme.c
 	${LIB_KERNELFLINGER_SOURCE}/timer.c
 	${LIB_KERNELFLINGER_SOURCE}/virtual_media.c
@@ -136,6 +136,7 @@ struct BERT_TABLE {
 struct ACPI_INFO {
 	UINT32 MediaId;
 	UINT32 img_size;		/* ACPI or ACPIO image size */
+	UINT32 total_size;		/* Size used by the dt_table image */
 	UINT64 partition_start;
 	UINT64 partition_size;
 };
@@ -25,6 +25,7 @@
 #endif
 #include "targets.h"
 #include "android_vb2.h"
+#include "cmdline.h"
 
 #define BOOT_MAGIC "ANDROID!"
 #define BOOT_MAGIC_SIZE 8
@@ -514,6 +515,25 @@ EFI_STATUS android_image_load_partition(
                 IN const CHAR16 *label,
                 OUT VOID **bootimage_p);
 
+/* Size of the beginning of an image required to plan its location:
+ * boot image header followed by the kernel boot parameters. */
+#define ANDROID_IMAGE_PLAN_HEADER_SIZE (BOOT_IMG_HEADER_SIZE_V3 + 4096)
+
+/* Return TRUE if the PARTITION image may be planned, that is boot
+ * and vendor_boot with an optional slot suffix. */
+BOOLEAN android_image_plannable(const char *partition);
+/* Allocate the buffer to load the PARTITION image of IMAGE_SIZE bytes
+ * into, so that its parts can be used in place at boot.  HEADER holds
+ * the first HEADER_SIZE bytes of the partition.  Return NULL if the
+ * image cannot be planned. */
+VOID *android_image_plan(const char *partition, const VOID *header,
+                         UINTN header_size, UINTN image_size);
+/* Free the buffer returned by android_image_plan().  */
+VOID android_image_plan_free(VOID *data);
+/* Free all the planned images once their verification or boot has
+ * failed. */
+VOID android_image_plan_release(VOID);
+
 EFI_STATUS android_image_load_file(
                 IN EFI_HANDLE device,
                 IN CHAR16 *loader,
@@ -569,9 +589,7 @@ EFI_STATUS get_bootimage_blob(VOID *bootimage, enum blobtype btype, VOID **blob,
 /* Get a pointer and size to the 2ndstage area of a boot image */
 EFI_STATUS get_bootimage_2nd(VOID *bootimage, VOID **second, UINT32 *size);
 
-EFI_STATUS prepend_command_line(CHAR16 **cmdline, CHAR16 *fmt, ...);
-
-EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
+EFI_STATUS prepend_slot_command_line(struct cmdline *cmdline,
                                      enum boot_target boot_target,
                                      VBDATA *vb_data);
 
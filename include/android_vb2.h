@@ -20,6 +20,7 @@
 #include "libavb/libavb.h"
 #include "libavb_user/uefi_avb_ops.h"
 #include "libavb_ab/libavb_ab.h"
+#include "cmdline.h"
 
 typedef AvbSlotVerifyData VBDATA;
 
@@ -27,7 +28,7 @@ AvbOps *avb_init(void);
 
 bool avb_update_stored_rollback_indexes_for_slot(AvbOps* ops, AvbSlotVerifyData* slot_data);
 
-EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
+EFI_STATUS prepend_slot_command_line(struct cmdline *cmdline,
         enum boot_target boot_target,
         VBDATA *vb_data);
 
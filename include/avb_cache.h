@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2020, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _AVB_CACHE_H_
+#define _AVB_CACHE_H_
+
+#include <efi.h>
+#include "libavb/libavb.h"
+
+/* Per-boot cache of the AVB verification results.
+ *
+ * vbmeta images are identified by their partition name, including
+ * the slot suffix, and the SHA-256 digest of their content so that a
+ * vbmeta image verified once, by avb_slot_verify() or by
+ * avb_cache_vbmeta_verify(), does not have its signature checked
+ * again.
+ *
+ * Images loaded by the last avb_slot_verify() call which succeeded
+ * without any verification error are known to match their hash
+ * descriptor until their AvbSlotVerifyData is released with
+ * avb_cache_free_slot(). */
+
+/* Record the results of an avb_slot_verify() call. */
+void avb_cache_record_slot(AvbSlotVerifyData *slot_data,
+			   AvbSlotVerifyResult result);
+
+/* Forget SLOT_DATA if it has been recorded as verified and free
+   it.  Must be used instead of avb_slot_verify_data_free() for any
+   AvbSlotVerifyData given to avb_cache_record_slot(). */
+void avb_cache_free_slot(AvbSlotVerifyData *slot_data);
+
+/* Same as avb_vbmeta_image_verify() but skip the signature check if
+   this vbmeta image has already been verified. */
+AvbVBMetaVerifyResult avb_cache_vbmeta_verify(const char *name,
+					      const uint8_t *data,
+					      size_t length,
+					      const uint8_t **out_public_key_data,
+					      size_t *out_public_key_length);
+
+/* Verify the main vbmeta image of SLOT_DATA and return its public
+   key. */
+AvbVBMetaVerifyResult avb_cache_slot_public_key(AvbSlotVerifyData *slot_data,
+						const uint8_t **out_public_key_data,
+						size_t *out_public_key_length);
+
+/* Return TRUE if IMAGE has been loaded from the NAME partition (without
+   slot suffix) by the SLOT_DATA verification and checked against a
+   hash descriptor of the VBMETA image of this partition. */
+BOOLEAN avb_cache_image_verified(AvbSlotVerifyData *slot_data,
+				 const char *name,
+				 const void *image,
+				 const uint8_t *vbmeta,
+				 size_t vbmeta_size);
+
+#endif	/* _AVB_CACHE_H_ */
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2022, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include <efi.h>
+#include <efilib.h>
+
+/* Small LRU cache of disk reads.
+ *
+ * Headers, footers and metadata are often read several times during
+ * a boot: GPT headers, the AVB footer and vbmeta blob, image headers
+ * read again with the image...  Reads up to 64 KiB are rounded to 4
+ * KiB lines, kept per (block device, media, byte range) and served
+ * from memory until they are evicted or invalidated.  Larger reads
+ * go to the disk directly.
+ *
+ * Every write to the disk must invalidate the range it modifies. */
+
+struct block_cache_stats {
+	UINT64 hits;
+	UINT64 misses;
+	UINT64 evictions;
+	UINT64 invalidations;
+};
+
+EFI_STATUS block_cache_read(EFI_BLOCK_IO *bio, EFI_DISK_IO *dio,
+			    UINT64 offset, UINTN size, VOID *data);
+
+/* Drop the cached data overlapping SIZE bytes at OFFSET of BIO.  */
+void block_cache_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size);
+
+/* Drop all the cached data, for writes which do not go through
+   kernelflinger, file system writes for instance. */
+void block_cache_invalidate_all(void);
+
+void block_cache_get_stats(struct block_cache_stats *stats);
+
+#endif	/* _BLOCK_CACHE_H_ */
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2020, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _CMDLINE_H_
+#define _CMDLINE_H_
+
+#include <efi.h>
+
+/* Kernel command line builder.
+ *
+ * The command line is kept as a single CHAR8 string in an arena which
+ * has room at both ends so that fragments can be prepended or
+ * appended without copying the whole command line each time.
+ *
+ * cmdline_prepend() and cmdline_prepend_stra() put the new fragment
+ * followed by a space in front of the current content,
+ * cmdline_append_stra() puts a space followed by the new fragment at
+ * its end. */
+struct cmdline {
+	CHAR8 *buf;
+	UINTN size;
+	UINTN start;
+	UINTN end;
+};
+
+/* Initialize CMDLINE with the BASE string. */
+EFI_STATUS cmdline_init(struct cmdline *cmdline, const CHAR16 *base);
+
+EFI_STATUS cmdline_prepend(struct cmdline *cmdline, const CHAR16 *fmt, ...);
+
+/* Prepend or append the first LEN characters of STR, or less if STR
+   is NUL terminated before. */
+EFI_STATUS cmdline_prepend_stra(struct cmdline *cmdline, const CHAR8 *str,
+				UINTN len);
+EFI_STATUS cmdline_append_stra(struct cmdline *cmdline, const CHAR8 *str,
+			       UINTN len);
+
+/* Write out the command line.
+ *
+ * Only the first occurrence of each androidboot.* key is kept.  If
+ * BOOTCONFIG_SIZE is not NULL, the androidboot.* parameters are left
+ * out of KERNEL and, unless BOOTCONFIG is NULL, written to BOOTCONFIG
+ * one per line.
+ *
+ * KERNEL_SIZE and BOOTCONFIG_SIZE are the buffer sizes on input and
+ * the required sizes, including the NUL terminator, on output.
+ * EFI_BUFFER_TOO_SMALL is returned if one of the buffers is too
+ * small. */
+EFI_STATUS cmdline_finish(struct cmdline *cmdline,
+			  CHAR8 *kernel, UINTN *kernel_size,
+			  CHAR8 *bootconfig, UINTN *bootconfig_size);
+
+/* Write out only the androidboot.* parameters, as cmdline_finish()
+ * writes them to BOOTCONFIG.  This lets them be written directly at
+ * their final location, such as the free room of the bootconfig
+ * section, once the kernel command line has been written out. */
+EFI_STATUS cmdline_finish_bootconfig(struct cmdline *cmdline,
+				     CHAR8 *bootconfig, UINTN *bootconfig_size);
+
+void cmdline_free(struct cmdline *cmdline);
+
+#endif	/* _CMDLINE_H_ */
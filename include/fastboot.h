@@ -61,6 +61,9 @@ struct download_buffer {
 };
 
 struct download_buffer *fastboot_download_buffer(void);
+/* Flash all the partitions synchronously, the download buffer is
+   never handed over to a background flash job.  */
+void fastboot_disable_writeback(void);
 
 struct fastboot_cmd *fastboot_get_root_cmd(const char *name);
 EFI_STATUS fastboot_register(struct fastboot_cmd *cmd);
@@ -248,6 +248,10 @@ void *memset_s(void *dest, size_t dest_size, int c, size_t count)
 int memcmp(const void *s1, const void *s2, size_t n)
     __attribute__((weak));
 
+/* Sum of the SIZE bytes at DATA, modulo 2^32.  Used for the ACPI and
+ * bootconfig checksums. */
+UINT32 sum_bytes(const VOID *data, UINTN size);
+
 EFI_STATUS alloc_aligned(VOID **free_addr, VOID **aligned_addr,
                          UINTN size, UINTN align);
 
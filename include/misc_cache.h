@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MISC_CACHE_H_
+#define _MISC_CACHE_H_
+
+#include <efi.h>
+
+/* In-memory copy of the head of the misc partition.
+ *
+ * The bootloader message and the A/B metadata which follows it are
+ * read once, on first access, and every later read is served from
+ * memory.  Writes update the in-memory copy and are written back
+ * right away unless write-back is deferred and they only touch the
+ * bootloader message, in which case all the changes are written at
+ * once by misc_cache_flush().  Only the modified bytes are written
+ * and a write which does not change anything does not reach the
+ * disk. */
+
+/* Number of bytes of the misc partition managed by the cache, that
+   is the size of struct bootloader_message_ab. */
+#define MISC_CACHE_SIZE	4096
+
+EFI_STATUS misc_cache_read(UINTN offset, VOID *data, UINTN size);
+EFI_STATUS misc_cache_write(UINTN offset, const VOID *data, UINTN size);
+
+/* Write the pending changes back to the misc partition. */
+EFI_STATUS misc_cache_flush(void);
+
+/* When DEFER is TRUE, misc_cache_write() only updates the in-memory
+   copy of the bootloader message.  A/B metadata writes are still
+   written back right away, along with the pending bootloader
+   message changes.  Disabling it flushes the pending changes. */
+EFI_STATUS misc_cache_defer(BOOLEAN defer);
+
+/* Drop the in-memory copy, to be called when the misc partition
+   might have been modified behind the cache, by a flash or erase
+   operation for instance. */
+void misc_cache_invalidate(void);
+
+#endif	/* _MISC_CACHE_H_ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2022, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <efi.h>
+#include "gpt.h"
+
+/* Speculative read-ahead of the boot images.
+ *
+ * prefetch_boot_images() reads the vbmeta partition of the given
+ * slot and queues an asynchronous EFI_BLOCK_IO2 read for every
+ * image described by one of its hash descriptors.  The readers of
+ * these partitions then get the data from prefetch_read() instead of
+ * reading the disk synchronously, one partition after another.
+ *
+ * Boot and vendor_boot images are read straight into the buffer
+ * planned by android_image_plan(), which libavb then gets from
+ * prefetch_get_planned() without any copy.
+ *
+ * Nothing is verified here: the prefetched data goes through the
+ * same verification as data read from the disk.  If the disk does
+ * not support the EFI_BLOCK_IO2 protocol, nothing is prefetched and
+ * prefetch_read() always fails. */
+
+EFI_STATUS prefetch_boot_images(const char *slot_suffix);
+
+/* Queue a read of the first SIZE bytes of the GPARTI partition, to be
+   served to the readers of partition LABEL.  */
+EFI_STATUS prefetch_partition_interface(struct gpt_partition_interface *gparti,
+					const CHAR16 *label, UINT64 size);
+
+/* Copy SIZE bytes at OFFSET of partition LABEL into DATA, waiting
+   for the read to complete if needed.  Return EFI_NOT_FOUND if this
+   range has not been prefetched. */
+EFI_STATUS prefetch_read(const CHAR16 *label, UINT64 offset, UINTN size, VOID *data);
+
+/* Return the planned image prefetched for partition LABEL once its
+   first SIZE bytes have been read, NULL if there is none.  The image
+   is handed over: the caller frees it with android_image_plan_free(). */
+VOID *prefetch_get_planned(const CHAR16 *label, UINTN size);
+
+/* Wait for the read into the planned image DATA, if any, and drop
+   it.  Must be called before a planned image is freed. */
+void prefetch_forget(const VOID *data);
+
+/* Wait for the outstanding reads and release all the buffers.  Must
+   be called before the boot services are exited. */
+void prefetch_release(void);
+
+#endif	/* _PREFETCH_H_ */
@@ -62,8 +62,20 @@ typedef enum {
 /* It is faster to erase multiple block at once */
 #define N_BLOCK (4096)
 
+/* Range of blocks to discard, END included */
+struct discard_range {
+	EFI_LBA start;
+	EFI_LBA end;
+};
+
+/* Maximum number of ranges accumulated before the discard queue is
+   flushed to the device */
+#define DISCARD_QUEUE_SIZE (64)
+
 struct storage {
 	EFI_STATUS (*erase_blocks)(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end);
+	EFI_STATUS (*discard_ranges)(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				     struct discard_range *ranges, UINTN count);
 	EFI_STATUS (*check_logical_unit)(EFI_DEVICE_PATH *p, logical_unit_t log_unit);
 	EFI_STATUS (*get_erase_block_size)(EFI_HANDLE handle, UINTN *erase_blk_size);
 	EFI_STATUS (*set_logical_unit)(UINT64 user_lun,UINT64 factory_lun);
@@ -82,6 +94,8 @@ EFI_STATUS get_boot_device_type(enum storage_type *type);
 EFI_STATUS storage_set_boot_device(EFI_HANDLE device);
 EFI_STATUS storage_check_logical_unit(EFI_DEVICE_PATH *p, logical_unit_t log_unit);
 EFI_STATUS storage_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end);
+EFI_STATUS storage_discard_queue(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end);
+EFI_STATUS storage_discard_flush(void);
 EFI_STATUS storage_get_erase_block_size(UINTN *erase_blk_size);
 EFI_STATUS fill_with(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end,
 		     VOID *pattern, UINTN pattern_blocks);
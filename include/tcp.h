@@ -43,5 +43,6 @@ EFI_STATUS tcp_stop(void);
 EFI_STATUS tcp_run(void);
 EFI_STATUS tcp_read(void *buf, UINT32 size);
 EFI_STATUS tcp_write(void *buf, UINT32 size);
+BOOLEAN tcp_connected(void);
 
 #endif	/* _TCP_H_ */
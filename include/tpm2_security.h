@@ -38,6 +38,8 @@
 #include <lib.h>
 
 #define TRUSTY_SEED_SIZE		32
+/* Number of rollback index slots stored in the TPM */
+#define TPM2_ROLLBACK_INDEX_COUNT	8
 
 EFI_STATUS tpm2_init(void);
 EFI_STATUS tpm2_end(void);
@@ -55,6 +57,10 @@ EFI_STATUS read_device_state_tpm2(UINT8 *state);
 EFI_STATUS write_device_state_tpm2(UINT8 state);
 EFI_STATUS read_rollback_index_tpm2(size_t rollback_index_slot, uint64_t *out_rollback_index);
 EFI_STATUS write_rollback_index_tpm2(size_t rollback_index_slot, uint64_t rollback_index);
+/* Read or write COUNT consecutive rollback index slots in a single TPM
+   NV transaction. */
+EFI_STATUS read_rollback_indexes_tpm2(size_t first_slot, size_t count, uint64_t *out_rollback_indexes);
+EFI_STATUS write_rollback_indexes_tpm2(size_t first_slot, size_t count, const uint64_t *rollback_indexes);
 BOOLEAN tpm2_bootloader_need_init(void);
 
 #ifndef USER
@@ -39,6 +39,7 @@
 
 typedef void (*data_callback_t)(void *buf, unsigned len);
 typedef void (*start_callback_t)(void);
+typedef void (*sched_callback_t)(void *context);
 
 typedef struct transport {
 	const char *name;
@@ -49,6 +50,8 @@ typedef struct transport {
 	EFI_STATUS (*run)(void);
 	EFI_STATUS (*read)(void *buf, UINT32 size);
 	EFI_STATUS (*write)(void *buf, UINT32 size);
+	/* Optional, return FALSE once the host is disconnected.  */
+	BOOLEAN (*connected)(void);
 } transport_t;
 
 EFI_STATUS transport_register(transport_t *trans, UINTN nb);
@@ -62,4 +65,32 @@ EFI_STATUS transport_run(void);
 EFI_STATUS transport_read(void *buf, UINT32 len);
 EFI_STATUS transport_write(void *buf, UINT32 len);
 
+/* All the supported transport layers are started by
+ * transport_start().  The first one to receive data from the host
+ * owns the session and is used by transport_read() and
+ * transport_write().  If secondary callbacks are set before
+ * transport_start(), the next transport layer to receive data is
+ * handed to them and accessed with transport_secondary_read() and
+ * transport_secondary_write().  A transport layer loses its role when
+ * its host is disconnected or connects again. */
+EFI_STATUS transport_set_secondary(start_callback_t start_cb,
+				   data_callback_t rx_cb,
+				   data_callback_t tx_cb);
+EFI_STATUS transport_secondary_read(void *buf, UINT32 len);
+EFI_STATUS transport_secondary_write(void *buf, UINT32 len);
+
+/* Transport scheduler.  transport_schedule() polls the transport
+ * layer and sleeps on the watched events (key input, timers, ...)
+ * when there is no transport activity and no deferred job to run.
+ * Timers and deferred jobs are released by transport_stop(). */
+EFI_STATUS transport_watch_event(EFI_EVENT event, sched_callback_t callback,
+				 void *context);
+EFI_STATUS transport_add_timer(UINTN period_ms, sched_callback_t callback,
+			       void *context);
+void transport_unwatch(sched_callback_t callback, void *context);
+EFI_STATUS transport_defer(sched_callback_t callback, void *context);
+BOOLEAN transport_is_idle(void);
+EFI_STATUS transport_schedule(void);
+void transport_sched_free(void);
+
 #endif	/* _TRANSPORT_H_ */
@@ -63,4 +63,43 @@ EFI_STATUS uefi_check_upgrade(EFI_LOADED_IMAGE *loaded_image,
 		CHAR16 *partition, CHAR16 *upgrade_file,
 		CHAR16 *self_path1, CHAR16 *bak_path1, CHAR16 *self_path2, CHAR16 *bak_path2);
 
+/* Read-ahead of a file region with EFI_FILE_PROTOCOL.ReadEx(): the
+ * read started by file_read_ahead_start() runs while the caller works
+ * on another buffer and file_read_ahead_finish() waits for it.  If the
+ * file protocol does not support asynchronous reads, or if the
+ * asynchronous read fails, file_read_ahead_finish() reads the region
+ * synchronously. */
+struct file_read_ahead {
+	EFI_EVENT event;
+	EFI_FILE_IO_TOKEN token;
+	EFI_FILE *file;
+	UINT64 pos;
+	void *buf;
+	UINTN len;
+	BOOLEAN requested;
+	BOOLEAN async;
+};
+
+EFI_STATUS file_read_ahead_init(struct file_read_ahead *ra);
+void file_read_ahead_start(struct file_read_ahead *ra, EFI_FILE *file,
+			   UINT64 pos, void *buf, UINTN len);
+/* LEN is set to the number of bytes read, less than requested at the
+ * end of the file. */
+EFI_STATUS file_read_ahead_finish(struct file_read_ahead *ra, UINTN *len);
+void file_read_ahead_free(struct file_read_ahead *ra);
+
+/* Same for a disk region with EFI_BLOCK_IO2_PROTOCOL.ReadBlocksEx().
+ * The read is synchronous, with EFI_DISK_IO, if HANDLE does not
+ * support EFI_BLOCK_IO2 or if the region is not made of whole blocks
+ * in a buffer aligned on the IoAlign boundary.  POLL, if not NULL, is
+ * called repeatedly while block_read_ahead_finish() waits. */
+struct block_read_ahead;
+
+struct block_read_ahead *block_read_ahead_new(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+					      EFI_DISK_IO *dio);
+void block_read_ahead_start(struct block_read_ahead *ra, UINT64 offset,
+			    void *buf, UINTN len);
+EFI_STATUS block_read_ahead_finish(struct block_read_ahead *ra, void (*poll)(void));
+void block_read_ahead_free(struct block_read_ahead *ra);
+
 #endif /* __UEFI_UTILS_H__ */
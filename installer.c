@@ -207,333 +207,285 @@ typedef struct flash_buffer {
 	char ckh_data[1];
 } __attribute__((__packed__)) flash_buffer_t;
 
-/*when flash big chunks and in two image should add read_flags*/
-static EFI_STATUS installer_flash_big_chunk_multiple(EFI_FILE **file, UINTN *read_flags,
-	UINTN file_size, UINTN *remaining_data, flash_buffer_t *fb, UINTN argc, CHAR8 **argv)
+/* Input files of a flash command, seen as one contiguous stream. */
+struct input_stream {
+	EFI_FILE **file;
+	UINTN *size;
+	UINTN num;
+	UINT64 total;
+};
+
+/* Locate the file holding the byte at POS of the stream and the
+   offset of that byte in this file. */
+static UINTN stream_locate(struct input_stream *in, UINT64 *pos)
 {
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
-	UINTN payload_size, read_size, already_read, ckh_blks, data_size;
-	const UINTN MAX_DATA_SIZE = dl->max_size - offsetof(flash_buffer_t, ckh_data);
-	if (fb->sph.blk_sz == 0) {
-		return EFI_INVALID_PARAMETER;
-	}
-	const UINTN MAX_BLKS = MAX_DATA_SIZE / fb->sph.blk_sz;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	struct chunk_header *ckh;
-	void *read_ptr;
-
-	ckh = &fb->d.ckh;
-	payload_size = ckh->total_sz - sizeof(*ckh);
-	fb->sph.total_chunks = 2; /* skip and data chunks. */
-
-	for (ckh_blks = ckh->chunk_sz; ckh_blks; ckh_blks -= ckh->chunk_sz) {
-		ckh->chunk_sz = min(MAX_BLKS, ckh_blks);
-		data_size = ((UINTN)ckh->chunk_sz) * fb->sph.blk_sz;
-		ckh->total_sz = sizeof(*ckh) + data_size;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz + ckh->chunk_sz;
-		installer_flash_buffer(fb, ckh->total_sz + HEADER_SIZE, argc, argv);
-		if (!last_cmd_succeeded)
-			return EFI_INVALID_PARAMETER;
+	UINTN i;
 
-		payload_size -= data_size;
-		if (!payload_size)
-			break;
+	for (i = 0; i < in->num && *pos >= in->size[i]; i++)
+		*pos -= in->size[i];
 
-		/* Move the incomplete data from the end to the
-		   beginning of the buffer. */
-		read_ptr = fb->ckh_data;
-		read_size = min(payload_size, MAX_DATA_SIZE);
-		if (data_size < MAX_DATA_SIZE) {
-			already_read = MAX_DATA_SIZE - data_size;
-			ret = memcpy_s(read_ptr, MAX_DATA_SIZE, fb->d.data + ckh->total_sz, already_read);
-			if (EFI_ERROR(ret))
-				return ret;
-			read_size -= already_read;
-			read_ptr += already_read;
-			if (read_size > file_size) {
-				ret = read_file(file[*read_flags], file_size, read_ptr);
-				if (EFI_ERROR(ret))
-					return ret;
-				read_size -= file_size;
-				read_ptr += file_size;
-				*remaining_data -= file_size;
-				(*read_flags)++;
-				}
+	return i;
+}
+
+static EFI_STATUS stream_read(struct input_stream *in, UINT64 pos,
+			      void *data, UINTN len)
+{
+	EFI_STATUS ret;
+	UINTN i, n;
+
+	for (i = stream_locate(in, &pos); len && i < in->num; i++, pos = 0) {
+		n = min(len, in->size[i] - pos);
+		ret = uefi_call_wrapper(in->file[i]->SetPosition, 2,
+					in->file[i], pos);
+		if (EFI_ERROR(ret)) {
+			inst_perror(ret, "Failed to set file position");
+			return ret;
 		}
-		ret = read_file(file[*read_flags], read_size, read_ptr);
+
+		ret = read_file(in->file[i], n, data);
 		if (EFI_ERROR(ret))
 			return ret;
-		*remaining_data -= read_size;
 
-		fb->skip_ckh.chunk_sz += ckh->chunk_sz;
+		data += n;
+		len -= n;
 	}
 
-	if (payload_size)
-		return EFI_INVALID_PARAMETER;
+	if (len) {
+		fastboot_fail("Attempt to read beyond the end of file");
+		return EFI_END_OF_FILE;
+	}
 
 	return EFI_SUCCESS;
 }
 
-/* This function splits a chunk too large to fit into a
-   dl->max_size buffer into smaller chunks and flash them. */
-static EFI_STATUS installer_flash_big_chunk(EFI_FILE *file, UINTN *remaining_data,
-					    flash_buffer_t *fb, UINTN argc, CHAR8 **argv)
+/* Double-buffered read-ahead of the input stream: the next window is
+   read with file_read_ahead_start() into the second download buffer
+   while the current one is flashed.  Each window starts at an
+   arbitrary stream offset so that an incomplete chunk at the end of a
+   window is read again at the beginning of the next one instead of
+   being moved.  If the second buffer cannot be allocated or if a
+   window spans two files, windows are read synchronously. */
+struct read_ahead {
+	struct input_stream *in;
+	flash_buffer_t *fb[2];
+	UINTN next;
+	struct file_read_ahead io;
+	BOOLEAN requested;
+	BOOLEAN in_file;
+	UINT64 pos;
+	UINTN len;
+	UINTN offset;
+};
+
+static void read_ahead_init(struct read_ahead *ra, struct input_stream *in,
+			    struct sparse_header *sph)
 {
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
-	UINTN payload_size, read_size, already_read, ckh_blks, data_size;
-	const UINTN MAX_DATA_SIZE = dl->max_size - offsetof(flash_buffer_t, ckh_data);
-	if (fb->sph.blk_sz == 0) {
-		return EFI_INVALID_PARAMETER;
+	UINTN i;
+
+	memset_s(ra, sizeof(*ra), 0, sizeof(*ra));
+	ra->in = in;
+	ra->fb[0] = dl->data;
+	ra->fb[1] = AllocatePool(dl->max_size);
+	if (!ra->fb[1])
+		debug(L"Read-ahead disabled, not enough memory");
+	else
+		file_read_ahead_init(&ra->io);
+
+	for (i = 0; i < ARRAY_SIZE(ra->fb) && ra->fb[i]; i++) {
+		/* New sparse header. */
+		memcpy_s(&ra->fb[i]->sph, sizeof(ra->fb[i]->sph), sph, sizeof(*sph));
+
+		/* Sparse skip chunk. */
+		ra->fb[i]->skip_ckh.chunk_type = CHUNK_TYPE_DONT_CARE;
+		ra->fb[i]->skip_ckh.total_sz = sizeof(ra->fb[i]->skip_ckh);
 	}
-	const UINTN MAX_BLKS = MAX_DATA_SIZE / fb->sph.blk_sz;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	struct chunk_header *ckh;
-	void *read_ptr;
+}
 
-	ckh = &fb->d.ckh;
-	payload_size = ckh->total_sz - sizeof(*ckh);
-	fb->sph.total_chunks = 2; /* skip and data chunks. */
+/* Request the next window: LEN bytes of the stream at POS to be
+   stored at OFFSET in the next download buffer. */
+static void read_ahead_request(struct read_ahead *ra, UINT64 pos, UINTN len,
+			       UINTN offset)
+{
+	UINT64 file_pos = pos;
+	UINTN i;
 
-	for (ckh_blks = ckh->chunk_sz; ckh_blks; ckh_blks -= ckh->chunk_sz) {
-		ckh->chunk_sz = min(MAX_BLKS, ckh_blks);
-		data_size = ((UINTN)ckh->chunk_sz) * fb->sph.blk_sz;
-		ckh->total_sz = sizeof(*ckh) + data_size;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz + ckh->chunk_sz;
+	ra->requested = TRUE;
+	ra->pos = pos;
+	ra->len = len;
+	ra->offset = offset;
+	ra->in_file = FALSE;
 
-		installer_flash_buffer(fb, ckh->total_sz + HEADER_SIZE, argc, argv);
-		if (!last_cmd_succeeded)
-			return EFI_INVALID_PARAMETER;
+	if (!ra->fb[1])
+		return;
 
-		payload_size -= data_size;
-		if (!payload_size)
-			break;
+	i = stream_locate(ra->in, &file_pos);
+	if (i == ra->in->num || file_pos + len > ra->in->size[i])
+		return;
 
-		/* Move the incomplete data from the end to the
-		   beginning of the buffer. */
-		read_ptr = fb->ckh_data;
-		read_size = min(payload_size, MAX_DATA_SIZE);
-		if (data_size < MAX_DATA_SIZE) {
-			already_read = MAX_DATA_SIZE - data_size;
-			ret = memcpy_s(read_ptr, MAX_DATA_SIZE, fb->d.data + ckh->total_sz, already_read);
-			if (EFI_ERROR(ret))
-				return ret;
-			read_size -= already_read;
-			read_ptr += already_read;
-		}
+	ra->in_file = TRUE;
+	file_read_ahead_start(&ra->io, ra->in->file[i], file_pos,
+			      (void *)ra->fb[ra->next] + offset, len);
+}
 
-		ret = read_file(file, read_size, read_ptr);
+/* Return the download buffer holding the requested window. */
+static EFI_STATUS read_ahead_fetch(struct read_ahead *ra, flash_buffer_t **fb)
+{
+	EFI_STATUS ret;
+	UINTN len;
+
+	if (!ra->requested)
+		return EFI_NOT_READY;
+	ra->requested = FALSE;
+
+	if (ra->in_file) {
+		ret = file_read_ahead_finish(&ra->io, &len);
+		if (EFI_ERROR(ret)) {
+			inst_perror(ret, "Failed to read file");
+			return ret;
+		}
+		if (len != ra->len) {
+			fastboot_fail("Failed to read %d bytes (only %d read)",
+				      ra->len, len);
+			return EFI_INVALID_PARAMETER;
+		}
+	} else {
+		ret = stream_read(ra->in, ra->pos,
+				  (void *)ra->fb[ra->next] + ra->offset, ra->len);
 		if (EFI_ERROR(ret))
 			return ret;
-		*remaining_data -= read_size;
-
-		fb->skip_ckh.chunk_sz += ckh->chunk_sz;
 	}
 
-	if (payload_size)
-		return EFI_INVALID_PARAMETER;
+	*fb = ra->fb[ra->next];
+	if (ra->fb[1])
+		ra->next ^= 1;
 
 	return EFI_SUCCESS;
 }
-/*this function splits a huge sparse file and put together the two image*/
-static void installer_split_and_joint_flash(CHAR16 **filename,
-						UINTN *size, UINTN num, UINTN argc, CHAR8 **argv)
+
+static void read_ahead_free(struct read_ahead *ra)
+{
+	if (!ra->fb[1])
+		return;
+
+	file_read_ahead_free(&ra->io);
+	FreePool(ra->fb[1]);
+}
+
+/* This function splits a chunk too large to fit into a dl->max_size
+   buffer into smaller chunks and flash them.  Each piece is flashed
+   as a sparse image made of a skip chunk and a piece of the chunk. */
+static EFI_STATUS installer_flash_big_chunk(struct read_ahead *ra, UINT64 pos,
+					    struct chunk_header *big, UINT32 blk_count,
+					    UINTN argc, CHAR8 **argv)
 {
+	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
+	const UINTN DATA_OFFSET = offsetof(flash_buffer_t, ckh_data);
+	const UINTN MAX_DATA_SIZE = dl->max_size - DATA_OFFSET;
+	const UINT32 blk_sz = ra->fb[0]->sph.blk_sz;
 	EFI_STATUS ret;
 	flash_buffer_t *fb;
-	UINTN  read_flags = 0;
-	struct sparse_header sph;
-	struct chunk_header *ckh;
-	UINTN read_size, flash_size, already_read = 0, remaining_data = 0;
-	void *read_ptr;
-	INTN nb_chunks;
-	EFI_FILE *file[num];
-	UINT32 blk_count;
+	UINT32 blks, next_blks, done;
 
-	memset_s(file, sizeof(file), 0, sizeof(file));
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	const UINTN MAX_DATA_SIZE = dl->max_size - HEADER_SIZE;
-	for (UINTN i = 0; i < num; i++) {
-		remaining_data = remaining_data + size[i];
-		ret = uefi_open_file(file_io_interface, filename[i], &file[i]);
-		if (EFI_ERROR(ret)) {
-			inst_perror(ret, "Failed to open %s file", filename[i]);
-			return;
-		}
-	}
+	if (blk_sz == 0 || big->total_sz - sizeof(*big) != (UINT64)big->chunk_sz * blk_sz)
+		return EFI_INVALID_PARAMETER;
 
-	ret = read_file(file[0], sizeof(sph), &sph);
-	if (EFI_ERROR(ret))
-		return;
-	remaining_data -= sizeof(sph);
-	size[read_flags] -=  sizeof(sph);
-	if (!is_sparse_image((void *) &sph, sizeof(sph))) {
-		fastboot_fail("sparse file expected");
-		return;
-	}
-	fb = dl->data;
-	ret = memcpy_s(&fb->sph, sizeof(fb->sph), &sph, sizeof(sph));
-	if (EFI_ERROR(ret))
-		return;
-	/* Sparse skip chunk. */
-	fb->skip_ckh.chunk_type = CHUNK_TYPE_DONT_CARE;
-	fb->skip_ckh.total_sz = sizeof(fb->skip_ckh);
-	nb_chunks = sph.total_chunks;
-	read_size = MAX_DATA_SIZE;
-	read_ptr = fb->d.data;
-	blk_count = 0;
-	while (nb_chunks > 0 && remaining_data > 0) {
-		fb->sph.total_chunks = 1;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz = blk_count;
-		if (remaining_data < read_size)
-			read_size = remaining_data;
-		/* Read a new piece of the input sparse file. */
-		ret = read_file(file[read_flags], read_size, read_ptr);
-		if (EFI_ERROR(ret))
-			goto exit;
-		remaining_data -= read_size;
-		size[read_flags] -= read_size;
-		/* Process the loaded chunks to build the new header
-		   and the skip chunk. */
-		flash_size = HEADER_SIZE;
-		ckh = &fb->d.ckh;
-		while ((void *)ckh + sizeof(*ckh) <= read_ptr + read_size &&
-				(void *)ckh + ckh->total_sz <= read_ptr + read_size) {
-			if (nb_chunks == 0)
-				goto exit;
-			flash_size += ckh->total_sz;
-			fb->sph.total_blks += ckh->chunk_sz;
-			blk_count += ckh->chunk_sz;
-			fb->sph.total_chunks++;
-			nb_chunks--;
-			ckh = (void *)ckh + ckh->total_sz;
-		}
-		/* chunk is too big to fit in the download buffer. */
-		if (flash_size == HEADER_SIZE) {
-			if (ckh->chunk_type != CHUNK_TYPE_RAW ||
-					remaining_data < ckh->total_sz - MAX_DATA_SIZE) {
-				fastboot_fail("Corrupted sparse file");
-				goto exit;
-			}
+	pos += sizeof(*big);
+	blks = min(MAX_DATA_SIZE / blk_sz, big->chunk_sz);
+	read_ahead_request(ra, pos, (UINTN)blks * blk_sz, DATA_OFFSET);
 
-			blk_count += ckh->chunk_sz;
-			nb_chunks--;
+	for (done = 0; done < big->chunk_sz; done += blks, blks = next_blks) {
+		ret = read_ahead_fetch(ra, &fb);
+		if (EFI_ERROR(ret))
+			return ret;
 
-			ret = installer_flash_big_chunk_multiple(file, &read_flags,
-						size[read_flags], &remaining_data, fb, argc, argv);
-			if (EFI_ERROR(ret))
-				goto exit;
+		fb->sph.total_chunks = 2; /* skip and data chunks. */
+		fb->skip_ckh.chunk_sz = blk_count + done;
+		memcpy_s(&fb->d.ckh, sizeof(fb->d.ckh), big, sizeof(*big));
+		fb->d.ckh.chunk_sz = blks;
+		fb->d.ckh.total_sz = sizeof(*big) + (UINTN)blks * blk_sz;
+		fb->sph.total_blks = fb->skip_ckh.chunk_sz + blks;
 
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-			continue;
-		}
+		pos += (UINTN)blks * blk_sz;
+		next_blks = min(MAX_DATA_SIZE / blk_sz, big->chunk_sz - done - blks);
+		if (next_blks)
+			read_ahead_request(ra, pos, (UINTN)next_blks * blk_sz, DATA_OFFSET);
 
-		installer_flash_buffer(dl->data, flash_size, argc, argv);
+		installer_flash_buffer(fb, fb->d.ckh.total_sz + HEADER_SIZE, argc, argv);
 		if (!last_cmd_succeeded)
-			goto exit;
-		/* Move the incomplete chunk from the end to the
-		   beginning of the buffer. */
-
-		if (dl->data + flash_size < read_ptr + read_size) {
-			already_read = read_ptr + read_size - (void *)ckh;
-			ret = memcpy_s(fb->d.data, MAX_DATA_SIZE, ckh, already_read);
-			if (EFI_ERROR(ret))
-				goto exit;
-			read_size = MAX_DATA_SIZE - already_read;
-			read_ptr = fb->d.data + already_read;
-
-		} else {
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-		}
-		if ((read_size > size[read_flags]) && (read_flags != (num - 1))) {
-			ret = read_file(file[read_flags], size[read_flags], read_ptr);
-			if (EFI_ERROR(ret))
-				goto exit;
-			ret = memcpy_s(fb->d.data+already_read, MAX_DATA_SIZE, read_ptr, size[read_flags]);
-			if (EFI_ERROR(ret))
-				goto exit;
-			read_size = read_size - size[read_flags];
-			remaining_data  -= size[read_flags];
-			read_ptr = fb->d.data+already_read+size[read_flags];
-			read_flags++;
-			}
+			return EFI_INVALID_PARAMETER;
 	}
-exit:
-	for (UINTN i = 0; i < num; i++)
-		uefi_call_wrapper(file[i]->Close, 1, file[i]);
+
+	return EFI_SUCCESS;
 }
-/* This function splits a huge sparse file into smaller ones and flash
-   them. */
-static void installer_split_and_flash(CHAR16 *filename, UINTN size,
-				      UINTN argc, CHAR8 **argv)
+
+/* This function splits a huge sparse file, possibly split in several
+   files, into smaller ones and flash them. */
+static void installer_split_and_flash(CHAR16 **filename, UINTN *size,
+				      UINTN num, UINTN argc, CHAR8 **argv)
 {
 	EFI_STATUS ret;
+	struct input_stream in;
+	struct read_ahead ra;
 	flash_buffer_t *fb;
 	struct sparse_header sph;
-	struct chunk_header *ckh;
-	UINTN read_size, flash_size, already_read, remaining_data = size;
-	void *read_ptr;
+	struct chunk_header *ckh, big;
+	UINTN i, read_size, flash_size;
+	UINT64 pos;
 	INTN nb_chunks;
-	EFI_FILE *file;
+	EFI_FILE *file[num];
 	UINT32 blk_count;
 	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
 	const UINTN MAX_DATA_SIZE = dl->max_size - HEADER_SIZE;
 
-	ret = uefi_open_file(file_io_interface, filename, &file);
-	if (EFI_ERROR(ret)) {
-		inst_perror(ret, "Failed to open %s file", filename);
-		return;
+	memset_s(file, sizeof(file), 0, sizeof(file));
+	in.file = file;
+	in.size = size;
+	in.num = num;
+	in.total = 0;
+	for (i = 0; i < num; i++) {
+		in.total += size[i];
+		ret = uefi_open_file(file_io_interface, filename[i], &file[i]);
+		if (EFI_ERROR(ret)) {
+			inst_perror(ret, "Failed to open %s file", filename[i]);
+			goto exit;
+		}
 	}
 
-	ret = read_file(file, sizeof(sph), &sph);
+	ret = stream_read(&in, 0, &sph, sizeof(sph));
 	if (EFI_ERROR(ret))
-		return;
-	remaining_data -= sizeof(sph);
+		goto exit;
 
 	if (!is_sparse_image((void *) &sph, sizeof(sph))) {
 		fastboot_fail("sparse file expected");
-		return;
+		goto exit;
 	}
 
-	fb = dl->data;
-
-	/* New sparse header. */
-	ret = memcpy_s(&fb->sph, sizeof(fb->sph), &sph, sizeof(sph));
-	if (EFI_ERROR(ret))
-		return;
-
-	/* Sparse skip chunk. */
-	fb->skip_ckh.chunk_type = CHUNK_TYPE_DONT_CARE;
-	fb->skip_ckh.total_sz = sizeof(fb->skip_ckh);
+	read_ahead_init(&ra, &in, &sph);
 
 	nb_chunks = sph.total_chunks;
-	read_size = MAX_DATA_SIZE;
-	read_ptr = fb->d.data;
 	blk_count = 0;
+	pos = sizeof(sph);
+	read_ahead_request(&ra, pos, min(MAX_DATA_SIZE, in.total - pos), HEADER_SIZE);
 
-	while (nb_chunks > 0 && remaining_data > 0) {
-		fb->sph.total_chunks = 1;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz = blk_count;
-
-		if (remaining_data < read_size)
-			read_size = remaining_data;
+	while (nb_chunks > 0 && pos < in.total) {
+		read_size = min(MAX_DATA_SIZE, in.total - pos);
 
-		/* Read a new piece of the input sparse file. */
-		ret = read_file(file, read_size, read_ptr);
+		/* Get the new piece of the input sparse file. */
+		ret = read_ahead_fetch(&ra, &fb);
 		if (EFI_ERROR(ret))
-			goto exit;
-		remaining_data -= read_size;
+			goto out;
 
 		/* Process the loaded chunks to build the new header
 		   and the skip chunk. */
+		fb->sph.total_chunks = 1;
+		fb->sph.total_blks = fb->skip_ckh.chunk_sz = blk_count;
 		flash_size = HEADER_SIZE;
 		ckh = &fb->d.ckh;
-		while ((void *)ckh + sizeof(*ckh) <= read_ptr + read_size &&
-				(void *)ckh + ckh->total_sz <= read_ptr + read_size) {
+		while ((void *)ckh + sizeof(*ckh) <= (void *)fb->d.data + read_size &&
+		       (void *)ckh + ckh->total_sz <= (void *)fb->d.data + read_size) {
 			if (nb_chunks == 0) {
 				fastboot_fail("Corrupted sparse file: too many chunks");
-				goto exit;
+				goto out;
 			}
 			flash_size += ckh->total_sz;
 			fb->sph.total_blks += ckh->chunk_sz;
@@ -545,46 +497,50 @@ static void installer_split_and_flash(CHAR16 *filename, UINTN size,
 
 		/* chunk is too big to fit in the download buffer. */
 		if (flash_size == HEADER_SIZE) {
-			if (ckh->chunk_type != CHUNK_TYPE_RAW ||
-					remaining_data < ckh->total_sz - MAX_DATA_SIZE) {
+			if ((void *)ckh + sizeof(*ckh) > (void *)fb->d.data + read_size ||
+			    ckh->chunk_type != CHUNK_TYPE_RAW ||
+			    in.total - pos < ckh->total_sz) {
 				fastboot_fail("Corrupted sparse file");
-				goto exit;
+				goto out;
 			}
 
-			blk_count += ckh->chunk_sz;
+			memcpy_s(&big, sizeof(big), ckh, sizeof(*ckh));
 			nb_chunks--;
 
-			ret = installer_flash_big_chunk(file, &remaining_data,
-					fb, argc, argv);
+			ret = installer_flash_big_chunk(&ra, pos, &big, blk_count,
+							argc, argv);
 			if (EFI_ERROR(ret))
-				goto exit;
+				goto out;
 
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
+			blk_count += big.chunk_sz;
+			pos += big.total_sz;
+		} else {
+			/* The incomplete chunk at the end of the buffer
+			   is read again at the beginning of the next
+			   window, which is read while this one is
+			   flashed. */
+			pos += flash_size - HEADER_SIZE;
+			if (nb_chunks > 0 && pos < in.total)
+				read_ahead_request(&ra, pos, min(MAX_DATA_SIZE, in.total - pos),
+						   HEADER_SIZE);
+
+			installer_flash_buffer(fb, flash_size, argc, argv);
+			if (!last_cmd_succeeded)
+				goto out;
 			continue;
 		}
 
-		installer_flash_buffer(dl->data, flash_size, argc, argv);
-		if (!last_cmd_succeeded)
-			goto exit;
-
-		/* Move the incomplete chunk from the end to the
-		   beginning of the buffer. */
-		if (dl->data + flash_size < read_ptr + read_size) {
-			already_read = read_ptr + read_size - (void *)ckh;
-			ret = memcpy_s(fb->d.data, MAX_DATA_SIZE, ckh, already_read);
-			if (EFI_ERROR(ret))
-				goto exit;
-			read_size = MAX_DATA_SIZE - already_read;
-			read_ptr = fb->d.data + already_read;
-		} else {
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-		}
+		if (nb_chunks > 0 && pos < in.total)
+			read_ahead_request(&ra, pos, min(MAX_DATA_SIZE, in.total - pos),
+					   HEADER_SIZE);
 	}
 
+out:
+	read_ahead_free(&ra);
 exit:
-	uefi_call_wrapper(file->Close, 1, file);
+	for (i = 0; i < num; i++)
+		if (file[i])
+			uefi_call_wrapper(file[i]->Close, 1, file[i]);
 }
 
 static void installer_flash_cmd(INTN argc, CHAR8 **argv)
@@ -643,7 +599,7 @@ static void installer_flash_cmd(INTN argc, CHAR8 **argv)
 			goto exit;
 		}
 
-		installer_split_and_joint_flash(numname, numsize, num, argc, argv);
+		installer_split_and_flash(numname, numsize, num, argc, argv);
 	} else {
 		/* The fastboot flash command does not want the file parameter. */
 		argc--;
@@ -685,7 +641,7 @@ static void installer_flash_cmd(INTN argc, CHAR8 **argv)
 		}
 
 		if (size > dl->max_size) {
-			installer_split_and_flash(filename, size, argc, argv);
+			installer_split_and_flash(&filename, &size, 1, argc, argv);
 			goto exit;
 		}
 
@@ -1214,6 +1170,9 @@ EFI_STATUS installer_transport_start(start_callback_t start_cb,
 		return ret;
 	}
 
+	/* The installer flashes from its own buffers. */
+	fastboot_disable_writeback();
+
 	fastboot_tx_cb = tx_cb;
 	fastboot_rx_cb = rx_cb;
 	start_cb();
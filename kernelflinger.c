@@ -65,6 +65,8 @@
 #include "trusty_common.h"
 #endif
 #include "gpt.h"
+#include "misc_cache.h"
+#include "prefetch.h"
 #include "protocol.h"
 #include "uefi_utils.h"
 #include "security_interface.h"
@@ -953,6 +955,7 @@ static EFI_STATUS load_image(VOID *bootimage, VOID *vendorbootimage, UINT8 boot_
                 }
 
 		set_boottime_stamp(TM_LOAD_TOS_DONE);
+		prefetch_release();
 		ret = start_trusty(tosimage);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Unable to start trusty; stop.");
@@ -1065,6 +1068,7 @@ static VOID enter_fastboot_mode(UINT8 boot_state)
                                         efi_perror(ret, L"Fastboot mode fail to load slot data");
 				set_image_oemvars_nocheck(bootimage, NULL);
 				load_image(bootimage, NULL, BOOT_STATE_ORANGE, NORMAL_BOOT, slot_data);
+				android_image_plan_release();
 			}
 			FreePool(bootimage);
 			bootimage = NULL;
@@ -1250,9 +1254,18 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 		boot_target = FASTBOOT;
 	}
 
+	/* The BCB updates made while choosing and loading the boot
+	   target are written back at once, before the kernel is
+	   started, the device reboots or kernelflinger hands over to
+	   another EFI application.  The A/B metadata is not deferred:
+	   the tries remaining decrement made by avb_ab_flow() is on
+	   disk when it returns.  */
+	misc_cache_defer(TRUE);
+
 	ret = slot_init();
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Slot management initialization failed");
+		misc_cache_defer(FALSE);
 		return ret;
 	}
 
@@ -1261,8 +1274,10 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	 */
 	if (boot_target == NORMAL_BOOT)
 		boot_target = choose_boot_target(&target_path, &oneshot);
-	if (boot_target == EXIT_SHELL)
+	if (boot_target == EXIT_SHELL) {
+		misc_cache_defer(FALSE);
 		return EFI_SUCCESS;
+	}
 	if (boot_target == CRASHMODE) {
 #ifdef USE_UI
 		boot_target = ux_prompt_user_for_boot_target(NO_ERROR_CODE);
@@ -1326,6 +1341,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	/* EFI binaries are validated by the BIOS */
 	if (boot_target == ESP_EFI_BINARY) {
 		debug(L"entering EFI binary");
+		misc_cache_defer(FALSE);
 		if (!target_path)
 			return EFI_INVALID_PARAMETER;
 		ret = uefi_enter_binary(g_disk_device, target_path, oneshot, 0, NULL);
@@ -1354,6 +1370,11 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	set_boottime_stamp(TM_AVB_START);
 	acpi_set_boot_target(boot_target);
 
+	/* Start reading the images of the active slot while the
+	   previous ones are being verified.  */
+	if (boot_target == NORMAL_BOOT || boot_target == CHARGER)
+		prefetch_boot_images(slot_get_active());
+
 	/* AVB check */
 	disable_slot_if_efi_loaded_slot_failed();
 	ret = avb_load_verify_boot_image(boot_target, target_path, &bootimage, oneshot, &boot_state, &vb_data);
@@ -1392,6 +1413,8 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 			);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to start boot image");
+	prefetch_release();
+	android_image_plan_release();
 
 	switch (boot_target) {
 	case NORMAL_BOOT:
@@ -45,6 +45,7 @@
 #include "ioc_can.h"
 #endif
 #include "android_vb2.h"
+#include "avb_cache.h"
 #include "android.h"
 #include "slot.h"
 #include "timer.h"
@@ -843,8 +844,7 @@ EFI_STATUS avb_boot_android(enum boot_target boot_target, CHAR8 *abl_cmd_line)
 	ret = android_install_acpi_table_avb(slot_data);
 	if (EFI_ERROR(ret)) goto fail;
 
-	ret = avb_vbmeta_image_verify(slot_data->vbmeta_images[0].vbmeta_data,
-			slot_data->vbmeta_images[0].vbmeta_size,
+	ret = avb_cache_slot_public_key(slot_data,
 			&vbmeta_pub_key,
 			&vbmeta_pub_key_len);
 	if (EFI_ERROR(ret)) {
@@ -864,7 +864,7 @@ EFI_STATUS avb_boot_android(enum boot_target boot_target, CHAR8 *abl_cmd_line)
         ret = setup_acpi_table(bootimage, boot_target);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"setup_acpi_table");
-                return ret;
+                goto fail;
         }
 
 #ifdef USE_TRUSTY
@@ -896,8 +896,9 @@ EFI_STATUS avb_boot_android(enum boot_target boot_target, CHAR8 *abl_cmd_line)
 	}
 
 fail:
+	android_image_plan_release();
 	if (slot_data)
-		avb_slot_verify_data_free(slot_data);
+		avb_cache_free_slot(slot_data);
 
 	return ret;
 }
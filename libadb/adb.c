@@ -400,7 +400,8 @@ static transport_t ADB_TRANSPORT[] = {
 		.stop = tcp_stop,
 		.run = tcp_run,
 		.read = tcp_read,
-		.write = tcp_write
+		.write = tcp_write,
+		.connected = tcp_connected
 	}
 };
 
@@ -424,7 +425,7 @@ EFI_STATUS adb_run()
 {
 	EFI_STATUS ret;
 
-	ret = transport_run();
+	ret = transport_schedule();
 	if (EFI_ERROR(ret) && ret != EFI_TIMEOUT) {
 		efi_perror(ret, L"Error occurred during USB run");
 		return ret;
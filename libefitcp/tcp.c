@@ -614,6 +614,11 @@ EFI_STATUS tcp_stop(void)
 	return EFI_SUCCESS;
 }
 
+BOOLEAN tcp_connected(void)
+{
+	return tcp_connection != NULL;
+}
+
 EFI_STATUS tcp_run(void)
 {
 	if (!tcp_connection)
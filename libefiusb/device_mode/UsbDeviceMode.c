@@ -329,7 +329,6 @@ UsbdEpRxData (
 {
   EFI_STATUS        Status = EFI_DEVICE_ERROR;
   USB_XFER_REQUEST  RxReq;
-  UINT32            ReqPacket;
 
   DEBUG ((DEBUG_INFO,  "RX REQUEST in: IoReq->IoInfo.Length: 0x%x\n", IoReq->IoInfo.Length));
   DEBUG ((DEBUG_INFO,  "RX REQUEST in: MaxPacketSize: 0x%x\n", IoReq->EndpointInfo.EndpointDesc->MaxPacketSize));
@@ -349,11 +348,15 @@ UsbdEpRxData (
   RxReq.XferBuffer = IoReq->IoInfo.Buffer;
 
   //
-  // Transfer length should be multiple of USB packet size.
+  // Transfer length must be a multiple of USB packet size.  It is not
+  // rounded up here as the controller would then write past the end of
+  // the caller buffer: the caller handles the sub-packet tail.
   //
-  ReqPacket = IoReq->IoInfo.Length / IoReq->EndpointInfo.EndpointDesc->MaxPacketSize;
-  ReqPacket = ((IoReq->IoInfo.Length % IoReq->EndpointInfo.EndpointDesc->MaxPacketSize) == 0)? ReqPacket : ReqPacket + 1;
-  RxReq.XferLen = ReqPacket * IoReq->EndpointInfo.EndpointDesc->MaxPacketSize;
+  if ((IoReq->IoInfo.Length % IoReq->EndpointInfo.EndpointDesc->MaxPacketSize) != 0) {
+    DEBUG ((DEBUG_INFO, "RX REQUEST: length 0x%x is not a multiple of MaxPacketSize\n", IoReq->IoInfo.Length));
+    return EFI_INVALID_PARAMETER;
+  }
+  RxReq.XferLen = IoReq->IoInfo.Length;
 
   RxReq.XferDone = UsbdXferDoneHndlr;
 
@@ -178,16 +178,25 @@ EFI_STATUS usb_write(void *buf, UINT32 size)
 	return ret;
 }
 
-EFI_STATUS usb_read(void *buf, UINT32 size)
+/* The device controller only accepts OUT transfers whose length is a
+ * multiple of MaxPacketSize.  To complete a read of exactly SIZE bytes
+ * without writing past the caller buffer, the largest MaxPacketSize
+ * multiple is received in place and the remaining tail (less than one
+ * packet) is received in RX_TAIL and copied back on completion.  A short
+ * packet or a zero length packet ends the transfer early. */
+static struct rx_request {
+	UINT8 *buf;
+	UINT32 size;
+	UINT32 received;
+	BOOLEAN tail;
+} rx_req;
+static UINT8 rx_tail[USB_BULK_EP_PKT_SIZE_MAX] __attribute__((aligned(64)));
+
+static EFI_STATUS usb_queue_rx(void *buf, UINT32 size)
 {
 	EFI_STATUS ret;
 	USB_DEVICE_IO_REQ ioReq;
 
-	/* WA: usb device stack doesn't accept rx buffer not multiple of MaxPacketSize */
-	unsigned max_pkt_size = config_descriptor.ep_out.MaxPacketSize;
-
-	size = ALIGN(size, max_pkt_size);
-
 	ioReq.EndpointInfo.EndpointDesc = &config_descriptor.ep_out;
 	ioReq.EndpointInfo.EndpointCompDesc = NULL;
 	ioReq.IoInfo.Buffer = buf;
@@ -201,6 +210,88 @@ EFI_STATUS usb_read(void *buf, UINT32 size)
 	return ret;
 }
 
+static EFI_STATUS usb_queue_rx_tail(void)
+{
+	UINT32 max_pkt_size = config_descriptor.ep_out.MaxPacketSize;
+
+	if (max_pkt_size > sizeof(rx_tail)) {
+		error(L"MaxPacketSize %d is larger than the Rx tail buffer",
+		      max_pkt_size);
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	rx_req.tail = TRUE;
+	return usb_queue_rx(rx_tail, max_pkt_size);
+}
+
+EFI_STATUS usb_read(void *buf, UINT32 size)
+{
+	UINT32 max_pkt_size = config_descriptor.ep_out.MaxPacketSize;
+	UINT32 aligned;
+
+	if (!buf || !size || !max_pkt_size)
+		return EFI_INVALID_PARAMETER;
+
+	rx_req.buf = buf;
+	rx_req.size = size;
+	rx_req.received = 0;
+	rx_req.tail = FALSE;
+
+	aligned = size - (size % max_pkt_size);
+	if (!aligned)
+		return usb_queue_rx_tail();
+
+	return usb_queue_rx(buf, aligned);
+}
+
+static void usb_rx_complete(void *buf, UINT32 len)
+{
+	EFI_STATUS ret;
+	UINT32 remaining = rx_req.size - rx_req.received;
+
+	if (buf != rx_req.buf + rx_req.received && buf != rx_tail) {
+		error(L"Received data in an unexpected buffer");
+		return;
+	}
+
+	if (len > remaining) {
+		error(L"Received %d bytes, only %d expected", len, remaining);
+		len = remaining;
+	}
+
+	if (rx_req.tail) {
+		ret = memcpy_s(rx_req.buf + rx_req.received, remaining,
+			       rx_tail, len);
+		if (EFI_ERROR(ret))
+			return;
+		rx_req.tail = FALSE;
+		rx_req.received += len;
+	} else {
+		rx_req.received += len;
+		/* Full packets only and some bytes left: receive the
+		   tail, otherwise a short packet ended the transfer.  If
+		   the tail cannot be queued, the bytes received so far are
+		   returned as if a short packet had ended the transfer. */
+		if (len && !(len % config_descriptor.ep_out.MaxPacketSize) &&
+		    rx_req.received < rx_req.size) {
+			ret = usb_queue_rx_tail();
+			if (!EFI_ERROR(ret))
+				return;
+			efi_perror(ret, L"Failed to receive the %d last bytes",
+				   rx_req.size - rx_req.received);
+			rx_req.tail = FALSE;
+		}
+	}
+
+	if (!rx_req.received) {
+		error(L"Received an unexpected zero length packet");
+		return;
+	}
+
+	if (rx_callback)
+		rx_callback(rx_req.buf, rx_req.received);
+}
+
 static EFIAPI EFI_STATUS setup_handler(__attribute__((__unused__)) EFI_USB_DEVICE_REQUEST *CtrlRequest,
 				       __attribute__((__unused__)) USB_DEVICE_IO_INFO *IoInfo)
 {
@@ -228,18 +319,22 @@ static EFIAPI EFI_STATUS config_handler(UINT8 cfgVal)
 
 EFIAPI EFI_STATUS data_handler(EFI_USB_DEVICE_XFER_INFO *XferInfo)
 {
-	if (!XferInfo->Buffer || XferInfo->Length == 0) {
-		error(L"Received an unexpected NULL or zero length buffer");
+	if (!XferInfo->Buffer) {
+		error(L"Received an unexpected NULL buffer");
 		return EFI_INVALID_PARAMETER;
 	}
 
 	/* if we are receiving a command or data, call the processing routine */
 	if (XferInfo->EndpointDir == USB_ENDPOINT_DIR_OUT) {
-		if (rx_callback)
-			rx_callback(XferInfo->Buffer, XferInfo->Length);
-	} else
+		usb_rx_complete(XferInfo->Buffer, XferInfo->Length);
+	} else {
+		if (XferInfo->Length == 0) {
+			error(L"Sent an unexpected zero length buffer");
+			return EFI_INVALID_PARAMETER;
+		}
 		if (tx_callback)
 			tx_callback(XferInfo->Buffer, XferInfo->Length);
+	}
 	return EFI_SUCCESS;
 }
 
@@ -50,7 +50,7 @@ elf32_get_segment_info(const elf32_ehdr_t *ehdr,
 
 /* prototypes of the real elf parsing functions */
 static BOOLEAN
-elf32_update_rela_section(uint32_t relocation_offset, elf32_dyn_t *dyn_section, uint64_t dyn_section_sz)
+elf32_update_rela_section(module_file_info_t *file_info, uint32_t relocation_offset, elf32_dyn_t *dyn_section, uint64_t dyn_section_sz)
 {
 	elf32_rela_t *rela = NULL;
 	uint32_t rela_sz = 0;
@@ -113,16 +113,34 @@ elf32_update_rela_section(uint32_t relocation_offset, elf32_dyn_t *dyn_section,
 		&& rela_sz && (NULL != symtab)
 		&& (sizeof(elf32_rela_t) == rela_entsz)
 		&& (sizeof(elf32_sym_t) == symtab_entsz)) {
+		/* the relocations are applied in place, in the runtime image */
+		if (!image_runtime_range(file_info, (uint64_t)(UINTN)rela, rela_sz)) {
+			local_print(L"relocation table is out of the image\n");
+			return FALSE;
+		}
+
 		for (i = 0; i < rela_sz / rela_entsz; ++i) {
 			uint32_t *target_addr =
 				(uint32_t *)(UINTN)((uint64_t)rela[i].r_offset +
 						 (uint64_t)relocation_offset);
 			uint32_t symtab_idx;
 
+			if (!image_runtime_range(file_info, (uint64_t)(UINTN)target_addr,
+						 sizeof(*target_addr))) {
+				local_print(L"relocation target is out of the image\n");
+				return FALSE;
+			}
+
 			switch (rela[i].r_info & 0xFF) {
 			case R_386_32:
 				*target_addr = rela[i].r_addend + relocation_offset;
 				symtab_idx = rela[i].r_info >> 8;
+				if (!image_runtime_range(file_info,
+							 (uint64_t)(UINTN)&symtab[symtab_idx],
+							 sizeof(*symtab))) {
+					local_print(L"symbol is out of the image\n");
+					return FALSE;
+				}
 				*target_addr += symtab[symtab_idx].st_value;
 				break;
 			case R_386_RELATIVE:
@@ -149,16 +167,33 @@ elf32_update_rela_section(uint32_t relocation_offset, elf32_dyn_t *dyn_section,
 		 * architecture, one form or the other might be necessary or more
 		 * convenient. Consequently, an implementation for a particular machine
 		 * may use one form exclusively or either form depending on context. */
+		if (!image_runtime_range(file_info, (uint64_t)(UINTN)rel, rel_sz)) {
+			local_print(L"relocation table is out of the image\n");
+			return FALSE;
+		}
+
 		for (i = 0; i < rel_sz / rel_entsz; ++i) {
 			uint32_t *target_addr =
 				(uint32_t *)(UINTN)((uint64_t)rel[i].r_offset +
 						 (uint64_t)relocation_offset);
 			uint32_t symtab_idx;
 
+			if (!image_runtime_range(file_info, (uint64_t)(UINTN)target_addr,
+						 sizeof(*target_addr))) {
+				local_print(L"relocation target is out of the image\n");
+				return FALSE;
+			}
+
 			switch (rel[i].r_info & 0xFF) {
 			case R_386_32:
 				*target_addr += relocation_offset;
 				symtab_idx = rel[i].r_info >> 8;
+				if (!image_runtime_range(file_info,
+							 (uint64_t)(UINTN)&symtab[symtab_idx],
+							 sizeof(*symtab))) {
+					local_print(L"symbol is out of the image\n");
+					return FALSE;
+				}
 				*target_addr += symtab[symtab_idx].st_value;
 				break;
 
@@ -216,7 +251,8 @@ static void elf32_update_segment_table(module_file_info_t *file_info, uint32_t r
 BOOLEAN
 elf32_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 {
-	elf32_ehdr_t *ehdr;             /* ELF header */
+	elf32_ehdr_t ehdr_buf;
+	elf32_ehdr_t *ehdr = &ehdr_buf; /* ELF header */
 	uint8_t *phdrtab;               /* Program Segment header Table */
 	uint32_t phsize;            /* Program Segment header Table size */
 	uint32_t low_addr = (uint32_t) ~0;
@@ -227,21 +263,27 @@ elf32_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 	uint16_t i;
 	elf32_phdr_t *phdr_dyn = NULL;
 	elf32_dyn_t *dyn_section;
+	uint64_t dyn_addr;
 	uint32_t relocation_offset;
 	uint64_t offset_0_addr = (uint64_t)~0;
+	BOOLEAN ret = FALSE;
 
-	/* map ELF header to ehdr */
-	ehdr = (elf32_ehdr_t *)(uint8_t *)image_offset(file_info, 0,
-			sizeof(elf32_ehdr_t));
-	if (!ehdr) {
+	/* The Program Segment header Table is used in place in the
+	 * loadtime image, each loadable segment is then copied once from
+	 * the loadtime image to its runtime address */
+	if (!image_read(file_info, 0, ehdr, sizeof(*ehdr))) {
 		return FALSE;
 	}
 
-	/* map Program Segment header Table to phdrtab */
-	phsize = ehdr->e_phnum * sizeof(elf32_phdr_t);
-	phdrtab = (uint8_t *)image_offset
-			(file_info, (uint64_t)ehdr->e_phoff, (uint64_t)phsize);
-	if (!phdrtab){
+	if (0 == ehdr->e_phnum || ehdr->e_phentsize < sizeof(elf32_phdr_t)) {
+		local_print(L"invalid program header table\n");
+		return FALSE;
+	}
+
+	phsize = (uint32_t)ehdr->e_phnum * ehdr->e_phentsize;
+	phdrtab = image_offset(file_info, (uint64_t)ehdr->e_phoff, phsize);
+	if (!phdrtab) {
+		local_print(L"program header table is out of the image\n");
 		return FALSE;
 	}
 
@@ -268,14 +310,14 @@ elf32_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 	if (0 != (low_addr & PAGE_4K_MASK)) {
 		local_print(
 			L"Failed because kernel low address is not page aligned, low_addr = %#p", low_addr);
-		return FALSE;
+		goto out;
 	}
 
 	file_info->runtime_image_size = PAGE_ALIGN_4K(max_addr - low_addr);
 	if (file_info->runtime_total_size < file_info->runtime_image_size ||
 		0 == file_info->runtime_image_size) {
 		local_print(L"dest memory is smaller than required or it is zero\n");
-		return FALSE;
+		goto out;
 	}
 
 	relocation_offset = (uint32_t)file_info->runtime_addr - low_addr;
@@ -307,14 +349,14 @@ elf32_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 
 		if (!image_copy((void *)(UINTN)((uint64_t)addr + (uint64_t)relocation_offset),
 				file_info, (uint64_t)phdr->p_offset, (uint64_t)filesz)) {
-			local_print(L"failed to read segment from file\n");
-			return FALSE;
+			local_print(L"segment is out of the image\n");
+			goto out;
 		}
 
 		if (filesz < memsz) { /* zero BSS if exists */
-			memset_s((void *)(UINTN)((uint64_t)addr + (uint64_t)filesz +
-						    (uint64_t)relocation_offset), memsz - filesz, 0,
-				memsz - filesz);
+			memset((void *)(UINTN)((uint64_t)addr + (uint64_t)filesz +
+						  (uint64_t)relocation_offset), 0,
+			       memsz - filesz);
 		}
 	}
 
@@ -328,20 +370,27 @@ elf32_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 	if (offset_0_addr != (uint64_t)~0) {
 		if (offset_0_addr != low_addr) {
 			local_print(L"elf header is relocated to wrong place\n");
-			return FALSE;
+			goto out;
 		}
 		elf32_update_segment_table(file_info, relocation_offset);
 	}
 
 	if (NULL != phdr_dyn) {
-		dyn_section = (elf32_dyn_t *)image_offset
-				   (file_info, (uint64_t)phdr_dyn->p_offset, (uint64_t)phdr_dyn->p_filesz);
-		if (!elf32_update_rela_section(relocation_offset, dyn_section, phdr_dyn->p_filesz))
-				return FALSE;
+		/* the dynamic section has been loaded with its segment */
+		dyn_addr = (uint64_t)phdr_dyn->p_paddr + (uint64_t)relocation_offset;
+		if (!image_runtime_range(file_info, dyn_addr, phdr_dyn->p_filesz)) {
+			local_print(L"dynamic section is out of the image\n");
+			goto out;
+		}
+		dyn_section = (elf32_dyn_t *)(UINTN)dyn_addr;
+		if (!elf32_update_rela_section(file_info, relocation_offset, dyn_section, phdr_dyn->p_filesz))
+				goto out;
 	}
 
 	/* get the relocation entry addr */
 	*p_entry = ehdr->e_entry + relocation_offset;
+	ret = TRUE;
 
-	return TRUE;
+out:
+	return ret;
 }
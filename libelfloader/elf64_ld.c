@@ -48,7 +48,7 @@ elf64_get_segment_info(const elf64_ehdr_t *ehdr,
 }
 /* prototypes of the real elf parsing functions */
 static BOOLEAN
-elf64_update_rela_section(uint16_t e_type, uint64_t relocation_offset, elf64_dyn_t *dyn_section, uint64_t dyn_section_sz)
+elf64_update_rela_section(module_file_info_t *file_info, uint16_t e_type, uint64_t relocation_offset, elf64_dyn_t *dyn_section, uint64_t dyn_section_sz)
 {
 	elf64_rela_t *rela = NULL;
 	uint64_t rela_sz = 0;
@@ -102,18 +102,36 @@ elf64_update_rela_section(uint16_t e_type, uint64_t relocation_offset, elf64_dyn
 		}
 	}
 
+	/* the relocations are applied in place, in the runtime image */
+	if (!image_runtime_range(file_info, (uint64_t)(UINTN)rela, rela_sz)) {
+		local_print(L"relocation table is out of the image\n");
+		return FALSE;
+	}
+
 	for (i = 0; i < rela_sz / rela_entsz; ++i) {
 		uint64_t *target_addr =
 			(uint64_t *)(UINTN)(uint64_t)(rela[i].r_offset +
 						 relocation_offset);
 		uint32_t symtab_idx;
 
+		if (!image_runtime_range(file_info, (uint64_t)(UINTN)target_addr,
+					 sizeof(*target_addr))) {
+			local_print(L"relocation target is out of the image\n");
+			return FALSE;
+		}
+
 		switch (rela[i].r_info & 0xFF) {
 		/* Formula for R_x86_64_32 and R_X86_64_64 are same: S + A  */
 		case R_X86_64_32:
 		case R_X86_64_64:
 			*target_addr = rela[i].r_addend + relocation_offset;
 			symtab_idx = (uint32_t)(rela[i].r_info >> 32);
+			if (!image_runtime_range(file_info,
+						 (uint64_t)(UINTN)&symtab[symtab_idx],
+						 sizeof(*symtab))) {
+				local_print(L"symbol is out of the image\n");
+				return FALSE;
+			}
 			*target_addr += symtab[symtab_idx].st_value;
 			break;
 		case R_X86_64_RELATIVE:
@@ -161,7 +179,8 @@ static void elf64_update_segment_table(module_file_info_t *file_info, uint64_t r
 BOOLEAN
 elf64_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 {
-	elf64_ehdr_t *ehdr;
+	elf64_ehdr_t ehdr_buf;
+	elf64_ehdr_t *ehdr = &ehdr_buf;
 	uint8_t *phdrtab;
 	uint64_t phsize;
 	elf64_phdr_t *phdr;
@@ -173,21 +192,27 @@ elf64_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 	uint16_t i;
 	elf64_phdr_t *phdr_dyn = NULL;
 	elf64_dyn_t *dyn_section;
+	uint64_t dyn_addr;
 	uint64_t relocation_offset;
 	uint64_t offset_0_addr = (uint64_t)~0;
+	BOOLEAN ret = FALSE;
 
-	/* map ELF header to ehdr */
-	ehdr = (elf64_ehdr_t *)(uint8_t *)image_offset(file_info, 0,
-			sizeof(elf64_ehdr_t));
-	if (!ehdr){
+	/* The Program Segment header Table is used in place in the
+	 * loadtime image, each loadable segment is then copied once from
+	 * the loadtime image to its runtime address */
+	if (!image_read(file_info, 0, ehdr, sizeof(*ehdr))) {
 		return FALSE;
 	}
 
-	/* map Program Segment header Table to phdrtab */
-	phsize = ehdr->e_phnum * sizeof(elf64_phdr_t);
-	phdrtab = (uint8_t *)image_offset(file_info, (uint64_t)ehdr->e_phoff,
-			(uint64_t)phsize);
-	if (!phdrtab){
+	if (0 == ehdr->e_phnum || ehdr->e_phentsize < sizeof(elf64_phdr_t)) {
+		local_print(L"invalid program header table\n");
+		return FALSE;
+	}
+
+	phsize = (uint64_t)ehdr->e_phnum * ehdr->e_phentsize;
+	phdrtab = image_offset(file_info, (uint64_t)ehdr->e_phoff, phsize);
+	if (!phdrtab) {
+		local_print(L"program header table is out of the image\n");
 		return FALSE;
 	}
 
@@ -215,14 +240,14 @@ elf64_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 	if (0 != (low_addr & PAGE_4K_MASK)) {
 		local_print(L"failed because kernel low address "
 			"not page aligned, low_addr = %#p\n", low_addr);
-		return FALSE;
+		goto out;
 	}
 	file_info->runtime_image_size = PAGE_ALIGN_4K(max_addr - low_addr);
 
 	if (file_info->runtime_total_size < file_info->runtime_image_size ||
 		0 == file_info->runtime_image_size) {
 		local_print(L"memory is smaller than required or it is zero\n");
-		return FALSE;
+		goto out;
 	}
 
 	relocation_offset = (uint64_t)file_info->runtime_addr - low_addr;
@@ -255,15 +280,15 @@ elf64_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 
 		if (!image_copy((void *)(UINTN)(uint64_t)(addr + relocation_offset),
 				file_info, (uint64_t)phdr->p_offset, (uint64_t)filesz)) {
-			local_print(L"failed to read segment from file\n");
-			return FALSE;
+			local_print(L"segment is out of the image\n");
+			goto out;
 		}
 
 		if (filesz < memsz) {
 			/* zero BSS if exists */
-			memset_s((void *)(UINTN)(uint64_t)(addr + filesz +
-						    relocation_offset), (uint64_t)(memsz - filesz), 0,
-				(uint64_t)(memsz - filesz));
+			memset((void *)(UINTN)(uint64_t)(addr + filesz +
+						  relocation_offset), 0,
+			       (uint64_t)(memsz - filesz));
 		}
 	}
 
@@ -277,20 +302,27 @@ elf64_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 	if (offset_0_addr != (uint64_t)~0) {
 		if (offset_0_addr != low_addr) {
 			local_print(L"elf header is relocated to wrong place\n");
-			return FALSE;
+			goto out;
 		}
 		elf64_update_segment_table(file_info, relocation_offset);
 	}
 
 	if (NULL != phdr_dyn) {
-		dyn_section = (elf64_dyn_t *)(UINTN)image_offset
-			(file_info, (uint64_t)phdr_dyn->p_offset, (uint64_t)phdr_dyn->p_filesz);
-		if (!elf64_update_rela_section(ehdr->e_type, relocation_offset, dyn_section, phdr_dyn->p_filesz))
-			return FALSE;
+		/* the dynamic section has been loaded with its segment */
+		dyn_addr = phdr_dyn->p_paddr + relocation_offset;
+		if (!image_runtime_range(file_info, dyn_addr, phdr_dyn->p_filesz)) {
+			local_print(L"dynamic section is out of the image\n");
+			goto out;
+		}
+		dyn_section = (elf64_dyn_t *)(UINTN)dyn_addr;
+		if (!elf64_update_rela_section(file_info, ehdr->e_type, relocation_offset, dyn_section, phdr_dyn->p_filesz))
+			goto out;
 	}
 
 	/* get the relocation entry addr */
 	*p_entry = ehdr->e_entry + relocation_offset;
+	ret = TRUE;
 
-	return TRUE;
+out:
+	return ret;
 }
@@ -21,6 +21,8 @@
 //#define local_print(fmt, ...)
 #define local_print(fmt, ...) debug(fmt, ##__VA_ARGS__);
 
+/* The image is resident at loadtime_addr: return the address of
+ * [SRC_OFFSET, SRC_OFFSET + BYTES_TO_READ) in it */
 void *image_offset(module_file_info_t *file_info,
 				uint64_t src_offset, uint64_t bytes_to_read)
 {
@@ -34,23 +36,72 @@ void *image_offset(module_file_info_t *file_info,
 	return (void *)(UINTN)(file_info->loadtime_addr+ src_offset);
 }
 
-BOOLEAN image_copy(void *dest, module_file_info_t *file_info,
-				uint64_t src_offset, uint64_t bytes_to_copy)
+BOOLEAN image_read(module_file_info_t *file_info, uint64_t src_offset,
+				void *dest, uint64_t bytes_to_read)
 {
-	EFI_STATUS ret;
 	void *src;
-	src = image_offset(file_info, src_offset, bytes_to_copy);
+
+	src = image_offset(file_info, src_offset, bytes_to_read);
 	if (!src) {
 		return FALSE;
 	}
-	if (((uint64_t)(UINTN)dest < file_info->runtime_addr) ||
-		(((uint64_t)(UINTN)dest + bytes_to_copy) >
-		 (file_info->runtime_addr + file_info->runtime_image_size))) {
+
+	memcpy(dest, src, bytes_to_read);
+	return TRUE;
+}
+
+/* Check that [ADDR, ADDR + SIZE) lies within the runtime image */
+BOOLEAN image_runtime_range(module_file_info_t *file_info,
+				uint64_t addr, uint64_t size)
+{
+	return addr >= file_info->runtime_addr &&
+		addr + size >= addr &&
+		addr + size <= file_info->runtime_addr +
+			file_info->runtime_image_size;
+}
+
+BOOLEAN image_copy(void *dest, module_file_info_t *file_info,
+				uint64_t src_offset, uint64_t bytes_to_copy)
+{
+	if (!image_runtime_range(file_info, (uint64_t)(UINTN)dest,
+				 bytes_to_copy)) {
 		return FALSE;
 	}
 
-	ret = memcpy_s(dest, bytes_to_copy, src, bytes_to_copy);
-	return (ret == EFI_SUCCESS) ? (TRUE) : (FALSE);
+	return image_read(file_info, src_offset, dest, bytes_to_copy);
+}
+
+static BOOLEAN load_executable(module_file_info_t *file_info,
+				uint64_t *p_entry)
+{
+	union {
+		elf32_ehdr_t ehdr32;
+		elf64_ehdr_t ehdr64;
+	} header;
+
+	if (!image_read(file_info, 0, &header, sizeof(header.ehdr32))) {
+		local_print(L"failed to read file's header\n");
+		return FALSE;
+	}
+	if (!elf_header_is_valid(&header.ehdr32)) {
+		local_print(L"not an elf binary\n");
+		return FALSE;
+	}
+
+	if (is_elf32(&header.ehdr32)) {
+		return elf32_load_executable(file_info, p_entry);
+	}
+
+	if (!image_read(file_info, 0, &header, sizeof(header.ehdr64))) {
+		local_print(L"failed to read file's header\n");
+		return FALSE;
+	}
+	if (is_elf64(&header.ehdr64)) {
+		return elf64_load_executable(file_info, p_entry);
+	}
+
+	local_print(L"not an elf32 or elf64 binary\n");
+	return FALSE;
 }
 
 /*------------------------- Exported Interface --------------------------*/
@@ -78,31 +129,13 @@ BOOLEAN relocate_elf_image(	IN uint64_t ld_addr,
 				IN uint64_t rt_size,
 				OUT uint64_t *p_entry)
 {
-	uint8_t *p_buffer;
 	module_file_info_t file_info;
 
+	memset(&file_info, 0, sizeof(file_info));
 	file_info.loadtime_addr = ld_addr;
 	file_info.loadtime_size = ld_size;
 	file_info.runtime_addr = rt_addr;
 	file_info.runtime_total_size = rt_size;
 
-	p_buffer = (uint8_t *)image_offset(&file_info, 0,
-			sizeof(elf64_ehdr_t));
-	if (!p_buffer){
-		local_print(L"failed to read file's header\n");
-		return FALSE;
-	}
-	if (!elf_header_is_valid((elf64_ehdr_t *)p_buffer)) {
-		local_print(L"not an elf binary\n");
-		return FALSE;
-	}
-
-	if (is_elf64((elf64_ehdr_t *)p_buffer)) {
-		return elf64_load_executable(&file_info, p_entry);
-	} else if (is_elf32((elf32_ehdr_t *)p_buffer)) {
-		return elf32_load_executable(&file_info, p_entry);
-	} else {
-		local_print(L"not an elf32 or elf64 binary\n");
-		return FALSE;
-	}
+	return load_executable(&file_info, p_entry);
 }
@@ -229,7 +229,9 @@ typedef struct {
 	uint64_t runtime_total_size;
 } module_file_info_t;
 
-BOOLEAN image_copy(void * dest, module_file_info_t *file_info, uint64_t src_offset, uint64_t byte_to_read);
 void *image_offset(module_file_info_t *file_info, uint64_t src_offset, uint64_t byte_to_read);
+BOOLEAN image_copy(void * dest, module_file_info_t *file_info, uint64_t src_offset, uint64_t byte_to_read);
+BOOLEAN image_read(module_file_info_t *file_info, uint64_t src_offset, void *dest, uint64_t byte_to_read);
+BOOLEAN image_runtime_range(module_file_info_t *file_info, uint64_t addr, uint64_t size);
 
 #endif    /* _ELF_LD_H_ */
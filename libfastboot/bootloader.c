@@ -39,6 +39,7 @@
 #include "text_parser.h"
 #include "uefi_utils.h"
 #include "slot.h"
+#include "timer.h"
 
 #define ESP_TMP_PART		ESP_LABEL L"2"
 #define BOOTLOADER_TMP_PART	BOOTLOADER_LABEL L"2"
@@ -202,15 +203,24 @@ static EFI_STATUS flash_efi_partition(CHAR16 *label, CHAR16 *tmp_part,
 {
 	EFI_STATUS ret, erase_ret;
 	EFI_HANDLE handle;
+	EFI_GUID type;
 	UINTN i;
+	uint32_t start_ms, flash_ms, verify_ms = 0, swap_ms = 0;
 
+	start_ms = boottime_in_msec();
 	ret = flash_partition(data, size, tmp_part);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ret = gpt_refresh();
-	if (EFI_ERROR(ret))
-		return ret;
+	/* flash_partition() already refreshed the partition if it is
+	   an EFI System Partition.  */
+	ret = gpt_get_partition_type(tmp_part, &type, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret) || CompareGuid(&type, &EfiPartTypeSystemPartitionGuid)) {
+		ret = gpt_refresh();
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+	flash_ms = boottime_in_msec();
 
 	ret = gpt_get_partition_handle(tmp_part,
 				       LOGICAL_UNIT_USER, &handle);
@@ -239,9 +249,11 @@ static EFI_STATUS flash_efi_partition(CHAR16 *label, CHAR16 *tmp_part,
 		}
 	}
 
+	verify_ms = boottime_in_msec();
 	ret = gpt_swap_partition(tmp_part, label, LOGICAL_UNIT_USER);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to swap partitions");
+	swap_ms = boottime_in_msec();
 
 	if (is_load_options) {
 		ret = bootmgr_register_entries(label, load_options, load_option_nb);
@@ -252,11 +264,18 @@ exit:
 	/* Microsoft allows to use the FAT32 filesystem for the ESP
 	   partition only and in the context of a UEFI device.  We
 	   have to get rid of this potential second FAT32
-	   partition.  */
-	erase_ret = erase_by_label(tmp_part);
+	   partition.  Invalidating the file system and discarding
+	   the rest of the partition is enough and much cheaper than
+	   a full erase.  */
+	erase_ret = fast_erase_part(tmp_part);
 	if (EFI_ERROR(erase_ret))
 		efi_perror(erase_ret, L"Failed to erase '%s' partition", tmp_part);
 
+	if (swap_ms)
+		debug(L"%s update: flash %d ms, verify %d ms, swap %d ms, clean %d ms",
+		      label, flash_ms - start_ms, verify_ms - flash_ms,
+		      swap_ms - verify_ms, boottime_in_msec() - swap_ms);
+
 	free_load_options();
 
 	return EFI_ERROR(ret) ? ret : erase_ret;
@@ -41,6 +41,9 @@
 #include <transport.h>
 #include <slot.h>
 #include <storage.h>
+#include <misc_cache.h>
+#include <block_cache.h>
+#include <prefetch.h>
 
 #include "uefi_utils.h"
 #include "gpt.h"
@@ -102,11 +105,32 @@ static char *command_buffer;
 static UINTN command_buffer_size;
 static struct fastboot_var *varlist;
 static struct fastboot_tx_buffer *txbuf_head;
+static struct fastboot_tx_buffer *txbuf_tail;
 static enum fastboot_states fastboot_state;
 static enum fastboot_states next_state;
 
 /* Download buffer structure and size limits */
 static struct download_buffer dl;
+
+/* Write-back flash queue.  When a spare download buffer is available,
+ * plain partitions are flashed in the background from the transport
+ * scheduler idle time: the download buffer is handed to the flash job
+ * and the spare buffer receives the next download.  The flash job
+ * keeps the transport layer running so that the next download and
+ * getvar commands are processed while the partition is written. */
+static struct flash_job {
+	BOOLEAN pending;
+	BOOLEAN running;
+	void *data;
+	UINTN size;
+	CHAR16 *label;
+	EFI_STATUS status;
+	BOOLEAN status_reported;
+	char report[MAX_FLASH_REPORT];
+} flash_job;
+static void *spare_dl_data;
+static BOOLEAN writeback_disabled;
+static char flash_status[MAX_VARIABLE_LENGTH];
 static const UINTN MIN_DLSIZE = 8 * 1024 * 1024;
 static const UINTN MAX_DLSIZE = 256 * 1024 * 1024;
 
@@ -634,6 +658,23 @@ static const char *get_logical_block_size_var()
 
 }
 
+static const char *get_block_cache_var()
+{
+	static char block_cache[MAX_VARIABLE_LENGTH];
+	struct block_cache_stats stats;
+	int len;
+
+	block_cache_get_stats(&stats);
+	len = efi_snprintf((CHAR8 *)block_cache, sizeof(block_cache),
+			   (CHAR8 *)"hit:%ld miss:%ld evict:%ld inval:%ld",
+			   stats.hits, stats.misses, stats.evictions,
+			   stats.invalidations);
+	if (len < 0 || len >= (int)sizeof(block_cache))
+		return NULL;
+
+	return block_cache;
+}
+
 static EFI_STATUS fastboot_build_ack_msg(char *msg, const char *code, const char *fmt, va_list ap)
 {
 	char *response;
@@ -671,7 +712,6 @@ void fastboot_ack(const char *code, const char *fmt, va_list ap)
 void fastboot_ack_buffered(const char *code, const char *fmt, va_list ap)
 {
 	struct fastboot_tx_buffer *new_txbuf;
-	struct fastboot_tx_buffer *txbuf;
 	EFI_STATUS ret;
 
 	new_txbuf = AllocateZeroPool(sizeof(*new_txbuf));
@@ -687,12 +727,9 @@ void fastboot_ack_buffered(const char *code, const char *fmt, va_list ap)
 	}
 	if (!txbuf_head)
 		txbuf_head = new_txbuf;
-	else {
-		txbuf = txbuf_head;
-		while (txbuf->next)
-			txbuf = txbuf->next;
-		txbuf->next = new_txbuf;
-	}
+	else
+		txbuf_tail->next = new_txbuf;
+	txbuf_tail = new_txbuf;
 	fastboot_state = STATE_TX;
 }
 
@@ -804,6 +841,127 @@ EFI_STATUS refresh_partition_var(void)
 	return publish_partsize();
 }
 
+static void set_flash_status(const char *state, CHAR16 *label)
+{
+	if (efi_snprintf((CHAR8 *)flash_status, sizeof(flash_status),
+			 (CHAR8 *)"%a:%s", state, label) < 0)
+		flash_status[0] = '\0';
+}
+
+static const char *get_flash_status_var(void)
+{
+	return flash_status[0] ? flash_status : "idle";
+}
+
+static void fastboot_flash_yield(void);
+
+static void flash_job_run(__attribute__((__unused__)) void *context)
+{
+	EFI_STATUS ret;
+
+	if (!flash_job.pending || flash_job.running)
+		return;
+
+	flash_job.running = TRUE;
+	set_flash_status("flashing", flash_job.label);
+
+	flash_set_yield(fastboot_flash_yield);
+	ret = flash(flash_job.data, flash_job.size, flash_job.label);
+	flash_set_yield(NULL);
+	if (!EFI_ERROR(ret))
+		gpt_sync();
+
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Background flash of %s failed", flash_job.label);
+		set_flash_status("failed", flash_job.label);
+	} else {
+		info(L"Flash of %s done.", flash_job.label);
+		set_flash_status("done", flash_job.label);
+	}
+	/* The OKAY of the flash command has already been sent: the
+	   report is logged and a failure one is sent with the FAIL of
+	   the next command.  */
+	if (flash_get_report()[0])
+		info(L"%a", flash_get_report());
+	memcpy(flash_job.report, flash_get_report(), sizeof(flash_job.report));
+
+	flash_job.status = ret;
+	flash_job.status_reported = FALSE;
+	flash_job.running = FALSE;
+	flash_job.pending = FALSE;
+}
+
+/* Complete the pending flash job if any.  Return TRUE if a background
+ * flash failure was reported to the host. */
+static BOOLEAN flash_job_sync(BOOLEAN wait)
+{
+	if (wait && !flash_job.running)
+		flash_job_run(NULL);
+
+	if (flash_job.status_reported || !EFI_ERROR(flash_job.status))
+		return FALSE;
+
+	flash_job.status_reported = TRUE;
+	fastboot_fail("Background flash of %s failed: %r %a",
+		      flash_job.label, flash_job.status, flash_job.report);
+	return TRUE;
+}
+
+static void flash_job_free(void)
+{
+	if (flash_job.label) {
+		FreePool(flash_job.label);
+		flash_job.label = NULL;
+	}
+	flash_job.status = EFI_SUCCESS;
+	flash_status[0] = '\0';
+}
+
+/* Hand the downloaded data over to a background flash job.  LABEL is
+ * owned by the flash job on success. */
+static EFI_STATUS flash_job_queue(CHAR16 *label)
+{
+	EFI_STATUS ret;
+	void *data;
+
+	if (writeback_disabled || !spare_dl_data ||
+	    !flash_is_plain_partition(label))
+		return EFI_UNSUPPORTED;
+
+	flash_job_run(NULL);
+	flash_job_free();
+
+	flash_job.data = dl.data;
+	flash_job.size = dl.size;
+	flash_job.label = label;
+	flash_job.pending = TRUE;
+
+	ret = transport_defer(flash_job_run, NULL);
+	if (EFI_ERROR(ret)) {
+		flash_job.pending = FALSE;
+		flash_job.label = NULL;
+		return ret;
+	}
+
+	set_flash_status("queued", label);
+
+	data = dl.data;
+	dl.data = spare_dl_data;
+	spare_dl_data = data;
+
+	return EFI_SUCCESS;
+}
+
+void fastboot_disable_writeback(void)
+{
+	flash_job_run(NULL);
+	writeback_disabled = TRUE;
+	if (spare_dl_data) {
+		FreePool(spare_dl_data);
+		spare_dl_data = NULL;
+	}
+}
+
 static void cmd_flash(INTN argc, CHAR8 **argv)
 {
 	EFI_STATUS ret;
@@ -834,10 +992,19 @@ static void cmd_flash(INTN argc, CHAR8 **argv)
 		return;
 	}
 
+	ret = flash_job_queue(label);
+	if (!EFI_ERROR(ret)) {
+		info(L"Flashing %s in background ...", label);
+		fastboot_okay("");
+		return;
+	}
+
 	info(L"Flashing %s ...", label);
 
 	ret = flash(dl.data, dl.size, label);
 	FreePool(label);
+	if (flash_get_report()[0])
+		fastboot_info("%a", flash_get_report());
 	if (EFI_ERROR(ret)) {
 		fastboot_fail("Flash failure: %r", ret);
 		return;
@@ -1193,6 +1360,15 @@ static void fastboot_run_command()
 		return;
 	}
 
+	/* Only getvar and download can run while a partition is
+	 * flashed in background, any other command waits for the flash
+	 * job completion.  A background flash failure is reported on
+	 * the first command which is not getvar. */
+	if (!argc || strcmp(argv[0], (CHAR8 *)"getvar")) {
+		if (flash_job_sync(!argc || strcmp(argv[0], (CHAR8 *)"download")))
+			return;
+	}
+
 	fastboot_run_root_cmd((char *)argv[0], argc, argv);
 	received_len = 0;
 	last_received_len = 0;
@@ -1201,6 +1377,34 @@ static void fastboot_run_command()
 		flush_tx_buffer();
 }
 
+static BOOLEAN is_background_command(void)
+{
+	static const char *COMMANDS[] = { "getvar:", "download:" };
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(COMMANDS); i++)
+		if (!strncmp((CHAR8 *)command_buffer, (CHAR8 *)COMMANDS[i],
+			     strlen((CHAR8 *)COMMANDS[i])))
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Called by the flash job between two write operations. */
+static void fastboot_flash_yield(void)
+{
+	EFI_STATUS ret;
+
+	ret = transport_run();
+	if (EFI_ERROR(ret) && ret != EFI_TIMEOUT) {
+		efi_perror(ret, L"Error occurred during transport run");
+		return;
+	}
+
+	if (fastboot_state == STATE_COMMAND && is_background_command())
+		fastboot_run_command();
+}
+
 static void fastboot_process_rx(void *buf, unsigned len)
 {
 	CHAR8 *s;
@@ -1239,6 +1443,69 @@ static void fastboot_start_callback(void)
 	fastboot_read_command();
 }
 
+/* Read-only session served on the transport link which does not own
+ * the fastboot session: only the getvar command is supported. */
+static char secondary_command[MAGIC_LENGTH];
+
+static void fastboot_secondary_read_command(void)
+{
+	EFI_STATUS ret;
+
+	ret = transport_secondary_read(secondary_command,
+				       sizeof(secondary_command));
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to read secondary link command");
+}
+
+static void fastboot_secondary_reply(const char *code, const char *fmt, ...)
+{
+	static CHAR8 msg[MAGIC_LENGTH];
+	EFI_STATUS ret;
+	va_list args;
+
+	va_start(args, fmt);
+	ret = fastboot_build_ack_msg((char *)msg, code, fmt, args);
+	va_end(args);
+	if (EFI_ERROR(ret))
+		return;
+
+	ret = transport_secondary_write(msg, MAGIC_LENGTH);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to reply on the secondary link");
+}
+
+static void fastboot_secondary_rx(void *buf, unsigned len)
+{
+	static const char GETVAR[] = "getvar:";
+	struct fastboot_var *var;
+
+	if (buf != secondary_command || len >= sizeof(secondary_command)) {
+		fastboot_secondary_reply("FAIL", "Inappropriate command buffer or length");
+		return;
+	}
+
+	secondary_command[len] = '\0';
+	debug(L"GOT on secondary link %a", secondary_command);
+
+	if (strncmp((CHAR8 *)secondary_command, (CHAR8 *)GETVAR,
+		    sizeof(GETVAR) - 1)) {
+		fastboot_secondary_reply("FAIL", "Session owned by another transport");
+		return;
+	}
+
+	var = fastboot_getvar(secondary_command + sizeof(GETVAR) - 1);
+	if (!var)
+		fastboot_secondary_reply("FAIL", "Unknown variable");
+	else
+		fastboot_secondary_reply("OKAY", "%a", fastboot_var_value(var));
+}
+
+static void fastboot_secondary_tx(__attribute__((__unused__)) void *buf,
+				  __attribute__((__unused__)) unsigned len)
+{
+	fastboot_secondary_read_command();
+}
+
 static EFI_STATUS init_download_buffer(void)
 {
 	UINTN size;
@@ -1249,6 +1516,14 @@ static EFI_STATUS init_download_buffer(void)
 			continue;
 
 		dl.max_size = size;
+
+		/* Write-back flash is only enabled if a spare download
+		 * buffer of the same size is available. */
+		if (!writeback_disabled)
+			spare_dl_data = AllocatePool(size);
+		if (!spare_dl_data)
+			debug(L"Background flash is not available");
+
 		return EFI_SUCCESS;
 	}
 
@@ -1357,6 +1632,10 @@ static EFI_STATUS fastboot_init()
 	if (EFI_ERROR(ret))
 		goto error;
 
+	ret = fastboot_publish_dynamic("flash-status", get_flash_status_var);
+	if (EFI_ERROR(ret))
+		goto error;
+
 	ret = fastboot_publish_dynamic("erase-block-size", get_erase_block_size_var);
 	if (EFI_ERROR(ret))
 		goto error;
@@ -1369,6 +1648,10 @@ static EFI_STATUS fastboot_init()
 	if (EFI_ERROR(ret))
 		goto error;
 
+	ret = fastboot_publish_dynamic("block-cache", get_block_cache_var);
+	if (EFI_ERROR(ret))
+		goto error;
+
 	ret = publish_partsize();
 	if (EFI_ERROR(ret))
 		goto error;
@@ -1418,15 +1701,26 @@ static void *fastboot_efiimage;
 static UINTN fastboot_imagesize;
 static enum boot_target fastboot_target;
 
+#ifdef USE_UI
+static enum boot_target ui_target;
+
+static void fastboot_key_event(__attribute__((__unused__)) void *context)
+{
+	ui_target = fastboot_ui_event_handler();
+}
+#endif
+
+#if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
+static void fastboot_heart_beat(__attribute__((__unused__)) void *context)
+{
+	set_suppress_heart_beat_timeout(5);
+}
+#endif
+
 EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 			  enum boot_target *target)
 {
 	EFI_STATUS ret;
-#if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
-	EFI_TIME now;
-	UINT64 expiration_time = 0;
-	UINT64 current_time;
-#endif
 
 	if (!bootimage || !efiimage || !imagesize || !target)
 		return EFI_INVALID_PARAMETER;
@@ -1436,8 +1730,16 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 	fastboot_target = UNKNOWN_TARGET;
 	*target = UNKNOWN_TARGET;
 
+	/* A failed boot may have left images prefetched: give the
+	   memory back before the download buffer is allocated.  */
+	prefetch_release();
+
 	fastboot_init();
 
+	/* Fastboot commands expect their BCB and A/B metadata changes
+	   to be written right away.  */
+	misc_cache_defer(FALSE);
+
 	/* In case user still holding it from answering a UX prompt
 	 * or magic key */
 	ui_wait_for_key_release();
@@ -1448,6 +1750,12 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 		goto exit;
 	}
 
+	ret = transport_set_secondary(fastboot_secondary_read_command,
+				      fastboot_secondary_rx,
+				      fastboot_secondary_tx);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to set the secondary transport link");
+
 	ret = transport_start(fastboot_start_callback,
 			      fastboot_process_rx,
 			      fastboot_process_tx);
@@ -1456,42 +1764,45 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 		goto exit;
 	}
 
-	for (;;) {
 #ifdef USE_UI
-		*target = fastboot_ui_event_handler();
-		if (*target != UNKNOWN_TARGET)
-			break;
+	ui_target = UNKNOWN_TARGET;
+	ret = transport_watch_event(ST->ConIn->WaitForKey, fastboot_key_event, NULL);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to watch key events, UI is not functional");
 #endif
 #if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
-		ret = uefi_call_wrapper(RT->GetTime, 2, &now, NULL);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed to get the current time");
-		}
-		else {
-			current_time = efi_time_to_ctime(&now);
-			if (current_time >= expiration_time) {
-				set_suppress_heart_beat_timeout(5);
-				expiration_time = TIMEOUT + current_time;
-			}
-		}
+	fastboot_heart_beat(NULL);
+	ret = transport_add_timer(TIMEOUT * 1000, fastboot_heart_beat, NULL);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to schedule the IOC heart beat suppression");
 #endif
 
-		/* Keeping this for:
+	for (;;) {
+		/* Polling the transport layer is kept for:
 		 * - retro-compatibility with previous USB device mode
 		 *   protocol implementation;
 		 * - the installer needs to be scheduled; */
-		ret = transport_run();
+		ret = transport_schedule();
 		if (EFI_ERROR(ret) && ret != EFI_TIMEOUT) {
 			efi_perror(ret, L"Error occurred during transport run");
 			goto exit;
 		}
 
+#ifdef USE_UI
+		if (ui_target != UNKNOWN_TARGET) {
+			*target = ui_target;
+			break;
+		}
+#endif
+
 		fastboot_run_command();
 
 		if (fastboot_state == STATE_STOPPED)
 			break;
 	}
 
+	flash_job_run(NULL);
+
 	ret = transport_stop();
 	if (EFI_ERROR(ret))
 		goto exit;
@@ -1541,6 +1852,13 @@ EFI_STATUS fastboot_stop(void *bootimage, void *efiimage, UINTN imagesize,
 
 void fastboot_free()
 {
+	flash_job_run(NULL);
+	flash_job_free();
+	if (spare_dl_data) {
+		FreePool(spare_dl_data);
+		spare_dl_data = NULL;
+	}
+
 	if (dl.data) {
 		FreePool(dl.data);
 		dl.data = NULL;
@@ -62,6 +62,9 @@
 #define OFF_MODE_CHARGE		"off-mode-charge"
 #define CRASH_EVENT_MENU	"crash-event-menu"
 #define SLOT_FALLBACK		"slot-fallback"
+#define FLASH_MODE		"flash-mode"
+#define FLASH_VERIFY		"flash-verify"
+#define FLASH_DISCARD		"flash-discard"
 
 static cmdlist_t cmdlist;
 #ifdef USE_TPM
@@ -76,6 +79,18 @@ static EFI_STATUS fastboot_oem_publish(void)
 	if (EFI_ERROR(ret))
 		return ret;
 
+	ret = fastboot_publish(FLASH_MODE, flash_get_delta_mode() ? "delta" : "normal");
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = fastboot_publish(FLASH_VERIFY, flash_get_verify() ? "1" : "0");
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = fastboot_publish(FLASH_DISCARD, flash_get_discard() ? "1" : "0");
+	if (EFI_ERROR(ret))
+		return ret;
+
 	return publish_intel_variables();
 }
 
@@ -117,6 +132,95 @@ static void cmd_oem_off_mode_charge(INTN argc, CHAR8 **argv)
 		fastboot_okay("");
 }
 
+static void cmd_oem_flash_mode(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (!strcmp(argv[1], (CHAR8 *)"delta"))
+		flash_set_delta_mode(TRUE);
+	else if (!strcmp(argv[1], (CHAR8 *)"normal"))
+		flash_set_delta_mode(FALSE);
+	else {
+		fastboot_fail("Invalid value");
+		error(L"Please specify delta or normal");
+		return;
+	}
+
+	ret = fastboot_oem_publish();
+	if (EFI_ERROR(ret))
+		fastboot_fail("Failed to publish OEM variables");
+	else
+		fastboot_okay("");
+}
+
+static void cmd_oem_flash_option(INTN argc, CHAR8 **argv, char *name,
+				 void (*set_fun)(BOOLEAN value))
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (strcmp(argv[1], (CHAR8 *)"1") && strcmp(argv[1], (CHAR8 *)"0")) {
+		fastboot_fail("Invalid value");
+		error(L"Please specify 1 or 0 to enable/disable %a", name);
+		return;
+	}
+
+	set_fun(!strcmp(argv[1], (CHAR8 *)"1"));
+
+	ret = fastboot_oem_publish();
+	if (EFI_ERROR(ret))
+		fastboot_fail("Failed to publish OEM variables");
+	else
+		fastboot_okay("");
+}
+
+/* The block-hash manifest is sent with "fastboot stage" beforehand.
+   "none" drops the current one.  */
+static void cmd_oem_flash_manifest(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	struct download_buffer *dl;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], (CHAR8 *)"none"))) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (argc == 2) {
+		flash_set_manifest(NULL, 0);
+		fastboot_okay("");
+		return;
+	}
+
+	dl = fastboot_download_buffer();
+	ret = flash_set_manifest(dl->data, dl->size);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Invalid block-hash manifest, %r", ret);
+		return;
+	}
+
+	fastboot_okay("");
+}
+
+static void cmd_oem_flash_verify(INTN argc, CHAR8 **argv)
+{
+	cmd_oem_flash_option(argc, argv, FLASH_VERIFY, flash_set_verify);
+}
+
+static void cmd_oem_flash_discard(INTN argc, CHAR8 **argv)
+{
+	cmd_oem_flash_option(argc, argv, FLASH_DISCARD, flash_set_discard);
+}
+
 static void cmd_oem_crash_event_menu(INTN argc, CHAR8 **argv)
 {
 	EFI_STATUS ret;
@@ -726,6 +830,10 @@ static struct fastboot_cmd COMMANDS[] = {
 	{ "reboot",			LOCKED,		cmd_oem_reboot  },
 	{ "fw-update",			UNLOCKED,	cmd_oem_fw_update  },
 	{ "set-storage",		LOCKED,		cmd_oem_set_storage  },
+	{ FLASH_MODE,			UNLOCKED,	cmd_oem_flash_mode  },
+	{ "flash-manifest",		UNLOCKED,	cmd_oem_flash_manifest  },
+	{ FLASH_VERIFY,			UNLOCKED,	cmd_oem_flash_verify  },
+	{ FLASH_DISCARD,		UNLOCKED,	cmd_oem_flash_discard  },
 #ifndef USER
 	{ "reprovision",		LOCKED,		cmd_oem_reprovision  },
 	{ "rm",				LOCKED,		cmd_oem_rm },
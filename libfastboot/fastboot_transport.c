@@ -264,7 +264,8 @@ static transport_t FASTBOOT_TRANSPORT[] = {
 		.stop = tcp_stop,
 		.run = tcp_run,
 		.read = fastboot_tcp_read,
-		.write = fastboot_tcp_write
+		.write = fastboot_tcp_write,
+		.connected = tcp_connected
 	}
 };
 
@@ -38,6 +38,11 @@
 #include <fastboot.h>
 #include <android.h>
 #include <slot.h>
+#include <crc32.h>
+#include <misc_cache.h>
+#include <block_cache.h>
+#include <prefetch.h>
+#include <openssl/sha.h>
 #include "fastboot.h"
 #include "uefi_utils.h"
 #include "gpt.h"
@@ -58,6 +63,24 @@
 #endif
 static struct gpt_partition_interface gparti;
 static UINT64 cur_offset;
+static flash_yield_t flash_yield;
+static UINTN written_since_yield;
+static BOOLEAN delta_mode;
+static VOID *delta_buf;
+static struct flash_manifest *manifest;
+static BOOLEAN manifest_used;
+static UINT64 delta_skipped, delta_written;
+/* Summary of the last flash_partition() call.  It is not sent from
+   flash_partition() which may run as a background job.  */
+static char flash_report[MAX_FLASH_REPORT];
+static BOOLEAN verify_mode;
+static BOOLEAN discard_mode;
+static struct verify_extent {
+	UINT64 offset;
+	UINT32 size;
+	UINT32 crc;
+} *verify_extents;
+static UINTN verify_count, verify_max;
 static BOOLEAN userdata_erased = FALSE;
 BOOLEAN new_install_device = FALSE;
 
@@ -67,20 +90,376 @@ BOOLEAN new_install_device = FALSE;
 #define is_inside_partition(off, sz) \
 		(off >= part_start && off + sz <= part_end)
 
-EFI_STATUS flash_skip(UINT64 size)
+void flash_set_discard(BOOLEAN enable)
 {
-	if (!is_inside_partition(cur_offset, size)) {
-		error(L"Attempt to skip outside of partition [%ld %ld] [%ld %ld]",
-				part_start, part_end, cur_offset, cur_offset + size);
+	discard_mode = enable;
+}
+
+BOOLEAN flash_get_discard(void)
+{
+	return discard_mode;
+}
+
+/* When a yield function is set, the writes are split in chunks of
+   at most YIELD_SIZE bytes and the yield function is called each
+   time YIELD_SIZE bytes have been written.  It is small enough for
+   the transport layer to be polled before the host flow control
+   stalls the download running concurrently.  */
+#define YIELD_SIZE (1024 * 1024)
+
+void flash_set_yield(flash_yield_t yield)
+{
+	flash_yield = yield;
+	written_since_yield = 0;
+}
+
+/* Account for SIZE bytes of disk I/O and yield if needed.  */
+static void yield_after(UINTN size)
+{
+	if (!flash_yield)
+		return;
+
+	written_since_yield += size;
+	if (written_since_yield >= YIELD_SIZE) {
+		written_since_yield = 0;
+		flash_yield();
+	}
+}
+
+void flash_set_delta_mode(BOOLEAN enable)
+{
+	delta_mode = enable;
+}
+
+BOOLEAN flash_get_delta_mode(void)
+{
+	return delta_mode;
+}
+
+const char *flash_get_report(void)
+{
+	return flash_report;
+}
+
+/* In delta mode, the target range is read back in chunks of at most
+   DELTA_SIZE bytes and only the runs of blocks which differ from DATA
+   are written.  When a manifest of the partition is set, the blocks
+   are compared with their hash in the manifest instead, nothing is
+   read back.  */
+#define DELTA_SIZE (4 * 1024 * 1024)
+
+EFI_STATUS flash_set_manifest(VOID *data, UINTN size)
+{
+	struct flash_manifest *m = data;
+	UINTN hashes_size;
+
+	if (manifest) {
+		FreePool(manifest);
+		manifest = NULL;
+	}
+
+	if (!data)
+		return EFI_SUCCESS;
+
+	if (size < sizeof(*m) || m->magic != FLASH_MANIFEST_MAGIC ||
+	    m->version != FLASH_MANIFEST_VERSION || !m->block_size ||
+	    m->label[sizeof(m->label) - 1] != '\0') {
+		error(L"Invalid block-hash manifest");
 		return EFI_INVALID_PARAMETER;
 	}
-	cur_offset += size;
+
+	hashes_size = (size - sizeof(*m)) / FLASH_MANIFEST_HASH_SIZE;
+	if (m->block_count > hashes_size) {
+		error(L"Block-hash manifest truncated, %ld hashes for %ld blocks",
+		      hashes_size, m->block_count);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	size = sizeof(*m) + m->block_count * FLASH_MANIFEST_HASH_SIZE;
+	manifest = AllocatePool(size);
+	if (!manifest)
+		return EFI_OUT_OF_RESOURCES;
+	memcpy(manifest, m, size);
+
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS flash_write(VOID *data, UINTN size)
+/* Return TRUE if the manifest hash of the block at OFFSET matches
+   DATA.  DATA must cover a whole manifest block.  */
+static BOOLEAN manifest_match(UINT64 offset, VOID *data, UINTN len)
+{
+	UINT8 hash[SHA256_DIGEST_LENGTH];
+	UINT64 i;
+
+	offset -= part_start;
+	if (len != manifest->block_size || offset % manifest->block_size)
+		return FALSE;
+
+	i = offset / manifest->block_size;
+	if (i >= manifest->block_count)
+		return FALSE;
+
+	SHA256(data, len, hash);
+	return !memcmp(hash, manifest->hashes[i], sizeof(hash));
+}
+
+void flash_set_verify(BOOLEAN enable)
+{
+	verify_mode = enable;
+}
+
+BOOLEAN flash_get_verify(void)
+{
+	return verify_mode;
+}
+
+/* In verify mode, the CRC32 of the expected partition content is
+   recorded per extent of at most VERIFY_SIZE bytes: the image data,
+   including the blocks left unchanged by delta mode, the fill
+   patterns and, unless they are discarded, the don't care ranges as
+   read from the disk before the write.  The extents are read back and
+   checked once the whole image has been written.  The next extent is
+   read asynchronously while the current one is checked and the
+   transport layer keeps running while the reads are waited for.  */
+#define VERIFY_SIZE (4 * 1024 * 1024)
+#define VERIFY_EXTENTS_STEP 256
+
+/* Record DATA or, if DATA is NULL, SIZE bytes of repeated PATTERN.  */
+static EFI_STATUS verify_record(UINT64 offset, UINTN size, VOID *data,
+				UINT32 pattern)
+{
+	struct verify_extent *ext;
+	UINTN len;
+
+	for (; size; size -= len, offset += len) {
+		ext = verify_count ? &verify_extents[verify_count - 1] : NULL;
+		if (!ext || ext->size == VERIFY_SIZE ||
+		    ext->offset + ext->size != offset) {
+			if (verify_count == verify_max) {
+				ext = ReallocatePool(verify_extents,
+						     verify_max * sizeof(*ext),
+						     (verify_max + VERIFY_EXTENTS_STEP) * sizeof(*ext));
+				if (!ext) {
+					error(L"Failed to allocate verify extents");
+					return EFI_OUT_OF_RESOURCES;
+				}
+				verify_extents = ext;
+				verify_max += VERIFY_EXTENTS_STEP;
+			}
+			ext = &verify_extents[verify_count++];
+			ext->offset = offset;
+			ext->size = 0;
+			ext->crc = 0;
+		}
+
+		len = min(size, (UINTN)(VERIFY_SIZE - ext->size));
+		if (data)
+			ext->crc = crc32_update(ext->crc, data, len);
+		else
+			ext->crc = crc32_repeat(ext->crc, &pattern, sizeof(pattern),
+						len / sizeof(pattern));
+		ext->size += len;
+		if (data)
+			data += len;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static void verify_free(void)
+{
+	if (verify_extents)
+		FreePool(verify_extents);
+	verify_extents = NULL;
+	verify_count = verify_max = 0;
+}
+
+/* Record the current content of the range which is not written.  */
+static EFI_STATUS verify_record_disk(UINT64 offset, UINT64 size)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	VOID *buf;
+	UINTN len;
+
+	buf = AllocatePool(min(size, (UINT64)VERIFY_SIZE));
+	if (!buf) {
+		error(L"Failed to allocate the verify buffer");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	for (; size; size -= len, offset += len) {
+		len = min(size, (UINT64)VERIFY_SIZE);
+		ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+					gparti.bio->Media->MediaId, offset, len, buf);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read skipped bytes");
+			break;
+		}
+
+		ret = verify_record(offset, len, buf, 0);
+		if (EFI_ERROR(ret))
+			break;
+		yield_after(len);
+	}
+
+	FreePool(buf);
+	return ret;
+}
+
+static void verify_report(UINT64 start, UINT64 end)
+{
+	UINTN block_size = gparti.bio->Media->BlockSize;
+
+	error(L"Verify mismatch at LBA %ld-%ld", start / block_size,
+	      (end - 1) / block_size);
+
+	/* Only the first mismatch is reported to the host.  */
+	if (!strncmp((CHAR8 *)flash_report, (CHAR8 *)"verify", 6))
+		return;
+	if (efi_snprintf((CHAR8 *)flash_report, sizeof(flash_report),
+			 (CHAR8 *)"verify: mismatch at LBA %ld-%ld",
+			 start / block_size, (end - 1) / block_size) < 0)
+		flash_report[0] = '\0';
+}
+
+static EFI_STATUS verify_written(void)
 {
 	EFI_STATUS ret;
+	struct verify_extent *ext;
+	struct block_read_ahead *ra;
+	VOID *alloc[2] = { NULL, NULL }, *buf[2];
+	UINT64 bad_start = 0, bad_end = 0;
+	UINTN i;
+
+	if (!verify_count)
+		return EFI_SUCCESS;
+
+	ra = block_read_ahead_new(gparti.handle, gparti.bio, gparti.dio);
+	if (!ra) {
+		error(L"Failed to allocate the verify read-ahead");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(buf); i++) {
+		ret = alloc_aligned(&alloc[i], &buf[i], VERIFY_SIZE,
+				    gparti.bio->Media->IoAlign);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to allocate the verify buffers");
+			goto out;
+		}
+	}
+
+	ret = uefi_call_wrapper(gparti.bio->FlushBlocks, 1, gparti.bio);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to flush blocks before verify");
+
+	block_read_ahead_start(ra, verify_extents[0].offset, buf[0],
+			       verify_extents[0].size);
+	for (i = 0; i < verify_count; i++) {
+		ext = &verify_extents[i];
+		ret = block_read_ahead_finish(ra, flash_yield);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read back bytes");
+			goto out;
+		}
+
+		if (i + 1 < verify_count)
+			block_read_ahead_start(ra, ext[1].offset, buf[(i + 1) % 2],
+					       ext[1].size);
+
+		if (crc32_update(0, buf[i % 2], ext->size) != ext->crc) {
+			if (bad_end != ext->offset) {
+				if (bad_end)
+					verify_report(bad_start, bad_end);
+				bad_start = ext->offset;
+			}
+			bad_end = ext->offset + ext->size;
+		}
+
+		yield_after(ext->size);
+	}
+
+	if (bad_end) {
+		verify_report(bad_start, bad_end);
+		ret = EFI_CRC_ERROR;
+	}
+
+out:
+	/* Waits for the pending read before the buffers are freed.  */
+	block_read_ahead_free(ra);
+	for (i = 0; i < ARRAY_SIZE(alloc); i++)
+		if (alloc[i])
+			FreePool(alloc[i]);
+	return ret;
+}
+
+static EFI_STATUS write_disk(UINT64 offset, UINTN size, VOID *data)
+{
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio,
+				gparti.bio->Media->MediaId, offset, size, data);
+	block_cache_invalidate(gparti.bio, offset, size);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to write bytes");
+		return ret;
+	}
+
+	delta_written += size;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS write_delta(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	UINTN unit = gparti.bio->Media->BlockSize;
+	UINTN off, len, run;
+	BOOLEAN same;
+
+	if (manifest_used) {
+		unit = manifest->block_size;
+	} else {
+		ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+					gparti.bio->Media->MediaId, cur_offset,
+					size, delta_buf);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read bytes, falling back to plain write");
+			return write_disk(cur_offset, size, data);
+		}
+	}
+
+	for (off = 0, run = 0; off < size; off += len) {
+		len = min(size - off, unit - (UINTN)((cur_offset + off - part_start) % unit));
+		if (manifest_used)
+			same = manifest_match(cur_offset + off, data + off, len);
+		else
+			same = !memcmp(data + off, delta_buf + off, len);
+		if (!same) {
+			run += len;
+			continue;
+		}
+
+		delta_skipped += len;
+		if (!run)
+			continue;
+
+		ret = write_disk(cur_offset + off - run, run, data + off - run);
+		if (EFI_ERROR(ret))
+			return ret;
+		run = 0;
+	}
+
+	if (run)
+		return write_disk(cur_offset + size - run, run, data + size - run);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS write_range(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	UINTN chunk, max_chunk;
+	BOOLEAN delta;
 
 	if (!gparti.bio)
 		return EFI_INVALID_PARAMETER;
@@ -90,22 +469,48 @@ EFI_STATUS flash_write(VOID *data, UINTN size)
 				part_start, part_end, cur_offset, cur_offset + size);
 		return EFI_INVALID_PARAMETER;
 	}
-	ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio, gparti.bio->Media->MediaId, cur_offset, size, data);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to write bytes");
-		return ret;
+
+	delta = delta_buf || manifest_used;
+	max_chunk = delta ? DELTA_SIZE : size;
+	if (flash_yield)
+		max_chunk = min(max_chunk, (UINTN)YIELD_SIZE);
+
+	for (; size; size -= chunk) {
+		chunk = min(size, max_chunk);
+		if (delta)
+			ret = write_delta(data, chunk);
+		else
+			ret = write_disk(cur_offset, chunk, data);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		cur_offset += chunk;
+		data += chunk;
+		yield_after(chunk);
 	}
 
-	cur_offset += size;
 	return EFI_SUCCESS;
 }
 
+EFI_STATUS flash_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	UINT64 offset = cur_offset;
+
+	ret = write_range(data, size);
+	if (EFI_ERROR(ret) || !verify_mode)
+		return ret;
+
+	return verify_record(offset, size, data, 0);
+}
+
 EFI_STATUS flash_fill(UINT32 pattern, UINTN size)
 {
 	EFI_STATUS ret;
 	UINT32 *aligned_buf;
 	VOID *buf;
-	UINTN i, buf_size, write_size;
+	UINTN i, buf_size, write_size, left;
+	UINT64 offset = cur_offset;
 
 	if (!gparti.bio || !size || size % gparti.bio->Media->BlockSize)
 		return EFI_INVALID_PARAMETER;
@@ -120,18 +525,55 @@ EFI_STATUS flash_fill(UINT32 pattern, UINTN size)
 	for (i = 0; i < buf_size / sizeof(*aligned_buf); i++)
 		aligned_buf[i] = pattern;
 
-	for (; size; size -= write_size) {
-		write_size = min(size, buf_size);
-		ret = flash_write(aligned_buf, write_size);
+	for (left = size; left; left -= write_size) {
+		write_size = min(left, buf_size);
+		ret = write_range(aligned_buf, write_size);
 		if (EFI_ERROR(ret))
 			goto out;
 	}
 
+	if (verify_mode)
+		ret = verify_record(offset, size, NULL, pattern);
+
 out:
 	FreePool(buf);
 	return ret;
 }
 
+EFI_STATUS flash_skip(UINT64 size)
+{
+	EFI_STATUS ret;
+	UINTN block_size;
+	EFI_LBA start, end;
+
+	if (!is_inside_partition(cur_offset, size)) {
+		error(L"Attempt to skip outside of partition [%ld %ld] [%ld %ld]",
+				part_start, part_end, cur_offset, cur_offset + size);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	/* In discard mode, the blocks entirely covered by the skipped
+	   range are discarded, their content is not checked by verify
+	   mode.  */
+	if (discard_mode) {
+		block_size = gparti.bio->Media->BlockSize;
+		start = (cur_offset + block_size - 1) / block_size;
+		end = (cur_offset + size) / block_size;
+		if (start < end) {
+			ret = storage_discard_queue(gparti.handle, gparti.bio, start, end - 1);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+	} else if (verify_mode && size) {
+		ret = verify_record_disk(cur_offset, size);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	cur_offset += size;
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS flash_into_esp(VOID *data, UINTN size, CHAR16 *label)
 {
 	EFI_STATUS ret;
@@ -231,6 +673,7 @@ static EFI_STATUS flash_mbr(VOID *data, UINTN size)
 
 	ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio,
 				gparti.bio->Media->MediaId, 0, size, data);
+	block_cache_invalidate(gparti.bio, 0, size);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to flash MBR");
 
@@ -435,28 +878,102 @@ static EFI_STATUS flash_ramdisk(VOID *data, UINTN size)
 static CHAR16 *DM_VERITY_PARTITIONS[] =
 	{ SYSTEM_LABEL, VENDOR_LABEL, OEM_LABEL };
 
-EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label)
+/* Return TRUE if the manifest describes the partition LABEL with
+   blocks made of whole device blocks.  */
+static BOOLEAN manifest_applies(const CHAR16 *label)
 {
-	EFI_STATUS ret;
-	UINTN i;
+	CHAR16 *name;
+	BOOLEAN match;
 
-	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get partition %s", label);
-		return ret;
+	if (!manifest)
+		return FALSE;
+
+	if (manifest->block_size % gparti.bio->Media->BlockSize ||
+	    manifest->block_count * manifest->block_size > part_end - part_start) {
+		error(L"The block-hash manifest does not fit %s", label);
+		return FALSE;
 	}
 
+	name = stra_to_str(manifest->label);
+	if (!name)
+		return FALSE;
+	match = !StrCmp(name, label);
+	FreePool(name);
+
+	return match;
+}
+
+EFI_STATUS flash_partition_interface(struct gpt_partition_interface *parti,
+				     VOID *data, UINTN size, const CHAR16 *label)
+{
+	EFI_STATUS ret, discard_ret;
+
+	gparti = *parti;
 	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	delta_skipped = delta_written = 0;
+	flash_report[0] = '\0';
+
+	if (delta_mode && manifest_applies(label))
+		manifest_used = TRUE;
+	else if (delta_mode) {
+		delta_buf = AllocatePool(DELTA_SIZE);
+		if (!delta_buf)
+			error(L"Failed to allocate the delta buffer, using plain write");
+	}
 
 	if (is_sparse_image(data, size))
 		ret = flash_sparse(data, size);
 	else
 		ret = flash_write(data, size);
 
+	/* The manifest describes the content replaced by this flash.  */
+	if (manifest_used) {
+		manifest_used = FALSE;
+		flash_set_manifest(NULL, 0);
+	}
+
+	if (delta_mode) {
+		if (delta_buf) {
+			FreePool(delta_buf);
+			delta_buf = NULL;
+		}
+		if (!EFI_ERROR(ret) &&
+		    efi_snprintf((CHAR8 *)flash_report, sizeof(flash_report),
+				 (CHAR8 *)"delta: %ld bytes skipped, %ld bytes written",
+				 delta_skipped, delta_written) < 0)
+			flash_report[0] = '\0';
+	}
+
+	if (discard_mode) {
+		discard_ret = storage_discard_flush();
+		if (EFI_ERROR(discard_ret) && discard_ret != EFI_UNSUPPORTED)
+			efi_perror(discard_ret, L"Failed to discard skipped blocks of %s", label);
+	}
+
+	if (verify_mode && !EFI_ERROR(ret))
+		ret = verify_written();
+	verify_free();
+
+	return ret;
+}
+
+EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface parti;
+	UINTN i;
+
+	ret = gpt_get_partition_by_label(label, &parti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	ret = flash_partition_interface(&parti, data, size, label);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	if (!CompareGuid(&gparti.part.type, &EfiPartTypeSystemPartitionGuid)) {
+	if (!CompareGuid(&parti.part.type, &EfiPartTypeSystemPartitionGuid)) {
 		ret = gpt_refresh();
 		if (EFI_ERROR(ret))
 			return ret;
@@ -496,7 +1013,7 @@ static struct label_exception {
 #endif
 };
 
-EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label)
+static EFI_STATUS flash_label(VOID *data, UINTN size, CHAR16 *label)
 {
 	UINTN i;
 
@@ -514,6 +1031,37 @@ EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label)
 	return flash_partition(data, size, label);
 }
 
+EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label)
+{
+	EFI_STATUS ret;
+
+	flash_report[0] = '\0';
+	ret = flash_label(data, size, label);
+	/* The misc partition might have been overwritten or moved.  */
+	misc_cache_invalidate();
+	/* Files are written through the file system driver.  */
+	block_cache_invalidate_all();
+	prefetch_release();
+
+	return ret;
+}
+
+BOOLEAN flash_is_plain_partition(CHAR16 *label)
+{
+	UINTN i;
+
+#ifndef USER
+	CHAR16 esp[] = L"/ESP/";
+	if (!StrnCmp(esp, label, StrLen(esp)))
+		return FALSE;
+#endif
+	for (i = 0; i < ARRAY_SIZE(LABEL_EXCEPTIONS); i++)
+		if (!StrCmp(LABEL_EXCEPTIONS[i].name, label))
+			return FALSE;
+
+	return TRUE;
+}
+
 EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label)
 {
 	EFI_STATUS ret;
@@ -571,7 +1119,7 @@ static EFI_STATUS erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA sta
 	return fill_zero(bio, start, end);
 }
 
-static EFI_STATUS fast_erase_part(const CHAR16 *label)
+EFI_STATUS fast_erase_part(const CHAR16 *label)
 {
 	EFI_STATUS ret;
 	EFI_LBA start, end, min_end;
@@ -592,13 +1140,23 @@ static EFI_STATUS fast_erase_part(const CHAR16 *label)
 		return ret;
 	}
 
+	/* Let the storage know that the rest of the partition is not
+	   used anymore.  This is only a hint, failures are ignored.  */
+	if (min_end < end) {
+		ret = storage_discard_queue(gparti.handle, gparti.bio, min_end + 1, end);
+		if (!EFI_ERROR(ret))
+			ret = storage_discard_flush();
+		if (EFI_ERROR(ret) && ret != EFI_UNSUPPORTED)
+			efi_perror(ret, L"Failed to discard partition %s", label);
+	}
+
 	if (!CompareGuid(&gparti.part.type, &EfiPartTypeSystemPartitionGuid))
 		return gpt_refresh();
 
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS erase_by_label(CHAR16 *label)
+static EFI_STATUS erase_label(CHAR16 *label)
 {
 	EFI_STATUS ret;
 
@@ -639,6 +1197,18 @@ EFI_STATUS erase_by_label(CHAR16 *label)
 	return EFI_SUCCESS;
 }
 
+EFI_STATUS erase_by_label(CHAR16 *label)
+{
+	EFI_STATUS ret;
+
+	ret = erase_label(label);
+	misc_cache_invalidate();
+	block_cache_invalidate_all();
+	prefetch_release();
+
+	return ret;
+}
+
 EFI_STATUS garbage_disk(void)
 {
 	struct gpt_partition_interface gparti;
@@ -671,5 +1241,6 @@ EFI_STATUS garbage_disk(void)
 			gparti.part.ending_lba, aligned_chunk, N_BLOCK);
 
 	FreePool(chunk);
+	misc_cache_invalidate();
 	return gpt_refresh();
 }
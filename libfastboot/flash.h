@@ -36,9 +36,51 @@
 #define _FLASH_H_
 
 #include <efi.h>
+#include "gpt.h"
 
 extern BOOLEAN new_install_device;
 
+typedef void (*flash_yield_t)(void);
+
+void flash_set_yield(flash_yield_t yield);
+/* When delta mode is enabled, flash_partition() compares the image
+   against the partition content and only writes the blocks which
+   differ.  */
+void flash_set_delta_mode(BOOLEAN enable);
+BOOLEAN flash_get_delta_mode(void);
+/* Block-hash manifest of the current content of a partition, sent
+   by the host to skip the read-back of delta mode.  HASHES holds the
+   SHA-256 digest of each BLOCK_SIZE bytes block of the partition
+   LABEL.  All the fields are little-endian.  */
+#define FLASH_MANIFEST_MAGIC	0x4d484246	/* "FBHM" */
+#define FLASH_MANIFEST_VERSION	1
+#define FLASH_MANIFEST_HASH_SIZE	32
+
+struct flash_manifest {
+	UINT32 magic;
+	UINT32 version;
+	CHAR8 label[36];
+	UINT32 block_size;
+	UINT64 block_count;
+	UINT8 hashes[][FLASH_MANIFEST_HASH_SIZE];
+} __attribute__((packed));
+
+/* Copy the manifest DATA of SIZE bytes.  It is used, and dropped, by
+   the next delta mode flash of its partition.  A NULL DATA drops the
+   current manifest.  */
+EFI_STATUS flash_set_manifest(VOID *data, UINTN size);
+/* Summary of the last flash_partition() call, delta statistics for
+   instance, or an empty string.  */
+#define MAX_FLASH_REPORT 64
+const char *flash_get_report(void);
+/* When verify mode is enabled, flash_partition() reads the written
+   ranges back and checks them against the image.  */
+void flash_set_verify(BOOLEAN enable);
+BOOLEAN flash_get_verify(void);
+/* When discard mode is enabled, the don't care chunks of sparse
+   images are discarded instead of being left untouched.  */
+void flash_set_discard(BOOLEAN enable);
+BOOLEAN flash_get_discard(void);
 EFI_STATUS flash_skip(UINT64 size);
 EFI_STATUS flash_write(VOID *data, UINTN size);
 EFI_STATUS flash_fill(UINT32 pattern, UINTN size);
@@ -48,10 +90,20 @@ EFI_STATUS flash_fill(UINT32 pattern, UINTN size);
 #define REFRESH_PARTITION_VAR 0x1
 
 EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label);
+/* Return TRUE if LABEL is flashed by flash_partition(), that is it
+   is not a special label such as "gpt", "oemvars", "bootloader"...  */
+BOOLEAN flash_is_plain_partition(CHAR16 *label);
 EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label);
 EFI_STATUS erase_by_label(CHAR16 *label);
+/* Zero the head of the partition, enough to invalidate any file
+   system, and discard the rest of it.  */
+EFI_STATUS fast_erase_part(const CHAR16 *label);
 EFI_STATUS garbage_disk(void);
 EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label);
+/* Flash DATA to the partition PARTI, named LABEL, as flash_partition()
+   does but without looking the partition up nor refreshing the GPT.  */
+EFI_STATUS flash_partition_interface(struct gpt_partition_interface *parti,
+				     VOID *data, UINTN size, const CHAR16 *label);
 EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end);
 
 #endif	/* _FLASH_H_ */
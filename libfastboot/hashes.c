@@ -89,20 +89,6 @@ out:
 	return ret;
 }
 
-static void hash_buffer(CHAR8 *buffer, UINT64 len, CHAR8 *hash)
-{
-	EVP_MD_CTX mdctx;
-
-	if (!selected_md)
-		set_hash_algorithm(NULL);
-
-	EVP_MD_CTX_init(&mdctx);
-	EVP_DigestInit_ex(&mdctx, selected_md, NULL);
-	EVP_DigestUpdate(&mdctx, buffer, len);
-	EVP_DigestFinal_ex(&mdctx, hash, NULL);
-	EVP_MD_CTX_cleanup(&mdctx);
-}
-
 static EFI_STATUS report_hash(const CHAR16 *base, const CHAR16 *name, CHAR8 *hash)
 {
 	EFI_STATUS ret;
@@ -120,112 +106,131 @@ static EFI_STATUS report_hash(const CHAR16 *base, const CHAR16 *name, CHAR8 *has
 	return EFI_SUCCESS;
 }
 
-#define MAX_DIR 10
 #define MAX_FILENAME_LEN (256 * sizeof(CHAR16))
-#define DIR_BUFFER_SIZE (MAX_DIR * MAX_FILENAME_LEN)
-static CHAR16 *path;
-static CHAR16 *subname[MAX_DIR];
-static INTN subdir;
-
-static EFI_STATUS hash_file(EFI_FILE *dir, EFI_FILE_INFO *fi)
+#define FILE_CHUNK (1024 * 1024)
+
+/* Files are hashed FILE_CHUNK bytes at a time so that large ESP
+ * payloads do not need to fit in memory.  BUFFER holds two chunks:
+ * the next one is read with file_read_ahead_start() while the current
+ * one is hashed, as the installer does for its input files. */
+static EFI_STATUS hash_file(EFI_FILE *dir, EFI_FILE_INFO *fi,
+			    const CHAR16 *path, struct file_read_ahead *ra,
+			    CHAR8 *buffer)
 {
+	EVP_MD_CTX mdctx;
 	EFI_FILE *file;
-	void *data;
 	CHAR8 hash[EVP_MAX_MD_SIZE];
 	EFI_STATUS ret;
-	UINTN size;
-
-	if (!fi->Size) {
-		hash_buffer(NULL, 0, hash);
-		return report_hash(path, fi->FileName, hash);
-	}
+	UINT64 pos = 0;
+	UINTN size, cur = 0;
 
 	ret = uefi_call_wrapper(dir->Open, 5, dir, &file, fi->FileName, EFI_FILE_MODE_READ, 0);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open %s%s", path, fi->FileName);
 		return ret;
+	}
 
-	size = fi->FileSize;
+	if (!selected_md)
+		set_hash_algorithm(NULL);
 
-	data = AllocatePool(size);
-	if (!data)
-		goto close;
+	EVP_MD_CTX_init(&mdctx);
+	EVP_DigestInit_ex(&mdctx, selected_md, NULL);
 
-	ret = uefi_call_wrapper(file->Read, 3, file, &size, data);
-	if (EFI_ERROR(ret))
-		goto free;
+	file_read_ahead_start(ra, file, pos, buffer, FILE_CHUNK);
+	do {
+		ret = file_read_ahead_finish(ra, &size);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read %s%s", path, fi->FileName);
+			goto out;
+		}
+
+		/* A short read is the end of the file */
+		pos += size;
+		if (size == FILE_CHUNK)
+			file_read_ahead_start(ra, file, pos,
+					      buffer + (cur ^ 1) * FILE_CHUNK,
+					      FILE_CHUNK);
+
+		EVP_DigestUpdate(&mdctx, buffer + cur * FILE_CHUNK, size);
+		cur ^= 1;
+	} while (size == FILE_CHUNK);
 
-	hash_buffer(data, size, hash);
+	EVP_DigestFinal_ex(&mdctx, hash, NULL);
 	ret = report_hash(path, fi->FileName, hash);
 
-free:
-	FreePool(data);
-close:
+out:
+	EVP_MD_CTX_cleanup(&mdctx);
 	uefi_call_wrapper(file->Close, 1, file);
 	return ret;
 }
 
 /*
- * generate a string with the current directory
- * updated each time we open/close a directory
+ * The ESP is walked iteratively with a stack of opened directories.
+ * Both the stack and the current path string grow on demand so there
+ * is no limit on the directory depth.
  */
- static void initpath(void)
- {
-	path = AllocateZeroPool(DIR_BUFFER_SIZE);
-	if (!path)
-		return;
-	strcat16_s(path, DIR_BUFFER_SIZE / sizeof(CHAR16), L"/bootloader/");
- }
-
-static void freepath(void)
-{
-	if (!path)
-		return;
-
-	FreePool(path);
-	path = NULL;
-	debug(L"Free path");
-}
+struct esp_dir {
+	EFI_FILE *file;
+	UINTN path_len;		/* path length before entering this directory */
+};
 
-static void pushdir(CHAR16 *dir)
+static EFI_STATUS path_append(CHAR16 **path, UINTN *path_max, const CHAR16 *name)
 {
-	EFI_STATUS ret;
-
-	if (!path)
-		return;
+	CHAR16 *new_path;
+	UINTN len = *path ? StrLen(*path) : 0;
+	UINTN name_len = StrLen(name);
+	UINTN needed = len + name_len + 2;
+
+	if (needed > *path_max) {
+		new_path = ReallocatePool(*path, *path_max * sizeof(CHAR16),
+					  needed * 2 * sizeof(CHAR16));
+		if (!new_path)
+			return EFI_OUT_OF_RESOURCES;
+		*path = new_path;
+		*path_max = needed * 2;
+	}
 
-	if (StrSize(path) + StrSize(dir) > DIR_BUFFER_SIZE)
-		return;
+	CopyMem(*path + len, name, name_len * sizeof(CHAR16));
+	len += name_len;
+	(*path)[len++] = L'/';
+	(*path)[len] = L'\0';
 
-	subname[subdir] = path + StrLen(path);
-	ret = strcat16_s(path, DIR_BUFFER_SIZE / sizeof(CHAR16), dir);
-	if (EFI_ERROR(ret))
-	    return;
-	ret = strcat16_s(path, DIR_BUFFER_SIZE / sizeof(CHAR16), L"/");
-	if (EFI_ERROR(ret))
-	    return;
-	debug(L"Opening %s", path);
+	return EFI_SUCCESS;
 }
 
-static void popdir(void)
+static EFI_STATUS push_dir(struct esp_dir **dirs, UINTN *max_depth, UINTN depth,
+			   EFI_FILE *file, UINTN path_len)
 {
-	if (!path)
-		return;
-	if (subdir > 0) {
-		*subname[subdir - 1] = L'\0';
-		debug(L"Return to %s", path);
-		return;
+	struct esp_dir *new_dirs;
+
+	if (depth == *max_depth) {
+		new_dirs = ReallocatePool(*dirs, *max_depth * sizeof(**dirs),
+					  (*max_depth + 8) * sizeof(**dirs));
+		if (!new_dirs)
+			return EFI_OUT_OF_RESOURCES;
+		*dirs = new_dirs;
+		*max_depth += 8;
 	}
-	freepath();
+
+	(*dirs)[depth].file = file;
+	(*dirs)[depth].path_len = path_len;
+	return EFI_SUCCESS;
 }
 
 static EFI_STATUS get_esp_hash(void)
 {
 	EFI_STATUS ret;
 	EFI_FILE_IO_INTERFACE *io;
-	EFI_FILE *dirs[MAX_DIR];
+	EFI_FILE *root, *file;
 	CHAR8 buf[sizeof(EFI_FILE_INFO) + MAX_FILENAME_LEN];
 	EFI_FILE_INFO *fi = (EFI_FILE_INFO *) buf;
-	UINTN size = sizeof(buf);
+	struct esp_dir *dirs = NULL, *cur;
+	UINTN depth = 0, max_depth = 0;
+	CHAR16 *path = NULL;
+	UINTN path_max = 0, path_len;
+	CHAR8 *buffer;
+	struct file_read_ahead ra;
+	UINTN size;
 
 	ret = get_esp_fs(&io);
 	if (EFI_ERROR(ret)) {
@@ -233,59 +238,92 @@ static EFI_STATUS get_esp_hash(void)
 		return ret;
 	}
 
-	subdir = 0;
-	ret = uefi_call_wrapper(io->OpenVolume, 2, io, &dirs[subdir]);
+	buffer = AllocatePool(2 * FILE_CHUNK);
+	if (!buffer)
+		return EFI_OUT_OF_RESOURCES;
+
+	/* Without an event, files are read synchronously */
+	file_read_ahead_init(&ra);
+
+	ret = path_append(&path, &path_max, L"/bootloader");
+	if (EFI_ERROR(ret))
+		goto out;
+
+	ret = uefi_call_wrapper(io->OpenVolume, 2, io, &root);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to open root directory");
-		return ret;
+		goto out;
 	}
-	initpath();
-	do {
+
+	ret = push_dir(&dirs, &max_depth, depth, root, StrLen(path));
+	if (EFI_ERROR(ret)) {
+		uefi_call_wrapper(root->Close, 1, root);
+		goto out;
+	}
+	depth++;
+
+	while (depth) {
+		cur = &dirs[depth - 1];
 		size = sizeof(buf);
-		if (subdir >= 0) {
-			ret = uefi_call_wrapper(dirs[subdir]->Read, 3, dirs[subdir], &size, fi);
-			if (EFI_ERROR(ret)) {
-				efi_perror(ret, L"Cannot read directory entry");
-				/* continue to walk the ESP partition */
-				size = 0;
-			}
+		ret = uefi_call_wrapper(cur->file->Read, 3, cur->file, &size, fi);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Cannot read directory entry");
+			/* continue to walk the ESP partition */
+			size = 0;
 		}
-		if (!size && subdir >= 0) {
-			/* size is 0 means there are no more files/dir in current directory
-			 * so if we are in a subdir, go back 1 level */
-			uefi_call_wrapper(dirs[subdir]->Close, 1, dirs[subdir]);
-			popdir();
-			subdir--;
+
+		if (!size) {
+			/* No more files/dir in current directory, go
+			 * back 1 level */
+			uefi_call_wrapper(cur->file->Close, 1, cur->file);
+			path[cur->path_len] = L'\0';
+			depth--;
 			continue;
 		}
-		if (fi->Attribute & EFI_FILE_DIRECTORY) {
-			EFI_FILE *parent;
-
-			if (!StrCmp(fi->FileName, L".") || !StrCmp(fi->FileName, L".."))
-				continue;
-			if (subdir == MAX_DIR - 1) {
-				error(L"too much subdir, ignoring %s", fi->FileName);
-				continue;
-			}
-			parent = dirs[subdir];
-			pushdir(fi->FileName);
-			subdir++;
-			ret = uefi_call_wrapper(parent->Open, 5, parent, &dirs[subdir], fi->FileName, EFI_FILE_MODE_READ, 0);
-			if (EFI_ERROR(ret)) {
-				efi_perror(ret, L"Cannot open directory %s", fi->FileName);
-				/* continue to walk the ESP partition */
-				popdir();
-				subdir--;
-			}
-		} else {
-			ret = hash_file(dirs[subdir], fi);
-			if (EFI_ERROR(ret)) {
-				freepath();
-				return ret;
-			}
+
+		if (!(fi->Attribute & EFI_FILE_DIRECTORY)) {
+			ret = hash_file(cur->file, fi, path, &ra, buffer);
+			if (EFI_ERROR(ret))
+				goto out;
+			continue;
 		}
-	} while (size || subdir >= 0);
-	return EFI_SUCCESS;
+
+		if (!StrCmp(fi->FileName, L".") || !StrCmp(fi->FileName, L".."))
+			continue;
+
+		ret = uefi_call_wrapper(cur->file->Open, 5, cur->file, &file,
+					fi->FileName, EFI_FILE_MODE_READ, 0);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Cannot open directory %s", fi->FileName);
+			/* continue to walk the ESP partition */
+			continue;
+		}
+
+		path_len = StrLen(path);
+		ret = path_append(&path, &path_max, fi->FileName);
+		if (!EFI_ERROR(ret))
+			ret = push_dir(&dirs, &max_depth, depth, file, path_len);
+		if (EFI_ERROR(ret)) {
+			uefi_call_wrapper(file->Close, 1, file);
+			goto out;
+		}
+		depth++;
+		debug(L"Opening %s", path);
+	}
+	ret = EFI_SUCCESS;
+
+out:
+	while (depth) {
+		depth--;
+		uefi_call_wrapper(dirs[depth].file->Close, 1, dirs[depth].file);
+	}
+	if (dirs)
+		FreePool(dirs);
+	if (path)
+		FreePool(path);
+	file_read_ahead_free(&ra);
+	FreePool(buffer);
+	return ret;
 }
 
 EFI_STATUS get_bootloader_hash(const CHAR16 *label)
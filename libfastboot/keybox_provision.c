@@ -19,6 +19,7 @@
 #include <efi.h>
 #include <efilib.h>
 #include <gpt.h>
+#include <block_cache.h>
 #include <log.h>
 
 #define MAX_KEYBOX_SIZE    16384
@@ -67,6 +68,8 @@ EFI_STATUS flash_keybox(VOID *data, UINTN size)
 				partoffset + KB_HEAD_OFFSET,
 				sizeof(keybox_header_t),
 				(void *)&kb_header);
+	block_cache_invalidate(gpart.bio, partoffset + KB_HEAD_OFFSET,
+			       sizeof(keybox_header_t));
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Could not write keybox header to disk.");
 		goto exit;
@@ -80,6 +83,8 @@ EFI_STATUS flash_keybox(VOID *data, UINTN size)
 				sizeof(keybox_header_t) + partoffset + KB_HEAD_OFFSET,
 				size,
 				data);
+	block_cache_invalidate(gpart.bio, sizeof(keybox_header_t) + partoffset +
+			       KB_HEAD_OFFSET, size);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Could not write keybox to disk.");
 		goto exit;
@@ -35,6 +35,7 @@
 #include <efi.h>
 #include <efilib.h>
 #include <lib.h>
+#include <crc32.h>
 #include "uefi_utils.h"
 
 #include "flash.h"
@@ -47,6 +48,9 @@ static const unsigned int BUFFER_SIZE = 10 * 1024 * 1024;
 static const unsigned int HUNK_SIZE_THRESHOLD = 1024 * 1024;
 static void *buffer;
 static unsigned int cur_size;
+/* CRC32 of the expanded image data processed so far, checked against
+   the CRC32 chunks.  */
+static UINT32 image_crc;
 
 BOOLEAN is_sparse_image(void *data, UINT64 size)
 {
@@ -140,6 +144,7 @@ static EFI_STATUS flash_chunk(struct sparse_header *sph, struct chunk_header *ck
 {
 	EFI_STATUS ret;
 	UINT64 chunk_szb = (UINT64)ckh->chunk_sz * (UINT64)sph->blk_sz;
+	UINT32 value;
 
 	switch (ckh->chunk_type) {
 	case CHUNK_TYPE_RAW:
@@ -147,19 +152,40 @@ static EFI_STATUS flash_chunk(struct sparse_header *sph, struct chunk_header *ck
 			error(L"inconsistent raw chunk");
 			return EFI_INVALID_PARAMETER;
 		}
+		image_crc = crc32_update(image_crc, data, size);
 		return flash_raw_data(data, size);
 	case CHUNK_TYPE_DONT_CARE:
+		/* Skipped blocks count as zeros in the image CRC32.  */
+		value = 0;
+		image_crc = crc32_repeat(image_crc, &value, sizeof(value),
+					 chunk_szb / sizeof(value));
 		ret = flush_buffer();
 		if (EFI_ERROR(ret))
 			return ret;
 		return flash_skip(chunk_szb);
 	case CHUNK_TYPE_FILL:
+		if (size != sizeof(value)) {
+			error(L"inconsistent fill chunk");
+			return EFI_INVALID_PARAMETER;
+		}
+		value = *((UINT32 *) data);
+		image_crc = crc32_repeat(image_crc, &value, sizeof(value),
+					 chunk_szb / sizeof(value));
 		ret = flush_buffer();
 		if (EFI_ERROR(ret))
 			return ret;
-		return flash_fill(*((UINT32 *) data), chunk_szb);
+		return flash_fill(value, chunk_szb);
 	case CHUNK_TYPE_CRC32:
-		debug(L"crc chunk not implemented yet %d", size);
+		if (size != sizeof(value)) {
+			error(L"inconsistent crc32 chunk");
+			return EFI_INVALID_PARAMETER;
+		}
+		value = *((UINT32 *) data);
+		if (value != image_crc) {
+			error(L"sparse image CRC32 mismatch, expected %08x got %08x",
+			      value, image_crc);
+			return EFI_CRC_ERROR;
+		}
 		break;
 	default:
 		error(L"Unknow chunk type %04x", ckh->chunk_type);
@@ -180,6 +206,7 @@ EFI_STATUS flash_sparse(void *data, UINT64 size)
 	s = data;
 	sph = data;
 	s += sph->file_hdr_sz;
+	image_crc = 0;
 
 	init_buffer();
 
@@ -100,6 +100,7 @@ endif
 
 LOCAL_SRC_FILES := \
 	android.c \
+	cmdline.c \
 	efilinux.c \
 	acpi.c \
 	acpi_image.c \
@@ -125,6 +126,10 @@ LOCAL_SRC_FILES := \
 	watchdog.c \
 	life_cycle.c \
 	qsort.c \
+	crc32.c \
+	misc_cache.c \
+	prefetch.c \
+	block_cache.c \
 	timer.c \
 	nvme.c \
 	virtual_media.c \
@@ -132,7 +137,8 @@ LOCAL_SRC_FILES := \
 	aes_gcm.c \
 	vbmeta_ias.c \
 	android_vb2.c \
-	security_vb2.c
+	security_vb2.c \
+	avb_cache.c
 
 ifeq ($(KERNELFLINGER_SUPPORT_USB_STORAGE),true)
 	LOCAL_SRC_FILES += usb_storage.c \
@@ -142,11 +142,7 @@ static UINT64 _get_acpi_field(CHAR8 *name, CHAR8 *fieldname _unused, VOID **var,
 
 static EFI_STATUS acpi_verify_checksum(struct ACPI_DESC_HEADER *table)
 {
-	UINT32 i;
-	CHAR8 sum = 0, *data = (CHAR8 *)table;
-
-	for (i = 0; i < table->length; i++)
-		sum += data[i];
+	UINT8 sum = sum_bytes(table, table->length);
 
 	return sum == 0 ? EFI_SUCCESS : EFI_CRC_ERROR;
 }
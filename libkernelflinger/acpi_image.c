@@ -42,6 +42,8 @@
 #include "acpi.h"
 #include "slot.h"
 #include "gpt.h"
+#include "prefetch.h"
+#include "block_cache.h"
 #include "dt_table.h"
 #ifdef USE_FIRSTSTAGE_MOUNT
 #include "firststage_mount.h"
@@ -71,18 +73,7 @@ static enum boot_target acpi_get_boot_target(VOID)
 
 static UINT8 acpi_csum(VOID *base, UINT32 n)
 {
-	UINT8 *p;
-	UINT8 sum;
-
-	p = (UINT8 *)base;
-
-	sum = 0;
-	for (UINT32 i = 0; i < n; i++) {
-		sum += *p;
-		p++;
-	}
-
-	return sum;
+	return (UINT8)sum_bytes(base, n);
 }
 
 EFI_STATUS acpi_image_get_length(const CHAR16 *label, struct ACPI_INFO **acpi_info)
@@ -106,8 +97,10 @@ EFI_STATUS acpi_image_get_length(const CHAR16 *label, struct ACPI_INFO **acpi_in
 	partition_size = (gpart.part.ending_lba + 1 - gpart.part.starting_lba) *
 		gpart.bio->Media->BlockSize;
 	debug(L"Reading %s image header", label);
-	ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId,
-				partition_start, sizeof(aosp_header), &aosp_header);
+	ret = prefetch_read(label, 0, sizeof(aosp_header), &aosp_header);
+	if (EFI_ERROR(ret))
+		ret = block_cache_read(gpart.bio, gpart.dio, partition_start,
+				       sizeof(aosp_header), &aosp_header);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"ReadDisk (%s_header)", label);
 		return ret;
@@ -150,9 +143,17 @@ EFI_STATUS acpi_image_get_length(const CHAR16 *label, struct ACPI_INFO **acpi_in
 		return EFI_INVALID_PARAMETER;
 	}
 
+	if (total_size < sizeof(aosp_header) ||
+	    total_size > (*current_acpi).img_size) {
+		error(L"%s image has an invalid total size %d", label, total_size);
+		FreePool(current_acpi);
+		return EFI_INVALID_PARAMETER;
+	}
+
 	(*current_acpi).MediaId = MediaId;
 	(*current_acpi).partition_start = partition_start;
 	(*current_acpi).partition_size = partition_size;
+	(*current_acpi).total_size = total_size;
 	*acpi_info = current_acpi;
 	return EFI_SUCCESS;
 }
@@ -175,15 +176,19 @@ static EFI_STATUS acpi_image_load_partition(const CHAR16 *label, VOID **image)
 		return ret;
 	}
 
-	acpiimage = AllocatePool((*acpi_info).img_size);
+	/* The partition is usually much larger than the image, only
+	   read the part actually used. */
+	acpiimage = AllocatePool((*acpi_info).total_size);
 	if (!acpiimage) {
 		error(L"Alloc memory for %s image failed", label);
 		FreePool(acpi_info);
 		return EFI_OUT_OF_RESOURCES;
 	}
-	debug(L"Reading %s image: %d bytes", label, (*acpi_info).img_size);
-	ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, (*acpi_info).MediaId,
-				(*acpi_info).partition_start, (*acpi_info).img_size, acpiimage);
+	debug(L"Reading %s image: %d bytes", label, (*acpi_info).total_size);
+	ret = prefetch_read(label, 0, (*acpi_info).total_size, acpiimage);
+	if (EFI_ERROR(ret))
+		ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, (*acpi_info).MediaId,
+					(*acpi_info).partition_start, (*acpi_info).total_size, acpiimage);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"ReadDisk Error for %s image read", label);
 		FreePool(acpi_info);
@@ -315,11 +320,18 @@ static EFI_STATUS acpi_image_parse_table(VOID *acpiimage, int is_acpio)
 	VOID *acpi_table;
 	UINTN dt_size, dt_offset, tablekey;
 
+	UINT32 total_size = bswap_32(header->total_size);
 	UINT32 entry_size = bswap_32(header->dt_entry_size);
 	UINT32 entry_offset = bswap_32(header->dt_entries_offset);
 	UINT32 entry_count = bswap_32(header->dt_entry_count);
 	EFI_STATUS ret;
 
+	if (entry_size < sizeof(*entry) ||
+	    (UINT64)entry_offset + (UINT64)entry_size * entry_count > total_size) {
+		error(L"Invalid ACPI image table entries");
+		return EFI_INVALID_PARAMETER;
+	}
+
 	for (UINT32 i = 0; i < entry_count; i++, entry_offset += entry_size) {
 		entry = (struct dt_table_entry *)(acpiimage + entry_offset);
 
@@ -328,6 +340,12 @@ static EFI_STATUS acpi_image_parse_table(VOID *acpiimage, int is_acpio)
 		if (dt_size == 0 || dt_offset == 0)
 			continue;
 
+		if (dt_size < sizeof(*acpi_header) ||
+		    (UINT64)dt_offset + dt_size > total_size) {
+			error(L"ACPI table %d is out of the image", i);
+			continue;
+		}
+
 		acpi_table = acpiimage + dt_offset;
 		acpi_header = (struct ACPI_DESC_HEADER *)(acpi_table);
 		debug(L"acpi table info: magic=0x%08x, size=%d",
@@ -374,12 +392,12 @@ static EFI_STATUS install_acpi_image_from_partition(int is_acpio)
 		return ret;
 	}
 	ret = acpi_image_parse_table(acpiimage, is_acpio);
+	FreePool(acpiimage);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to install acpi table from %s image",
 			   acpi_label);
 		return ret;
 	}
-	FreePool(acpiimage);
 
 	return ret;
 }
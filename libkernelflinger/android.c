@@ -43,6 +43,9 @@
 #include "power.h"
 #include "targets.h"
 #include "gpt.h"
+#include "misc_cache.h"
+#include "prefetch.h"
+#include "block_cache.h"
 #include "storage.h"
 #include "text_parser.h"
 #include "watchdog.h"
@@ -214,6 +217,11 @@ struct boot_params {
         UINT8 eddbuf[0x1ec];
         UINT8 _pad9[276];
 };
+#if (__STDC_VERSION__ >= 201112L || defined(__cplusplus))
+_Static_assert(sizeof(struct boot_params) + BOOT_IMG_HEADER_SIZE_V3 ==
+               ANDROID_IMAGE_PLAN_HEADER_SIZE,
+               "struct boot_params has wrong size");
+#endif
 
 /* See "Intel IA32/64 Architecture Software Developper Manual"
  * Volume 3 - Chapter 3.4.5 "Segment Descriptors".
@@ -551,12 +559,254 @@ static struct boot_params *get_boot_param_hdr (VOID *bootimage)
     return (struct boot_params *)(bootimage + hdr_size);
 }
 
-static EFI_STATUS setup_ramdisk(UINT8 *bootimage, UINT8 *vendorbootimage, UINT8 *androidcmd)
+/* Boot and vendor_boot images of version 3 and above can be loaded
+ * at locations planned from their headers so that they do not have
+ * to be copied before handing over to the kernel:
+ * - the boot image is loaded so that its kernel is suitably aligned
+ *   and followed by the memory required by the kernel to decompress
+ *   itself,
+ * - the vendor_boot image is loaded so that its vendor ramdisk is the
+ *   beginning of the final ramdisk region, with enough room after it
+ *   for the boot ramdisk and the bootconfig.
+ * The images are read whole so that their hash can still be verified
+ * over the original byte order. */
+#define MAX_PLANNED_IMAGES 4
+#define RAMDISK_EXTRA_SIZE (64 * 1024) /* androidcmd bootconfig and trailer */
+
+static struct planned_image {
+        CHAR8 name[32];
+        EFI_PHYSICAL_ADDRESS addr;
+        UINTN size;
+        UINT8 *data;
+} planned_images[MAX_PLANNED_IMAGES];
+static UINT32 planned_boot_ramdisk_size;
+
+/* Return the planned image whose region contains DATA. */
+static struct planned_image *get_planned_image(const VOID *data)
+{
+        UINTN i, start;
+
+        if (!data)
+                return NULL;
+
+        for (i = 0; i < ARRAY_SIZE(planned_images); i++) {
+                start = (UINTN)planned_images[i].addr;
+                if (planned_images[i].size && (UINTN)data >= start &&
+                    (UINTN)data < start + planned_images[i].size)
+                        return &planned_images[i];
+        }
+
+        return NULL;
+}
+
+/* Return the end of the planned region containing DATA. */
+static UINT8 *planned_image_end(const VOID *data)
+{
+        struct planned_image *image = get_planned_image(data);
+
+        if (!image)
+                return NULL;
+
+        return (UINT8 *)(UINTN)image->addr + image->size;
+}
+
+static BOOLEAN is_partition(const char *partition, const char *name)
+{
+        UINTN len = strlen((CHAR8 *)name);
+
+        /* Optional A/B slot suffix. */
+        return !strncmp((CHAR8 *)partition, (CHAR8 *)name, len) &&
+                (partition[len] == '\0' ||
+                 (partition[len] == '_' && partition[len + 1] != '\0' &&
+                  partition[len + 2] == '\0'));
+}
+
+static EFI_STATUS plan_boot_image(const VOID *header, UINTN image_size,
+                                  EFI_PHYSICAL_ADDRESS *addr, UINTN *size,
+                                  UINTN *offset)
+{
+        const struct boot_img_hdr_v3 *boot_hdr = header;
+        const struct boot_params *bp = header + BOOT_IMG_HEADER_SIZE_V3;
+        UINT32 align = bp->hdr.kernel_alignment;
+        UINTN koffset, lead, skip;
+        EFI_STATUS ret;
+
+        if (memcmp(boot_hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) ||
+            boot_hdr->header_version < BOOT_HEADER_V3 ||
+            bp->hdr.signature != 0xAA55 || bp->hdr.header != SETUP_HDR ||
+            !bp->hdr.relocatable_kernel ||
+            align < EFI_PAGE_SIZE || (align & (align - 1)))
+                return EFI_UNSUPPORTED;
+
+        koffset = BOOT_IMG_HEADER_SIZE_V3 + ((UINTN)bp->hdr.setup_secs + 1) * 512;
+        if (boot_hdr->kernel_size + BOOT_IMG_HEADER_SIZE_V3 < koffset)
+                return EFI_UNSUPPORTED;
+
+        /* The kernel must start on a KERNEL_ALIGNMENT boundary. */
+        lead = ALIGN(koffset, align) - koffset;
+        *size = lead + max(image_size, koffset + bp->hdr.init_size);
+        ret = emalloc(*size, align, addr, FALSE);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        /* Give the unused leading pages back. */
+        skip = lead & ~EFI_PAGE_MASK;
+        if (skip) {
+                free_pages(*addr, EFI_SIZE_TO_PAGES(skip));
+                *addr += skip;
+                *size -= skip;
+                lead -= skip;
+        }
+
+        *offset = lead;
+        planned_boot_ramdisk_size = boot_hdr->ramdisk_size;
+        return EFI_SUCCESS;
+}
+
+static UINTN get_vendor_ramdisk_offset(const struct vendor_boot_img_hdr_v3 *hdr)
+{
+        if (hdr->header_version == 3)
+                return BOOT_IMG_HEADER_SIZE_V3;
+        return ALIGN(sizeof(struct vendor_boot_img_hdr_v4), hdr->page_size);
+}
+
+static EFI_STATUS plan_vendor_boot_image(const VOID *header, UINTN image_size,
+                                         EFI_PHYSICAL_ADDRESS *addr, UINTN *size,
+                                         UINTN *offset)
+{
+        const struct vendor_boot_img_hdr_v3 *hdr = header;
+        UINTN roffset, rsize;
+
+        if (memcmp(hdr->magic, VENDOR_BOOT_MAGIC, VENDOR_BOOT_MAGIC_SIZE) ||
+            (hdr->header_version != 3 && hdr->header_version != 4) ||
+            !hdr->page_size)
+                return EFI_UNSUPPORTED;
+
+        roffset = get_vendor_ramdisk_offset(hdr);
+        if (roffset & EFI_PAGE_MASK)
+                return EFI_UNSUPPORTED;
+
+        rsize = hdr->vendor_ramdisk_size + planned_boot_ramdisk_size;
+        if (hdr->header_version == 4)
+                rsize += ((const struct vendor_boot_img_hdr_v4 *)header)->bootconfig_size +
+                        RAMDISK_EXTRA_SIZE;
+
+        *size = max(image_size, roffset + rsize);
+        *offset = 0;
+        return emalloc(*size, EFI_PAGE_SIZE, addr, FALSE);
+}
+
+BOOLEAN android_image_plannable(const char *partition)
+{
+        return is_partition(partition, "boot") ||
+                is_partition(partition, "vendor_boot");
+}
+
+VOID *android_image_plan(const char *partition, const VOID *header,
+                         UINTN header_size, UINTN image_size)
+{
+        struct planned_image *image = NULL;
+        EFI_PHYSICAL_ADDRESS addr;
+        const char *base;
+        UINTN i, size, offset;
+        EFI_STATUS ret;
+
+        if (header_size < ANDROID_IMAGE_PLAN_HEADER_SIZE ||
+            image_size < ANDROID_IMAGE_PLAN_HEADER_SIZE)
+                return NULL;
+
+        if (is_partition(partition, "boot")) {
+                base = "boot";
+                ret = plan_boot_image(header, image_size, &addr, &size, &offset);
+        } else if (is_partition(partition, "vendor_boot")) {
+                base = "vendor_boot";
+                ret = plan_vendor_boot_image(header, image_size, &addr, &size, &offset);
+        } else
+                return NULL;
+        if (EFI_ERROR(ret))
+                return NULL;
+
+        /* A partition loaded again, from any slot, replaces its
+           previous image: the image of a slot which failed to verify
+           is not used anymore. */
+        for (i = 0; i < ARRAY_SIZE(planned_images); i++) {
+                if (planned_images[i].size &&
+                    is_partition((char *)planned_images[i].name, base)) {
+                        prefetch_forget(planned_images[i].data);
+                        efree(planned_images[i].addr, planned_images[i].size);
+                        planned_images[i].size = 0;
+                }
+                if (!planned_images[i].size && !image)
+                        image = &planned_images[i];
+        }
+
+        if (!image || efi_snprintf(image->name, sizeof(image->name),
+                                   (CHAR8 *)"%a", partition) < 0) {
+                efree(addr, size);
+                return NULL;
+        }
+
+        image->addr = addr;
+        image->size = size;
+        image->data = (UINT8 *)(UINTN)addr + offset;
+        debug(L"%a image planned at 0x%lx", partition, (UINTN)image->data);
+        return image->data;
+}
+
+VOID android_image_plan_free(VOID *data)
+{
+        struct planned_image *image = get_planned_image(data);
+
+        if (!image)
+                return;
+
+        prefetch_forget(image->data);
+        efree(image->addr, image->size);
+        image->size = 0;
+}
+
+VOID android_image_plan_release(VOID)
+{
+        UINTN i;
+
+        for (i = 0; i < ARRAY_SIZE(planned_images); i++) {
+                if (!planned_images[i].size)
+                        continue;
+                prefetch_forget(planned_images[i].data);
+                efree(planned_images[i].addr, planned_images[i].size);
+                planned_images[i].size = 0;
+        }
+        planned_boot_ramdisk_size = 0;
+}
+
+/* Use the vendor ramdisk of a planned vendor_boot image as the
+   beginning of the RSIZE bytes ramdisk region if there is room. */
+static BOOLEAN ramdisk_in_place(UINT8 *vendorbootimage, UINTN rsize,
+                                struct boot_params *bp,
+                                EFI_PHYSICAL_ADDRESS *ramdisk_addr)
+{
+        struct vendor_boot_img_hdr_v3 *vendor_hdr = (struct vendor_boot_img_hdr_v3 *)vendorbootimage;
+        UINT8 *end = planned_image_end(vendorbootimage);
+        UINT8 *ramdisk = vendorbootimage + get_vendor_ramdisk_offset(vendor_hdr);
+
+        if (!end || (UINTN)(end - ramdisk) < rsize ||
+            (UINTN)ramdisk > bp->hdr.ramdisk_max)
+                return FALSE;
+
+        debug(L"Vendor ramdisk used in place, %d bytes not copied",
+              vendor_hdr->vendor_ramdisk_size);
+        *ramdisk_addr = (UINTN)ramdisk;
+        return TRUE;
+}
+
+static EFI_STATUS setup_ramdisk(UINT8 *bootimage, UINT8 *vendorbootimage,
+                                struct cmdline *androidcmd)
 {
         struct boot_img_hdr *aosp_header;
         struct boot_params *bp;
         UINT32 roffset, rsize;
         EFI_PHYSICAL_ADDRESS ramdisk_addr;
+        BOOLEAN in_place = FALSE;
         EFI_STATUS ret;
 
         aosp_header = (struct boot_img_hdr *)bootimage;
@@ -595,21 +845,23 @@ static EFI_STATUS setup_ramdisk(UINT8 *bootimage, UINT8 *vendorbootimage, UINT8
             }
 
             bp->hdr.ramdisk_len = rsize;
-            ret = emalloc(rsize, 0x1000, &ramdisk_addr, FALSE);
-            if (EFI_ERROR(ret))
-                return ret;
+            in_place = ramdisk_in_place(vendorbootimage, rsize, bp, &ramdisk_addr);
+            if (!in_place) {
+                ret = emalloc(rsize, 0x1000, &ramdisk_addr, FALSE);
+                if (EFI_ERROR(ret))
+                    return ret;
 
-            if ((UINTN)ramdisk_addr > bp->hdr.ramdisk_max) {
-                error(L"Ramdisk address is too high!");
-                ret = EFI_OUT_OF_RESOURCES;
-                goto out;
-            }
-            ret = memcpy_s((VOID *)(UINTN)ramdisk_addr, rsize,
-                            vendorbootimage + BOOT_IMG_HEADER_SIZE_V3,
-                            vendor_hdr->vendor_ramdisk_size);
-            if (EFI_ERROR(ret))
+                if ((UINTN)ramdisk_addr > bp->hdr.ramdisk_max) {
+                    error(L"Ramdisk address is too high!");
+                    ret = EFI_OUT_OF_RESOURCES;
                     goto out;
-
+                }
+                ret = memcpy_s((VOID *)(UINTN)ramdisk_addr, rsize,
+                                vendorbootimage + BOOT_IMG_HEADER_SIZE_V3,
+                                vendor_hdr->vendor_ramdisk_size);
+                if (EFI_ERROR(ret))
+                        goto out;
+            }
 
             ret = memcpy_s((VOID *)(UINTN)ramdisk_addr + vendor_hdr->vendor_ramdisk_size,
                             rsize, bootimage + roffset, boot_hdr->ramdisk_size);
@@ -622,21 +874,25 @@ static EFI_STATUS setup_ramdisk(UINT8 *bootimage, UINT8 *vendorbootimage, UINT8
             UINT32 page_size = vendor_hdr->page_size;
             UINT32 vendor_ramdisk_offset = ALIGN(sizeof(struct vendor_boot_img_hdr_v4), page_size);
 
-            UINT32 androidcmd_size = 0;
-            if (androidcmd != NULL)
-                    androidcmd_size = strlen(androidcmd) + 1;
+            UINTN androidcmd_size = 0;
+            if (androidcmd->buf)
+                    cmdline_finish_bootconfig(androidcmd, NULL, &androidcmd_size);
 
             UINT32 bootconfig_offset = ALIGN(sizeof(struct vendor_boot_img_hdr_v4), page_size) +
                             ALIGN(vendor_hdr->vendor_ramdisk_size, page_size) +
                             ALIGN(vendor_hdr->dtb_size, page_size) +
                             ALIGN(vendor_hdr->vendor_ramdisk_table_size, page_size);
             UINT32 rboffset = vendor_hdr->vendor_ramdisk_size + boot_hdr->ramdisk_size;
+            BootConfigWriter bootconfig;
+            int32_t bootconfig_size;
 
             roffset = BOOT_IMG_HEADER_SIZE_V4 + ALIGN(boot_hdr->kernel_size, BOOT_IMG_HEADER_SIZE_V4);
+            /* One more byte in case a new line has to be inserted
+               after the vendor bootconfig */
             rsize = boot_hdr->ramdisk_size
                         + vendor_hdr->vendor_ramdisk_size
                         + vendor_hdr->bootconfig_size
-                        + androidcmd_size
+                        + androidcmd_size + 1
                         + BOOTCONFIG_TRAILER_SIZE;
             if (!rsize) {
                 debug(L"boot image has no ramdisk");
@@ -644,56 +900,76 @@ static EFI_STATUS setup_ramdisk(UINT8 *bootimage, UINT8 *vendorbootimage, UINT8
             }
 
             bp->hdr.ramdisk_len = rsize;
-            ret = emalloc(rsize, 0x1000, &ramdisk_addr, FALSE);
-            if (EFI_ERROR(ret))
-                return ret;
-
-            if ((UINTN)ramdisk_addr > bp->hdr.ramdisk_max) {
-                error(L"Ramdisk address is too high!");
-                ret = EFI_OUT_OF_RESOURCES;
-                goto out;
-            }
+            in_place = ramdisk_in_place(vendorbootimage, rsize, bp, &ramdisk_addr);
+            if (!in_place) {
+                ret = emalloc(rsize, 0x1000, &ramdisk_addr, FALSE);
+                if (EFI_ERROR(ret))
+                    return ret;
 
-            ret = memcpy_s((VOID *)(UINTN)ramdisk_addr, rsize,
-                            vendorbootimage + vendor_ramdisk_offset,
-                            vendor_hdr->vendor_ramdisk_size);
-            if (EFI_ERROR(ret))
+                if ((UINTN)ramdisk_addr > bp->hdr.ramdisk_max) {
+                    error(L"Ramdisk address is too high!");
+                    ret = EFI_OUT_OF_RESOURCES;
                     goto out;
+                }
+
+                ret = memcpy_s((VOID *)(UINTN)ramdisk_addr, rsize,
+                                vendorbootimage + vendor_ramdisk_offset,
+                                vendor_hdr->vendor_ramdisk_size);
+                if (EFI_ERROR(ret))
+                        goto out;
+            }
 
+            memmove((VOID *)(UINTN)ramdisk_addr + rboffset,
+                    vendorbootimage + bootconfig_offset,
+                    vendor_hdr->bootconfig_size);
 
             ret = memcpy_s((VOID *)(UINTN)ramdisk_addr + vendor_hdr->vendor_ramdisk_size,
                             rsize, bootimage + roffset, boot_hdr->ramdisk_size);
             if (EFI_ERROR(ret))
                     goto out;
 
-
-            ret = memcpy_s((VOID *)(UINTN)ramdisk_addr + rboffset,
-                            rsize, vendorbootimage + bootconfig_offset,
-                            vendor_hdr->bootconfig_size);
-            if (EFI_ERROR(ret))
+            if (bootConfigWriterInit(&bootconfig, (UINTN)ramdisk_addr + rboffset,
+                                     vendor_hdr->bootconfig_size, rsize - rboffset) < 0) {
+                    ret = EFI_INVALID_PARAMETER;
                     goto out;
+            }
 
-            if (androidcmd != NULL) {
-                    int iret = addBootConfigParameters(androidcmd, androidcmd_size,
-                                    (UINTN)ramdisk_addr + rboffset, vendor_hdr->bootconfig_size);
-                    if (iret < 0) {
-                            ret = EFI_INVALID_PARAMETER;
+            /* The androidboot.* parameters are written directly in
+               the room left after the vendor bootconfig. */
+            if (androidcmd->buf) {
+                    UINT32 room;
+                    UINTN size;
+                    char *params = bootConfigWriterRoom(&bootconfig, &room);
+
+                    size = room;
+                    ret = params ? cmdline_finish_bootconfig(androidcmd, (CHAR8 *)params, &size) :
+                            EFI_INVALID_PARAMETER;
+                    if (EFI_ERROR(ret))
                             goto out;
-                    }
-            } else {
-                    int iret = addBootConfigTrailer((UINTN)ramdisk_addr + rboffset, vendor_hdr->bootconfig_size);
-                    if (iret < 0) {
-                            ret = EFI_INVALID_PARAMETER;
+
+                    if (bootConfigWriterAddParameters(&bootconfig, params, size) < 0) {
+                            ret = EFI_BUFFER_TOO_SMALL;
                             goto out;
                     }
             }
+
+            bootconfig_size = bootConfigWriterFinish(&bootconfig);
+            if (bootconfig_size < 0) {
+                    ret = EFI_INVALID_PARAMETER;
+                    goto out;
+            }
+
+            /* The kernel looks for the bootconfig trailer at the very
+               end of the initrd */
+            bp->hdr.ramdisk_len = rboffset + bootconfig_size;
         }
 
         bp->hdr.ramdisk_start = (UINT32)(UINTN)ramdisk_addr;
         return EFI_SUCCESS;
 
 out:
-        efree(ramdisk_addr, rsize);
+        if (!in_place)
+                efree(ramdisk_addr, rsize);
         return ret;
 }
 
@@ -889,32 +1165,6 @@ done:
         return bootreason;
 }
 
-EFI_STATUS prepend_command_line(CHAR16 **cmdline, CHAR16 *fmt, ...)
-{
-        CHAR16 *old;
-        va_list args;
-        CHAR16 *string;
-        CHAR16 *new;
-
-        old = *cmdline;
-        va_start(args, fmt);
-        string = VPoolPrint(fmt, args);
-        va_end(args);
-
-        if (!string)
-                return EFI_OUT_OF_RESOURCES;
-
-        new = PoolPrint(L"%s %s", string, old);
-        FreePool(string);
-        if (!new)
-                return EFI_OUT_OF_RESOURCES;
-
-        FreePool(old);
-        *cmdline = new;
-        return EFI_SUCCESS;
-}
-
-
 static CHAR16 *get_command_line(IN struct boot_img_hdr *aosp_header,
                                 IN enum boot_target boot_target)
 {
@@ -972,30 +1222,34 @@ static CHAR16 *get_command_line(IN struct boot_img_hdr *aosp_header,
 
 #ifndef USER
         if (cmdline_prepend) {
-                EFI_STATUS ret;
+                CHAR16 *new;
 
                 error(L"Prepending '%s' to command line", cmdline_prepend);
                 needs_pause = TRUE;
 
-                ret = prepend_command_line(&cmdline16, L"%s", cmdline_prepend);
+                new = PoolPrint(L"%s %s", cmdline_prepend, cmdline16);
                 FreePool(cmdline_prepend);
-                if (EFI_ERROR(ret))
+                if (!new)
                         error(L"couldn't prepend to command line");
+                else {
+                        FreePool(cmdline16);
+                        cmdline16 = new;
+                }
         }
 
         if (cmdline_append) {
-                EFI_STATUS ret;
+                CHAR16 *new;
 
                 error(L"Appending '%s' to command line", cmdline_append);
                 needs_pause = TRUE;
 
-                ret = prepend_command_line(&cmdline_append, L"%s", cmdline16);
-                if (EFI_ERROR(ret)) {
-                        error(L"couldn't prepend to command line");
-                        FreePool(cmdline_append);
-                } else {
+                new = PoolPrint(L"%s %s", cmdline16, cmdline_append);
+                FreePool(cmdline_append);
+                if (!new)
+                        error(L"couldn't append to command line");
+                else {
                         FreePool(cmdline16);
-                        cmdline16 = cmdline_append;
+                        cmdline16 = new;
                 }
         }
 
@@ -1059,15 +1313,16 @@ EFI_STATUS get_bootimage_blob(VOID *bootimage, enum blobtype btype, VOID **blob,
  * trusted */
 static EFI_STATUS parse_bootvars_line(char *line, VOID *ctx)
 {
-        CHAR16 **cmdline16 = (CHAR16 **)ctx;
+        struct cmdline *cmdline = (struct cmdline *)ctx;
+        UINTN len = strlen((CHAR8 *)line);
 
-        if (strlen((CHAR8 *)line) == 0 || line[0] == '#')
+        if (len == 0 || line[0] == '#')
                 return EFI_SUCCESS;
 
-        return prepend_command_line(cmdline16, L"%a", line);
+        return cmdline_prepend_stra(cmdline, (CHAR8 *)line, len);
 }
 
-static EFI_STATUS add_bootvars(VOID *bootimage, CHAR16 **cmdline16)
+static EFI_STATUS add_bootvars(VOID *bootimage, struct cmdline *cmdline)
 {
         VOID *bootvars;
         UINT32 bvsize;
@@ -1085,84 +1340,10 @@ static EFI_STATUS add_bootvars(VOID *bootimage, CHAR16 **cmdline16)
         }
 
         return parse_text_buffer(bootvars, bvsize, parse_bootvars_line,
-                                 cmdline16);
+                                 cmdline);
 }
 #endif
 
-static EFI_STATUS classify_cmd_parameters(
-                IN UINT8 *cmd_conf,
-                OUT UINT8 *androidcmd,
-                OUT UINT8 *kernelcmd
-                )
-{
-	UINT32 cnt;
-	bool end = false;
-	CHAR8 *tempChar;
-	CHAR8 *androidcmd_tmp = androidcmd;
-	CHAR8 *kernelcmd_tmp = kernelcmd;
-
-	if (cmd_conf == NULL || androidcmd == NULL || kernelcmd == NULL)
-		return EFI_INVALID_PARAMETER;
-
-	tempChar = cmd_conf;
-	while(*tempChar == ' ')
-		tempChar += 1;
-
-	while (*tempChar != '\0') {
-		cnt = 0;
-		if (strncmp(tempChar, "androidboot", strlen("androidboot")) == 0) {
-			cnt = strlen("androidboot");
-			while (true) {
-				if (tempChar[cnt] == '\0') {
-					memcpy_s(androidcmd_tmp, cnt, tempChar, cnt);
-					androidcmd_tmp += cnt;
-					end = true;
-					break;
-				} else if (tempChar[cnt] == ' ') {
-					if (tempChar[cnt - 1] == '=') {
-						memcpy_s(androidcmd_tmp, cnt, tempChar, cnt);
-						memcpy_s(androidcmd_tmp + cnt, 7, "unknown", 7);
-						androidcmd_tmp += cnt + 7;
-					} else {
-						memcpy_s(androidcmd_tmp, cnt, tempChar, cnt);
-						androidcmd_tmp += cnt;
-					}
-					*androidcmd_tmp = '\n';
-					androidcmd_tmp += 1;
-					tempChar += cnt;
-					break;
-				}
-				cnt ++;
-			}
-		} else {
-			while (true) {
-				if (tempChar[cnt] == '\0') {
-					memcpy_s(kernelcmd_tmp, cnt, tempChar, cnt);
-					kernelcmd_tmp += cnt;
-					end = true;
-					break;
-				} else if (tempChar[cnt] == ' ') {
-					memcpy_s(kernelcmd_tmp, cnt+1, tempChar, cnt+1);
-					tempChar += cnt+1;
-					kernelcmd_tmp += cnt+1;
-					break;
-				}
-				cnt ++;
-			}
-		}
-
-		if (end) break;
-
-		while(*tempChar == ' ')
-			tempChar += 1;
-	}
-
-	*androidcmd_tmp = '\0';
-	*kernelcmd_tmp = '\0';
-
-	return EFI_SUCCESS;
-}
-
 /* when we call setup_command_line in EFI, parameter is EFI_GUID *swap_guid.
  * when we call setup_command_line in NON EFI, parameter is const CHAR8 *abl_cmd_line.
  * */
@@ -1173,39 +1354,35 @@ static EFI_STATUS setup_command_line(
                 IN void *parameter,
                 IN UINT8 boot_state,
                 IN VBDATA *vb_data,
-                OUT UINT8 **androidcmd
+                OUT struct cmdline *androidcmd
                 )
 {
         CHAR16 *cmdline16 = NULL;
+        struct cmdline builder = { 0 };
         char   *serialno = NULL;
         CHAR16 *serialport = NULL;
         CHAR16 *bootreason = NULL;
 
         EFI_PHYSICAL_ADDRESS cmdline_addr;
         CHAR8 *cmdline;
-        CHAR8 *cmd_conf= NULL;
-        UINTN cmdlen;
-        UINTN cmdsize;
+        UINTN cmdsize = 0;
+        UINTN androidcmd_size = 0;
         UINTN vb_cmdlen = 0;
         EFI_STATUS ret;
         struct boot_params *buf;
         struct boot_img_hdr *aosp_header;
         CHAR8 time_str8[128] = {0};
-        CHAR16 *time_str16 = NULL;
         EFI_GUID *swap_guid = NULL;
         CHAR8 *abl_cmd_line = NULL;
         BOOLEAN is_uefi = TRUE;
-        UINTN abl_cmd_len = 0;
+        BOOLEAN split;
 
         is_uefi = is_UEFI();
 
         if (is_uefi)
                 swap_guid = (EFI_GUID *)parameter;
-        else {
+        else
                 abl_cmd_line = (CHAR8 *)parameter;
-                if (abl_cmd_line != NULL)
-                    abl_cmd_len = strlen(abl_cmd_line);
-        }
 
         aosp_header = (struct boot_img_hdr *)bootimage;
         cmdline16 = get_command_line(aosp_header, boot_target);
@@ -1214,15 +1391,24 @@ static EFI_STATUS setup_command_line(
                 goto out;
         }
 
+        ret = cmdline_init(&builder, cmdline16);
+        FreePool(cmdline16);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to initialize the command line");
+                goto out;
+        }
+
         if (aosp_header->header_version >= BOOT_HEADER_V3) {
             struct vendor_boot_img_hdr_v3 *v3 = (struct vendor_boot_img_hdr_v3 *)vendorbootimage;
-            ret = prepend_command_line(&cmdline16, L"%a", v3->cmdline);
+            ret = cmdline_prepend_stra(&builder, v3->cmdline, sizeof(v3->cmdline));
+            if (EFI_ERROR(ret))
+                    goto out;
         }
 
         /* Append serial number from DMI */
         serialno = get_serial_number();
         if (serialno) {
-                ret = prepend_command_line(&cmdline16,
+                ret = cmdline_prepend(&builder,
                                 L"androidboot.serialno=%a g_ffs.iSerialNumber=%a",
                                 serialno, serialno);
                 if (EFI_ERROR(ret))
@@ -1230,7 +1416,7 @@ static EFI_STATUS setup_command_line(
         }
 
         if (boot_target == CHARGER) {
-                ret = prepend_command_line(&cmdline16,
+                ret = cmdline_prepend(&builder,
                                 L"androidboot.mode=charger");
                 if (EFI_ERROR(ret))
                         goto out;
@@ -1246,17 +1432,17 @@ static EFI_STATUS setup_command_line(
                 goto out;
         }
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.bootreason=%s", bootreason);
+        ret = cmdline_prepend(&builder, L"androidboot.bootreason=%s", bootreason);
         if (EFI_ERROR(ret))
                 goto out;
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.verifiedbootstate=%s",
+        ret = cmdline_prepend(&builder, L"androidboot.verifiedbootstate=%s",
                                    boot_state_to_string(boot_state));
         if (EFI_ERROR(ret))
                 goto out;
 
         if (swap_guid) {
-                ret = prepend_command_line(&cmdline16, L"resume=PARTUUID=%g",
+                ret = cmdline_prepend(&builder, L"resume=PARTUUID=%g",
                         swap_guid);
                 if (EFI_ERROR(ret))
                         goto out;
@@ -1264,14 +1450,14 @@ static EFI_STATUS setup_command_line(
 
         serialport = get_serial_port();
         if (serialport) {
-                ret = prepend_command_line(&cmdline16, L"console=%s", serialport);
+                ret = cmdline_prepend(&builder, L"console=%s", serialport);
                 if (EFI_ERROR(ret))
                         goto out;
         }
 
 #ifndef USER
         if (get_disable_watchdog()) {
-                ret = prepend_command_line(&cmdline16, CONVERT_TO_WIDE(TCO_OPT_DISABLED));
+                ret = cmdline_prepend(&builder, CONVERT_TO_WIDE(TCO_OPT_DISABLED));
                 if (EFI_ERROR(ret))
                         goto out;
         }
@@ -1286,7 +1472,7 @@ static EFI_STATUS setup_command_line(
                 diskbus = PoolPrint(L"%a", (CHAR8 *)PREDEF_DISK_BUS);
 #endif
                 StrToLower(diskbus);
-                ret = prepend_command_line(&cmdline16,
+                ret = cmdline_prepend(&builder,
                                            (aosp_header->header_version < 2)
                                            ? L"androidboot.diskbus=%s"
                                            : L"androidboot.boot_devices=pci0000:00/0000:00:%s",
@@ -1297,7 +1483,7 @@ static EFI_STATUS setup_command_line(
         } else
                 error(L"Boot device not found, diskbus parameter not set in the commandline!");
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.bootloader=%a",
+        ret = cmdline_prepend(&builder, L"androidboot.bootloader=%a",
                                    get_property_bootloader());
         if (EFI_ERROR(ret))
                 goto out;
@@ -1306,23 +1492,23 @@ static EFI_STATUS setup_command_line(
         //containing the recovery’s ramdisk. command line "androidboot.force_normal_boot=1" is
         //mandatory for normal boot.
         if(boot_target == NORMAL_BOOT) {
-                ret = prepend_command_line(&cmdline16, L"androidboot.force_normal_boot=1");
+                ret = cmdline_prepend(&builder, L"androidboot.force_normal_boot=1");
                 if (EFI_ERROR(ret))
                         goto out;
         }
 #endif
-        ret = prepend_command_line(&cmdline16, L"androidboot.acpi_idx=%a ",
+        ret = cmdline_prepend(&builder, L"androidboot.acpi_idx=%a ",
                                    acpi_loaded_table_idx_to_string(BOOT_ACPI));
         if (EFI_ERROR(ret))
                 goto out;
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.acpio_idx=%a ",
+        ret = cmdline_prepend(&builder, L"androidboot.acpio_idx=%a ",
                                    acpi_loaded_table_idx_to_string(ACPIO));
         if (EFI_ERROR(ret))
                 goto out;
 
 #ifdef HAL_AUTODETECT
-        ret = prepend_command_line(&cmdline16, L"androidboot.brand=%a "
+        ret = cmdline_prepend(&builder, L"androidboot.brand=%a "
                                    "androidboot.name=%a androidboot.device=%a "
                                    "androidboot.model=%a", get_property_brand(),
                                    get_property_name(), get_property_device(),
@@ -1331,71 +1517,53 @@ static EFI_STATUS setup_command_line(
                 goto out;
 
         if (aosp_header->header_version < BOOT_HEADER_V3) {
-                ret = add_bootvars(bootimage, &cmdline16);
+                ret = add_bootvars(bootimage, &builder);
                 if (EFI_ERROR(ret))
                         goto out;
         }
 #endif
 
-        ret = prepend_slot_command_line(&cmdline16, boot_target, vb_data);
+        ret = prepend_slot_command_line(&builder, boot_target, vb_data);
         if (EFI_ERROR(ret))
                 goto out;
         /* append stages boottime */
         set_boottime_stamp(TM_JMP_KERNEL);
         construct_stages_boottime(time_str8, sizeof(time_str8));
-        time_str16 = stra_to_str(time_str8);
-        if (time_str16) {
-                ret = prepend_command_line(&cmdline16, L"androidboot.boottime=%s", time_str16);
-                if (EFI_ERROR(ret))
-                        goto out;
-        }
+        ret = cmdline_prepend(&builder, L"androidboot.boottime=%a", time_str8);
+        if (EFI_ERROR(ret))
+                goto out;
 
         if(boot_target != MEMORY)
                 vb_cmdlen = get_vb_cmdlen(vb_data);
 
-        cmdlen = StrLen(cmdline16);
-        if (is_uefi) {
-            cmdsize = cmdlen + 1 + vb_cmdlen + 1;
-        } else {
-            cmdsize = cmdlen + vb_cmdlen + abl_cmd_len + 256;
-        }
-
-        cmd_conf = AllocatePool(cmdsize);
-        if (cmd_conf == NULL) {
-                ret = EFI_OUT_OF_RESOURCES;
-                goto out;
-        }
-
-        ret = str_to_stra(cmd_conf, cmdline16, cmdlen + 1);
-        if (EFI_ERROR(ret)) {
-                error(L"Non-ascii characters in command line");
-                goto out;
-        }
-
         if (vb_cmdlen > 0) {
-                char *vb_cmdline;
-                vb_cmdline = get_vb_cmdline(vb_data);
-                cmd_conf[cmdlen] = ' ';
-                ret = memcpy_s(cmd_conf + cmdlen + 1, vb_cmdlen, vb_cmdline, vb_cmdlen);
-                if (EFI_ERROR(ret)) {
+                ret = cmdline_append_stra(&builder, (CHAR8 *)get_vb_cmdline(vb_data),
+                                          vb_cmdlen);
+                if (EFI_ERROR(ret))
                         goto out;
-                }
-                cmdlen += vb_cmdlen + 1;
-                cmd_conf[cmdlen] = 0;
         }
 
         /* append command line from ABL */
-        if (abl_cmd_len > 0)
-        {
-                cmd_conf[cmdlen] = ' ';
-                ret = memcpy_s(cmd_conf + cmdlen + 1, abl_cmd_len + 1, abl_cmd_line, abl_cmd_len + 1);
-                if (EFI_ERROR(ret)) {
+        if (abl_cmd_line && abl_cmd_line[0]) {
+                ret = cmdline_append_stra(&builder, abl_cmd_line, strlen(abl_cmd_line));
+                if (EFI_ERROR(ret))
                         goto out;
-                }
-                cmdlen += abl_cmd_len + 1;
-                cmd_conf[cmdlen] = '\0';
         }
 
+        /* Starting with boot image header version 4, the androidboot.*
+         * parameters are passed through the bootconfig section of the
+         * ramdisk instead of the kernel command line */
+        split = aosp_header->header_version > BOOT_HEADER_V3;
+        if (split && androidcmd == NULL) {
+                ret = EFI_INVALID_PARAMETER;
+                goto out;
+        }
+
+        ret = cmdline_finish(&builder, NULL, &cmdsize,
+                             NULL, split ? &androidcmd_size : NULL);
+        if (ret != EFI_BUFFER_TOO_SMALL)
+                goto out;
+
         if (is_uefi) {
             /* Documentation/x86/boot.txt: "The kernel command line can be located
              * anywhere between the end of the setup heap and 0xA0000" */
@@ -1417,39 +1585,32 @@ static EFI_STATUS setup_command_line(
 
         cmdline = (CHAR8 *)(UINTN)cmdline_addr;
 
-        if (aosp_header->header_version <= BOOT_HEADER_V3) {
-                ret = memcpy_s(cmdline, cmdsize, cmd_conf, cmdsize);
-        } else {
-                if (androidcmd == NULL) {
-                        ret = EFI_INVALID_PARAMETER;
-                        goto out;
-                }
-                *androidcmd= AllocatePool(cmdsize);
-                if (*androidcmd == NULL) {
-                        ret = EFI_OUT_OF_RESOURCES;
-                        goto out;
-                }
-
-                ret = classify_cmd_parameters(cmd_conf, *androidcmd, cmdline);
-        }
+        ret = cmdline_finish(&builder, cmdline, &cmdsize,
+                             NULL, split ? &androidcmd_size : NULL);
+        if (EFI_ERROR(ret))
+                goto free_cmdline;
 
-        if (EFI_ERROR(ret)) {
-                free_pages(cmdline_addr, EFI_SIZE_TO_PAGES(cmdsize));
-                goto out;
+        /* The androidboot.* parameters are written out once the
+           bootconfig section is set up. */
+        if (split) {
+                *androidcmd = builder;
+                memset(&builder, 0, sizeof(builder));
         }
 
         buf = get_boot_param_hdr(bootimage);
         buf->hdr.cmd_line_ptr = (UINT32)(UINTN)cmdline;
         ret = EFI_SUCCESS;
+        goto out;
+
+free_cmdline:
+        if (is_uefi)
+                free_pages(cmdline_addr, EFI_SIZE_TO_PAGES(cmdsize));
+        else
+                FreePool(cmdline);
 out:
-        if (cmdline16)
-                FreePool(cmdline16);
-        if (cmd_conf)
-                FreePool(cmd_conf);
+        cmdline_free(&builder);
         if (serialport)
                 FreePool(serialport);
-        if (time_str16)
-                FreePool(time_str16);
 
         return ret;
 }
@@ -1491,6 +1652,8 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
         UINT32 koffset;
         size_t setup_header_size;
         size_t setup_header_end;
+        BOOLEAN in_place;
+        UINT8 *end;
 
         aosp_header = (struct boot_img_hdr *)bootimage;
         buf = get_boot_param_hdr(bootimage);
@@ -1505,27 +1668,38 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
 
         setup_screen_info_from_gop(&buf->screen_info);
 
-        ret = allocate_pages(AllocateAddress, EfiLoaderData,
-                             EFI_SIZE_TO_PAGES(init_size), &kernel_start);
-        if (EFI_ERROR(ret)) {
-                /*
-                 * We failed to allocate the preferred address, so
-                 * just allocate some memory and hope for the best.
-                 */
-                ret = emalloc(init_size, buf->hdr.kernel_alignment, &kernel_start,
-                              FALSE);
-                if (EFI_ERROR(ret))
-                        return ret;
-        }
-
         if (aosp_header->header_version < BOOT_HEADER_V3)
             koffset = setup_size + aosp_header->page_size;
         else
             koffset = setup_size + BOOT_IMG_HEADER_SIZE_V3;
-        ret = memcpy_s((CHAR8 *)(UINTN)kernel_start, init_size, bootimage + koffset,
-                       ksize);
-        if (EFI_ERROR(ret))
-                goto out;
+
+        /* A planned boot image already has its kernel at a suitable
+           load address. */
+        end = planned_image_end(bootimage);
+        in_place = end && !((UINTN)(bootimage + koffset) & (buf->hdr.kernel_alignment - 1)) &&
+                (UINT64)(end - (UINT8 *)bootimage - koffset) >= init_size;
+        if (in_place) {
+                debug(L"Kernel used in place, %d bytes not copied", ksize);
+                kernel_start = (UINTN)(bootimage + koffset);
+        } else {
+                ret = allocate_pages(AllocateAddress, EfiLoaderData,
+                                     EFI_SIZE_TO_PAGES(init_size), &kernel_start);
+                if (EFI_ERROR(ret)) {
+                        /*
+                         * We failed to allocate the preferred address, so
+                         * just allocate some memory and hope for the best.
+                         */
+                        ret = emalloc(init_size, buf->hdr.kernel_alignment, &kernel_start,
+                                      FALSE);
+                        if (EFI_ERROR(ret))
+                                return ret;
+                }
+
+                ret = memcpy_s((CHAR8 *)(UINTN)kernel_start, init_size, bootimage + koffset,
+                               ksize);
+                if (EFI_ERROR(ret))
+                        goto out;
+        }
 
         boot_addr = 0x3fffffff;
         ret = allocate_pages(AllocateMaxAddress, EfiLoaderData,
@@ -1573,7 +1747,8 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
 
         free_pages(boot_addr, EFI_SIZE_TO_PAGES(16384));
 out:
-        efree(kernel_start, ksize);
+        if (!in_place)
+                efree(kernel_start, ksize);
         return ret;
 }
 
@@ -1622,9 +1797,10 @@ EFI_STATUS android_image_load_partition(
         partition_start = gpart.part.starting_lba * gpart.bio->Media->BlockSize;
 
         debug(L"Reading boot image header");
-        ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId,
-                                partition_start,
-                                sizeof(aosp_header), &aosp_header);
+        ret = prefetch_read(label, 0, sizeof(aosp_header), &aosp_header);
+        if (EFI_ERROR(ret))
+                ret = block_cache_read(gpart.bio, gpart.dio, partition_start,
+                                       sizeof(aosp_header), &aosp_header);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"ReadDisk (header)");
                 return ret;
@@ -1640,8 +1816,10 @@ EFI_STATUS android_image_load_partition(
                 return EFI_OUT_OF_RESOURCES;
 
         debug(L"Reading full boot image (%d bytes)", img_size);
-        ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId, partition_start,
-                                img_size, bootimage);
+        ret = prefetch_read(label, 0, img_size, bootimage);
+        if (EFI_ERROR(ret))
+                ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId, partition_start,
+                                        img_size, bootimage);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"ReadDisk");
                 FreePool(bootimage);
@@ -1806,7 +1984,7 @@ EFI_STATUS android_image_start_buffer(
         struct boot_img_hdr *aosp_header;
         struct boot_params *buf;
         void *parameter = NULL;
-        UINT8 *androidcmd= NULL;
+        struct cmdline androidcmd = { 0 };
         EFI_STATUS ret;
         BOOLEAN use_ramdisk = TRUE;
         if (!bootimage)
@@ -1862,30 +2040,35 @@ EFI_STATUS android_image_start_buffer(
 
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"setup_command_line");
-                if (androidcmd != NULL)
-                        FreePool(androidcmd);
                 return ret;
         }
 #ifndef DYNAMIC_PARTITIONS
         use_ramdisk = !recovery_in_boot_partition() || boot_target == RECOVERY || boot_target == MEMORY;
 #endif
         if (use_ramdisk) {
-                ret = setup_ramdisk(bootimage, vendorbootimage, androidcmd);
+                ret = setup_ramdisk(bootimage, vendorbootimage, &androidcmd);
                 if (EFI_ERROR(ret)) {
                         efi_perror(ret, L"setup_ramdisk");
-                        if (androidcmd != NULL)
-                                FreePool(androidcmd);
+                        cmdline_free(&androidcmd);
                         goto out_cmdline;
                 }
         }
 
-        if (androidcmd != NULL)
-                FreePool(androidcmd);
+        cmdline_free(&androidcmd);
+
+        /* Last chance to write the pending BCB and A/B metadata
+           changes back.  */
+        ret = misc_cache_flush();
+        if (EFI_ERROR(ret))
+                efi_perror(ret, L"Failed to update the misc partition");
+        prefetch_release();
+
         debug(L"Loading the kernel");
         ret = handover_kernel(bootimage, parent_image);
         efi_perror(ret, L"handover_kernel");
 
-        efree(buf->hdr.ramdisk_start, buf->hdr.ramdisk_len);
+        if (!get_planned_image((VOID *)(UINTN)buf->hdr.ramdisk_start))
+                efree(buf->hdr.ramdisk_start, buf->hdr.ramdisk_len);
         buf->hdr.ramdisk_start = 0;
         buf->hdr.ramdisk_len = 0;
 out_cmdline:
@@ -1914,6 +2097,13 @@ EFI_STATUS read_bcb(
         struct gpt_partition_interface gpart;
         UINT64 partition_start;
 
+        if (!StrCmp(label, MISC_LABEL)) {
+                ret = misc_cache_read(0, bcb, sizeof(*bcb));
+                if (EFI_ERROR(ret))
+                        return ret == EFI_NOT_FOUND ? EFI_INVALID_PARAMETER : ret;
+                goto out;
+        }
+
         debug(L"Locating BCB");
         ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
         if (EFI_ERROR(ret))
@@ -1928,6 +2118,7 @@ EFI_STATUS read_bcb(
                 efi_perror(ret, L"ReadDisk (bcb)");
                 return ret;
         }
+out:
         bcb->command[31] = '\0';
         bcb->status[31] = '\0';
         dump_bcb(bcb);
@@ -1945,6 +2136,14 @@ EFI_STATUS write_bcb(
         struct gpt_partition_interface gpart;
         UINT64 partition_start;
 
+        if (!StrCmp(label, MISC_LABEL)) {
+                ret = misc_cache_write(0, bcb, sizeof(*bcb));
+                if (EFI_ERROR(ret))
+                        return ret == EFI_NOT_FOUND ? EFI_INVALID_PARAMETER : ret;
+                dump_bcb(bcb);
+                return EFI_SUCCESS;
+        }
+
         debug(L"Locating BCB");
         ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
         if (EFI_ERROR(ret))
@@ -1955,6 +2154,7 @@ EFI_STATUS write_bcb(
         ret = uefi_call_wrapper(gpart.dio->WriteDisk, 5, gpart.dio,
                                 gpart.bio->Media->MediaId,
                                 partition_start, sizeof(*bcb), bcb);
+        block_cache_invalidate(gpart.bio, partition_start, sizeof(*bcb));
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"WriteDisk (bcb)");
                 return ret;
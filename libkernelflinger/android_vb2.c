@@ -33,6 +33,7 @@
 #endif
 #include "slot.h"
 #include "pae.h"
+#include "avb_cache.h"
 #include "timer.h"
 #include "acpi.h"
 
@@ -77,7 +78,9 @@ bool avb_update_stored_rollback_indexes_for_slot(AvbOps* ops, AvbSlotVerifyData*
                         }
                 }
         }
-        return true;
+
+        /* Commit all the updated slots at once. */
+        return uefi_avb_ops_flush_rollback_indexes() == AVB_IO_RESULT_OK;
 }
 #ifdef DYNAMIC_PARTITIONS
 #define AVB_ROOTFS_PREFIX L"rootwait ro init=/init"
@@ -87,7 +90,7 @@ bool avb_update_stored_rollback_indexes_for_slot(AvbOps* ops, AvbSlotVerifyData*
 #define DISABLE_AVB_ROOTFS_PREFIX L" root="
 
 static EFI_STATUS avb_prepend_command_line_rootfs(
-                __attribute__((__unused__)) OUT CHAR16 **cmdline16,
+                __attribute__((__unused__)) IN OUT struct cmdline *cmdline,
                 IN enum boot_target boot_target)
 {
         EFI_STATUS ret = EFI_SUCCESS;
@@ -96,7 +99,7 @@ static EFI_STATUS avb_prepend_command_line_rootfs(
                 return ret;
 
         if (use_slot()) {
-                ret = prepend_command_line(cmdline16, AVB_ROOTFS_PREFIX);
+                ret = cmdline_prepend(cmdline, AVB_ROOTFS_PREFIX);
                 if (EFI_ERROR(ret)) {
                         efi_perror(ret, L"Failed to add AVB rootfs prefix");
                         return ret;
@@ -105,7 +108,7 @@ static EFI_STATUS avb_prepend_command_line_rootfs(
         return ret;
 }
 
-EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
+EFI_STATUS prepend_slot_command_line(struct cmdline *cmdline,
         enum boot_target boot_target,
         VBDATA *vb_data)
 {
@@ -114,11 +117,11 @@ EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
         EFI_GUID system_uuid;
 #endif
 
-        avb_prepend_command_line_rootfs(cmdline16, boot_target);
+        avb_prepend_command_line_rootfs(cmdline, boot_target);
 
         if (use_slot()) {
                 if (slot_get_active()) {
-                        ret = prepend_command_line(cmdline16,
+                        ret = cmdline_prepend(cmdline,
                                 L"androidboot.slot_suffix=%a",
                                 slot_get_active());
                         if (EFI_ERROR(ret))
@@ -138,7 +141,7 @@ EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
                                 return ret;
                         }
 
-                        ret = prepend_command_line(cmdline16,
+                        ret = cmdline_prepend(cmdline,
                                 DISABLE_AVB_ROOTFS_PREFIX "PARTUUID=%g",
                                 &system_uuid);
                         if (EFI_ERROR(ret))
@@ -201,6 +204,19 @@ EFI_STATUS get_avb_flow_result(
                 return EFI_LOAD_ERROR;
         }
 
+        /* avb_ab_flow() updates the stored rollback indexes when the
+           slot is already marked as successful.  Failing to store
+           them is an I/O error of the flow, as it was when they were
+           written directly. */
+        if (uefi_avb_ops_flush_rollback_indexes() != AVB_IO_RESULT_OK) {
+                error(L"Failed to store the rollback indexes");
+                flow_result = AVB_AB_FLOW_RESULT_ERROR_IO;
+        }
+
+        avb_cache_record_slot(slot_data, flow_result == AVB_AB_FLOW_RESULT_OK ?
+                              AVB_SLOT_VERIFY_RESULT_OK :
+                              AVB_SLOT_VERIFY_RESULT_ERROR_VERIFICATION);
+
         switch (flow_result) {
         case AVB_AB_FLOW_RESULT_OK:
                 if (allow_verification_error && *boot_state < BOOT_STATE_ORANGE)
@@ -247,6 +263,8 @@ EFI_STATUS get_avb_result(
                 return EFI_LOAD_ERROR;
         }
 
+        avb_cache_record_slot(slot_data, verify_result);
+
         switch (verify_result) {
         case AVB_SLOT_VERIFY_RESULT_OK:
                 if (allow_verification_error && *boot_state < BOOT_STATE_ORANGE)
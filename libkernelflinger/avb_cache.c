@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2020, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include "lib.h"
+#include "avb_sha.h"
+#include "avb_cache.h"
+
+#define MAX_VBMETA_ENTRIES 16
+
+static struct vbmeta_entry {
+	char name[AVB_PART_NAME_MAX_SIZE];
+	UINT8 digest[AVB_SHA256_DIGEST_SIZE];
+} vbmeta_entries[MAX_VBMETA_ENTRIES];
+static UINTN nb_vbmeta_entries;
+
+/* Last AvbSlotVerifyData verified without any error.  It must be
+   released with avb_cache_free_slot() so that a new AvbSlotVerifyData
+   allocated at the same address is not mistaken for it. */
+static AvbSlotVerifyData *verified_slot;
+
+static void vbmeta_digest(const uint8_t *data, size_t length, UINT8 *digest)
+{
+	AvbSHA256Ctx ctx;
+
+	avb_sha256_init(&ctx);
+	avb_sha256_update(&ctx, data, length);
+	memcpy_s(digest, AVB_SHA256_DIGEST_SIZE,
+		 avb_sha256_final(&ctx), AVB_SHA256_DIGEST_SIZE);
+}
+
+static struct vbmeta_entry *find_vbmeta(const char *name, const UINT8 *digest)
+{
+	UINTN i;
+
+	for (i = 0; i < nb_vbmeta_entries; i++)
+		if (!strcmp((CHAR8 *)vbmeta_entries[i].name, (CHAR8 *)name) &&
+		    !memcmp(vbmeta_entries[i].digest, digest, AVB_SHA256_DIGEST_SIZE))
+			return &vbmeta_entries[i];
+
+	return NULL;
+}
+
+static void add_vbmeta(const char *name, const UINT8 *digest)
+{
+	struct vbmeta_entry *entry;
+
+	if (find_vbmeta(name, digest))
+		return;
+
+	/* Once the cache is full, the oldest entry is dropped. */
+	if (nb_vbmeta_entries == MAX_VBMETA_ENTRIES) {
+		memmove(vbmeta_entries, vbmeta_entries + 1,
+			sizeof(vbmeta_entries) - sizeof(*entry));
+		nb_vbmeta_entries--;
+	}
+	entry = &vbmeta_entries[nb_vbmeta_entries];
+
+	if (efi_snprintf((CHAR8 *)entry->name, sizeof(entry->name),
+			 (CHAR8 *)"%a", name) < 0)
+		return;
+	memcpy_s(entry->digest, sizeof(entry->digest), digest, AVB_SHA256_DIGEST_SIZE);
+	nb_vbmeta_entries++;
+}
+
+static BOOLEAN get_public_key(const uint8_t *data, size_t length,
+			      const uint8_t **key, size_t *key_length)
+{
+	AvbVBMetaImageHeader h;
+	uint64_t offset;
+
+	if (length < sizeof(h))
+		return FALSE;
+
+	avb_vbmeta_image_header_to_host_byte_order((const AvbVBMetaImageHeader *)data, &h);
+	offset = sizeof(h) + h.authentication_data_block_size + h.public_key_offset;
+	if (offset > length || h.public_key_size > length - offset)
+		return FALSE;
+
+	if (key)
+		*key = data + offset;
+	if (key_length)
+		*key_length = h.public_key_size;
+
+	return TRUE;
+}
+
+void avb_cache_record_slot(AvbSlotVerifyData *slot_data,
+			   AvbSlotVerifyResult result)
+{
+	CHAR8 name[AVB_PART_NAME_MAX_SIZE];
+	UINT8 digest[AVB_SHA256_DIGEST_SIZE];
+	AvbVBMetaData *vbmeta;
+	size_t i;
+
+	verified_slot = NULL;
+	if (!slot_data)
+		return;
+
+	for (i = 0; i < slot_data->num_vbmeta_images; i++) {
+		vbmeta = &slot_data->vbmeta_images[i];
+		if (vbmeta->verify_result != AVB_VBMETA_VERIFY_RESULT_OK)
+			continue;
+
+		if (efi_snprintf(name, sizeof(name), (CHAR8 *)"%a%a",
+				 vbmeta->partition_name, slot_data->ab_suffix) < 0)
+			continue;
+
+		vbmeta_digest(vbmeta->vbmeta_data, vbmeta->vbmeta_size, digest);
+		add_vbmeta((char *)name, digest);
+	}
+
+	if (result == AVB_SLOT_VERIFY_RESULT_OK)
+		verified_slot = slot_data;
+}
+
+void avb_cache_free_slot(AvbSlotVerifyData *slot_data)
+{
+	if (!slot_data)
+		return;
+
+	if (slot_data == verified_slot)
+		verified_slot = NULL;
+	avb_slot_verify_data_free(slot_data);
+}
+
+AvbVBMetaVerifyResult avb_cache_vbmeta_verify(const char *name,
+					      const uint8_t *data,
+					      size_t length,
+					      const uint8_t **out_public_key_data,
+					      size_t *out_public_key_length)
+{
+	UINT8 digest[AVB_SHA256_DIGEST_SIZE];
+	AvbVBMetaVerifyResult ret;
+
+	vbmeta_digest(data, length, digest);
+	if (find_vbmeta(name, digest) &&
+	    get_public_key(data, length, out_public_key_data, out_public_key_length)) {
+		debug(L"%a vbmeta already verified", name);
+		return AVB_VBMETA_VERIFY_RESULT_OK;
+	}
+
+	ret = avb_vbmeta_image_verify(data, length, out_public_key_data,
+				      out_public_key_length);
+	if (ret == AVB_VBMETA_VERIFY_RESULT_OK)
+		add_vbmeta(name, digest);
+
+	return ret;
+}
+
+AvbVBMetaVerifyResult avb_cache_slot_public_key(AvbSlotVerifyData *slot_data,
+						const uint8_t **out_public_key_data,
+						size_t *out_public_key_length)
+{
+	CHAR8 name[AVB_PART_NAME_MAX_SIZE];
+	AvbVBMetaData *vbmeta;
+
+	if (!slot_data || !slot_data->num_vbmeta_images)
+		return AVB_VBMETA_VERIFY_RESULT_INVALID_VBMETA_HEADER;
+
+	vbmeta = &slot_data->vbmeta_images[0];
+	if (efi_snprintf(name, sizeof(name), (CHAR8 *)"%a%a",
+			 vbmeta->partition_name, slot_data->ab_suffix) < 0)
+		return AVB_VBMETA_VERIFY_RESULT_INVALID_VBMETA_HEADER;
+
+	return avb_cache_vbmeta_verify((char *)name, vbmeta->vbmeta_data,
+				       vbmeta->vbmeta_size, out_public_key_data,
+				       out_public_key_length);
+}
+
+BOOLEAN avb_cache_image_verified(AvbSlotVerifyData *slot_data,
+				 const char *name,
+				 const void *image,
+				 const uint8_t *vbmeta,
+				 size_t vbmeta_size)
+{
+	BOOLEAN vbmeta_found = FALSE;
+	size_t i;
+
+	if (!slot_data || slot_data != verified_slot)
+		return FALSE;
+
+	for (i = 0; i < slot_data->num_vbmeta_images && !vbmeta_found; i++)
+		vbmeta_found = !strcmp((CHAR8 *)slot_data->vbmeta_images[i].partition_name,
+				       (CHAR8 *)name) &&
+			slot_data->vbmeta_images[i].vbmeta_size == vbmeta_size &&
+			!memcmp(slot_data->vbmeta_images[i].vbmeta_data, vbmeta, vbmeta_size);
+
+	if (!vbmeta_found)
+		return FALSE;
+
+	for (i = 0; i < slot_data->num_loaded_partitions; i++)
+		if (!strcmp((CHAR8 *)slot_data->loaded_partitions[i].partition_name,
+			    (CHAR8 *)name))
+			return slot_data->loaded_partitions[i].data == image;
+
+	return FALSE;
+}
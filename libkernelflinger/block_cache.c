@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2022, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "uefi_utils.h"
+#include "block_cache.h"
+
+#define NB_ENTRIES	16
+/* Larger reads are image loads, which are not worth caching.  */
+#define MAX_READ_SIZE	(64 * 1024)
+/* Cached ranges are aligned on lines so that neighbouring small
+   reads, a header and the data right after it for instance, share
+   an entry.  */
+#define LINE_SIZE	4096
+
+static struct cache_entry {
+	EFI_BLOCK_IO *bio;
+	UINT32 media_id;
+	UINT64 offset;		/* Line aligned disk offset */
+	UINT64 size;
+	VOID *data;		/* NULL for an unused entry */
+	UINT64 last_use;
+} entries[NB_ENTRIES];
+static UINT64 tick;
+static struct block_cache_stats stats;
+
+static BOOLEAN overlaps(struct cache_entry *entry, EFI_BLOCK_IO *bio,
+			UINT64 offset, UINT64 size)
+{
+	return entry->data && entry->bio == bio &&
+		offset < entry->offset + entry->size &&
+		entry->offset < offset + size;
+}
+
+static struct cache_entry *lookup(EFI_BLOCK_IO *bio, UINT64 offset, UINTN size)
+{
+	struct cache_entry *entry;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		entry = &entries[i];
+		if (entry->data && entry->bio == bio &&
+		    entry->media_id == bio->Media->MediaId &&
+		    offset >= entry->offset &&
+		    offset + size <= entry->offset + entry->size)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void free_entry(struct cache_entry *entry)
+{
+	FreePool(entry->data);
+	entry->data = NULL;
+}
+
+static struct cache_entry *lru_entry(void)
+{
+	struct cache_entry *lru = &entries[0];
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		if (!entries[i].data)
+			return &entries[i];
+		if (entries[i].last_use < lru->last_use)
+			lru = &entries[i];
+	}
+
+	free_entry(lru);
+	stats.evictions++;
+	return lru;
+}
+
+EFI_STATUS block_cache_read(EFI_BLOCK_IO *bio, EFI_DISK_IO *dio,
+			    UINT64 offset, UINTN size, VOID *data)
+{
+	EFI_STATUS ret;
+	struct cache_entry *entry;
+	UINT64 start, end, disk_size, line;
+	VOID *buf;
+
+	if (size > MAX_READ_SIZE)
+		goto read_disk;
+
+	entry = lookup(bio, offset, size);
+	if (entry) {
+		stats.hits++;
+		entry->last_use = ++tick;
+		memcpy(data, (UINT8 *)entry->data + (offset - entry->offset), size);
+		return EFI_SUCCESS;
+	}
+
+	line = max((UINT64)LINE_SIZE, (UINT64)bio->Media->BlockSize);
+	disk_size = (bio->Media->LastBlock + 1) * bio->Media->BlockSize;
+	start = offset - offset % line;
+	end = min(ALIGN(offset + size, line), disk_size);
+	if (end < offset + size)
+		goto read_disk;
+
+	buf = AllocatePool(end - start);
+	if (!buf)
+		goto read_disk;
+
+	ret = uefi_call_wrapper(dio->ReadDisk, 5, dio, bio->Media->MediaId,
+				start, end - start, buf);
+	if (EFI_ERROR(ret)) {
+		FreePool(buf);
+		goto read_disk;
+	}
+
+	stats.misses++;
+	entry = lru_entry();
+	entry->bio = bio;
+	entry->media_id = bio->Media->MediaId;
+	entry->offset = start;
+	entry->size = end - start;
+	entry->data = buf;
+	entry->last_use = ++tick;
+
+	memcpy(data, (UINT8 *)buf + (offset - start), size);
+	return EFI_SUCCESS;
+
+read_disk:
+	return uefi_call_wrapper(dio->ReadDisk, 5, dio, bio->Media->MediaId,
+				 offset, size, data);
+}
+
+void block_cache_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++)
+		if (overlaps(&entries[i], bio, offset, size)) {
+			free_entry(&entries[i]);
+			stats.invalidations++;
+		}
+}
+
+void block_cache_invalidate_all(void)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++)
+		if (entries[i].data) {
+			free_entry(&entries[i]);
+			stats.invalidations++;
+		}
+}
+
+void block_cache_get_stats(struct block_cache_stats *out)
+{
+	memcpy(out, &stats, sizeof(stats));
+}
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2020, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+
+#include "cmdline.h"
+
+#define CMDLINE_ROOM		1024
+#define CMDLINE_FRAGMENT_MAX	512
+#define CMDLINE_MAX_KEYS	64
+#define ANDROIDBOOT_PREFIX	"androidboot."
+#define EMPTY_VALUE		"unknown"
+
+static EFI_STATUS cmdline_reserve(struct cmdline *cmdline,
+				  UINTN front, UINTN back)
+{
+	UINTN len = cmdline->end - cmdline->start;
+	UINTN size, start;
+	CHAR8 *buf;
+
+	if (cmdline->start >= front && cmdline->size - cmdline->end >= back)
+		return EFI_SUCCESS;
+
+	/* Doubling the arena keeps the total copying linear */
+	size = max(cmdline->size * 2, len + front + back + CMDLINE_ROOM);
+	buf = AllocatePool(size);
+	if (!buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	start = front + (size - len - front - back) / 2;
+	if (len)
+		memcpy(buf + start, cmdline->buf + cmdline->start, len);
+	if (cmdline->buf)
+		FreePool(cmdline->buf);
+
+	cmdline->buf = buf;
+	cmdline->size = size;
+	cmdline->start = start;
+	cmdline->end = start + len;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS copy_ascii(CHAR8 *dst, const CHAR8 *src, UINTN len)
+{
+	UINTN i;
+
+	for (i = 0; i < len; i++) {
+		if (src[i] > 0x7F)
+			return EFI_INVALID_PARAMETER;
+		dst[i] = src[i];
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS narrow_ascii(CHAR8 *dst, const CHAR16 *src, UINTN len)
+{
+	UINTN i;
+
+	for (i = 0; i < len; i++) {
+		if (src[i] > 0x7F)
+			return EFI_INVALID_PARAMETER;
+		dst[i] = (CHAR8)src[i];
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS cmdline_init(struct cmdline *cmdline, const CHAR16 *base)
+{
+	EFI_STATUS ret;
+	UINTN len;
+
+	memset(cmdline, 0, sizeof(*cmdline));
+
+	len = StrLen(base);
+	ret = cmdline_reserve(cmdline, CMDLINE_ROOM, len);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = narrow_ascii(cmdline->buf + cmdline->start, base, len);
+	if (EFI_ERROR(ret)) {
+		cmdline_free(cmdline);
+		return ret;
+	}
+
+	cmdline->end += len;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS cmdline_prepend(struct cmdline *cmdline, const CHAR16 *fmt, ...)
+{
+	CHAR16 fragment[CMDLINE_FRAGMENT_MAX];
+	EFI_STATUS ret;
+	va_list args;
+	UINTN len;
+
+	va_start(args, fmt);
+	len = VSPrint(fragment, sizeof(fragment), (CHAR16 *)fmt, args);
+	va_end(args);
+	if (len >= ARRAY_SIZE(fragment) - 1)
+		return EFI_BUFFER_TOO_SMALL;
+
+	ret = cmdline_reserve(cmdline, len + 1, 0);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = narrow_ascii(cmdline->buf + cmdline->start - len - 1,
+			   fragment, len);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	cmdline->start -= len + 1;
+	cmdline->buf[cmdline->start + len] = ' ';
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS cmdline_prepend_stra(struct cmdline *cmdline, const CHAR8 *str,
+				UINTN len)
+{
+	EFI_STATUS ret;
+
+	len = strnlen(str, len);
+	ret = cmdline_reserve(cmdline, len + 1, 0);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = copy_ascii(cmdline->buf + cmdline->start - len - 1, str, len);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	cmdline->start -= len + 1;
+	cmdline->buf[cmdline->start + len] = ' ';
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS cmdline_append_stra(struct cmdline *cmdline, const CHAR8 *str,
+			       UINTN len)
+{
+	EFI_STATUS ret;
+
+	len = strnlen(str, len);
+	ret = cmdline_reserve(cmdline, 0, len + 1);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = copy_ascii(cmdline->buf + cmdline->end + 1, str, len);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	cmdline->buf[cmdline->end] = ' ';
+	cmdline->end += len + 1;
+	return EFI_SUCCESS;
+}
+
+struct writer {
+	CHAR8 *buf;
+	UINTN size;
+	UINTN len;
+};
+
+static void writer_put(struct writer *w, const CHAR8 *str, UINTN len)
+{
+	if (w->buf && w->len + len < w->size)
+		memcpy(w->buf + w->len, str, len);
+	w->len += len;
+}
+
+static EFI_STATUS writer_end(struct writer *w, UINTN *size)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+
+	if (!w->buf || w->len + 1 > w->size)
+		ret = EFI_BUFFER_TOO_SMALL;
+	else
+		w->buf[w->len] = '\0';
+
+	*size = w->len + 1;
+	return ret;
+}
+
+static BOOLEAN is_separator(CHAR8 c)
+{
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+/* Return TRUE if one of the parameters between CUR and END has the
+   KEY_LEN characters long KEY. */
+static BOOLEAN has_key(const CHAR8 *cur, const CHAR8 *end,
+		       const CHAR8 *key, UINTN key_len)
+{
+	const CHAR8 *token;
+	BOOLEAN quoted;
+
+	while (cur < end) {
+		while (cur < end && is_separator(*cur))
+			cur++;
+
+		token = cur;
+		for (quoted = FALSE; cur < end && (quoted || !is_separator(*cur)); cur++)
+			if (*cur == '"')
+				quoted = !quoted;
+
+		if ((UINTN)(cur - token) >= key_len &&
+		    !memcmp(token, key, key_len) &&
+		    (token + key_len == cur || token[key_len] == '='))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Write the parameters of CMDLINE to KW or, for the androidboot.*
+   parameters, to BW if BW is not NULL. */
+static void write_out(struct cmdline *cmdline, struct writer *kw,
+		      struct writer *bw)
+{
+	static const UINTN prefix_len = sizeof(ANDROIDBOOT_PREFIX) - 1;
+	struct {
+		const CHAR8 *str;
+		UINTN len;
+	} keys[CMDLINE_MAX_KEYS];
+	UINTN nb_keys = 0, token_len, key_len, i;
+	CHAR8 *cur, *end, *space, *token;
+	BOOLEAN quoted;
+
+	cur = cmdline->buf + cmdline->start;
+	end = cmdline->buf + cmdline->end;
+	while (cur < end) {
+		space = cur;
+		while (cur < end && is_separator(*cur))
+			cur++;
+		if (cur == end) {
+			if (!bw)
+				writer_put(kw, space, cur - space);
+			break;
+		}
+
+		token = cur;
+		for (quoted = FALSE; cur < end && (quoted || !is_separator(*cur)); cur++)
+			if (*cur == '"')
+				quoted = !quoted;
+		token_len = cur - token;
+
+		if (token_len > prefix_len &&
+		    !strncmp(token, (CHAR8 *)ANDROIDBOOT_PREFIX, prefix_len)) {
+			for (key_len = 0; key_len < token_len; key_len++)
+				if (token[key_len] == '=')
+					break;
+
+			/* The first occurrence of a key takes precedence */
+			for (i = 0; i < nb_keys; i++)
+				if (keys[i].len == key_len &&
+				    !memcmp(keys[i].str, token, key_len))
+					break;
+			if (i < nb_keys)
+				continue;
+
+			/* Past a full index, look at the previous
+			   parameters themselves. */
+			if (nb_keys < ARRAY_SIZE(keys)) {
+				keys[nb_keys].str = token;
+				keys[nb_keys].len = key_len;
+				nb_keys++;
+			} else if (has_key(cmdline->buf + cmdline->start, token,
+					   token, key_len))
+				continue;
+
+			if (bw) {
+				if (bw->len)
+					writer_put(bw, (CHAR8 *)"\n", 1);
+				writer_put(bw, token, token_len);
+				if (token[token_len - 1] == '=')
+					writer_put(bw, (CHAR8 *)EMPTY_VALUE,
+						   sizeof(EMPTY_VALUE) - 1);
+				continue;
+			}
+		}
+
+		if (!bw)
+			writer_put(kw, space, token - space);
+		else if (kw->len)
+			writer_put(kw, (CHAR8 *)" ", 1);
+		writer_put(kw, token, token_len);
+	}
+}
+
+EFI_STATUS cmdline_finish(struct cmdline *cmdline,
+			  CHAR8 *kernel, UINTN *kernel_size,
+			  CHAR8 *bootconfig, UINTN *bootconfig_size)
+{
+	struct writer kw = { kernel, *kernel_size, 0 };
+	struct writer bw = { bootconfig, 0, 0 };
+	EFI_STATUS ret, bret;
+
+	if (bootconfig_size)
+		bw.size = *bootconfig_size;
+
+	write_out(cmdline, &kw, bootconfig_size ? &bw : NULL);
+
+	ret = writer_end(&kw, kernel_size);
+	if (bootconfig_size) {
+		bret = writer_end(&bw, bootconfig_size);
+		if (bootconfig && EFI_ERROR(bret))
+			ret = bret;
+	}
+
+	return ret;
+}
+
+EFI_STATUS cmdline_finish_bootconfig(struct cmdline *cmdline,
+				     CHAR8 *bootconfig, UINTN *bootconfig_size)
+{
+	struct writer kw = { NULL, 0, 0 };
+	struct writer bw = { bootconfig, *bootconfig_size, 0 };
+
+	write_out(cmdline, &kw, &bw);
+	return writer_end(&bw, bootconfig_size);
+}
+
+void cmdline_free(struct cmdline *cmdline)
+{
+	if (cmdline->buf)
+		FreePool(cmdline->buf);
+	memset(cmdline, 0, sizeof(*cmdline));
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2022, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "crc32.h"
+
+/* Reflected IEEE 802.3 polynomial.  */
+#define CRC32_POLY 0xedb88320
+
+/* Slicing-by-8 tables: crc_table[0] is the classic byte-wise table,
+   crc_table[k][n] is the CRC of byte N followed by K zero bytes.  */
+static UINT32 crc_table[8][256];
+/* x2n_table[n] is x^(2^n) modulo the CRC polynomial.  */
+static UINT32 x2n_table[32];
+static BOOLEAN initialized;
+
+/* Multiply A and B modulo the CRC polynomial, in the reflected
+   representation.  */
+static UINT32 multmodp(UINT32 a, UINT32 b)
+{
+	UINT32 m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+
+	return p;
+}
+
+static void crc32_init(void)
+{
+	UINT32 crc, p;
+	UINTN i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+		crc_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		crc = crc_table[0][i];
+		for (j = 1; j < ARRAY_SIZE(crc_table); j++) {
+			crc = crc_table[0][crc & 0xff] ^ (crc >> 8);
+			crc_table[j][i] = crc;
+		}
+	}
+
+	p = 1U << 30;		/* x^1 */
+	x2n_table[0] = p;
+	for (i = 1; i < ARRAY_SIZE(x2n_table); i++)
+		x2n_table[i] = p = multmodp(p, p);
+
+	initialized = TRUE;
+}
+
+UINT32 crc32_update(UINT32 crc, const VOID *data, UINTN size)
+{
+	const UINT8 *p = data;
+	UINT32 lo, hi;
+
+	if (!initialized)
+		crc32_init();
+
+	crc = ~crc;
+
+	for (; size && ((UINTN)p & 7); size--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	for (; size >= 8; size -= 8, p += 8) {
+		lo = *(const UINT32 *)p ^ crc;
+		hi = *(const UINT32 *)(p + 4);
+		crc = crc_table[7][lo & 0xff] ^
+			crc_table[6][(lo >> 8) & 0xff] ^
+			crc_table[5][(lo >> 16) & 0xff] ^
+			crc_table[4][lo >> 24] ^
+			crc_table[3][hi & 0xff] ^
+			crc_table[2][(hi >> 8) & 0xff] ^
+			crc_table[1][(hi >> 16) & 0xff] ^
+			crc_table[0][hi >> 24];
+	}
+
+	while (size--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/* Return x^(8 * LEN) modulo the CRC polynomial.  */
+static UINT32 x8nmodp(UINT64 len)
+{
+	UINT32 p = 1U << 31;	/* x^0 */
+	UINTN k = 3;
+
+	for (; len; len >>= 1, k++)
+		if (len & 1)
+			p = multmodp(x2n_table[k & 31], p);
+
+	return p;
+}
+
+/* Return the CRC of A followed by B, B being LEN_B bytes long.  */
+static UINT32 crc32_combine(UINT32 crc_a, UINT32 crc_b, UINT64 len_b)
+{
+	return multmodp(x8nmodp(len_b), crc_a) ^ crc_b;
+}
+
+UINT32 crc32_repeat(UINT32 crc, const VOID *data, UINTN size, UINT64 count)
+{
+	UINT32 piece;
+	UINT64 len = size;
+
+	if (!count || !size)
+		return crc;
+
+	piece = crc32_update(0, data, size);
+	for (;;) {
+		if (count & 1)
+			crc = crc32_combine(crc, piece, len);
+		count >>= 1;
+		if (!count)
+			break;
+		piece = crc32_combine(piece, piece, len);
+		len <<= 1;
+	}
+
+	return crc;
+}
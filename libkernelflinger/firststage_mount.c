@@ -42,23 +42,6 @@
 #include "storage.h"
 
 #ifdef AUTO_DISKBUS
-static CHAR8 csum(void *base, UINTN n)
-{
-	CHAR8 *p;
-	CHAR8 sum;
-	UINTN bytesDone;
-
-	p = (CHAR8 *)base;
-
-	sum = 0;
-	for (bytesDone = 0; bytesDone < n; bytesDone++) {
-		sum += *p;
-		p++;
-	}
-
-	return sum;
-}
-
 EFI_STATUS revise_diskbus_from_ssdt(CHAR8 *ssdt, UINTN ssdt_len)
 {
 	const CHAR8 *pattern = (CHAR8 *)"/0000:00:ff.ff/";
@@ -113,7 +96,7 @@ EFI_STATUS revise_diskbus_from_ssdt(CHAR8 *ssdt, UINTN ssdt_len)
 	/* Update the header information. */
 	header = (struct ACPI_DESC_HEADER *)ssdt;
 	header->checksum = 0;
-	header->checksum = ~csum((void *)ssdt, ssdt_len) + 1;
+	header->checksum = ~(UINT8)sum_bytes(ssdt, ssdt_len) + 1;
 
 	return EFI_SUCCESS;
 }
@@ -35,6 +35,8 @@
 #include <efi.h>
 #include <efilib.h>
 #include <lib.h>
+#include <crc32.h>
+#include "block_cache.h"
 #include "uefi_utils.h"
 #include "gpt.h"
 #include "gpt_bin.h"
@@ -96,12 +98,8 @@ static struct gpt_disk sdisk;
 
 static EFI_STATUS calculate_crc32(void *data, UINTN size, UINT32 *crc)
 {
-	EFI_STATUS ret;
-
-	ret = uefi_call_wrapper(BS->CalculateCrc32, 3, data, size, crc);
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"CalculateCrc32 failed");
-	return ret;
+	*crc = crc32_update(0, data, size);
+	return EFI_SUCCESS;
 }
 
 static EFI_STATUS set_header_crc32(struct gpt_header *gh)
@@ -120,9 +118,8 @@ static EFI_STATUS read_gpt_header(struct gpt_disk *disk, UINT64 offset)
 	EFI_STATUS ret;
 	UINT32 saved_crc, crc;
 
-	ret = uefi_call_wrapper(disk->dio->ReadDisk, 5, disk->dio,
-				disk->bio->Media->MediaId,
-				offset, sizeof(disk->gpt_hd), (VOID *)&disk->gpt_hd);
+	ret = block_cache_read(disk->bio, disk->dio, offset,
+			       sizeof(disk->gpt_hd), (VOID *)&disk->gpt_hd);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to read disk for GPT header at %lld",
 			   offset);
@@ -173,7 +170,7 @@ static EFI_STATUS read_gpt_partitions(struct gpt_disk *disk)
 	offset = disk->bio->Media->BlockSize * disk->gpt_hd.entries_lba;
 	size = ((UINTN)disk->gpt_hd.number_of_entries) * disk->gpt_hd.size_of_entry;
 
-	ret = uefi_call_wrapper(disk->dio->ReadDisk, 5, disk->dio, disk->bio->Media->MediaId, offset, size, disk->partitions);
+	ret = block_cache_read(disk->bio, disk->dio, offset, size, disk->partitions);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to read GPT partitions");
 		return ret;
@@ -326,7 +323,11 @@ EFI_STATUS gpt_sync(void)
 	return ret;
 }
 
-EFI_STATUS gpt_refresh(void)
+/* Reinstall the block io interface of the cached disk so that the
+ * partition and file system drivers pick up the new content.  This
+ * reconnects the disk io driver: the disk io interface is fetched
+ * again, the rest of the cache is left untouched. */
+static EFI_STATUS gpt_reinstall(void)
 {
 	EFI_STATUS ret;
 
@@ -343,6 +344,24 @@ EFI_STATUS gpt_refresh(void)
 		efi_perror(ret, L"Failed to Reinstall block io interface on System disk");
 		return ret;
 	}
+
+	ret = uefi_call_wrapper(BS->HandleProtocol, 3, sdisk.handle, &DiskIoProtocol, (VOID *)&sdisk.dio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get disk io protocol");
+		gpt_free_cache();
+	}
+
+	return ret;
+}
+
+EFI_STATUS gpt_refresh(void)
+{
+	EFI_STATUS ret;
+
+	ret = gpt_reinstall();
+	if (EFI_ERROR(ret))
+		return ret;
+
 	/* invalid gpt cache to force to get new handle next time */
 	gpt_free_cache();
 
@@ -701,6 +720,7 @@ static EFI_STATUS gpt_write_mbr(void)
 
 	ret = uefi_call_wrapper(sdisk.dio->WriteDisk, 5, sdisk.dio, sdisk.bio->Media->MediaId,
 				440, sizeof(struct mbr), &mbr);
+	block_cache_invalidate(sdisk.bio, 440, sizeof(struct mbr));
 	if (EFI_ERROR(ret))
 		error(L"Couldn't write MBR");
 
@@ -716,18 +736,22 @@ static EFI_STATUS gpt_write_table_to_disk(struct gpt_header *gh)
 	header_offset = gh->my_lba * sdisk.bio->Media->BlockSize;
 	entries_offset = gh->entries_lba * sdisk.bio->Media->BlockSize;
 
+	/* The entries are written first so that the header CRC never
+	   covers a partially written entries array.  */
 	ret = uefi_call_wrapper(sdisk.dio->WriteDisk, 5, sdisk.dio, sdisk.bio->Media->MediaId,
-				header_offset, sizeof(struct gpt_header), gh);
+				entries_offset, entries_size,
+				sdisk.partitions);
+	block_cache_invalidate(sdisk.bio, entries_offset, entries_size);
 	if (EFI_ERROR(ret)) {
-		error(L"Couldn't write GPT header");
+		error(L"Couldn't write GPT entries array");
 		return ret;
 	}
 
 	ret = uefi_call_wrapper(sdisk.dio->WriteDisk, 5, sdisk.dio, sdisk.bio->Media->MediaId,
-				entries_offset, entries_size,
-				sdisk.partitions);
+				header_offset, sizeof(struct gpt_header), gh);
+	block_cache_invalidate(sdisk.bio, header_offset, sizeof(struct gpt_header));
 	if (EFI_ERROR(ret))
-		error(L"Couldn't write GPT entries array");
+		error(L"Couldn't write GPT header");
 
 	return ret;
 }
@@ -757,13 +781,6 @@ static EFI_STATUS gpt_write_partition_tables(void)
 	if (EFI_ERROR(ret))
 		return ret;
 
-	debug(L"Write first GPT Header at %d", gh->my_lba);
-	ret = gpt_write_table_to_disk(gh);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to write primary GPT header");
-		return ret;
-	}
-
 	gh_backup = AllocatePool(sizeof(struct gpt_header));
 	if (!gh_backup) {
 		error(L"Cannot allocate alternate GPT header");
@@ -777,9 +794,15 @@ static EFI_STATUS gpt_write_partition_tables(void)
 	gh_backup->entries_lba = gh_backup->my_lba - entries_size / sdisk.bio->Media->BlockSize;
 
 	ret = set_header_crc32(gh_backup);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
+		FreePool(gh_backup);
 		return ret;
+	}
 
+	/* The alternate table is written and flushed before the
+	   primary one: if the update is interrupted, the primary
+	   table is either the old one or invalid, in which case the
+	   already updated alternate table is used.  */
 	debug(L"Write alternate GPT Header at %d", gh_backup->my_lba);
 	ret = gpt_write_table_to_disk(gh_backup);
 	FreePool(gh_backup);
@@ -787,12 +810,26 @@ static EFI_STATUS gpt_write_partition_tables(void)
 		efi_perror(ret, L"Failed to write alternate GPT header");
 		return ret;
 	}
+
+	ret = gpt_sync();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	debug(L"Write first GPT Header at %d", gh->my_lba);
+	ret = gpt_write_table_to_disk(gh);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to write primary GPT header");
+		return ret;
+	}
+
 	debug(L"Write protective MBR");
 	ret = gpt_write_mbr();
 	if (EFI_ERROR(ret))
 		return ret;
 
-	return gpt_refresh();
+	/* The cache matches what has just been written, only the
+	   drivers need to be notified.  */
+	return gpt_reinstall();
 }
 
 EFI_STATUS gpt_create(struct gpt_header *gh, UINTN gh_size,
@@ -1061,8 +1098,7 @@ EFI_STATUS read_partition(struct gpt_partition_interface *gparti, INT64 offset,
 		return EFI_END_OF_MEDIA;
 	}
 
-	ret = gparti->dio->ReadDisk(gparti->dio, gparti->bio->Media->MediaId,
-		partoffset + offset, len, data);
+	ret = block_cache_read(gparti->bio, gparti->dio, partoffset + offset, len, data);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"read partition %s failed", gparti->part.name);
 
@@ -68,6 +68,7 @@
 
 #include "lib.h"
 #include "vars.h"
+#include "misc_cache.h"
 
 
 EFI_HANDLE g_parent_image;
@@ -1301,6 +1302,7 @@ VOID pause(UINTN seconds)
 
 VOID halt_system(VOID)
 {
+        misc_cache_flush();
         uefi_call_wrapper(RT->ResetSystem, 4, EfiResetShutdown, EFI_SUCCESS,
                           0, NULL);
         error(L"Failed to halt the device ... looping forever");
@@ -1312,6 +1314,8 @@ VOID reboot(CHAR16 *target, EFI_RESET_TYPE type)
 {
         EFI_STATUS ret;
 
+        misc_cache_flush();
+
         if (target) {
                 ret = set_efi_variable_str(&loader_guid, LOADER_ENTRY_ONESHOT,
                                            TRUE, TRUE, target);
@@ -1419,6 +1423,37 @@ EFI_STATUS memcpy_s(void *dest, size_t dest_size, const void *source, size_t cou
         return EFI_SUCCESS;
 }
 
+UINT32 sum_bytes(const VOID *data, UINTN size)
+{
+        const UINT64 mask = 0x00FF00FF00FF00FFULL;
+        const UINT8 *p = data;
+        UINT32 sum = 0;
+        UINTN words;
+        UINT64 lanes;
+        UINT64 word;
+
+        /* Add the bytes eight at a time in the 16-bit lanes of a
+         * 64-bit word: a lane gets at most 2 * 255 per word so 128
+         * words can be added before the lanes have to be folded. */
+        while (size >= sizeof(word)) {
+                words = min(size / sizeof(word), (UINTN)128);
+                size -= words * sizeof(word);
+
+                for (lanes = 0; words; words--, p += sizeof(word)) {
+                        __builtin_memcpy(&word, p, sizeof(word));
+                        lanes += (word & mask) + ((word >> 8) & mask);
+                }
+                lanes = (lanes & 0x0000FFFF0000FFFFULL) +
+                        ((lanes >> 16) & 0x0000FFFF0000FFFFULL);
+                sum += (UINT32)lanes + (UINT32)(lanes >> 32);
+        }
+
+        while (size--)
+                sum += *p++;
+
+        return sum;
+}
+
 void *memmove(void *dst, const void *src, size_t n)
 {
         size_t offs;
@@ -1542,14 +1577,14 @@ VOID cpuid(UINT32 op, UINT32 reg[4])
                      "cpuid\n\t"
                      "xchg{q}\t{%%}rbx, %q1\n\t"
                      : "=a" (reg[0]), "=&r" (reg[1]), "=c" (reg[2]), "=d" (reg[3])
-                     : "a" (op));
+                     : "a" (op), "c" (0));
 #else
         asm volatile("pushl %%ebx      \n\t" /* save %ebx */
                      "cpuid            \n\t"
                      "movl %%ebx, %1   \n\t" /* save what cpuid just put in %ebx */
                      "popl %%ebx       \n\t" /* restore the old %ebx */
                      : "=a"(reg[0]), "=r"(reg[1]), "=c"(reg[2]), "=d"(reg[3])
-                     : "a"(op)
+                     : "a"(op), "c"(0)
                      : "cc");
 #endif
 }
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2022, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "vars.h"
+#include "gpt.h"
+#include "android.h"
+#include "misc_cache.h"
+#include "block_cache.h"
+
+#if (__STDC_VERSION__ >= 201112L)
+_Static_assert(sizeof(struct bootloader_message_ab) == MISC_CACHE_SIZE,
+	       "MISC_CACHE_SIZE does not match struct bootloader_message_ab");
+#endif
+
+static UINT8 cache[MISC_CACHE_SIZE];
+static BOOLEAN loaded;
+static BOOLEAN deferred;
+/* Modified bytes not written back yet: [dirty_start, dirty_end[ */
+static UINTN dirty_start, dirty_end;
+
+static EFI_STATUS get_misc(struct gpt_partition_interface *gparti)
+{
+	EFI_STATUS ret;
+	UINT64 size;
+
+	ret = gpt_get_partition_by_label(MISC_LABEL, gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	size = (gparti->part.ending_lba + 1 - gparti->part.starting_lba) *
+		gparti->bio->Media->BlockSize;
+	if (gparti->part.ending_lba < gparti->part.starting_lba ||
+	    size < sizeof(cache)) {
+		error(L"%s partition is too small", MISC_LABEL);
+		return EFI_COMPROMISED_DATA;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS load(void)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+
+	if (loaded)
+		return EFI_SUCCESS;
+
+	ret = get_misc(&gparti);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	debug(L"Reading %s", MISC_LABEL);
+	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+				gparti.bio->Media->MediaId,
+				gparti.part.starting_lba * gparti.bio->Media->BlockSize,
+				sizeof(cache), cache);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read %s", MISC_LABEL);
+		return ret;
+	}
+
+	loaded = TRUE;
+	dirty_start = dirty_end = 0;
+
+	return EFI_SUCCESS;
+}
+
+static BOOLEAN in_range(UINTN offset, UINTN size)
+{
+	return offset <= sizeof(cache) && size <= sizeof(cache) - offset;
+}
+
+EFI_STATUS misc_cache_read(UINTN offset, VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+
+	if (!data || !in_range(offset, size))
+		return EFI_INVALID_PARAMETER;
+
+	ret = load();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memcpy(data, cache + offset, size);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS misc_cache_flush(void)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+	UINT64 offset;
+
+	if (dirty_start == dirty_end)
+		return EFI_SUCCESS;
+
+	ret = get_misc(&gparti);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize + dirty_start;
+	debug(L"Writing %s [%d, %d[", MISC_LABEL, dirty_start, dirty_end);
+	ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio,
+				gparti.bio->Media->MediaId, offset,
+				dirty_end - dirty_start, cache + dirty_start);
+	block_cache_invalidate(gparti.bio, offset, dirty_end - dirty_start);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to write %s", MISC_LABEL);
+		return ret;
+	}
+
+	dirty_start = dirty_end = 0;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS misc_cache_write(UINTN offset, const VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+
+	if (!data || !in_range(offset, size))
+		return EFI_INVALID_PARAMETER;
+
+	ret = load();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!memcmp(cache + offset, data, size))
+		return EFI_SUCCESS;
+
+	memcpy(cache + offset, data, size);
+	if (dirty_start == dirty_end) {
+		dirty_start = offset;
+		dirty_end = offset + size;
+	} else {
+		dirty_start = min(dirty_start, offset);
+		dirty_end = max(dirty_end, offset + size);
+	}
+
+	/* Only the bootloader message is coalesced, the A/B metadata
+	   (tries remaining, successful boot...) must reach the disk
+	   as soon as the slot selection has been made. */
+	if (deferred && offset + size <= sizeof(struct bootloader_message))
+		return EFI_SUCCESS;
+
+	return misc_cache_flush();
+}
+
+EFI_STATUS misc_cache_defer(BOOLEAN defer)
+{
+	deferred = defer;
+	return defer ? EFI_SUCCESS : misc_cache_flush();
+}
+
+void misc_cache_invalidate(void)
+{
+	if (dirty_start != dirty_end)
+		debug(L"Dropping pending %s changes", MISC_LABEL);
+
+	loaded = FALSE;
+	dirty_start = dirty_end = 0;
+}
@@ -41,10 +41,14 @@
 #define NVME_GENERIC_TIMEOUT                  (EFI_TIMER_PERIOD_SECONDS(5))
 #define NVME_MAX_WRITE_ZEROS_BLOCKS           0x10000
 
+#define NVME_CTRL_ONCS_DSM                    (1 << 2)
 #define NVME_CTRL_ONCS_WRITE_ZEROES           (1 << 3)
 
 #define NVME_RW_FUA               (1 << 14)
 #define NVME_CMD_WRITE_ZEROS      0x08
+#define NVME_CMD_DSM              0x09
+#define NVME_DSM_DEALLOCATE       (1 << 2)
+#define NVME_DSM_MAX_RANGES       256
 #define NVME_CONTROLLER_ID        0
 
 #define MSG_NVME_NAMESPACE_DP     0x17
@@ -57,6 +61,23 @@ typedef struct {
 	UINT64                          NamespaceUuid;
 } NVME_NAMESPACE_DEVICE_PATH;
 
+typedef struct {
+	UINT32                          Attributes;
+	UINT32                          Blocks;
+	UINT64                          Lba;
+} NVME_DSM_RANGE;
+
+/* NVMe pass-thru access to a namespace, resolved once per block
+ * device handle. */
+static struct {
+	EFI_HANDLE                         Handle;
+	EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru;
+	UINT32                             NamespaceId;
+	UINT16                             Oncs;
+} nvme_dev;
+
+static NVME_DSM_RANGE dsm_ranges[NVME_DSM_MAX_RANGES] __attribute__((aligned(4096)));
+
 
 EFI_STATUS get_nvme_passthru(EFI_DEVICE_PATH *FilePath, VOID **Interface)
 {
@@ -87,7 +108,7 @@ static NVME_NAMESPACE_DEVICE_PATH *get_nvme_device_path(EFI_DEVICE_PATH *p)
 	return NULL;
 }
 
-static BOOLEAN is_nvme_supported_write_zeros(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru)
+static EFI_STATUS get_nvme_oncs(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru, UINT16 *Oncs)
 {
 	NVME_ADMIN_CONTROLLER_DATA CtrlData;
 
@@ -120,12 +141,45 @@ static BOOLEAN is_nvme_supported_write_zeros(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL
 
 	Status = NvmePassthru->PassThru(NvmePassthru, NVME_CONTROLLER_ID, &CommandPacket, NULL);
 	if (EFI_ERROR(Status))
-		return FALSE;
+		return Status;
+
+	*Oncs = CtrlData.Oncs;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS get_nvme_dev(EFI_HANDLE handle)
+{
+	NVME_NAMESPACE_DEVICE_PATH *nvme_dp;
+	EFI_DEVICE_PATH *dp;
+	EFI_STATUS ret;
+
+	if (nvme_dev.Handle && nvme_dev.Handle == handle)
+		return EFI_SUCCESS;
+
+	nvme_dev.Handle = NULL;
+	dp = DevicePathFromHandle(handle);
+	if (!dp) {
+		error(L"Failed to get device path from handle");
+		return EFI_INVALID_PARAMETER;
+	}
 
-	if (CtrlData.Oncs & NVME_CTRL_ONCS_WRITE_ZEROES)
-		return TRUE;
+	ret = get_nvme_passthru(dp, (VOID **) &nvme_dev.NvmePassthru);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	return FALSE;
+	ret = get_nvme_oncs(nvme_dev.NvmePassthru, &nvme_dev.Oncs);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	nvme_dp = get_nvme_device_path(dp);
+	nvme_dev.NamespaceId = 0;
+	ret = nvme_dev.NvmePassthru->GetNamespace(nvme_dev.NvmePassthru,
+						  (EFI_DEVICE_PATH_PROTOCOL *)nvme_dp,
+						  &nvme_dev.NamespaceId);
+	debug(L"GetNamespace() ret=%d, NamespaceId=%d", ret, nvme_dev.NamespaceId);
+
+	nvme_dev.Handle = handle;
+	return EFI_SUCCESS;
 }
 
 EFI_STATUS nvme_erase_blocks_impl(
@@ -181,11 +235,7 @@ static EFI_STATUS nvme_erase_blocks(
 	EFI_LBA end
 )
 {
-	EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru;
-	NVME_NAMESPACE_DEVICE_PATH *nvme_dp;
-	EFI_DEVICE_PATH *dp;
 	EFI_STATUS ret;
-	UINT32 NamespaceId = 0;
 	UINT32 num;
 	EFI_LBA blk;
 
@@ -197,30 +247,20 @@ static EFI_STATUS nvme_erase_blocks(
 		return EFI_UNSUPPORTED;
 
 	debug(L"nvme_erase_blocks: 0x%X blocks", end - start + 1);
-	dp = DevicePathFromHandle(handle);
-	if (!dp) {
-		error(L"Failed to get device path from handle");
-		return EFI_INVALID_PARAMETER;
-	}
-
-	ret = get_nvme_passthru(dp, (VOID **) &NvmePassthru);
+	ret = get_nvme_dev(handle);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	if (!is_nvme_supported_write_zeros(NvmePassthru))
+	if (!(nvme_dev.Oncs & NVME_CTRL_ONCS_WRITE_ZEROES))
 		return EFI_UNSUPPORTED;
 
-	nvme_dp = get_nvme_device_path(dp);
-	ret = NvmePassthru->GetNamespace(NvmePassthru, (EFI_DEVICE_PATH_PROTOCOL *)nvme_dp, &NamespaceId);
-	debug(L"GetNamespace() ret=%d, NamespaceId=%d", ret, NamespaceId);
-
-	for (blk = start;  blk < end; ) {
-		if (end - blk >= NVME_MAX_WRITE_ZEROS_BLOCKS)
+	for (blk = start;  blk <= end; ) {
+		if (end - blk + 1 >= NVME_MAX_WRITE_ZEROS_BLOCKS)
 			num = NVME_MAX_WRITE_ZEROS_BLOCKS;
 		else
-			num = end - blk;
+			num = end - blk + 1;
 
-		ret = nvme_erase_blocks_impl(NvmePassthru, NamespaceId, blk, num);
+		ret = nvme_erase_blocks_impl(nvme_dev.NvmePassthru, nvme_dev.NamespaceId, blk, num);
 		if (EFI_ERROR(ret))
 			return EFI_UNSUPPORTED;
 
@@ -230,6 +270,96 @@ static EFI_STATUS nvme_erase_blocks(
 	return ret;
 }
 
+static EFI_STATUS nvme_dsm_deallocate(UINTN count)
+{
+	EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET CommandPacket;
+	EFI_NVM_EXPRESS_COMMAND                  Command;
+	EFI_NVM_EXPRESS_COMPLETION               Completion;
+	EFI_STATUS                               Status;
+
+	ZeroMem(&CommandPacket, sizeof(EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET));
+	ZeroMem(&Command, sizeof(EFI_NVM_EXPRESS_COMMAND));
+	ZeroMem(&Completion, sizeof(EFI_NVM_EXPRESS_COMPLETION));
+
+	CommandPacket.NvmeCmd        = &Command;
+	CommandPacket.NvmeCompletion = &Completion;
+
+	CommandPacket.NvmeCmd->Cdw0.Opcode = NVME_CMD_DSM;
+	CommandPacket.NvmeCmd->Nsid  = nvme_dev.NamespaceId;
+
+	CommandPacket.TransferBuffer = (VOID *)dsm_ranges;
+	CommandPacket.TransferLength = count * sizeof(*dsm_ranges);
+
+	CommandPacket.CommandTimeout = NVME_GENERIC_TIMEOUT;
+	CommandPacket.QueueType      = NVME_IO_QUEUE;
+
+	/* Number of ranges is 0's based */
+	CommandPacket.NvmeCmd->Cdw10 = count - 1;
+	CommandPacket.NvmeCmd->Cdw11 = NVME_DSM_DEALLOCATE;
+
+	CommandPacket.NvmeCmd->Flags = CDW10_VALID | CDW11_VALID;
+
+	Status = nvme_dev.NvmePassthru->PassThru(nvme_dev.NvmePassthru, nvme_dev.NamespaceId,
+						 &CommandPacket, NULL);
+	if (EFI_ERROR(Status)) {
+		debug(L"NvmePassthru(NVME_CMD_DSM) failed, ret = %d", Status);
+		nvme_dev.Handle = NULL;
+	}
+
+	return Status;
+}
+
+/* Unlike nvme_erase_blocks(), this is used on UEFI platforms too:
+ * deallocation is only a hint, the content of the discarded blocks
+ * is never relied upon and a failure just leaves them allocated. */
+static EFI_STATUS nvme_discard_ranges(
+	EFI_HANDLE handle,
+	ATTR_UNUSED EFI_BLOCK_IO *bio,
+	struct discard_range *ranges,
+	UINTN count
+)
+{
+	EFI_STATUS ret;
+	UINTN i, n = 0;
+	UINT64 left;
+	UINT32 num;
+	EFI_LBA blk;
+
+	ret = get_nvme_dev(handle);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!(nvme_dev.Oncs & NVME_CTRL_ONCS_DSM))
+		return EFI_UNSUPPORTED;
+
+	for (i = 0; i < count; i++) {
+		blk = ranges[i].start;
+		left = ranges[i].end - ranges[i].start + 1;
+		while (left) {
+			num = min(left, (UINT64)0xffffffff);
+			dsm_ranges[n].Attributes = 0;
+			dsm_ranges[n].Blocks = num;
+			dsm_ranges[n].Lba = blk;
+			n++;
+			blk += num;
+			left -= num;
+
+			if (n < NVME_DSM_MAX_RANGES)
+				continue;
+
+			ret = nvme_dsm_deallocate(n);
+			if (EFI_ERROR(ret))
+				return ret;
+			n = 0;
+		}
+	}
+
+	if (n)
+		return nvme_dsm_deallocate(n);
+
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS nvme_check_logical_unit(ATTR_UNUSED EFI_DEVICE_PATH *p, logical_unit_t log_unit)
 {
 	return log_unit == LOGICAL_UNIT_USER ? EFI_SUCCESS : EFI_UNSUPPORTED;
@@ -242,6 +372,7 @@ static BOOLEAN is_nvme(EFI_DEVICE_PATH *p)
 
 struct storage STORAGE(STORAGE_NVME) = {
 	.erase_blocks = nvme_erase_blocks,
+	.discard_ranges = nvme_discard_ranges,
 	.check_logical_unit = nvme_check_logical_unit,
 	.probe = is_nvme,
 	.name = L"NVME"
@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2022, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "gpt.h"
+#include "uefi_utils.h"
+#include "prefetch.h"
+#include "android.h"
+#include "protocol/BlockIo2.h"
+#include "libavb/libavb.h"
+
+#define MAX_ENTRIES		16
+/* Upper bound of the memory used by the prefetched images.  */
+#define MAX_TOTAL_SIZE		(256 * 1024 * 1024)
+#define VBMETA_MAX_SIZE		(64 * 1024)
+
+/* Entries are never moved: the device keeps a pointer to the token
+   of a pending read.  Unused entries have no data. */
+static struct prefetch_entry {
+	CHAR16 label[GPT_NAME_LEN];
+	UINT64 size;		/* Bytes available from the start of
+				   the partition. */
+	UINT64 end;		/* End of the image, the buffer is
+				   released once it has been read. */
+	VOID *buffer;		/* Pool allocation, NULL if DATA is a
+				   planned image owned by android.c */
+	VOID *data;		/* BUFFER aligned on the IoAlign boundary
+				   or the planned image */
+	EFI_BLOCK_IO2_TOKEN token;
+	BOOLEAN pending;	/* Read not completed yet */
+} entries[MAX_ENTRIES];
+static UINT64 total_size;
+
+static EFI_GUID block_io2_guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
+
+static struct prefetch_entry *find_entry(const CHAR16 *label)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++)
+		if (entries[i].data && !StrCmp(entries[i].label, label))
+			return &entries[i];
+
+	return NULL;
+}
+
+static EFI_STATUS wait_entry(struct prefetch_entry *entry)
+{
+	EFI_STATUS ret;
+	UINTN index;
+
+	if (!entry->pending)
+		return entry->token.TransactionStatus;
+
+	ret = uefi_call_wrapper(BS->WaitForEvent, 3, 1, &entry->token.Event, &index);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to wait for %s read", entry->label);
+		return ret;
+	}
+
+	uefi_call_wrapper(BS->CloseEvent, 1, entry->token.Event);
+	entry->token.Event = NULL;
+	entry->pending = FALSE;
+
+	if (EFI_ERROR(entry->token.TransactionStatus))
+		efi_perror(entry->token.TransactionStatus,
+			   L"Failed to prefetch %s", entry->label);
+
+	return entry->token.TransactionStatus;
+}
+
+static void free_entry(struct prefetch_entry *entry)
+{
+	if (entry->pending)
+		wait_entry(entry);
+
+	/* The buffer cannot be released while the device might
+	   still write into it. */
+	if (entry->pending) {
+		error(L"Leaking the %s prefetch buffer", entry->label);
+		return;
+	}
+
+	total_size -= entry->size;
+	if (entry->buffer)
+		FreePool(entry->buffer);
+	entry->buffer = entry->data = NULL;
+}
+
+/* Reserve an entry for SIZE bytes of partition LABEL, read into the
+   PLANNED image if not NULL or into a new buffer otherwise.  */
+static struct prefetch_entry *new_entry(const CHAR16 *label, UINT64 size,
+					UINTN align, VOID *planned)
+{
+	struct prefetch_entry *entry = NULL;
+	UINTN i;
+
+	if (total_size + size > MAX_TOTAL_SIZE)
+		return NULL;
+
+	for (i = 0; i < ARRAY_SIZE(entries) && !entry; i++)
+		if (!entries[i].data)
+			entry = &entries[i];
+	if (!entry)
+		return NULL;
+
+	memset(entry, 0, sizeof(*entry));
+	StrNCpy(entry->label, label, ARRAY_SIZE(entry->label) - 1);
+
+	if (planned) {
+		entry->data = planned;
+	} else {
+		/* Not AllocateZeroPool(), the whole buffer is about to
+		   be overwritten.  */
+		entry->buffer = AllocatePool(size + align);
+		if (!entry->buffer)
+			return NULL;
+		entry->data = (VOID *)ALIGN((UINTN)entry->buffer, max(align, (UINTN)1));
+	}
+	entry->size = entry->end = size;
+	total_size += size;
+
+	return entry;
+}
+
+/* Plan the location of partition LABEL if it is a boot or
+   vendor_boot image so that it is read where it is used at boot
+   rather than copied there.  The header it is planned from is read
+   synchronously.  */
+static VOID *plan_image(struct gpt_partition_interface *gparti,
+			const CHAR16 *label, UINT64 size)
+{
+	CHAR8 name[GPT_NAME_LEN];
+	UINT32 align = gparti->bio->Media->IoAlign;
+	VOID *header, *data = NULL;
+
+	if (size < ANDROID_IMAGE_PLAN_HEADER_SIZE ||
+	    EFI_ERROR(str_to_stra(name, label, ARRAY_SIZE(name))) ||
+	    !android_image_plannable((char *)name))
+		return NULL;
+
+	header = AllocatePool(ANDROID_IMAGE_PLAN_HEADER_SIZE);
+	if (!header)
+		return NULL;
+
+	if (!EFI_ERROR(read_partition(gparti, 0, ANDROID_IMAGE_PLAN_HEADER_SIZE, header)))
+		data = android_image_plan((char *)name, header,
+					  ANDROID_IMAGE_PLAN_HEADER_SIZE, size);
+	FreePool(header);
+
+	if (data && align > 1 && (UINTN)data % align) {
+		android_image_plan_free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+EFI_STATUS prefetch_partition_interface(struct gpt_partition_interface *gparti,
+					const CHAR16 *label, UINT64 size)
+{
+	EFI_STATUS ret;
+	EFI_BLOCK_IO2_PROTOCOL *bio2;
+	struct prefetch_entry *entry;
+	UINT32 block_size;
+	UINT64 part_size, read_size;
+	VOID *planned;
+
+	if (find_entry(label))
+		return EFI_SUCCESS;
+
+	ret = uefi_call_wrapper(BS->HandleProtocol, 3, gparti->handle,
+				&block_io2_guid, (VOID **)&bio2);
+	if (EFI_ERROR(ret))
+		return EFI_UNSUPPORTED;
+
+	block_size = gparti->bio->Media->BlockSize;
+	part_size = (gparti->part.ending_lba + 1 - gparti->part.starting_lba) * block_size;
+	if (!size || size > part_size)
+		return EFI_SUCCESS;
+
+	/* The planned image must hold the whole blocks read.  */
+	read_size = min(ALIGN(size, block_size), part_size);
+	planned = plan_image(gparti, label, read_size);
+	entry = new_entry(label, read_size, gparti->bio->Media->IoAlign, planned);
+	if (!entry) {
+		if (planned)
+			android_image_plan_free(planned);
+		return EFI_OUT_OF_RESOURCES;
+	}
+	entry->end = size;
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+				&entry->token.Event);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = uefi_call_wrapper(bio2->ReadBlocksEx, 6, bio2, gparti->bio->Media->MediaId,
+				gparti->part.starting_lba, &entry->token, entry->size,
+				entry->data);
+	if (EFI_ERROR(ret)) {
+		uefi_call_wrapper(BS->CloseEvent, 1, entry->token.Event);
+		goto err;
+	}
+
+	entry->pending = TRUE;
+	debug(L"Prefetching %ld bytes of %s%s", size, label,
+	      planned ? L" in place" : L"");
+	return EFI_SUCCESS;
+
+err:
+	free_entry(entry);
+	if (planned)
+		android_image_plan_free(planned);
+	return ret;
+}
+
+/* Queue a read of the first SIZE bytes of partition LABEL.  */
+static EFI_STATUS prefetch_partition(const CHAR16 *label, UINT64 size)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+
+	if (find_entry(label))
+		return EFI_SUCCESS;
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return prefetch_partition_interface(&gparti, label, size);
+}
+
+struct prefetch_ctx {
+	const char *suffix;
+	EFI_STATUS ret;
+};
+
+static bool prefetch_descriptor(const AvbDescriptor *descriptor, void *user_data)
+{
+	struct prefetch_ctx *slot = user_data;
+	AvbDescriptor desc;
+	AvbHashDescriptor hash_desc;
+	CHAR16 label[GPT_NAME_LEN];
+	const uint8_t *name;
+	UINTN i, j;
+
+	if (!avb_descriptor_validate_and_byteswap(descriptor, &desc) ||
+	    desc.tag != AVB_DESCRIPTOR_TAG_HASH)
+		return TRUE;
+
+	if (!avb_hash_descriptor_validate_and_byteswap((const AvbHashDescriptor *)descriptor,
+						       &hash_desc))
+		return TRUE;
+
+	if (hash_desc.partition_name_len + strlen((CHAR8 *)slot->suffix) >= ARRAY_SIZE(label))
+		return TRUE;
+
+	name = (const uint8_t *)descriptor + sizeof(AvbHashDescriptor);
+	for (i = 0; i < hash_desc.partition_name_len; i++)
+		label[i] = name[i];
+	for (j = 0; slot->suffix[j]; j++)
+		label[i + j] = slot->suffix[j];
+	label[i + j] = '\0';
+
+	/* Partitions without slot are looked up without suffix. */
+	slot->ret = prefetch_partition(label, hash_desc.image_size);
+	if (slot->ret == EFI_NOT_FOUND && j) {
+		label[i] = '\0';
+		slot->ret = prefetch_partition(label, hash_desc.image_size);
+	}
+
+	/* No need to go any further if the disk does not support
+	   asynchronous reads or if there is no memory left.  */
+	return slot->ret != EFI_UNSUPPORTED && slot->ret != EFI_OUT_OF_RESOURCES;
+}
+
+EFI_STATUS prefetch_boot_images(const char *slot_suffix)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+	struct prefetch_entry *entry;
+	struct prefetch_ctx slot = { .suffix = slot_suffix ? slot_suffix : "",
+				  .ret = EFI_SUCCESS };
+	CHAR16 label[GPT_NAME_LEN];
+	UINT64 size;
+
+	SPrint(label, sizeof(label), L"vbmeta%a", slot.suffix);
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	size = (gparti.part.ending_lba + 1 - gparti.part.starting_lba) *
+		gparti.bio->Media->BlockSize;
+	size = min(size, (UINT64)VBMETA_MAX_SIZE);
+
+	/* The vbmeta image is read synchronously, it is needed first
+	   anyway.  Keeping it saves libavb another read.  */
+	entry = new_entry(label, size, 0, NULL);
+	if (!entry)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = read_partition(&gparti, 0, size, entry->data);
+	if (EFI_ERROR(ret)) {
+		free_entry(entry);
+		return ret;
+	}
+
+	if (!avb_descriptor_foreach(entry->data, size, prefetch_descriptor, &slot))
+		debug(L"Invalid %s descriptors", label);
+
+	if (slot.ret == EFI_UNSUPPORTED)
+		debug(L"Asynchronous block reads not supported, prefetching disabled");
+
+	return slot.ret;
+}
+
+EFI_STATUS prefetch_read(const CHAR16 *label, UINT64 offset, UINTN size, VOID *data)
+{
+	EFI_STATUS ret;
+	struct prefetch_entry *entry;
+
+	entry = find_entry(label);
+	if (!entry || offset > entry->size || size > entry->size - offset)
+		return EFI_NOT_FOUND;
+
+	ret = wait_entry(entry);
+	if (EFI_ERROR(ret)) {
+		free_entry(entry);
+		return EFI_NOT_FOUND;
+	}
+
+	if (data != (UINT8 *)entry->data + offset)
+		memcpy(data, (UINT8 *)entry->data + offset, size);
+
+	/* Images are read from start to end, once the end has been
+	   consumed, the buffer is not needed anymore.  */
+	if (offset + size >= entry->end)
+		free_entry(entry);
+
+	return EFI_SUCCESS;
+}
+
+VOID *prefetch_get_planned(const CHAR16 *label, UINTN size)
+{
+	struct prefetch_entry *entry;
+	VOID *data;
+
+	entry = find_entry(label);
+	if (!entry || entry->buffer)
+		return NULL;
+
+	data = entry->data;
+	if (EFI_ERROR(wait_entry(entry)) || size > entry->size)
+		data = NULL;
+
+	/* On failure, the planned image is replaced once the caller
+	   plans it again.  */
+	free_entry(entry);
+	return data;
+}
+
+void prefetch_forget(const VOID *data)
+{
+	UINTN i;
+
+	if (!data)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++)
+		if (entries[i].data == data)
+			free_entry(&entries[i]);
+}
+
+void prefetch_release(void)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++)
+		if (entries[i].data)
+			free_entry(&entries[i]);
+}
@@ -38,6 +38,9 @@
 #define CDB_LENGTH			10
 #define BLOCK_TIMEOUT			10000	/* 100ns units => 1ms by block */
 #define UFS_UNMAP			0x42
+#define UFS_INQUIRY			0x12
+#define UFS_INQUIRY_EVPD		0x01
+#define UFS_VPD_BLOCK_LIMITS		0xb0
 #define UFS_SECURITY_PROTOCOL_IN	0xa2
 #define UFS_SECURITY_PROTOCOL_OUT	0xb5
 #define UFS_RPMB_LUN			0x44c1
@@ -66,6 +69,32 @@ struct unmap_parameter {
 	struct unmap_block_descriptor block_desc;
 } __attribute__((packed));
 
+struct unmap_parameter_header {
+	__be16 data_length; /* length in bytes of the following data */
+	__be16 block_desc_length; /* length in bytes of the unmap block descriptors */
+	__be32 reserved;
+} __attribute__((packed));
+
+struct command_descriptor_block_inquiry {
+	__be8 op_code;		/* Operation Code (must be 0x12 for inquiry) */
+	__be8 evpd;		/* enable vital product data */
+	__be8 page_code;
+	__be16 allocation_length;
+	__be8 control;
+} __attribute__((packed));
+
+/* Block Limits VPD page, only the fields used to split UNMAP
+   commands.  */
+struct vpd_block_limits {
+	__be8 device_type;
+	__be8 page_code;	/* must be 0xb0 */
+	__be16 page_length;
+	__be8 reserved[16];
+	__be32 max_unmap_lba_count;
+	__be32 max_unmap_desc_count;
+	__be8 reserved2[36];
+} __attribute__((packed));
+
 struct command_descriptor_block_security_protocol {
 	__be8 op_code;
 	__be8 sec_protocol;
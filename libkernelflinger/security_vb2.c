@@ -31,6 +31,7 @@
  */
 #include "security.h"
 #include "security_vb2.h"
+#include "avb_cache.h"
 
 EFI_STATUS rot_pub_key_sha256(IN VBDATA *vb_data,
                         OUT UINT8 **hash_p)
@@ -40,8 +41,7 @@ EFI_STATUS rot_pub_key_sha256(IN VBDATA *vb_data,
 	UINTN vbmeta_pub_key_len;
 
 	if (vb_data && hash_p) {
-		ret = avb_vbmeta_image_verify(vb_data->vbmeta_images[0].vbmeta_data,
-			vb_data->vbmeta_images[0].vbmeta_size,
+		ret = avb_cache_slot_public_key(vb_data,
 			&vbmeta_pub_key,
 			&vbmeta_pub_key_len);
 
@@ -345,6 +345,12 @@ const char *slot_get_active(void)
 	}
 	avb_ab_flow(&ab_ops, requested_partitions, AVB_SLOT_VERIFY_FLAGS_ALLOW_VERIFICATION_ERROR,\
 			AVB_HASHTREE_ERROR_MODE_RESTART, &data);
+	if (uefi_avb_ops_flush_rollback_indexes() != AVB_IO_RESULT_OK) {
+		error(L"Failed to store the rollback indexes");
+		if (data)
+			avb_slot_verify_data_free(data);
+		return NULL;
+	}
 	if (!data)
 		return NULL;
 
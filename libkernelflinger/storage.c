@@ -37,6 +37,7 @@
 #include "pci.h"
 #include "protocol/EraseBlock.h"
 #include "timer.h"
+#include "block_cache.h"
 
 static struct storage *cur_storage;
 static PCI_DEVICE_PATH boot_device = { .Function = -1, .Device = -1 };
@@ -317,6 +318,12 @@ EFI_STATUS storage_check_logical_unit(EFI_DEVICE_PATH *p, logical_unit_t log_uni
 	return cur_storage->check_logical_unit(p, log_unit);
 }
 
+static void invalidate_blocks(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+{
+	block_cache_invalidate(bio, start * bio->Media->BlockSize,
+			       (end - start + 1) * bio->Media->BlockSize);
+}
+
 EFI_STATUS storage_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
 {
 	EFI_STATUS ret;
@@ -328,26 +335,98 @@ EFI_STATUS storage_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA st
 	 * If so use ERASE_BLOCK_PROTOCOL to erase blocks.
 	 */
 	ret = media_erase_blocks(handle, bio, start, end);
-	if (ret == EFI_SUCCESS || ret != EFI_UNSUPPORTED)
-		return ret;
+	if (ret != EFI_UNSUPPORTED)
+		goto out;
 
 	debug(L"ERASE_BLOCK_PROTOCOL not supported");
-	return cur_storage->erase_blocks(handle, bio, start, end);
+	ret = cur_storage->erase_blocks(handle, bio, start, end);
+
+out:
+	invalidate_blocks(bio, start, end);
+	return ret;
+}
+
+/* Discarded ranges are accumulated, merged when contiguous and sent
+ * to the device in as few commands as the storage driver allows.
+ * Discarding is advisory: storage without discard support silently
+ * drops the queue. */
+static struct {
+	EFI_HANDLE handle;
+	EFI_BLOCK_IO *bio;
+	struct discard_range ranges[DISCARD_QUEUE_SIZE];
+	UINTN count;
+} discard_queue;
+
+EFI_STATUS storage_discard_queue(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+{
+	EFI_STATUS ret;
+	struct discard_range *last;
+
+	if (end < start)
+		return EFI_INVALID_PARAMETER;
+
+	if (discard_queue.count && discard_queue.handle == handle) {
+		last = &discard_queue.ranges[discard_queue.count - 1];
+		if (last->end + 1 == start) {
+			last->end = end;
+			return EFI_SUCCESS;
+		}
+	}
+
+	if (discard_queue.count == DISCARD_QUEUE_SIZE ||
+	    (discard_queue.count && discard_queue.handle != handle)) {
+		ret = storage_discard_flush();
+		if (EFI_ERROR(ret) && ret != EFI_UNSUPPORTED)
+			return ret;
+	}
+
+	discard_queue.handle = handle;
+	discard_queue.bio = bio;
+	discard_queue.ranges[discard_queue.count].start = start;
+	discard_queue.ranges[discard_queue.count].end = end;
+	discard_queue.count++;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS storage_discard_flush(void)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (!discard_queue.count)
+		return EFI_SUCCESS;
+
+	for (i = 0; i < discard_queue.count; i++)
+		invalidate_blocks(discard_queue.bio, discard_queue.ranges[i].start,
+				  discard_queue.ranges[i].end);
+
+	if (!valid_storage() || !cur_storage->discard_ranges)
+		ret = EFI_UNSUPPORTED;
+	else
+		ret = cur_storage->discard_ranges(discard_queue.handle, discard_queue.bio,
+						  discard_queue.ranges, discard_queue.count);
+	if (EFI_ERROR(ret) && ret != EFI_UNSUPPORTED)
+		efi_perror(ret, L"Failed to discard %d block ranges", discard_queue.count);
+
+	discard_queue.count = 0;
+	return ret;
 }
 
 EFI_STATUS fill_with(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end,
 			    VOID *pattern, UINTN pattern_blocks)
 {
-	EFI_LBA lba;
+	EFI_LBA lba, total;
 	UINT64 size;
-	uint32_t total, print_sec, print_prev;
+	uint32_t print_sec, print_prev;
 	EFI_STATUS ret;
 
 	debug(L"Fill lba %d -> %d", start, end);
-	if (end <= start)
+	if (end < start)
 		return EFI_INVALID_PARAMETER;
 
 	total = end - start +1;
+	invalidate_blocks(bio, start, end);
 	info_n(L"Erasing ");
 	print_sec = boottime_in_msec() / 1000;
 	print_prev = 0;
@@ -377,14 +456,20 @@ EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
 	EFI_STATUS ret;
 	VOID *emptyblock;
 	VOID *aligned_emptyblock;
+	UINTN blocks;
+
+	if (end < start)
+		return EFI_INVALID_PARAMETER;
 
+	/* Do not allocate more than the range to fill */
+	blocks = min(end - start + 1, (EFI_LBA)N_BLOCK);
 	ret = alloc_aligned(&emptyblock, &aligned_emptyblock,
-			    bio->Media->BlockSize * N_BLOCK,
+			    bio->Media->BlockSize * blocks,
 			    bio->Media->IoAlign);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ret = fill_with(bio, start, end, aligned_emptyblock, N_BLOCK);
+	ret = fill_with(bio, start, end, aligned_emptyblock, blocks);
 
 	FreePool(emptyblock);
 
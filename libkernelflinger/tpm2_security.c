@@ -97,9 +97,15 @@ typedef struct {
 	UINT8	struct_ver;  /* the version of this struct */
 	UINT8	lock_state;
 	UINT8	reserved[6];  /* keep 8 bytes align */
-	uint64_t rollback_index[8];  /* AVB max rollback index slot is 32, now we support 8 for TPM */
+	uint64_t rollback_index[TPM2_ROLLBACK_INDEX_COUNT];  /* AVB max rollback index slot is 32, now we support 8 for TPM */
 } tpm2_bootloader_t;
 
+/* Copy of the bootloader NV index header: the device state and the
+ * rollback indexes are read with a single NV read per boot. */
+static struct {
+	BOOLEAN valid;
+	tpm2_bootloader_t data;
+} bootloader_cache;
 
 static EFI_STATUS tpm2_get_capability(
 		IN      TPM_CAP                   Capability,
@@ -129,6 +135,13 @@ static EFI_STATUS tpm2_get_capability(
 	return ret;
 }
 
+/* TPMA_PERMANENT only changes when a hierarchy authorization is
+ * changed, so it is read once. */
+static struct {
+	BOOLEAN valid;
+	TPMA_PERMANENT value;
+} cap_permanent;
+
 static EFI_STATUS tpm2_get_cap_permanent(TPMA_PERMANENT *per)
 {
 	EFI_STATUS ret;
@@ -137,6 +150,11 @@ static EFI_STATUS tpm2_get_cap_permanent(TPMA_PERMANENT *per)
 	UINT32 value;
 	TPML_TAGGED_TPM_PROPERTY *prop;
 
+	if (cap_permanent.valid) {
+		*per = cap_permanent.value;
+		return EFI_SUCCESS;
+	}
+
 	ret = tpm2_get_capability(TPM_CAP_TPM_PROPERTIES, TPM_PT_PERMANENT, 1, &more_data, &cap_data);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Get TPM cap permanent failed");
@@ -151,24 +169,30 @@ static EFI_STATUS tpm2_get_cap_permanent(TPMA_PERMANENT *per)
 
 	value = bswap_32(prop->tpmProperty[0].value);
 	*per = *(TPMA_PERMANENT *)&value;
+	cap_permanent.value = *per;
+	cap_permanent.valid = TRUE;
 
 	return ret;
 }
 
-static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
-				TPM2B_DIGEST *policy_digest,
-				TPMS_AUTH_COMMAND *policy_session,
-				BOOLEAN is_trial)
+static void pcr_policy_selection(TPML_PCR_SELECTION *pcrs)
 {
-	EFI_STATUS ret = EFI_SUCCESS;
+	pcrs->count = 1;
+	pcrs->pcrSelections[0].hash = TPM_ALG_SHA1;
+	pcrs->pcrSelections[0].sizeofSelect = 3;
+	pcrs->pcrSelections[0].pcrSelect[0] = 0;
+	pcrs->pcrSelections[0].pcrSelect[1] = 0;
+	pcrs->pcrSelections[0].pcrSelect[2] = 0;
+	Set_PcrSelect_Bit(pcrs->pcrSelections[0], PCR_7);
+}
+
+static EFI_STATUS start_policy_session(TPMI_SH_AUTH_SESSION *sessionhandle,
+				       BOOLEAN is_trial)
+{
+	EFI_STATUS ret;
 	TPM2B_ENCRYPTED_SECRET encryptedSalt;
 	TPMT_SYM_DEF symmetric = {.algorithm = TPM_ALG_NULL};
 	TPM2B_NONCE nonceCaller, nonceTpm;
-	TPM2B_DIGEST pcrDigest;
-	TPML_PCR_SELECTION pcrs;
-	TPML_DIGEST pcrValues;
-	UINT32 pcrUpdateCounter;
-	TPML_PCR_SELECTION pcrSelectionOut;
 
 	encryptedSalt.size = 0;
 	nonceCaller.size = DIGEST_SIZE;
@@ -191,21 +215,21 @@ static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
 				&nonceTpm);
 
 	memset_s(nonceCaller.buffer, DIGEST_SIZE, 0, DIGEST_SIZE);
-	if (EFI_ERROR(ret)) {
+	if (EFI_ERROR(ret))
 		efi_perror(ret, L"StartAuthSession failed");
-		return ret;
-	}
 
-	pcrs.count = 1;
-	pcrs.pcrSelections[0].hash = TPM_ALG_SHA1;
-	pcrs.pcrSelections[0].sizeofSelect = 3;
-	pcrs.pcrSelections[0].pcrSelect[0] = 0;
-	pcrs.pcrSelections[0].pcrSelect[1] = 0;
-	pcrs.pcrSelections[0].pcrSelect[2] = 0;
-	Set_PcrSelect_Bit(pcrs.pcrSelections[0], PCR_7);
+	return ret;
+}
+
+static EFI_STATUS read_pcr_digest(TPML_PCR_SELECTION *pcrs, TPM2B_DIGEST *pcrDigest)
+{
+	EFI_STATUS ret;
+	TPML_DIGEST pcrValues;
+	UINT32 pcrUpdateCounter;
+	TPML_PCR_SELECTION pcrSelectionOut;
 
 	//1. Read PCRs (&pcrSelectionOut MUST NOT be NULL!!!!!)
-	ret = Tpm2PcrRead(&pcrs, &pcrUpdateCounter, &pcrSelectionOut, &pcrValues);
+	ret = Tpm2PcrRead(pcrs, &pcrUpdateCounter, &pcrSelectionOut, &pcrValues);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Tpm2PcrRead failed");
 		return ret;
@@ -217,12 +241,41 @@ static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
 	}
 
 	// 2. Hash those PCRs together
-	pcrDigest.size = sizeof(pcrDigest) - sizeof(UINT16);
-	ret = Tpm2HashSequence(TPM_ALG_SHA256, pcrValues.count, &pcrValues.digests[0], &pcrDigest);
-	if (EFI_ERROR(ret)) {
+	pcrDigest->size = sizeof(*pcrDigest) - sizeof(UINT16);
+	ret = Tpm2HashSequence(TPM_ALG_SHA256, pcrValues.count, &pcrValues.digests[0], pcrDigest);
+	if (EFI_ERROR(ret))
 		efi_perror(ret, L"HashSequence failed");
+
+	return ret;
+}
+
+static void set_policy_auth(TPMS_AUTH_COMMAND *policy_session,
+			    TPMI_SH_AUTH_SESSION sessionhandle)
+{
+	policy_session->sessionHandle = sessionhandle;
+	policy_session->hmac.size = 0;
+	policy_session->nonce.size = 0;
+	*((UINT8 *)((void *)&(policy_session->sessionAttributes))) = 0;
+	policy_session->sessionAttributes.continueSession = 1;
+}
+
+static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
+				TPM2B_DIGEST *policy_digest,
+				TPMS_AUTH_COMMAND *policy_session,
+				BOOLEAN is_trial)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	TPM2B_DIGEST pcrDigest;
+	TPML_PCR_SELECTION pcrs;
+
+	ret = start_policy_session(sessionhandle, is_trial);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	pcr_policy_selection(&pcrs);
+	ret = read_pcr_digest(&pcrs, &pcrDigest);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
 
 	//3. Apply selected PCRs' pcrDigest (as approvedPcrDigest) to policyDigest
 	ret = Tpm2PolicyPCR(*sessionhandle, &pcrDigest, &pcrs);
@@ -250,15 +303,90 @@ static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
 	}
 
 	//5. Apply policy session handle
-	if (policy_session) {
-		policy_session->sessionHandle = *sessionhandle;
-		policy_session->hmac.size = 0;
-		policy_session->nonce.size = 0;
-		*((UINT8 *)((void *)&(policy_session->sessionAttributes))) = 0;
-		policy_session->sessionAttributes.continueSession = 1;
+	if (policy_session)
+		set_policy_auth(policy_session, *sessionhandle);
+
+	return EFI_SUCCESS;
+}
+
+/* PCR policy session shared by the NV index accesses of a batch,
+ * see nv_batch_begin().  A policy session is reset each time it
+ * authorizes a command so the PCR policy is asserted again before each
+ * command, but the session and the PCR digest are only built once per
+ * batch.  The session is flushed at the end of the outermost batch, or
+ * right after the command outside of a batch, so that it never
+ * outlives a tpm2_*() call whatever the boot target is. */
+static struct {
+	UINTN batch;
+	BOOLEAN started;
+	TPMI_SH_AUTH_SESSION handle;
+	TPML_PCR_SELECTION pcrs;
+	TPM2B_DIGEST pcr_digest;
+} nv_session;
+
+static void put_nv_session(EFI_STATUS status)
+{
+	EFI_STATUS ret;
+
+	/* A session which failed to authorize a command keeps its
+	   policy digest, it cannot be used anymore. */
+	if (!nv_session.started || (!EFI_ERROR(status) && nv_session.batch))
+		return;
+
+	nv_session.started = FALSE;
+	ret = Tpm2FlushContext(nv_session.handle);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"%a - FlushContext failed", __func__);
+}
+
+static EFI_STATUS get_nv_session(TPMS_AUTH_COMMAND *policy_session)
+{
+	EFI_STATUS ret;
+
+	if (nv_session.started) {
+		ret = Tpm2PolicyPCR(nv_session.handle, &nv_session.pcr_digest, &nv_session.pcrs);
+		if (!EFI_ERROR(ret)) {
+			set_policy_auth(policy_session, nv_session.handle);
+			return EFI_SUCCESS;
+		}
+		/* PCR 7 has been extended or the session has been
+		   flushed: start a new one. */
+		put_nv_session(ret);
 	}
 
+	ret = start_policy_session(&nv_session.handle, FALSE);
+	if (EFI_ERROR(ret))
+		return ret;
+	nv_session.started = TRUE;
+
+	pcr_policy_selection(&nv_session.pcrs);
+	ret = read_pcr_digest(&nv_session.pcrs, &nv_session.pcr_digest);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = Tpm2PolicyPCR(nv_session.handle, &nv_session.pcr_digest, &nv_session.pcrs);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"PolicyPCR failed");
+		goto err;
+	}
+
+	set_policy_auth(policy_session, nv_session.handle);
 	return EFI_SUCCESS;
+
+err:
+	put_nv_session(ret);
+	return ret;
+}
+
+static void nv_batch_begin(void)
+{
+	nv_session.batch++;
+}
+
+static void nv_batch_end(void)
+{
+	if (nv_session.batch && --nv_session.batch == 0)
+		put_nv_session(EFI_ABORTED);
 }
 
 EFI_STATUS tpm2_create_nvindex(TPMI_RH_NV_INDEX nv_index,
@@ -306,20 +434,14 @@ EFI_STATUS tpm2_write_nvindex(TPMI_RH_NV_INDEX nv_index,
 {
 	EFI_STATUS ret = EFI_SUCCESS;
 	TPMS_AUTH_COMMAND session_data = {0};
-	TPMI_SH_AUTH_SESSION session_handle = 0;
 	TPM2B_MAX_BUFFER nv_write_data;
 	UINT16 left_size = data_size;
 	UINT16 written_size = 0;
 	UINT16 cur_size;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"build PCR policy failed");
-		return ret;
-	}
-
 	// Make sure the data buffer not overflow, maybe write data several times.
 	// But if attributes->TPMA_NV_WRITEALL == 1, then write will failed.
+	nv_batch_begin();
 	while (left_size > 0) {
 		cur_size = (left_size > sizeof(nv_write_data.buffer)) ? sizeof(nv_write_data.buffer) : left_size;
 		nv_write_data.size = cur_size;
@@ -327,8 +449,15 @@ EFI_STATUS tpm2_write_nvindex(TPMI_RH_NV_INDEX nv_index,
 					   nv_write_data.size);
 		if (EFI_ERROR(ret))
 			goto out;
+
+		ret = get_nv_session(&session_data);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"build PCR policy failed");
+			goto out;
+		}
 		ret = Tpm2NvWrite(nv_index, nv_index,
 			   &session_data, &nv_write_data, written_size + offset);
+		put_nv_session(ret);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Write TPM NV index failed, index: 0x%x, size: %d, written_size: %d",
 					nv_index, nv_write_data.size, written_size);
@@ -338,11 +467,8 @@ EFI_STATUS tpm2_write_nvindex(TPMI_RH_NV_INDEX nv_index,
 		written_size += cur_size;
 	}
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
-
 out:
+	nv_batch_end();
 	memset_s(&nv_write_data, sizeof(nv_write_data), 0, sizeof(nv_write_data));
 	return ret;
 }
@@ -351,59 +477,55 @@ EFI_STATUS tpm2_write_lock_nvindex(TPMI_RH_NV_INDEX nv_index)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
 	TPMS_AUTH_COMMAND session_data = {0};
-	TPMI_SH_AUTH_SESSION session_handle = 0;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
+	ret = get_nv_session(&session_data);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"build PCR policy failed");
 		return ret;
 	}
 
 	ret = Tpm2NvWriteLock(nv_index, nv_index, &session_data);
+	put_nv_session(ret);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Tpm2NvWriteLock nv_index 0x%x failed", nv_index);
 		return ret;
 	}
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
-		return ret;
-	}
-
 	return ret;
 }
 
 EFI_STATUS tpm2_read_nvindex(TPMI_RH_NV_INDEX nv_index,
 				UINT16 *data_size, BYTE *data, UINT16 offset)
 {
-	EFI_STATUS ret;
+	EFI_STATUS ret = EFI_SUCCESS;
 	TPMS_AUTH_COMMAND session_data = {0};
-	TPMI_SH_AUTH_SESSION session_handle = 0;
 	TPM2B_MAX_BUFFER nv_read_data;
 	UINT16 left_size = *data_size;
 	UINT16 read_size = 0;
 	UINT16 cur_size;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"build PCR policy failed");
-		return ret;
-	}
-
+	nv_batch_begin();
 	while (left_size > 0) {
+		ret = get_nv_session(&session_data);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"build PCR policy failed");
+			goto out;
+		}
+
 		cur_size = (left_size > sizeof(nv_read_data.buffer)) ? sizeof(nv_read_data.buffer) : left_size;
 		nv_read_data.size = cur_size;
 
 		ret = Tpm2NvRead(nv_index, nv_index, &session_data, nv_read_data.size, read_size + offset, &nv_read_data);
+		put_nv_session(ret);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Read NVIndex failed");
-			return ret;
+			goto out;
 		}
 		if (nv_read_data.size > cur_size) {
 			// Overflow?
 			error(L"Overflow after read the NVindex");
-			return EFI_ABORTED;
+			ret = EFI_ABORTED;
+			goto out;
 		}
 		if (nv_read_data.size == 0) {
 			// No data read
@@ -411,46 +533,78 @@ EFI_STATUS tpm2_read_nvindex(TPMI_RH_NV_INDEX nv_index,
 		}
 		ret = memcpy_s(data + read_size, nv_read_data.size, nv_read_data.buffer, nv_read_data.size);
 		if (EFI_ERROR(ret))
-			return ret;
+			goto out;
 		left_size -= nv_read_data.size;
 		read_size += nv_read_data.size;
 	}
 	*data_size = read_size;
+
+out:
+	nv_batch_end();
 	memset_s(&nv_read_data, sizeof(nv_read_data), 0, sizeof(nv_read_data));
+	return ret;
+}
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
-		return ret;
+struct nv_read {
+	TPMI_RH_NV_INDEX nv_index;
+	UINT16 size;
+	void *data;
+	EFI_STATUS status;
+};
+
+/* Read each of the COUNT NV index in turn with a single policy
+   session.  The status of each read is stored in its entry, the first
+   error is returned. */
+static EFI_STATUS read_nvindexes(struct nv_read *reads, UINTN count)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	UINTN i;
+
+	nv_batch_begin();
+	for (i = 0; i < count; i++) {
+		reads[i].status = tpm2_read_nvindex(reads[i].nv_index, &reads[i].size,
+						    reads[i].data, 0);
+		if (EFI_ERROR(reads[i].status) && !EFI_ERROR(ret))
+			ret = reads[i].status;
 	}
+	nv_batch_end();
 
-	return EFI_SUCCESS;
+	return ret;
+}
+
+/* Validate the bootloader NV index header read by READ into the
+   cache. */
+static void bootloader_cache_loaded(struct nv_read *read)
+{
+	if (EFI_ERROR(read->status))
+		return;
+
+	if (read->size != sizeof(bootloader_cache.data)) {
+		error(L"Read bootloader NV index, but data size is wrong: %d", read->size);
+		read->status = EFI_COMPROMISED_DATA;
+		return;
+	}
+	bootloader_cache.valid = TRUE;
 }
 
 EFI_STATUS tpm2_read_lock_nvindex(TPMI_RH_NV_INDEX nv_index)
 {
 	EFI_STATUS ret;
 	TPMS_AUTH_COMMAND session_data = {0};
-	TPMI_SH_AUTH_SESSION session_handle = 0;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
+	ret = get_nv_session(&session_data);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"build PCR policy failed");
 		return ret;
 	}
 
 	ret = Tpm2NvReadLock(nv_index, nv_index, &session_data);
+	put_nv_session(ret);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Tpm2NvReadLock nv_index 0x%x failed", nv_index);
 		return ret;
 	}
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
-		return ret;
-	}
-
 	return EFI_SUCCESS;
 }
 
@@ -458,26 +612,20 @@ static EFI_STATUS tpm2_set_nvbits(TPMI_RH_NV_INDEX nv_index, UINT64 set_bits)
 {
 	EFI_STATUS ret;
 	TPMS_AUTH_COMMAND session_data = {0};
-	TPMI_SH_AUTH_SESSION session_handle = 0;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
+	ret = get_nv_session(&session_data);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"build PCR policy failed");
 		return ret;
 	}
 
 	ret = Tpm2NvSetBits(nv_index, nv_index, &session_data, set_bits);
+	put_nv_session(ret);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"set nvbits failed");
 		return ret;
 	}
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
-		return ret;
-	}
-
 	return EFI_SUCCESS;
 }
 
@@ -523,6 +671,9 @@ EFI_STATUS tpm2_delete_index(UINT32 index)
 {
 	EFI_STATUS ret = Tpm2NvUndefineSpace(TPM_RH_OWNER, index, NULL);
 
+	if (index == NV_INDEX_BOOTLOADER)
+		bootloader_cache.valid = FALSE;
+
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Delete TPM NV index failed, index: %x", index);
 
@@ -591,6 +742,7 @@ EFI_STATUS tpm2_fuse_lock_owner(void)
 	}
 
 	ret = Tpm2HierarchyChangeAuth(TPM_RH_OWNER, &session_data, &owner_auth);
+	cap_permanent.valid = FALSE;
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"failed to Tpm2HierarchyChangeAuth");
 		goto out;
@@ -690,6 +842,7 @@ EFI_STATUS tpm2_fuse_trusty_seed(void)
 	UINT16 read_seed_size = TRUSTY_SEED_SIZE;
 	UINT16 config_index;
 
+	nv_batch_begin();
 	ret = Tpm2GetRandom(TRUSTY_SEED_SIZE, &trusty_seed);
 	if (EFI_ERROR(ret)) {
 		error(L"Tpm2GetRandom failed");
@@ -718,6 +871,7 @@ EFI_STATUS tpm2_fuse_trusty_seed(void)
 	}
 
 out:
+	nv_batch_end();
 	// Always clear the memory
 	// Maybe be optimized?
 	memset_s(trusty_seed.buffer, TRUSTY_SEED_SIZE, 0, TRUSTY_SEED_SIZE);
@@ -750,10 +904,25 @@ EFI_STATUS tpm2_read_trusty_seed(UINT8 seed[TRUSTY_SEED_SIZE])
 {
 	EFI_STATUS ret;
 	EFI_STATUS ret2;
-	UINT16 seed_size = TRUSTY_SEED_SIZE;
-
-	ret = tpm2_read_nvindex(NV_INDEX_TRUSTYOS_SEED, &seed_size, seed, 0);
+	UINT16 seed_size;
+	/* The bootloader NV index header is read in the same sequence
+	   when it is not cached yet, as after it has been fused. */
+	struct nv_read reads[] = {
+		{ NV_INDEX_TRUSTYOS_SEED, TRUSTY_SEED_SIZE, seed, EFI_SUCCESS },
+		{ NV_INDEX_BOOTLOADER, sizeof(bootloader_cache.data),
+		  &bootloader_cache.data, EFI_SUCCESS }
+	};
+
+	nv_batch_begin();
+	read_nvindexes(reads, bootloader_cache.valid ? 1 : ARRAY_SIZE(reads));
 	ret2 = tpm2_read_lock_nvindex(NV_INDEX_TRUSTYOS_SEED);  // Lock anyway
+	nv_batch_end();
+
+	if (!bootloader_cache.valid)
+		bootloader_cache_loaded(&reads[1]);
+
+	ret = reads[0].status;
+	seed_size = reads[0].size;
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Read trusty seed failed");
 		goto out;
@@ -839,6 +1008,8 @@ static EFI_STATUS tpm2_fuse_bootloader(void)
 	UINT16 data_read_size = sizeof(data);
 	tpm2_bootloader_t *bootloader = (tpm2_bootloader_t *)data;
 
+	bootloader_cache.valid = FALSE;
+
 	config_index = NV_INDEX_BOOTLOADER - config_table[0].nv_index;
 	ret = tpm2_create_nvindex(NV_INDEX_BOOTLOADER, config_table[config_index].attribute, sizeof(data));
 	if (EFI_ERROR(ret)) {
@@ -872,13 +1043,54 @@ static EFI_STATUS tpm2_fuse_bootloader(void)
 	return EFI_SUCCESS;
 }
 
+static EFI_STATUS read_bootloader_tpm2(UINT16 offset, UINT16 size, void *data)
+{
+	struct nv_read read = {
+		NV_INDEX_BOOTLOADER, sizeof(bootloader_cache.data),
+		&bootloader_cache.data, EFI_SUCCESS
+	};
+
+	if (offset > sizeof(bootloader_cache.data) ||
+	    size > sizeof(bootloader_cache.data) - offset)
+		return EFI_INVALID_PARAMETER;
+
+	if (!bootloader_cache.valid) {
+		read.status = tpm2_read_nvindex(read.nv_index, &read.size, read.data, 0);
+		bootloader_cache_loaded(&read);
+		if (EFI_ERROR(read.status))
+			return read.status;
+	}
+
+	memcpy(data, (UINT8 *)&bootloader_cache.data + offset, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS write_bootloader_tpm2(UINT16 offset, UINT16 size, const void *data)
+{
+	EFI_STATUS ret;
+
+	if (offset > sizeof(bootloader_cache.data) ||
+	    size > sizeof(bootloader_cache.data) - offset)
+		return EFI_INVALID_PARAMETER;
+
+	ret = tpm2_write_nvindex(NV_INDEX_BOOTLOADER, size, (BYTE *)data, offset);
+	if (EFI_ERROR(ret)) {
+		bootloader_cache.valid = FALSE;
+		return ret;
+	}
+
+	if (bootloader_cache.valid)
+		memcpy((UINT8 *)&bootloader_cache.data + offset, data, size);
+
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS tpm2_check_bootloader_index(void)
 {
 	EFI_STATUS ret;
 	TPM2B_NV_PUBLIC NvPublic;
 	TPM2B_NAME NvName;
 	UINT8 struct_ver;
-	UINT16 data_size = sizeof(struct_ver);
 	UINT32 *attr;
 	UINT32 *config_attr;
 
@@ -907,11 +1119,10 @@ static EFI_STATUS tpm2_check_bootloader_index(void)
 		return EFI_COMPROMISED_DATA;
 	}
 
-	ret = tpm2_read_nvindex(NV_INDEX_BOOTLOADER, &data_size,
-			(BYTE *)&struct_ver,
-			offsetof(tpm2_bootloader_t, struct_ver));
-	if (EFI_ERROR(ret) || data_size != sizeof(struct_ver)) {
-		efi_perror(ret, L"Read bootloader NV index for struct version failed, read size: %d", data_size);
+	ret = read_bootloader_tpm2(offsetof(tpm2_bootloader_t, struct_ver),
+				   sizeof(struct_ver), &struct_ver);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Read bootloader NV index for struct version failed");
 		return ret;
 	}
 
@@ -932,20 +1143,14 @@ static EFI_STATUS tpm2_check_bootloader_index(void)
 EFI_STATUS read_device_state_tpm2(UINT8 *state)
 {
 	EFI_STATUS ret;
-	UINT16 data_size = sizeof(UINT8);
 
-	ret = tpm2_read_nvindex(NV_INDEX_BOOTLOADER, &data_size, (BYTE *)state,
-			offsetof(tpm2_bootloader_t, lock_state));
+	ret = read_bootloader_tpm2(offsetof(tpm2_bootloader_t, lock_state),
+				   sizeof(*state), state);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Read device state from TPM failed");
 		return ret;
 	}
 
-	if (data_size != sizeof(UINT8)) {
-		error(L"Read device state from TPM, but data size is wrong: %d", data_size);
-		return EFI_COMPROMISED_DATA;
-	}
-
 	debug(L"Read device state from TPM success, state: %d", *state);
 	return ret;
 }
@@ -954,8 +1159,8 @@ EFI_STATUS write_device_state_tpm2(UINT8 state)
 {
 	EFI_STATUS ret;
 
-	ret = tpm2_write_nvindex(NV_INDEX_BOOTLOADER, sizeof(UINT8), (BYTE *)&state,
-			offsetof(tpm2_bootloader_t, lock_state));
+	ret = write_bootloader_tpm2(offsetof(tpm2_bootloader_t, lock_state),
+				    sizeof(state), &state);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Write device state %d to TPM failed", state);
 		return ret;
@@ -965,53 +1170,62 @@ EFI_STATUS write_device_state_tpm2(UINT8 state)
 	return ret;
 }
 
-EFI_STATUS read_rollback_index_tpm2(size_t rollback_index_slot, uint64_t *out_rollback_index)
+EFI_STATUS read_rollback_indexes_tpm2(size_t first_slot, size_t count, uint64_t *out_rollback_indexes)
 {
 	EFI_STATUS ret;
-	UINT16 data_size = sizeof(uint64_t);
 
-	if (rollback_index_slot >= ARRAY_SIZE(((tpm2_bootloader_t *)0)->rollback_index)) {
-		error(L"The rollback index slot is too large to write into TPM: %d", rollback_index_slot);
+	if (count == 0 || first_slot >= TPM2_ROLLBACK_INDEX_COUNT ||
+	    count > TPM2_ROLLBACK_INDEX_COUNT - first_slot) {
+		error(L"The rollback index slots are out of the TPM range: %d-%d",
+		      first_slot, first_slot + count - 1);
 		return EFI_INVALID_PARAMETER;
 	}
 
-	ret = tpm2_read_nvindex(NV_INDEX_BOOTLOADER, &data_size, (BYTE *)out_rollback_index,
-			rollback_index_slot * sizeof(uint64_t) + offsetof(tpm2_bootloader_t, rollback_index));
+	ret = read_bootloader_tpm2(first_slot * sizeof(uint64_t) + offsetof(tpm2_bootloader_t, rollback_index),
+				   count * sizeof(uint64_t), out_rollback_indexes);
 	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Read rollback index from TPM failed, slot: %d", rollback_index_slot);
+		efi_perror(ret, L"Read rollback indexes from TPM failed, slots: %d-%d",
+			   first_slot, first_slot + count - 1);
 		return ret;
 	}
 
-	if (data_size != sizeof(uint64_t)) {
-		error(L"Read rollback index from TPM, but data size is wrong: %d", data_size);
-		return EFI_COMPROMISED_DATA;
-	}
-
-	debug(L"Read rollback index from TPM success, slot: %d, index: 0x%llx", rollback_index_slot, *out_rollback_index);
+	debug(L"Read rollback indexes from TPM success, slots: %d-%d", first_slot, first_slot + count - 1);
 	return ret;
 }
 
-EFI_STATUS write_rollback_index_tpm2(size_t rollback_index_slot, uint64_t rollback_index)
+EFI_STATUS write_rollback_indexes_tpm2(size_t first_slot, size_t count, const uint64_t *rollback_indexes)
 {
 	EFI_STATUS ret;
 
-	if (rollback_index_slot >= ARRAY_SIZE(((tpm2_bootloader_t *)0)->rollback_index)) {
-		error(L"The rollback index slot is too large to write into TPM: %d", rollback_index_slot);
+	if (count == 0 || first_slot >= TPM2_ROLLBACK_INDEX_COUNT ||
+	    count > TPM2_ROLLBACK_INDEX_COUNT - first_slot) {
+		error(L"The rollback index slots are out of the TPM range: %d-%d",
+		      first_slot, first_slot + count - 1);
 		return EFI_INVALID_PARAMETER;
 	}
 
-	ret = tpm2_write_nvindex(NV_INDEX_BOOTLOADER, sizeof(uint64_t), (BYTE *)&rollback_index,
-			rollback_index_slot * sizeof(uint64_t) + offsetof(tpm2_bootloader_t, rollback_index));
+	ret = write_bootloader_tpm2(first_slot * sizeof(uint64_t) + offsetof(tpm2_bootloader_t, rollback_index),
+				    count * sizeof(uint64_t), rollback_indexes);
 	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Write rollback index to TPM failed, slot: %d, index: 0x%llx",
-				rollback_index_slot, rollback_index);
+		efi_perror(ret, L"Write rollback indexes to TPM failed, slots: %d-%d",
+			   first_slot, first_slot + count - 1);
 		return ret;
 	}
 
-	debug(L"Write rollback index to TPM success, slot: %d, index: 0x%llx", rollback_index_slot, rollback_index);
+	debug(L"Write rollback indexes to TPM success, slots: %d-%d", first_slot, first_slot + count - 1);
 	return ret;
 }
 
+EFI_STATUS read_rollback_index_tpm2(size_t rollback_index_slot, uint64_t *out_rollback_index)
+{
+	return read_rollback_indexes_tpm2(rollback_index_slot, 1, out_rollback_index);
+}
+
+EFI_STATUS write_rollback_index_tpm2(size_t rollback_index_slot, uint64_t rollback_index)
+{
+	return write_rollback_indexes_tpm2(rollback_index_slot, 1, &rollback_index);
+}
+
 BOOLEAN tpm2_bootloader_need_init(void)
 {
 	EFI_STATUS ret;
@@ -1036,11 +1250,11 @@ EFI_STATUS tpm2_init(void)
 	if (EFI_ERROR(ret))
 		return ret;
 
+	nv_batch_begin();
 	ret = tpm2_check_bootloader_index();
-	if (EFI_ERROR(ret))
-		return ret;
-
-	ret = tpm2_check_trusty_seed_index();
+	if (!EFI_ERROR(ret))
+		ret = tpm2_check_trusty_seed_index();
+	nv_batch_end();
 	if (EFI_ERROR(ret))
 		return ret;
 
@@ -1055,9 +1269,12 @@ EFI_STATUS tpm2_init(void)
 EFI_STATUS tpm2_end(void)
 {
 	/* Maybe set read/write lock again */
+	nv_batch_begin();
 	tpm2_read_lock_nvindex(NV_INDEX_TRUSTYOS_SEED);
 	tpm2_read_lock_nvindex(NV_INDEX_BOOTLOADER);
 	tpm2_write_lock_nvindex(NV_INDEX_BOOTLOADER);
+	nv_batch_end();
+	bootloader_cache.valid = FALSE;
 
 	extend_pcr7();
 
@@ -47,6 +47,7 @@
 #define AVB_COMPILATION
 #include "avb_sha.h"
 #include "slot.h"
+#include "avb_cache.h"
 
 extern char _binary_avb_pk_start;
 extern char _binary_avb_pk_end;
@@ -75,7 +76,8 @@ static EFI_STATUS android_query_image_and_size_from_avb_result(
     return EFI_NOT_FOUND;
 }
 
-static AvbSlotVerifyResult avb_verify_image(const CHAR16 *label, const uint8_t *image_buf)
+static AvbSlotVerifyResult avb_verify_image(const CHAR16 *label, const uint8_t *image_buf,
+                                            const char *name, AvbSlotVerifyData *slot_data)
 {
     AvbFooter footer;
     const AvbFooter *img_footer;
@@ -92,6 +94,7 @@ static AvbSlotVerifyResult avb_verify_image(const CHAR16 *label, const uint8_t *
     const uint8_t *out_public_key_data;
     size_t out_public_key_length;
     const uint8_t *vbmeta = NULL;
+    char name_suffix[AVB_PART_NAME_MAX_SIZE];
     uint64_t vbmeta_offset;
     uint64_t vbmeta_size;
     AvbSlotVerifyResult aret;
@@ -126,7 +129,13 @@ static AvbSlotVerifyResult avb_verify_image(const CHAR16 *label, const uint8_t *
             break;
         }
 
-        vret = avb_vbmeta_image_verify(
+        if (efi_snprintf((CHAR8 *)name_suffix, sizeof(name_suffix), (CHAR8 *)"%s", label) < 0) {
+            aret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_ARGUMENT;
+            break;
+        }
+
+        vret = avb_cache_vbmeta_verify(
+            name_suffix,
             vbmeta,
             footer.vbmeta_size,
             &out_public_key_data,
@@ -174,6 +183,11 @@ static AvbSlotVerifyResult avb_verify_image(const CHAR16 *label, const uint8_t *
         desc_partition_name = ((const uint8_t*)descriptor) + sizeof(AvbHashDescriptor);
         desc_salt = desc_partition_name + hash_desc.partition_name_len;
         desc_digest = desc_salt + hash_desc.salt_len;
+        if (avb_cache_image_verified(slot_data, name, image_buf, vbmeta, vbmeta_size)) {
+            debug(L"%s: image already verified\n", label);
+            break;
+        }
+
         if (avb_strcmp((const char*)hash_desc.hash_algorithm, "sha256") == 0) {
             AvbSHA256Ctx sha256_ctx;
             avb_sha256_init(&sha256_ctx);
@@ -251,7 +265,7 @@ EFI_STATUS load_tos_image(OUT VOID **tosimage)
         if (!slot_suffix)
             slot_suffix = "";
         SPrint(label, sizeof(label), L"%a%a", "tos", slot_suffix);
-        vret = avb_verify_image(label, *tosimage);
+        vret = avb_verify_image(label, *tosimage, "tos", slot_data);
         debug(L"avb_verify_image ret = 0x%X\n", vret);
         if (vret != AVB_SLOT_VERIFY_RESULT_OK)
             return EFI_SECURITY_VIOLATION;
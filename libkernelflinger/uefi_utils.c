@@ -37,6 +37,7 @@
 #include <lib.h>
 #include <gpt.h>
 #include "protocol.h"
+#include "protocol/BlockIo2.h"
 #include "uefi_utils.h"
 #include "options.h"
 
@@ -387,6 +388,216 @@ out:
 }
 
 
+#ifndef EFI_FILE_PROTOCOL_REVISION2
+#define EFI_FILE_PROTOCOL_REVISION2 0x00020000
+#endif
+
+EFI_STATUS file_read_ahead_init(struct file_read_ahead *ra)
+{
+	EFI_STATUS ret;
+
+	memset_s(ra, sizeof(*ra), 0, sizeof(*ra));
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+				&ra->event);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create read-ahead event");
+		ra->event = NULL;
+	}
+
+	return ret;
+}
+
+void file_read_ahead_start(struct file_read_ahead *ra, EFI_FILE *file,
+			   UINT64 pos, void *buf, UINTN len)
+{
+	EFI_STATUS ret;
+
+	ra->requested = TRUE;
+	ra->file = file;
+	ra->pos = pos;
+	ra->buf = buf;
+	ra->len = len;
+
+	if (!ra->event || file->Revision < EFI_FILE_PROTOCOL_REVISION2)
+		return;
+
+	ret = uefi_call_wrapper(file->SetPosition, 2, file, pos);
+	if (EFI_ERROR(ret))
+		return;
+
+	ra->token.Event = ra->event;
+	ra->token.Status = EFI_SUCCESS;
+	ra->token.BufferSize = len;
+	ra->token.Buffer = buf;
+
+	ret = uefi_call_wrapper(file->ReadEx, 2, file, &ra->token);
+	ra->async = !EFI_ERROR(ret);
+}
+
+static void file_read_ahead_wait(struct file_read_ahead *ra)
+{
+	EFI_STATUS ret;
+	UINTN index;
+
+	if (!ra->async)
+		return;
+
+	ra->async = FALSE;
+	ret = uefi_call_wrapper(BS->WaitForEvent, 3, 1, &ra->event, &index);
+	if (EFI_ERROR(ret))
+		ra->token.Status = ret;
+}
+
+EFI_STATUS file_read_ahead_finish(struct file_read_ahead *ra, UINTN *len)
+{
+	EFI_STATUS ret;
+
+	if (!ra->requested)
+		return EFI_NOT_READY;
+	ra->requested = FALSE;
+
+	if (ra->async) {
+		file_read_ahead_wait(ra);
+		if (!EFI_ERROR(ra->token.Status)) {
+			*len = ra->token.BufferSize;
+			return EFI_SUCCESS;
+		}
+		debug(L"Asynchronous read failed, retrying synchronously");
+	}
+
+	ret = uefi_call_wrapper(ra->file->SetPosition, 2, ra->file, ra->pos);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	*len = ra->len;
+	return uefi_call_wrapper(ra->file->Read, 3, ra->file, len, ra->buf);
+}
+
+void file_read_ahead_free(struct file_read_ahead *ra)
+{
+	file_read_ahead_wait(ra);
+	ra->requested = FALSE;
+
+	if (ra->event)
+		uefi_call_wrapper(BS->CloseEvent, 1, ra->event);
+	ra->event = NULL;
+}
+
+struct block_read_ahead {
+	EFI_BLOCK_IO *bio;
+	EFI_DISK_IO *dio;
+	EFI_BLOCK_IO2_PROTOCOL *bio2;
+	EFI_BLOCK_IO2_TOKEN token;
+	UINT64 offset;
+	void *buf;
+	UINTN len;
+	BOOLEAN requested;
+	BOOLEAN async;
+};
+
+static EFI_GUID block_io2_guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
+
+struct block_read_ahead *block_read_ahead_new(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+					      EFI_DISK_IO *dio)
+{
+	EFI_STATUS ret;
+	struct block_read_ahead *ra;
+
+	ra = AllocateZeroPool(sizeof(*ra));
+	if (!ra)
+		return NULL;
+
+	ra->bio = bio;
+	ra->dio = dio;
+	if (!handle)
+		return ra;
+
+	ret = uefi_call_wrapper(BS->HandleProtocol, 3, handle,
+				&block_io2_guid, (VOID **)&ra->bio2);
+	if (EFI_ERROR(ret)) {
+		ra->bio2 = NULL;
+		return ra;
+	}
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+				&ra->token.Event);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create read-ahead event");
+		ra->bio2 = NULL;
+	}
+
+	return ra;
+}
+
+void block_read_ahead_start(struct block_read_ahead *ra, UINT64 offset,
+			    void *buf, UINTN len)
+{
+	EFI_STATUS ret;
+	UINT32 block_size = ra->bio->Media->BlockSize;
+	UINTN align = ra->bio->Media->IoAlign;
+
+	ra->requested = TRUE;
+	ra->offset = offset;
+	ra->buf = buf;
+	ra->len = len;
+
+	if (!ra->bio2 || offset % block_size || len % block_size ||
+	    (align > 1 && (UINTN)buf % align))
+		return;
+
+	ra->token.TransactionStatus = EFI_SUCCESS;
+	ret = uefi_call_wrapper(ra->bio2->ReadBlocksEx, 6, ra->bio2,
+				ra->bio->Media->MediaId, offset / block_size,
+				&ra->token, len, buf);
+	ra->async = !EFI_ERROR(ret);
+}
+
+static void block_read_ahead_wait(struct block_read_ahead *ra, void (*poll)(void))
+{
+	EFI_STATUS ret;
+	UINTN index;
+
+	if (!ra->async)
+		return;
+
+	ra->async = FALSE;
+	if (poll) {
+		while ((ret = uefi_call_wrapper(BS->CheckEvent, 1,
+						ra->token.Event)) == EFI_NOT_READY)
+			poll();
+	} else
+		ret = uefi_call_wrapper(BS->WaitForEvent, 3, 1, &ra->token.Event, &index);
+	if (EFI_ERROR(ret))
+		ra->token.TransactionStatus = ret;
+}
+
+EFI_STATUS block_read_ahead_finish(struct block_read_ahead *ra, void (*poll)(void))
+{
+	if (!ra->requested)
+		return EFI_NOT_READY;
+	ra->requested = FALSE;
+
+	if (ra->async) {
+		block_read_ahead_wait(ra, poll);
+		if (!EFI_ERROR(ra->token.TransactionStatus))
+			return EFI_SUCCESS;
+		debug(L"Asynchronous read failed, retrying synchronously");
+	}
+
+	return uefi_call_wrapper(ra->dio->ReadDisk, 5, ra->dio, ra->bio->Media->MediaId,
+				 ra->offset, ra->len, ra->buf);
+}
+
+void block_read_ahead_free(struct block_read_ahead *ra)
+{
+	block_read_ahead_wait(ra, NULL);
+
+	if (ra->bio2)
+		uefi_call_wrapper(BS->CloseEvent, 1, ra->token.Event);
+	FreePool(ra);
+}
+
+
 EFI_STATUS verify_image(EFI_HANDLE handle, CHAR16 *path)
 {
 	EFI_STATUS ret, unload_ret = EFI_SUCCESS;
@@ -52,25 +52,111 @@ static EFI_DEVICE_PATH *get_ufs_device_path(EFI_DEVICE_PATH *p)
 	return NULL;
 }
 
-static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, __attribute__((unused)) EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+#define UFS_UNMAP_MAX_DESC	64
+#define UFS_DEV_CACHE_SIZE	4
+#define UFS_INQUIRY_TIMEOUT	10000000	/* 100ns units => 1s */
+
+struct unmap_parameter_list {
+	struct unmap_parameter_header header;
+	struct unmap_block_descriptor block_desc[UFS_UNMAP_MAX_DESC];
+} __attribute__((packed));
+
+/* SCSI pass-thru access to a UFS logical unit and its UNMAP limits,
+ * resolved once per block device handle. */
+static struct ufs_dev {
+	EFI_HANDLE handle;
+	EFI_EXT_SCSI_PASS_THRU_PROTOCOL *scsi;
+	UINT8 target[TARGET_MAX_BYTES];
+	UINT64 lun;
+	UINT32 max_unmap_lba;
+	UINT32 max_unmap_desc;
+} ufs_devs[UFS_DEV_CACHE_SIZE];
+static UINTN ufs_devs_next;
+
+static EFI_STATUS ufs_pass_thru(struct ufs_dev *dev,
+				EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET *scsi_req)
+{
+	UINT8 *target = dev->target;
+
+	return uefi_call_wrapper(dev->scsi->PassThru, 5, dev->scsi, target,
+				 dev->lun, scsi_req, NULL);
+}
+
+/* Without the Block Limits VPD page, a single descriptor with a 32
+ * bits block count is sent per UNMAP command. */
+static void ufs_read_block_limits(struct ufs_dev *dev)
 {
 	EFI_STATUS ret;
-	EFI_GUID ScsiPassThruProtocolGuid = EFI_EXT_SCSI_PASS_THRU_PROTOCOL_GUID;
-	EFI_EXT_SCSI_PASS_THRU_PROTOCOL *scsi;
 	EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET scsi_req;
-	struct unmap_parameter unmap;
-	struct command_descriptor_block_unmap cdb;
-	EFI_HANDLE scsi_handle;
-	EFI_DEVICE_PATH *dp = DevicePathFromHandle(handle);
-	EFI_DEVICE_PATH *scsi_dp = dp;
-	UINT8 target_bytes[TARGET_MAX_BYTES];
-	UINT8 *target = target_bytes;
-	UINT64 lun;
+	struct command_descriptor_block_inquiry cdb;
+	struct vpd_block_limits vpd;
+	UINT32 value;
 
+	dev->max_unmap_lba = 0xffffffff;
+	dev->max_unmap_desc = 1;
+
+	ZeroMem(&scsi_req, sizeof(scsi_req));
+	ZeroMem(&cdb, sizeof(cdb));
+	ZeroMem(&vpd, sizeof(vpd));
+
+	cdb.op_code = UFS_INQUIRY;
+	cdb.evpd = UFS_INQUIRY_EVPD;
+	cdb.page_code = UFS_VPD_BLOCK_LIMITS;
+	cdb.allocation_length = htobe16(sizeof(vpd));
+
+	scsi_req.Timeout = UFS_INQUIRY_TIMEOUT;
+	scsi_req.InDataBuffer = &vpd;
+	scsi_req.Cdb = &cdb;
+	scsi_req.InTransferLength = sizeof(vpd);
+	scsi_req.CdbLength = sizeof(cdb);
+	scsi_req.DataDirection = EFI_EXT_SCSI_DATA_DIRECTION_READ;
+
+	ret = ufs_pass_thru(dev, &scsi_req);
+	if (EFI_ERROR(ret) || vpd.page_code != UFS_VPD_BLOCK_LIMITS ||
+	    scsi_req.InTransferLength < offsetof(struct vpd_block_limits, reserved2)) {
+		debug(L"Block Limits VPD page not available, ret=%r", ret);
+		return;
+	}
+
+	value = be32toh(vpd.max_unmap_lba_count);
+	if (value)
+		dev->max_unmap_lba = value;
+	value = be32toh(vpd.max_unmap_desc_count);
+	if (value)
+		dev->max_unmap_desc = min(value, (UINT32)UFS_UNMAP_MAX_DESC);
+
+	debug(L"UFS UNMAP limits: %d blocks, %d descriptors",
+	      dev->max_unmap_lba, dev->max_unmap_desc);
+}
+
+static EFI_STATUS ufs_get_dev(EFI_HANDLE handle, struct ufs_dev **dev_p)
+{
+	EFI_STATUS ret;
+	EFI_GUID ScsiPassThruProtocolGuid = EFI_EXT_SCSI_PASS_THRU_PROTOCOL_GUID;
+	EFI_HANDLE scsi_handle;
+	EFI_DEVICE_PATH *dp;
+	EFI_DEVICE_PATH *scsi_dp;
+	struct ufs_dev *dev;
+	UINT8 *target;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(ufs_devs); i++)
+		if (ufs_devs[i].handle && ufs_devs[i].handle == handle) {
+			*dev_p = &ufs_devs[i];
+			return EFI_SUCCESS;
+		}
+
+	dev = &ufs_devs[ufs_devs_next];
+	ufs_devs_next = (ufs_devs_next + 1) % ARRAY_SIZE(ufs_devs);
+	dev->handle = NULL;
+
+	dp = DevicePathFromHandle(handle);
 	if (!dp) {
 		error(L"Failed to get device path from handle");
 		return EFI_INVALID_PARAMETER;
 	}
+
+	scsi_dp = dp;
 	ret = uefi_call_wrapper(BS->LocateDevicePath, 3, &ScsiPassThruProtocolGuid,
 				&scsi_dp, &scsi_handle);
 	if (EFI_ERROR(ret)) {
@@ -79,7 +165,7 @@ static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, __attribute__((unused)) EF
 	}
 
 	ret = uefi_call_wrapper(BS->HandleProtocol, 3, scsi_handle,
-				&ScsiPassThruProtocolGuid, (void *)&scsi);
+				&ScsiPassThruProtocolGuid, (void *)&dev->scsi);
 	if (EFI_ERROR(ret)) {
 		error(L"failed to get scsi protocol");
 		return ret;
@@ -91,35 +177,107 @@ static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, __attribute__((unused)) EF
 		return EFI_NOT_FOUND;
 	}
 
-	ret = uefi_call_wrapper(scsi->GetTargetLun, 4, scsi, scsi_dp, (UINT8 **)&target, &lun);
+	target = dev->target;
+	ret = uefi_call_wrapper(dev->scsi->GetTargetLun, 4, dev->scsi, scsi_dp,
+				(UINT8 **)&target, &dev->lun);
 	if (EFI_ERROR(ret)) {
 		error(L"Failed to get LUN of current device");
 		return ret;
 	}
 
+	ufs_read_block_limits(dev);
+
+	dev->handle = handle;
+	*dev_p = dev;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS ufs_unmap(struct ufs_dev *dev, struct unmap_parameter_list *unmap,
+			    UINTN count, UINT64 blocks)
+{
+	EFI_STATUS ret;
+	EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET scsi_req;
+	struct command_descriptor_block_unmap cdb;
+	UINTN size = sizeof(unmap->header) + count * sizeof(*unmap->block_desc);
+
 	ZeroMem(&scsi_req, sizeof(scsi_req));
-	ZeroMem(&unmap, sizeof(unmap));
+	ZeroMem(&unmap->header, sizeof(unmap->header));
 	ZeroMem(&cdb, sizeof(cdb));
 
 	cdb.op_code = UFS_UNMAP;
-	cdb.param_length = htobe16(sizeof(unmap));
+	cdb.param_length = htobe16(size);
 
-	unmap.data_length = htobe16(sizeof(unmap) - sizeof(unmap.data_length));
-	unmap.block_desc_length = htobe16(sizeof(unmap.block_desc));
-	unmap.block_desc.lba = htobe64(start);
-	unmap.block_desc.count = htobe32(end - start + 1);
+	unmap->header.data_length = htobe16(size - sizeof(unmap->header.data_length));
+	unmap->header.block_desc_length = htobe16(count * sizeof(*unmap->block_desc));
 
-	scsi_req.Timeout = BLOCK_TIMEOUT * (end - start + 1);
-	scsi_req.OutDataBuffer = &unmap;
+	scsi_req.Timeout = BLOCK_TIMEOUT * blocks;
+	scsi_req.OutDataBuffer = unmap;
 	scsi_req.Cdb = &cdb;
-	scsi_req.OutTransferLength = sizeof(unmap);
+	scsi_req.OutTransferLength = size;
 	scsi_req.CdbLength = sizeof(cdb);
 	scsi_req.DataDirection = EFI_EXT_SCSI_DATA_DIRECTION_WRITE;
 
-	ret = uefi_call_wrapper(scsi->PassThru, 5, scsi, target, lun, &scsi_req, NULL);
+	ret = ufs_pass_thru(dev, &scsi_req);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"UNMAP of %ld blocks failed", blocks);
+		/* Resolve the pass-thru protocol again next time */
+		dev->handle = NULL;
+	}
+
 	return ret;
 }
 
+static EFI_STATUS ufs_discard_ranges(EFI_HANDLE handle, __attribute__((unused)) EFI_BLOCK_IO *bio,
+				     struct discard_range *ranges, UINTN count)
+{
+	EFI_STATUS ret;
+	struct ufs_dev *dev;
+	struct unmap_parameter_list unmap;
+	UINTN i, n = 0;
+	UINT64 len, left, blocks = 0;
+	EFI_LBA lba;
+
+	ret = ufs_get_dev(handle, &dev);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	for (i = 0; i < count; i++) {
+		lba = ranges[i].start;
+		left = ranges[i].end - ranges[i].start + 1;
+		while (left) {
+			len = min(left, dev->max_unmap_lba - blocks);
+			unmap.block_desc[n].lba = htobe64(lba);
+			unmap.block_desc[n].count = htobe32(len);
+			unmap.block_desc[n].reserved = 0;
+			n++;
+			blocks += len;
+			lba += len;
+			left -= len;
+
+			if (n < dev->max_unmap_desc && blocks < dev->max_unmap_lba)
+				continue;
+
+			ret = ufs_unmap(dev, &unmap, n, blocks);
+			if (EFI_ERROR(ret))
+				return ret;
+			n = 0;
+			blocks = 0;
+		}
+	}
+
+	if (n)
+		return ufs_unmap(dev, &unmap, n, blocks);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+{
+	struct discard_range range = { .start = start, .end = end };
+
+	return ufs_discard_ranges(handle, bio, &range, 1);
+}
+
 
 static UINT64 lun_factory = UFS_DEFAULT_FACTORY_LUN;
 static UINT64 lun_user = UFS_DEFAULT_USER_LUN;
@@ -257,6 +415,7 @@ static EFI_STATUS ufs_set_log_unit_lun(UINT64 new_lun_user, UINT64 new_lun_facto
 
 struct storage STORAGE(STORAGE_UFS) = {
 	.erase_blocks = ufs_erase_blocks,
+	.discard_ranges = ufs_discard_ranges,
 	.check_logical_unit = ufs_check_logical_unit,
 	.set_logical_unit = ufs_set_log_unit_lun,
 	.probe = is_ufs,
@@ -958,12 +958,15 @@ EFI_STATUS read_efi_rollback_index(UINTN rollback_index_slot, uint64_t* out_roll
 			debug(L"EFI variable %s is not found", name);
 		return ret;
 	}
-	debug(L"Success to read EFI variable %s: 0x%llx ", name, *(uint64_t *)data);
 
-	if (size != sizeof(*out_rollback_index))
+	if (size != sizeof(*out_rollback_index)) {
+		FreePool(data);
 		return EFI_COMPROMISED_DATA;
+	}
 
 	*out_rollback_index = *(uint64_t *)data;
+	FreePool(data);
+	debug(L"Success to read EFI variable %s: 0x%llx ", name, *out_rollback_index);
 
 	return EFI_SUCCESS;
 }
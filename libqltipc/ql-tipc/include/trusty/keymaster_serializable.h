@@ -26,77 +26,57 @@
 #define TRUSTY_KEYMASTER_SERIALIZABLE_H_
 
 #include <trusty/keymaster.h>
+#include <trusty/trusty_ipc.h>
 
 /**
  * Simple serialization routines for dynamically sized keymaster messages.
  */
 
 /**
- * Appends |data_len| bytes at |data| to |buf|. Performs no bounds checking,
- * assumes sufficient memory allocated at |buf|. Returns |buf| + |data_len|.
+ * Scatter-gather keymaster request. The command header and the fixed size
+ * fields are stored in |words| while variable size data is referenced in
+ * place, so the request is copied only once, into the shared IPC buffer.
+ * Consecutive words share a single iovec. The request holds pointers to
+ * itself and must not be copied once initialized.
  */
-uint8_t *append_to_buf(uint8_t *buf, const void *data, size_t data_len);
+#define KM_SG_REQ_MAX_IOVS 24
+#define KM_SG_REQ_MAX_WORDS 16
 
-/**
- * Appends |val| to |buf|. Performs no bounds checking. Returns |buf| +
- * sizeof(uint32_t).
- */
-uint8_t *append_uint32_to_buf(uint8_t *buf, uint32_t val);
-
-/**
- * Appends a sized buffer to |buf|. First appends |data_len| to |buf|, then
- * appends |data_len| bytes at |data| to |buf|. Performs no bounds checking.
- * Returns |buf| + sizeof(uint32_t) + |data_len|.
- */
-uint8_t *append_sized_buf_to_buf(uint8_t *buf, const uint8_t *data,
-                                 uint32_t data_len);
-
-/**
- * Serializes a km_boot_params structure. On success, allocates |*out_size|
- * bytes to |*out| and writes the serialized |params| to |*out|. Caller takes
- * ownership of |*out|. Returns one of trusty_err.
- */
-int km_boot_params_serialize(const struct km_boot_params *params, uint8_t **out,
-                             uint32_t *out_size);
-
-/**
- * Serializes a km_boot_patchlevel structure. On success, allocates |*out_size|
- * bytes to |*out| and writes the serialized |params| to |*out|. Caller takes
- * ownership of |*out|. Returns one of trusty_err.
- */
-int km_boot_patchlevel_serialize(const struct km_boot_patchlevel *params, uint8_t **out,
-                             uint32_t *out_size);
-
-/**
- * Serializes a km_attestation_ids structure. On success, allocates |*out_size|
- * bytes to |*out| and writes the serialized |params| to |*out|. Caller takes
- * ownership of |*out|. Returns one of trusty_err.
- */
-int km_attestation_ids_serialize(const struct km_attestation_ids *params, uint8_t **out,
-                             uint32_t *out_size);
+struct km_sg_req {
+    struct trusty_ipc_iovec iovs[KM_SG_REQ_MAX_IOVS];
+    uint32_t words[KM_SG_REQ_MAX_WORDS];
+    size_t iovs_cnt;
+    size_t words_cnt;
+    int error;
+};
 
 /**
- * Serializes a km_attestation_data structure. On success, allocates |*out_size|
- * bytes to |*out| and writes the serialized |data| to |*out|. Caller takes
- * ownership of |*out|. Returns one of trusty_err.
+ * Initializes |req| with the keymaster_message header for |cmd|.
  */
-int km_attestation_data_serialize(const struct km_attestation_data *data,
-                                  uint8_t **out, uint32_t *out_size);
+void km_sg_req_init(struct km_sg_req *req, uint32_t cmd);
 
 /**
- * Serializes a km_provision_data structure. On success, allocates |*out_size|
- * bytes to |*out| and writes the serialized |data| to |*out|. Caller takes
- * ownership of |*out|. Returns one of trusty_err.
+ * Append a 32-bit word, |data_len| bytes at |data|, or |data_len| followed
+ * by |data_len| bytes at |data| to |req|. |data| is referenced, not copied,
+ * and must stay valid until the request is sent. On overflow, |req->error|
+ * is set and the request must not be sent.
  */
-int km_provision_data_serialize(const struct km_provision_data *data,
-                                uint8_t** out, uint32_t *out_size);
+void km_sg_append_uint32(struct km_sg_req *req, uint32_t val);
+void km_sg_append(struct km_sg_req *req, const void *data, size_t data_len);
+void km_sg_append_sized_buf(struct km_sg_req *req, const uint8_t *data,
+                            uint32_t data_len);
 
 /**
- * Serializes a km_raw_buffer structure. On success, allocates |*out_size|
- * bytes to |*out| and writes the serialized |data| to |*out|. Caller takes
- * ownership of |*out|. Returns one of trusty_err.
+ * Serialization routines for the keymaster requests: append the serialized
+ * |params| or |data| to |req|. Return one of trusty_err.
  */
-int km_raw_buffer_serialize(const struct km_raw_buffer *buf, uint8_t** out,
-                            uint32_t *out_size);
+int km_boot_params_serialize_sg(const struct km_boot_params *params,
+                                struct km_sg_req *req);
+int km_boot_patchlevel_serialize_sg(const struct km_boot_patchlevel *params,
+                                    struct km_sg_req *req);
+int km_attestation_ids_serialize_sg(const struct km_attestation_ids *params,
+                                    struct km_sg_req *req);
+int km_attestation_data_serialize_sg(const struct km_attestation_data *data,
+                                     struct km_sg_req *req);
 
 #endif /* TRUSTY_KEYMASTER_SERIALIZABLE_H_ */
@@ -180,25 +180,15 @@ static int km_read_data_response(uint32_t cmd, int32_t *error,
     return TRUSTY_ERR_NONE;
 }
 
-/**
- * Convenience method to send a request to the secure side
- * and receive the response. If |resp_data| is not NULL, the
- * caller expects an additional data buffer to be returned from the secure
- * side.
+/* Receives the response to |cmd|. If |resp_data| is not NULL, the caller
+ * expects an additional data buffer to be returned from the secure side.
  */
-static int km_do_tipc(uint32_t cmd, void* req,
-                      uint32_t req_len, void* resp_data,
-                      uint32_t* resp_data_len)
+static int km_read_response(uint32_t cmd, void* resp_data,
+                            uint32_t* resp_data_len)
 {
     int rc = TRUSTY_ERR_GENERIC;
     struct km_no_response resp_header  = { .error = 0 };
 
-    rc = km_send_request(cmd, req, req_len);
-    if (rc < 0) {
-        trusty_error("%s: failed (%d) to send km request\n", __func__, rc);
-        return rc;
-    }
-
     if (!resp_data) {
         rc = km_read_raw_response(cmd, &resp_header, sizeof(resp_header));
     } else {
@@ -218,6 +208,31 @@ static int km_do_tipc(uint32_t cmd, void* req,
     return TRUSTY_ERR_NONE;
 }
 
+/**
+ * Convenience method to send a scatter-gather request to the secure side
+ * and receive the response. The request is gathered straight into the
+ * shared IPC buffer.
+ */
+static int km_do_tipc_sg(const struct km_sg_req *req, void* resp_data,
+                         uint32_t* resp_data_len)
+{
+    int rc;
+
+    if (req->error) {
+        trusty_error("%s: failed (%d) to build km request\n", __func__,
+                     req->error);
+        return req->error;
+    }
+
+    rc = trusty_ipc_send(&km_chan, req->iovs, req->iovs_cnt, true);
+    if (rc < 0) {
+        trusty_error("%s: failed (%d) to send km request\n", __func__, rc);
+        return rc;
+    }
+
+    return km_read_response(req->words[0], resp_data, resp_data_len);
+}
+
 static int32_t MessageVersion(uint8_t major_ver, uint8_t minor_ver,
                               uint8_t subminor_ver) {
     UNUSED(subminor_ver);
@@ -368,21 +383,16 @@ int trusty_set_boot_params(uint32_t os_version, uint32_t os_patchlevel,
         .verified_boot_hash_size = verified_boot_hash_size,
         .verified_boot_hash = verified_boot_hash
     };
-    uint8_t *req = NULL;
-    uint32_t req_size = 0;
-    int rc = km_boot_params_serialize(&params, &req, &req_size);
+    struct km_sg_req req;
+    int rc;
 
+    km_sg_req_init(&req, KM_SET_BOOT_PARAMS);
+    rc = km_boot_params_serialize_sg(&params, &req);
     if (rc < 0) {
         trusty_error("failed (%d) to serialize request\n", rc);
-        goto end;
-    }
-    rc = km_do_tipc(KM_SET_BOOT_PARAMS, req, req_size, NULL, NULL);
-
-end:
-    if (req) {
-        trusty_free(req);
+        return rc;
     }
-    return rc;
+    return km_do_tipc_sg(&req, NULL, NULL);
 }
 
 int trusty_config_boot_patchlevel(uint32_t boot_patchlevel)
@@ -390,21 +400,16 @@ int trusty_config_boot_patchlevel(uint32_t boot_patchlevel)
     struct km_boot_patchlevel params = {
         .boot_patchlevel = boot_patchlevel
     };
-    uint8_t *req = NULL;
-    uint32_t req_size = 0;
-    int rc = km_boot_patchlevel_serialize(&params, &req, &req_size);
+    struct km_sg_req req;
+    int rc;
 
+    km_sg_req_init(&req, KM_CONFIGURE_BOOT_PATCHLEVEL);
+    rc = km_boot_patchlevel_serialize_sg(&params, &req);
     if (rc < 0) {
         trusty_error("failed (%d) to serialize request\n", rc);
-        goto end;
-    }
-    rc = km_do_tipc(KM_CONFIGURE_BOOT_PATCHLEVEL, req, req_size, NULL, NULL);
-
-end:
-    if (req) {
-        trusty_free(req);
+        return rc;
     }
-    return rc;
+    return km_do_tipc_sg(&req, NULL, NULL);
 }
 
 int trusty_set_attestation_ids(const uint8_t *brand,
@@ -442,20 +447,16 @@ int trusty_set_attestation_ids(const uint8_t *brand,
         .model_size = model_size,
         .model = model
     };
-    uint8_t *req = NULL;
-    uint32_t req_size = 0;
-    int rc = km_attestation_ids_serialize(&params, &req, &req_size);
+    struct km_sg_req req;
+    int rc;
+
+    km_sg_req_init(&req, KM_SET_ATTESTATION_IDS);
+    rc = km_attestation_ids_serialize_sg(&params, &req);
     if (rc < 0) {
         trusty_error("failed (%d) to serialize request\n", rc);
-        goto end;
-    }
-    rc = km_do_tipc(KM_SET_ATTESTATION_IDS, req, req_size, NULL, NULL);
-
-end:
-    if (req) {
-        trusty_free(req);
+        return rc;
     }
-    return rc;
+    return km_do_tipc_sg(&req, NULL, NULL);
 }
 
 static int trusty_send_attestation_data(uint32_t cmd, const uint8_t *data,
@@ -467,21 +468,16 @@ static int trusty_send_attestation_data(uint32_t cmd, const uint8_t *data,
         .data_size = data_size,
         .data = (uint8_t *)data,
     };
-    uint8_t *req = NULL;
-    uint32_t req_size = 0;
-    int rc = km_attestation_data_serialize(&attestation_data, &req, &req_size);
+    struct km_sg_req req;
+    int rc;
 
+    km_sg_req_init(&req, cmd);
+    rc = km_attestation_data_serialize_sg(&attestation_data, &req);
     if (rc < 0) {
         trusty_error("failed (%d) to serialize request\n", rc);
-        goto end;
-    }
-    rc = km_do_tipc(cmd, req, req_size, NULL, NULL);
-
-end:
-    if (req) {
-        trusty_free(req);
+        return rc;
     }
-    return rc;
+    return km_do_tipc_sg(&req, NULL, NULL);
 }
 
 int trusty_set_attestation_key(const uint8_t *key, uint32_t key_size,
@@ -24,166 +24,115 @@
 
 #include <trusty/keymaster_serializable.h>
 
-uint8_t *append_to_buf(uint8_t *buf, const void *data, size_t data_len)
+void km_sg_req_init(struct km_sg_req *req, uint32_t cmd)
 {
-    if (data && data_len) {
-        trusty_memcpy(buf, (void *)data, data_len);
-    }
-    return buf + data_len;
-}
-
-uint8_t *append_uint32_to_buf(uint8_t *buf, uint32_t val)
-{
-    return append_to_buf(buf, &val, sizeof(val));
+    req->iovs_cnt = 0;
+    req->words_cnt = 0;
+    req->error = TRUSTY_ERR_NONE;
+    km_sg_append_uint32(req, cmd);
 }
 
-uint8_t *append_sized_buf_to_buf(uint8_t *buf, const uint8_t *data,
-                                 uint32_t data_len)
+void km_sg_append_uint32(struct km_sg_req *req, uint32_t val)
 {
-    buf = append_uint32_to_buf(buf, data_len);
-    return append_to_buf(buf, data, data_len);
-}
+    struct trusty_ipc_iovec *last = req->iovs_cnt ?
+            &req->iovs[req->iovs_cnt - 1] : NULL;
+    uint32_t *word = &req->words[req->words_cnt];
 
-int km_boot_params_serialize(const struct km_boot_params *params, uint8_t** out,
-                             uint32_t *out_size)
-{
-    uint8_t *tmp;
-
-    if (!out || !params || !out_size) {
-        return TRUSTY_ERR_INVALID_ARGS;
-    }
-    *out_size = (sizeof(params->os_version) + sizeof(params->os_patchlevel) +
-                 sizeof(params->device_locked) +
-                 sizeof(params->verified_boot_state) +
-                 sizeof(params->verified_boot_key_hash_size) +
-                 sizeof(params->verified_boot_hash_size) +
-                 params->verified_boot_key_hash_size +
-                 params->verified_boot_hash_size);
-    *out = trusty_calloc(*out_size, 1);
-    if (!*out) {
-        return TRUSTY_ERR_NO_MEMORY;
+    if (req->words_cnt == KM_SG_REQ_MAX_WORDS) {
+        req->error = TRUSTY_ERR_MSG_TOO_BIG;
+        return;
     }
+    *word = val;
+    req->words_cnt++;
 
-    tmp = append_uint32_to_buf(*out, params->os_version);
-    tmp = append_uint32_to_buf(tmp, params->os_patchlevel);
-    tmp = append_uint32_to_buf(tmp, params->device_locked);
-    tmp = append_uint32_to_buf(tmp, params->verified_boot_state);
-    tmp = append_sized_buf_to_buf(tmp, params->verified_boot_key_hash,
-                                  params->verified_boot_key_hash_size);
-    tmp = append_sized_buf_to_buf(tmp, params->verified_boot_hash,
-                                  params->verified_boot_hash_size);
-
-    return TRUSTY_ERR_NONE;
+    /* Extend the previous iovec if it ends with the previous word */
+    if (last && (uint8_t *)last->base + last->len == (uint8_t *)word) {
+        last->len += sizeof(val);
+        return;
+    }
+    km_sg_append(req, word, sizeof(val));
 }
 
-int km_boot_patchlevel_serialize(const struct km_boot_patchlevel *params, uint8_t** out,
-                             uint32_t *out_size)
+void km_sg_append(struct km_sg_req *req, const void *data, size_t data_len)
 {
-    if (!out || !params || !out_size) {
-        return TRUSTY_ERR_INVALID_ARGS;
+    if (!data || !data_len) {
+        return;
     }
-    *out_size = (sizeof(params->boot_patchlevel));
-    *out = trusty_calloc(*out_size, 1);
-    if (!*out) {
-        return TRUSTY_ERR_NO_MEMORY;
+    if (req->iovs_cnt == KM_SG_REQ_MAX_IOVS) {
+        req->error = TRUSTY_ERR_MSG_TOO_BIG;
+        return;
     }
-    
-    append_uint32_to_buf(*out, params->boot_patchlevel);
-
-    return TRUSTY_ERR_NONE;
+    req->iovs[req->iovs_cnt].base = (void *)data;
+    req->iovs[req->iovs_cnt].len = data_len;
+    req->iovs_cnt++;
 }
 
-int km_attestation_ids_serialize(const struct km_attestation_ids *params, uint8_t** out,
-                             uint32_t *out_size)
+void km_sg_append_sized_buf(struct km_sg_req *req, const uint8_t *data,
+                            uint32_t data_len)
 {
-    uint8_t *tmp;
+    km_sg_append_uint32(req, data_len);
+    km_sg_append(req, data, data_len);
+}
 
-    if (!out || !params || !out_size) {
+int km_boot_params_serialize_sg(const struct km_boot_params *params,
+                                struct km_sg_req *req)
+{
+    if (!params || !req) {
         return TRUSTY_ERR_INVALID_ARGS;
     }
-    *out_size = (sizeof(params->brand_size) +
-                 sizeof(params->device_size) +
-                 sizeof(params->product_size) +
-                 sizeof(params->serial_size) +
-                 sizeof(params->imei_size) +
-                 sizeof(params->meid_size) +
-                 sizeof(params->manufacturer_size) +
-                 sizeof(params->model_size) +
-                 params->brand_size +
-                 params->device_size +
-                 params->product_size +
-                 params->serial_size +
-                 params->imei_size +
-                 params->meid_size +
-                 params->manufacturer_size +
-                 params->model_size);
-    *out = trusty_calloc(*out_size, 1);
-    if (!*out) {
-        return TRUSTY_ERR_NO_MEMORY;
-    }
 
-    tmp = append_sized_buf_to_buf(*out, params->brand, params->brand_size);
-    tmp = append_sized_buf_to_buf(tmp, params->device, params->device_size);
-    tmp = append_sized_buf_to_buf(tmp, params->product, params->product_size);
-    tmp = append_sized_buf_to_buf(tmp, params->serial, params->serial_size);
-    tmp = append_sized_buf_to_buf(tmp, params->imei, params->imei_size);
-    tmp = append_sized_buf_to_buf(tmp, params->meid, params->meid_size);
-    tmp = append_sized_buf_to_buf(tmp, params->manufacturer, params->manufacturer_size);
-    tmp = append_sized_buf_to_buf(tmp, params->model, params->model_size);
+    km_sg_append_uint32(req, params->os_version);
+    km_sg_append_uint32(req, params->os_patchlevel);
+    km_sg_append_uint32(req, params->device_locked);
+    km_sg_append_uint32(req, params->verified_boot_state);
+    km_sg_append_sized_buf(req, params->verified_boot_key_hash,
+                           params->verified_boot_key_hash_size);
+    km_sg_append_sized_buf(req, params->verified_boot_hash,
+                           params->verified_boot_hash_size);
 
-    return TRUSTY_ERR_NONE;
+    return req->error;
 }
 
-int km_attestation_data_serialize(const struct km_attestation_data *data,
-                                 uint8_t** out, uint32_t *out_size)
+int km_boot_patchlevel_serialize_sg(const struct km_boot_patchlevel *params,
+                                    struct km_sg_req *req)
 {
-    uint8_t *tmp;
-
-    if (!out || !data || !out_size) {
+    if (!params || !req) {
         return TRUSTY_ERR_INVALID_ARGS;
     }
-    *out_size = (sizeof(data->algorithm) + sizeof(data->data_size) +
-                 data->data_size);
-    *out = trusty_calloc(*out_size, 1);
-    if (!*out) {
-        return TRUSTY_ERR_NO_MEMORY;
-    }
 
-    tmp = append_uint32_to_buf(*out, data->algorithm);
-    tmp = append_sized_buf_to_buf(tmp, data->data, data->data_size);
+    km_sg_append_uint32(req, params->boot_patchlevel);
 
-    return TRUSTY_ERR_NONE;
+    return req->error;
 }
 
-int km_provision_data_serialize(const struct km_provision_data *data,
-                                 uint8_t** out, uint32_t *out_size)
+int km_attestation_ids_serialize_sg(const struct km_attestation_ids *params,
+                                    struct km_sg_req *req)
 {
-    if (!out || !data || !out_size) {
+    if (!params || !req) {
         return TRUSTY_ERR_INVALID_ARGS;
     }
-    *out_size = (sizeof(data->data_size) + data->data_size);
-    *out = trusty_calloc(*out_size, 1);
-    if (!*out) {
-        return TRUSTY_ERR_NO_MEMORY;
-    }
 
-    append_sized_buf_to_buf(*out, data->data, data->data_size);
+    km_sg_append_sized_buf(req, params->brand, params->brand_size);
+    km_sg_append_sized_buf(req, params->device, params->device_size);
+    km_sg_append_sized_buf(req, params->product, params->product_size);
+    km_sg_append_sized_buf(req, params->serial, params->serial_size);
+    km_sg_append_sized_buf(req, params->imei, params->imei_size);
+    km_sg_append_sized_buf(req, params->meid, params->meid_size);
+    km_sg_append_sized_buf(req, params->manufacturer, params->manufacturer_size);
+    km_sg_append_sized_buf(req, params->model, params->model_size);
 
-    return TRUSTY_ERR_NONE;
+    return req->error;
 }
 
-int km_raw_buffer_serialize(const struct km_raw_buffer *buf, uint8_t** out,
-                            uint32_t *out_size)
+int km_attestation_data_serialize_sg(const struct km_attestation_data *data,
+                                     struct km_sg_req *req)
 {
-    if (!out || !buf || !out_size) {
+    if (!data || !req) {
         return TRUSTY_ERR_INVALID_ARGS;
     }
-    *out_size = sizeof(buf->data_size) + buf->data_size;
-    *out = trusty_calloc(*out_size, 1);
-    if (!*out) {
-        return TRUSTY_ERR_NO_MEMORY;
-    }
-    append_sized_buf_to_buf(*out, buf->data, buf->data_size);
 
-    return TRUSTY_ERR_NONE;
+    km_sg_append_uint32(req, data->algorithm);
+    km_sg_append_sized_buf(req, data->data, data->data_size);
+
+    return req->error;
 }
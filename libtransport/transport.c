@@ -33,15 +33,286 @@
 #include <lib.h>
 #include <transport.h>
 
+/* All the registered transports which can be started are started
+ * concurrently.  The first one to receive data from the host owns the
+ * session, the next one is handed to the optional secondary
+ * callbacks.  A transport layer gives its role back when it is
+ * disconnected or when a host connects again.
+ *
+ * Until a transport layer has a role, its first read, as issued by
+ * the start callback, is received in its probe buffer.  The probe
+ * data is handed over to the first read of the role it gets. */
+#define MAX_TRANSPORTS		4
+#define NO_TRANSPORT		((UINTN)-1)
+#define PROBE_SIZE		256
+
 static transport_t *transports;
 static UINTN nb_transport;
-static transport_t *current;
+static UINTN owner = NO_TRANSPORT;
+static UINTN secondary = NO_TRANSPORT;
+
+static struct link {
+	BOOLEAN started;
+	BOOLEAN probe_pending;
+	UINT8 probe[PROBE_SIZE];
+	UINT32 probe_len;
+	UINT32 probe_off;
+	void *rx_buf;		/* Read served from the probe data */
+	UINT32 rx_len;
+} links[MAX_TRANSPORTS];
+
+/* Scheduler */
+#define MAX_WATCHED_EVENTS	8
+#define POLL_PERIOD		(1 * 10000)	/* 1 ms in 100ns unit */
+
+struct watched_event {
+	EFI_EVENT event;
+	sched_callback_t callback;
+	void *context;
+	BOOLEAN is_timer;
+};
+
+struct idle_job {
+	struct idle_job *next;
+	sched_callback_t callback;
+	void *context;
+};
+
+static struct watched_event watched[MAX_WATCHED_EVENTS];
+static UINTN nb_watched;
+static struct idle_job *idle_head, *idle_tail;
+static EFI_EVENT poll_timer;
+static BOOLEAN activity;
+
+static struct callbacks {
+	start_callback_t start;
+	data_callback_t rx;
+	data_callback_t tx;
+} session_cbs, secondary_cbs;
+
+/* Transport layer whose start callback is being run to set its probe
+ * size, and the callbacks of the role it may get.  */
+static UINTN probing = NO_TRANSPORT;
+static struct callbacks *probing_cbs;
+
+static struct callbacks *callbacks_of(UINTN index)
+{
+	if (index == owner)
+		return &session_cbs;
+	if (index == secondary && secondary_cbs.start)
+		return &secondary_cbs;
+	return NULL;
+}
+
+static void link_release(UINTN index, const CHAR16 *why)
+{
+	if (index == owner) {
+		debug(L"%a transport layer %s, session released",
+		      transports[index].name, why);
+		owner = NO_TRANSPORT;
+	} else if (index == secondary) {
+		debug(L"%a transport layer %s, secondary link released",
+		      transports[index].name, why);
+		secondary = NO_TRANSPORT;
+	}
+}
+
+static void link_reset(UINTN index)
+{
+	struct link *link = &links[index];
+
+	link->probe_pending = FALSE;
+	link->probe_len = link->probe_off = 0;
+	link->rx_buf = NULL;
+}
+
+/* Read the first data of a transport layer without a role in its
+ * probe buffer.  */
+static EFI_STATUS link_probe(UINTN index, UINT32 size)
+{
+	struct link *link = &links[index];
+	EFI_STATUS ret;
+
+	if (link->probe_pending)
+		return EFI_SUCCESS;
+
+	ret = transports[index].read(link->probe, min(size, (UINT32)PROBE_SIZE));
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read from %a transport layer",
+			   transports[index].name);
+		return ret;
+	}
+
+	link->probe_pending = TRUE;
+	return EFI_SUCCESS;
+}
+
+/* Serve a read from the probe data if any is left, the data is
+ * delivered by deliver_probe().  */
+static EFI_STATUS link_read(UINTN index, void *buf, UINT32 size)
+{
+	struct link *link = &links[index];
+	UINT32 len;
+	EFI_STATUS ret;
+
+	if (!link->probe_len)
+		return transports[index].read(buf, size);
+
+	len = min(size, link->probe_len);
+	ret = memcpy_s(buf, size, link->probe + link->probe_off, len);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	link->probe_off += len;
+	link->probe_len -= len;
+	link->rx_buf = buf;
+	link->rx_len = len;
+	activity = TRUE;
+
+	return EFI_SUCCESS;
+}
+
+static void deliver_probe(UINTN index)
+{
+	struct link *link = &links[index];
+	struct callbacks *cbs = callbacks_of(index);
+	void *buf = link->rx_buf;
+
+	if (!buf)
+		return;
+
+	link->rx_buf = NULL;
+	if (cbs)
+		cbs->rx(buf, link->rx_len);
+}
+
+/* Give a role to a transport layer which received its first data.  */
+static void link_claim(UINTN index, unsigned len)
+{
+	struct callbacks *cbs;
+
+	links[index].probe_pending = FALSE;
+	links[index].probe_len = len;
+	links[index].probe_off = 0;
+
+	if (owner == NO_TRANSPORT) {
+		owner = index;
+		debug(L"%a transport layer owns the session",
+		      transports[index].name);
+	} else if (secondary == NO_TRANSPORT && secondary_cbs.start) {
+		secondary = index;
+		debug(L"%a transport layer is the secondary link",
+		      transports[index].name);
+	}
+
+	cbs = callbacks_of(index);
+	if (!cbs) {
+		debug(L"%a transport layer connected but not used",
+		      transports[index].name);
+		link_reset(index);
+		return;
+	}
+
+	cbs->start();
+	deliver_probe(index);
+}
+
+/* The transport callbacks are wrapped to route the events to the
+ * session owner or to the secondary link and to track the transport
+ * activity: as long as data is flowing the scheduler keeps polling
+ * the transport layer without sleeping. */
+static void transport_started(UINTN index)
+{
+	struct callbacks *cbs;
+
+	activity = TRUE;
+
+	link_release(index, L"reconnected");
+	link_reset(index);
+
+	/* The start callback of the role the transport layer may get
+	   issues the first read, which sets the probe size.  */
+	if (owner == NO_TRANSPORT)
+		cbs = &session_cbs;
+	else if (secondary == NO_TRANSPORT && secondary_cbs.start)
+		cbs = &secondary_cbs;
+	else {
+		debug(L"%a transport layer connected but not used",
+		      transports[index].name);
+		return;
+	}
+
+	probing = index;
+	probing_cbs = cbs;
+	cbs->start();
+	probing = NO_TRANSPORT;
+	probing_cbs = NULL;
+}
+
+static void transport_received(UINTN index, void *buf, unsigned len)
+{
+	struct callbacks *cbs;
+
+	activity = TRUE;
+
+	if (links[index].probe_pending && buf == links[index].probe) {
+		link_claim(index, len);
+		return;
+	}
+
+	cbs = callbacks_of(index);
+	if (cbs)
+		cbs->rx(buf, len);
+}
+
+static void transport_sent(UINTN index, void *buf, unsigned len)
+{
+	struct callbacks *cbs = callbacks_of(index);
+
+	activity = TRUE;
+	if (cbs)
+		cbs->tx(buf, len);
+}
+
+#define TRANSPORT_CALLBACKS(n)						\
+	static void transport_start_cb_##n(void)			\
+	{								\
+		transport_started(n);					\
+	}								\
+	static void transport_rx_cb_##n(void *buf, unsigned len)	\
+	{								\
+		transport_received(n, buf, len);			\
+	}								\
+	static void transport_tx_cb_##n(void *buf, unsigned len)	\
+	{								\
+		transport_sent(n, buf, len);				\
+	}
+
+TRANSPORT_CALLBACKS(0)
+TRANSPORT_CALLBACKS(1)
+TRANSPORT_CALLBACKS(2)
+TRANSPORT_CALLBACKS(3)
+
+#define TRANSPORT_CALLBACKS_ENTRY(n)					\
+	{ transport_start_cb_##n, transport_rx_cb_##n, transport_tx_cb_##n }
+
+static const struct callbacks TRANSPORT_CBS[MAX_TRANSPORTS] = {
+	TRANSPORT_CALLBACKS_ENTRY(0),
+	TRANSPORT_CALLBACKS_ENTRY(1),
+	TRANSPORT_CALLBACKS_ENTRY(2),
+	TRANSPORT_CALLBACKS_ENTRY(3)
+};
 
 EFI_STATUS transport_register(transport_t *trans, UINTN nb)
 {
 	if (!trans || !nb)
 		return EFI_INVALID_PARAMETER;
 
+	if (nb > MAX_TRANSPORTS) {
+		error(L"Too many transport layers, %d maximum", MAX_TRANSPORTS);
+		return EFI_INVALID_PARAMETER;
+	}
+
 	transports = trans;
 	nb_transport = nb;
 
@@ -54,60 +325,359 @@ void transport_unregister(void)
 	nb_transport = 0;
 }
 
+EFI_STATUS transport_set_secondary(start_callback_t start_cb,
+				   data_callback_t rx_cb,
+				   data_callback_t tx_cb)
+{
+	if (!start_cb || !rx_cb || !tx_cb)
+		return EFI_INVALID_PARAMETER;
+
+	secondary_cbs.start = start_cb;
+	secondary_cbs.rx = rx_cb;
+	secondary_cbs.tx = tx_cb;
+
+	return EFI_SUCCESS;
+}
+
 EFI_STATUS transport_start(start_callback_t start_cb,
 			   data_callback_t rx_cb,
 			   data_callback_t tx_cb)
 {
-	EFI_STATUS ret = EFI_NOT_READY;
+	EFI_STATUS ret, first_error = EFI_NOT_READY;
+	BOOLEAN any_started = FALSE;
 	UINTN i;
 
 	if (!start_cb || !rx_cb || !tx_cb)
 		return EFI_INVALID_PARAMETER;
 
+	session_cbs.start = start_cb;
+	session_cbs.rx = rx_cb;
+	session_cbs.tx = tx_cb;
+	owner = secondary = NO_TRANSPORT;
+
 	for (i = 0; i < nb_transport; i++) {
-		current = &transports[i];
-		ret = current->start(start_cb, rx_cb, tx_cb);
-		if (!EFI_ERROR(ret))
-			break;
-		current = NULL;
+		link_reset(i);
+		ret = transports[i].start(TRANSPORT_CBS[i].start,
+					  TRANSPORT_CBS[i].rx,
+					  TRANSPORT_CBS[i].tx);
+		links[i].started = !EFI_ERROR(ret);
+		if (links[i].started) {
+			debug(L"%a transport layer started", transports[i].name);
+			any_started = TRUE;
+			continue;
+		}
 
 		if (ret == EFI_UNSUPPORTED) {
 			debug(L"%a transport layer is not supported, skipping",
 			      transports[i].name);
 			continue;
 		}
+
 		efi_perror(ret, L"Failed to initialize %a transport layer",
 			   transports[i].name);
-		break;
+		if (first_error == EFI_NOT_READY)
+			first_error = ret;
 	}
 
-	if (current)
-		debug(L"%a transport layer selected", current->name);
-
-	return ret;
+	return any_started ? EFI_SUCCESS : first_error;
 }
 
 EFI_STATUS transport_stop(void)
 {
-	EFI_STATUS ret;
+	EFI_STATUS ret = EFI_NOT_STARTED, stop_ret;
+	UINTN i;
+
+	for (i = 0; i < nb_transport; i++) {
+		if (!links[i].started)
+			continue;
+
+		stop_ret = transports[i].stop();
+		if (ret == EFI_NOT_STARTED || EFI_ERROR(stop_ret))
+			ret = stop_ret;
+		links[i].started = FALSE;
+		link_reset(i);
+	}
+
+	owner = secondary = NO_TRANSPORT;
+	secondary_cbs.start = NULL;
 
-	ret = current ? current->stop() : EFI_NOT_STARTED;
-	current = NULL;
+	transport_sched_free();
 
 	return ret;
 }
 
 EFI_STATUS transport_run(void)
 {
-	return current ? current->run() : EFI_NOT_STARTED;
+	EFI_STATUS ret = EFI_NOT_STARTED, run_ret;
+	UINTN i;
+
+	for (i = 0; i < nb_transport; i++) {
+		if (!links[i].started)
+			continue;
+
+		if ((i == owner || i == secondary) && transports[i].connected &&
+		    !transports[i].connected()) {
+			link_release(i, L"disconnected");
+			link_reset(i);
+		}
+
+		deliver_probe(i);
+
+		run_ret = transports[i].run();
+		if (ret == EFI_NOT_STARTED ||
+		    (EFI_ERROR(run_ret) && run_ret != EFI_TIMEOUT))
+			ret = run_ret;
+	}
+
+	return ret;
 }
 
 EFI_STATUS transport_read(void *buf, UINT32 size)
 {
-	return current ? current->read(buf, size) : EFI_NOT_STARTED;
+	if (probing_cbs == &session_cbs)
+		return link_probe(probing, size);
+
+	if (owner == NO_TRANSPORT)
+		return EFI_NOT_STARTED;
+
+	return link_read(owner, buf, size);
 }
 
 EFI_STATUS transport_write(void *buf, UINT32 size)
 {
-	return current ? current->write(buf, size) : EFI_NOT_STARTED;
+	if (owner == NO_TRANSPORT)
+		return EFI_NOT_STARTED;
+
+	return transports[owner].write(buf, size);
+}
+
+EFI_STATUS transport_secondary_read(void *buf, UINT32 size)
+{
+	if (probing_cbs == &secondary_cbs)
+		return link_probe(probing, size);
+
+	if (secondary == NO_TRANSPORT)
+		return EFI_NOT_STARTED;
+
+	return link_read(secondary, buf, size);
+}
+
+EFI_STATUS transport_secondary_write(void *buf, UINT32 size)
+{
+	if (secondary == NO_TRANSPORT)
+		return EFI_NOT_STARTED;
+
+	return transports[secondary].write(buf, size);
+}
+
+EFI_STATUS transport_watch_event(EFI_EVENT event, sched_callback_t callback,
+				 void *context)
+{
+	if (!event || !callback)
+		return EFI_INVALID_PARAMETER;
+
+	if (nb_watched == ARRAY_SIZE(watched)) {
+		error(L"Too many events watched by the transport scheduler");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	watched[nb_watched].event = event;
+	watched[nb_watched].callback = callback;
+	watched[nb_watched].context = context;
+	watched[nb_watched].is_timer = FALSE;
+	nb_watched++;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS transport_add_timer(UINTN period_ms, sched_callback_t callback,
+			       void *context)
+{
+	EFI_STATUS ret;
+	EFI_EVENT timer;
+
+	if (!period_ms || !callback)
+		return EFI_INVALID_PARAMETER;
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL,
+				NULL, &timer);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create the scheduler timer");
+		return ret;
+	}
+
+	ret = uefi_call_wrapper(BS->SetTimer, 3, timer, TimerPeriodic,
+				(UINT64)period_ms * 10000);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to set the scheduler timer");
+		goto err;
+	}
+
+	ret = transport_watch_event(timer, callback, context);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	watched[nb_watched - 1].is_timer = TRUE;
+	return EFI_SUCCESS;
+
+err:
+	uefi_call_wrapper(BS->CloseEvent, 1, timer);
+	return ret;
+}
+
+void transport_unwatch(sched_callback_t callback, void *context)
+{
+	UINTN i;
+
+	for (i = 0; i < nb_watched; ) {
+		if (watched[i].callback != callback ||
+		    watched[i].context != context) {
+			i++;
+			continue;
+		}
+
+		if (watched[i].is_timer)
+			uefi_call_wrapper(BS->CloseEvent, 1, watched[i].event);
+		watched[i] = watched[--nb_watched];
+	}
+}
+
+EFI_STATUS transport_defer(sched_callback_t callback, void *context)
+{
+	struct idle_job *job;
+
+	if (!callback)
+		return EFI_INVALID_PARAMETER;
+
+	job = AllocatePool(sizeof(*job));
+	if (!job)
+		return EFI_OUT_OF_RESOURCES;
+
+	job->next = NULL;
+	job->callback = callback;
+	job->context = context;
+
+	if (idle_tail)
+		idle_tail->next = job;
+	else
+		idle_head = job;
+	idle_tail = job;
+
+	return EFI_SUCCESS;
+}
+
+BOOLEAN transport_is_idle(void)
+{
+	return !idle_head;
+}
+
+static void run_idle_job(void)
+{
+	struct idle_job *job = idle_head;
+
+	idle_head = job->next;
+	if (!idle_head)
+		idle_tail = NULL;
+
+	job->callback(job->context);
+	FreePool(job);
+}
+
+static void dispatch_events(UINTN signaled)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	/* Callbacks are allowed to unwatch their own event, walk the
+	 * table backward to be robust to the table compaction. */
+	for (i = nb_watched; i > 0; i--) {
+		if (i - 1 == signaled) {
+			watched[i - 1].callback(watched[i - 1].context);
+			continue;
+		}
+
+		ret = uefi_call_wrapper(BS->CheckEvent, 1, watched[i - 1].event);
+		if (ret == EFI_SUCCESS)
+			watched[i - 1].callback(watched[i - 1].context);
+	}
+}
+
+/* Run one scheduling round: poll the transport layer and run one
+ * deferred job if any, otherwise sleep until a watched event is
+ * signaled or the next transport poll is due. */
+EFI_STATUS transport_schedule(void)
+{
+	EFI_EVENT events[MAX_WATCHED_EVENTS + 1];
+	EFI_STATUS ret;
+	UINTN i, index;
+
+	if (!poll_timer) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0,
+					NULL, NULL, &poll_timer);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create the transport poll timer");
+			poll_timer = NULL;
+			return ret;
+		}
+	}
+
+	activity = FALSE;
+	ret = transport_run();
+	if (EFI_ERROR(ret) && ret != EFI_TIMEOUT)
+		return ret;
+
+	/* Deferred jobs are run even if data is flowing: long jobs
+	 * are expected to keep the transport layer running. */
+	if (idle_head) {
+		run_idle_job();
+		activity = TRUE;
+	}
+
+	if (activity) {
+		dispatch_events(nb_watched);
+		return EFI_SUCCESS;
+	}
+
+	ret = uefi_call_wrapper(BS->SetTimer, 3, poll_timer, TimerRelative,
+				POLL_PERIOD);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to set the transport poll timer");
+		return ret;
+	}
+
+	for (i = 0; i < nb_watched; i++)
+		events[i] = watched[i].event;
+	events[nb_watched] = poll_timer;
+
+	ret = uefi_call_wrapper(BS->WaitForEvent, 3, nb_watched + 1,
+				events, &index);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Transport scheduler failed to wait for events");
+		return ret;
+	}
+
+	dispatch_events(index);
+
+	return EFI_SUCCESS;
+}
+
+void transport_sched_free(void)
+{
+	UINTN i;
+
+	while (idle_head) {
+		idle_tail = idle_head->next;
+		FreePool(idle_head);
+		idle_head = idle_tail;
+	}
+
+	for (i = 0; i < nb_watched; i++)
+		if (watched[i].is_timer)
+			uefi_call_wrapper(BS->CloseEvent, 1, watched[i].event);
+	nb_watched = 0;
+
+	if (poll_timer) {
+		uefi_call_wrapper(BS->CloseEvent, 1, poll_timer);
+		poll_timer = NULL;
+	}
 }
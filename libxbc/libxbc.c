@@ -16,21 +16,6 @@
 
 #include "libxbc.h"
 
-/*
- * Simple checksum for a buffer.
- *
- * @param addr pointer to the start of the buffer.
- * @param size size of the buffer in bytes.
- * @return check sum result.
- */
-static uint32_t checksum(const unsigned char* const buffer, uint32_t size) {
-    uint32_t sum = 0;
-    for (uint32_t i = 0; i < size; i++) {
-        sum += buffer[i];
-    }
-    return sum;
-}
-
 /*
  * Check if the bootconfig trailer is present within the bootconfig section.
  *
@@ -43,37 +28,276 @@ static BOOLEAN isTrailerPresent(uint64_t bootconfig_end_addr) {
                     BOOTCONFIG_MAGIC, BOOTCONFIG_MAGIC_SIZE);
 }
 
+static BOOLEAN isKeyChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-';
+}
+
+static BOOLEAN isBlank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/*
+ * Parse the key of a "key = value", "key += value", "key := value" or "key"
+ * parameter.
+ *
+ * @param param pointer to the parameter.
+ * @param len length of the parameter.
+ * @param key set to the start of the key.
+ * @param op set to the first character of the operator, '\0' if there is
+ *        none.
+ * @return length of the key, 0 if the parameter does not start with a valid
+ *         key.
+ */
+static uint32_t parseKey(const char *param, uint32_t len, const char **key,
+                         char *op) {
+    uint32_t i = 0, key_len = 0;
+
+    while (i < len && isBlank(param[i])) {
+        i++;
+    }
+    *key = param + i;
+    while (i < len && isKeyChar(param[i])) {
+        i++;
+        key_len++;
+    }
+    while (i < len && isBlank(param[i])) {
+        i++;
+    }
+    *op = '\0';
+    if (i == len) {
+        return key_len;
+    }
+    if ((param[i] == '+' || param[i] == ':') && i + 1 < len &&
+        param[i + 1] == '=') {
+        *op = param[i];
+        return key_len;
+    }
+    if (param[i] != '=') {
+        return 0;
+    }
+    *op = '=';
+    return key_len;
+}
+
+/*
+ * Look for a key by parsing every parameter of the boot config section.
+ */
+static BOOLEAN sectionHasKey(const BootConfigWriter *writer, const char *key,
+                             uint32_t len) {
+    const char *line = writer->start;
+    const char *end = writer->start + writer->size;
+
+    while (line < end) {
+        const char *eol = line;
+        const char *name;
+        uint32_t name_len;
+        char op;
+
+        while (eol < end && *eol != '\n') {
+            eol++;
+        }
+        name_len = parseKey(line, eol - line, &name, &op);
+        if (name_len == len && !memcmp(name, key, len)) {
+            return TRUE;
+        }
+        line = eol + 1;
+    }
+    return FALSE;
+}
+
+static BOOLEAN hasKey(const BootConfigWriter *writer, const char *key,
+                      uint32_t len) {
+    for (uint32_t i = 0; i < writer->nb_keys; i++) {
+        if (writer->keys[i].len == len &&
+            !memcmp(writer->keys[i].name, key, len)) {
+            return TRUE;
+        }
+    }
+    // the keys past a full index are only found in the section itself
+    if (writer->nb_keys == BOOTCONFIG_MAX_KEYS) {
+        return sectionHasKey(writer, key, len);
+    }
+    return FALSE;
+}
+
+static void addKey(BootConfigWriter *writer, const char *key, uint32_t len) {
+    if (writer->nb_keys < BOOTCONFIG_MAX_KEYS) {
+        writer->keys[writer->nb_keys].name = key;
+        writer->keys[writer->nb_keys].len = len;
+        writer->nb_keys++;
+    }
+}
+
+int32_t bootConfigWriterInit(BootConfigWriter *writer,
+                             uint64_t bootconfig_start_addr,
+                             uint32_t bootconfig_size, uint32_t capacity) {
+    if (!writer || !bootconfig_start_addr) {
+        return -1;
+    }
+
+    writer->start = (char *)(UINTN)bootconfig_start_addr;
+    writer->size = bootconfig_size;
+    writer->capacity = capacity;
+    writer->nb_keys = 0;
+
+    if (bootconfig_size >= BOOTCONFIG_TRAILER_SIZE &&
+        isTrailerPresent(bootconfig_start_addr + bootconfig_size)) {
+        memcpy_s(&writer->size, sizeof(writer->size),
+                 writer->start + bootconfig_size - (BOOTCONFIG_TRAILER_SIZE),
+                 BOOTCONFIG_SIZE_SIZE);
+        if (writer->size > bootconfig_size - (BOOTCONFIG_TRAILER_SIZE)) {
+            return -1;
+        }
+    }
+    if (writer->size + BOOTCONFIG_TRAILER_SIZE > capacity) {
+        return -1;
+    }
+
+    writer->checksum = sum_bytes(writer->start, writer->size);
+
+    // index the keys already defined
+    const char *line = writer->start;
+    const char *end = writer->start + writer->size;
+    while (line < end) {
+        const char *eol = line;
+        const char *key;
+        uint32_t key_len;
+        char op;
+
+        while (eol < end && *eol != '\n') {
+            eol++;
+        }
+        key_len = parseKey(line, eol - line, &key, &op);
+        if (key_len) {
+            addKey(writer, key, key_len);
+        }
+        line = eol + 1;
+    }
+
+    return 0;
+}
+
+int32_t bootConfigWriterAddParameters(BootConfigWriter *writer,
+                                      const char *params,
+                                      uint32_t params_size) {
+    if (!writer || !params) {
+        return -1;
+    }
+
+    int32_t added = 0;
+    const char *end = params + strnlen((const CHAR8 *)params, params_size);
+    while (params < end) {
+        const char *eol = params;
+        const char *key;
+        uint32_t len, key_len;
+        char op;
+
+        while (eol < end && *eol != '\n') {
+            eol++;
+        }
+        len = eol - params;
+        key_len = parseKey(params, len, &key, &op);
+
+        // "+=" appends to and ":=" overrides a previous definition
+        if (key_len && (op == '+' || op == ':' ||
+                        !hasKey(writer, key, key_len))) {
+            char *dst = writer->start + writer->size;
+            uint32_t needed = len + 1;
+            BOOLEAN separator = writer->size &&
+                writer->start[writer->size - 1] != '\n';
+
+            if (separator) {
+                needed++;
+            }
+            if (writer->size + needed + BOOTCONFIG_TRAILER_SIZE >
+                writer->capacity) {
+                return -1;
+            }
+
+            if (separator) {
+                *dst++ = '\n';
+            }
+            // params may have been written in the room of the section
+            memmove(dst, params, len);
+            dst[len] = '\n';
+            addKey(writer, dst + (key - params), key_len);
+
+            writer->checksum += sum_bytes(writer->start + writer->size,
+                                          needed);
+            writer->size += needed;
+            added++;
+        }
+        params = eol + 1;
+    }
+
+    return added;
+}
+
+char *bootConfigWriterRoom(BootConfigWriter *writer, uint32_t *room) {
+    uint32_t used;
+
+    if (!writer || !room) {
+        return NULL;
+    }
+
+    // leave room for a new line after the current parameters
+    used = writer->size + 1 + BOOTCONFIG_TRAILER_SIZE;
+    *room = writer->capacity > used ? writer->capacity - used : 0;
+    return writer->start + writer->size + 1;
+}
+
+int32_t bootConfigWriterFinish(BootConfigWriter *writer) {
+    if (!writer) {
+        return -1;
+    }
+    if (writer->size == 0) {
+        return 0;
+    }
+
+    char *end = writer->start + writer->size;
+
+    // size
+    memcpy_s(end, BOOTCONFIG_SIZE_SIZE, &writer->size, BOOTCONFIG_SIZE_SIZE);
+
+    // checksum
+    memcpy_s(end + BOOTCONFIG_SIZE_SIZE, BOOTCONFIG_CHECKSUM_SIZE,
+             &writer->checksum, BOOTCONFIG_CHECKSUM_SIZE);
+
+    // magic
+    memcpy_s(end + BOOTCONFIG_SIZE_SIZE + BOOTCONFIG_CHECKSUM_SIZE,
+             BOOTCONFIG_MAGIC_SIZE, BOOTCONFIG_MAGIC, BOOTCONFIG_MAGIC_SIZE);
+
+    return writer->size + BOOTCONFIG_TRAILER_SIZE;
+}
+
 /*
  * Add a string of boot config parameters to memory appended by the trailer.
  */
 int32_t addBootConfigParameters(char* params, uint32_t params_size,
     uint64_t bootconfig_start_addr, uint32_t bootconfig_size) {
+    BootConfigWriter writer;
+    int32_t new_size;
+
     if (!params || !bootconfig_start_addr) {
         return -1;
     }
     if (params_size == 0) {
         return 0;
     }
-    int32_t applied_bytes = 0;
-    int32_t new_size = 0;
-    uint64_t end = bootconfig_start_addr + bootconfig_size;
 
-    if (isTrailerPresent(end)) {
-      end -= BOOTCONFIG_TRAILER_SIZE;
-      applied_bytes -= BOOTCONFIG_TRAILER_SIZE;
-      memcpy_s(&new_size, BOOTCONFIG_SIZE_SIZE, (void *)end, BOOTCONFIG_SIZE_SIZE);
-    } else {
-      new_size = bootconfig_size;
+    if (bootConfigWriterInit(&writer, bootconfig_start_addr, bootconfig_size,
+                             (uint32_t)-1) < 0 ||
+        bootConfigWriterAddParameters(&writer, params, params_size) < 0) {
+        return -1;
     }
 
-    // params
-    memcpy_s((void*)end, params_size, params, params_size);
-
-    applied_bytes += params_size;
-    applied_bytes += addBootConfigTrailer(bootconfig_start_addr,
-        bootconfig_size + applied_bytes);
+    new_size = bootConfigWriterFinish(&writer);
+    if (new_size < 0) {
+        return -1;
+    }
 
-    return applied_bytes;
+    return new_size - (int32_t)bootconfig_size;
 }
 
 /*
@@ -98,8 +322,8 @@ int32_t addBootConfigTrailer(uint64_t bootconfig_start_addr,
     memcpy_s((void *)(end), BOOTCONFIG_SIZE_SIZE, &bootconfig_size, BOOTCONFIG_SIZE_SIZE);
 
     // checksum
-    uint32_t sum =
-        checksum((unsigned char*)bootconfig_start_addr, bootconfig_size);
+    uint32_t sum = sum_bytes((void *)(UINTN)bootconfig_start_addr,
+                             bootconfig_size);
     memcpy_s((void *)(end + BOOTCONFIG_SIZE_SIZE), BOOTCONFIG_CHECKSUM_SIZE, &sum,
         BOOTCONFIG_CHECKSUM_SIZE);
 
@@ -28,6 +28,81 @@
                                 BOOTCONFIG_SIZE_SIZE + \
                                 BOOTCONFIG_CHECKSUM_SIZE
 
+#define BOOTCONFIG_MAX_KEYS 128
+
+/*
+ * Boot config section writer.
+ *
+ * The writer appends parameters to a boot config section already in memory,
+ * typically the vendor bootconfig, and keeps the checksum of the section up
+ * to date as parameters are appended so that the trailer can be written
+ * without reading the whole section again.
+ *
+ * Parameters whose key is not a valid boot config key, or whose key is
+ * already defined in the section, are skipped: the first definition of a key
+ * takes precedence. Parameters using the "+=" or ":=" operator are always
+ * appended since they explicitly extend or override a previous definition. The first BOOTCONFIG_MAX_KEYS keys are indexed, past
+ * that the section is parsed again to look for a key.
+ */
+typedef struct {
+    char *start;        /* start of the boot config section */
+    uint32_t size;      /* size of the parameters in the section */
+    uint32_t capacity;  /* room available for the parameters and trailer */
+    uint32_t checksum;  /* checksum of the parameters */
+    uint32_t nb_keys;
+    struct {
+        const char *name;
+        uint32_t len;
+    } keys[BOOTCONFIG_MAX_KEYS];
+} BootConfigWriter;
+
+/*
+ * Initialize a boot config writer.
+ *
+ * @param writer writer to initialize.
+ * @param bootconfig_start_addr address that the boot config section is
+ *        starting at in memory.
+ * @param bootconfig_size size of the current bootconfig section in bytes,
+ *        including its trailer if any.
+ * @param capacity number of bytes available at bootconfig_start_addr.
+ * @return 0 on success, -1 for error.
+ */
+int32_t bootConfigWriterInit(BootConfigWriter *writer,
+                             uint64_t bootconfig_start_addr,
+                             uint32_t bootconfig_size, uint32_t capacity);
+
+/*
+ * Append a string of new line separated boot config parameters.
+ *
+ * @param writer boot config writer.
+ * @param params pointer to string of boot config parameters.
+ * @param params_size size of params string in bytes.
+ * @return number of parameters added, -1 for error.
+ */
+int32_t bootConfigWriterAddParameters(BootConfigWriter *writer,
+                                      const char *params,
+                                      uint32_t params_size);
+
+/*
+ * Return the free room of the boot config section. Parameters written there
+ * are then appended by bootConfigWriterAddParameters() in place, without
+ * being copied from another buffer.
+ *
+ * @param writer boot config writer.
+ * @param room set to the number of bytes available.
+ * @return start of the free room, NULL for error.
+ */
+char *bootConfigWriterRoom(BootConfigWriter *writer, uint32_t *room);
+
+/*
+ * Write the trailer at the end of the boot config section.
+ *
+ * @param writer boot config writer.
+ * @return size of the boot config section including the trailer, -1 for
+ *         error.
+ */
+int32_t bootConfigWriterFinish(BootConfigWriter *writer);
+
 /*
  * Add a string of boot config parameters to memory appended by the trailer.
  * This memory needs to be immediately following the end of the ramdisks.
@@ -41,12 +41,54 @@
 #include "unittest.h"
 #include "blobstore.h"
 #include "watchdog.h"
+#include "timer.h"
+#include "uefi_utils.h"
+#include "cmdline.h"
+#include "libxbc.h"
+#include "libelfloader.h"
+#include "efilinux.h"
+
+#define AVB_COMPILATION
+#include "libavb/avb_rsa.h"
+#include "libavb_user/uefi_avb_ops.h"
+#include "storage.h"
+#include "crc32.h"
+#include "flash.h"
+#include "sparse_format.h"
+#include "android.h"
+#include "prefetch.h"
+#include "block_cache.h"
+#include "protocol/BlockIo2.h"
+#include "protocol/EraseBlock.h"
+#include "protocol/ScsiPassThruExt.h"
+#include "protocol/ufs.h"
+#include "protocol/DevicePath.h"
+#include "protocol/NvmExpressPassthru.h"
+#include "protocol/NvmExpressHci.h"
+#include <openssl/sha.h>
+#ifdef USE_TRUSTY
+#include <trusty/keymaster_serializable.h>
+#endif
+
+extern struct storage STORAGE(STORAGE_UFS);
+extern struct storage STORAGE(STORAGE_NVME);
+extern struct storage STORAGE(STORAGE_GENERAL_BLOCK);
 
 /*
  * This is the hardware second timeout value
  */
 #define TCO_SECOND_TIMEOUT 3
 
+static UINTN test_failures;
+
+#define CHECK(cond) do {                                                \
+                if (!(cond)) {                                          \
+                        Print(L"%a:%d: check '%a' failed\n",            \
+                              __FILE__, __LINE__, #cond);               \
+                        test_failures++;                                \
+                }                                                       \
+        } while (0)
+
 static VOID test_watchdog(VOID)
 {
         EFI_STATUS ret;
@@ -107,14 +149,2481 @@ static VOID test_ux(VOID)
 }
 #endif
 
-static struct test_suite {
-        CHAR16 *name;
-        VOID (*fun)(VOID);
-} TEST_SUITES[] = {
-#ifdef USE_UI
-        { L"ux", test_ux },
-#endif
-        { L"keys", test_keys },
+/* Memory-backed EFI_FILE stand-in: each read takes LATENCY_US
+ * microseconds.  ReadEx() completes from a timer event so that the
+ * caller runs while the read is in progress. */
+struct fake_file {
+        EFI_FILE file;
+        UINT8 *data;
+        UINTN size;
+        UINT64 pos;
+        UINTN latency_us;
+        EFI_EVENT timer;
+        EFI_FILE_IO_TOKEN *token;
+};
+
+static UINTN fake_file_copy(struct fake_file *ff, VOID *buf, UINTN size)
+{
+        size = ff->pos < ff->size ? min(size, (UINTN)(ff->size - ff->pos)) : 0;
+        CopyMem(buf, ff->data + ff->pos, size);
+        ff->pos += size;
+        return size;
+}
+
+static EFIAPI EFI_STATUS fake_file_read(EFI_FILE *file, UINTN *size, VOID *buf)
+{
+        struct fake_file *ff = (struct fake_file *)file;
+
+        uefi_call_wrapper(BS->Stall, 1, ff->latency_us);
+        *size = fake_file_copy(ff, buf, *size);
+        return EFI_SUCCESS;
+}
+
+static EFIAPI EFI_STATUS fake_file_set_position(EFI_FILE *file, UINT64 pos)
+{
+        ((struct fake_file *)file)->pos = pos;
+        return EFI_SUCCESS;
+}
+
+static EFIAPI VOID fake_file_complete(__attribute__((__unused__)) EFI_EVENT event,
+                                      VOID *context)
+{
+        struct fake_file *ff = context;
+        EFI_FILE_IO_TOKEN *token = ff->token;
+
+        ff->token = NULL;
+        token->BufferSize = fake_file_copy(ff, token->Buffer, token->BufferSize);
+        token->Status = EFI_SUCCESS;
+        uefi_call_wrapper(BS->SignalEvent, 1, token->Event);
+}
+
+static EFIAPI EFI_STATUS fake_file_read_ex(EFI_FILE *file, EFI_FILE_IO_TOKEN *token)
+{
+        struct fake_file *ff = (struct fake_file *)file;
+
+        if (ff->token)
+                return EFI_NOT_READY;
+
+        ff->token = token;
+        return uefi_call_wrapper(BS->SetTimer, 3, ff->timer, TimerRelative,
+                                 ff->latency_us * 10);
+}
+
+static EFI_STATUS fake_file_init(struct fake_file *ff, UINT8 *data, UINTN size,
+                                 UINTN latency_us, BOOLEAN async)
+{
+        memset_s(ff, sizeof(*ff), 0, sizeof(*ff));
+        ff->file.Revision = async ? 0x00020000 : 0x00010000;
+        ff->file.Read = fake_file_read;
+        ff->file.SetPosition = fake_file_set_position;
+        ff->file.ReadEx = fake_file_read_ex;
+        ff->data = data;
+        ff->size = size;
+        ff->latency_us = latency_us;
+
+        return uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                                 TPL_CALLBACK, fake_file_complete, ff, &ff->timer);
+}
+
+static VOID fake_file_free(struct fake_file *ff)
+{
+        uefi_call_wrapper(BS->CloseEvent, 1, ff->timer);
+}
+
+#define RA_FILE_SIZE (4 * 1024 * 1024 + 123)
+#define RA_CHUNK (256 * 1024)
+#define RA_LATENCY_US 2000
+
+/* Read FF in RA_CHUNK pieces and check them, each piece taking
+   RA_LATENCY_US to process.  The next piece is read ahead while the
+   current one is processed.  Return the time spent in ms. */
+static UINT32 read_ahead_run(struct fake_file *ff, UINT8 *buf[2])
+{
+        struct file_read_ahead ra;
+        EFI_STATUS ret;
+        UINT32 start = boottime_in_msec();
+        UINT64 pos = 0;
+        UINTN i, len;
+
+        ret = file_read_ahead_init(&ra);
+        CHECK(!EFI_ERROR(ret));
+
+        file_read_ahead_start(&ra, &ff->file, 0, buf[0], RA_CHUNK);
+        for (i = 0;; i ^= 1) {
+                ret = file_read_ahead_finish(&ra, &len);
+                CHECK(!EFI_ERROR(ret));
+                if (EFI_ERROR(ret))
+                        break;
+                CHECK(len == min((UINT64)RA_CHUNK, ff->size - pos));
+                if (len == RA_CHUNK)
+                        file_read_ahead_start(&ra, &ff->file, pos + len,
+                                              buf[i ^ 1], RA_CHUNK);
+
+                CHECK(!CompareMem(buf[i], ff->data + pos, len));
+                uefi_call_wrapper(BS->Stall, 1, RA_LATENCY_US);
+                pos += len;
+                if (len < RA_CHUNK)
+                        break;
+        }
+        CHECK(pos == ff->size);
+
+        file_read_ahead_free(&ra);
+        return boottime_in_msec() - start;
+}
+
+static VOID test_read_ahead(VOID)
+{
+        struct fake_file ff;
+        UINT8 *data, *buf[2];
+        UINT32 sync_ms, async_ms;
+        UINTN i;
+
+        data = AllocatePool(RA_FILE_SIZE);
+        buf[0] = AllocatePool(RA_CHUNK);
+        buf[1] = AllocatePool(RA_CHUNK);
+        CHECK(data && buf[0] && buf[1]);
+        if (!data || !buf[0] || !buf[1])
+                goto out;
+
+        for (i = 0; i < RA_FILE_SIZE; i++)
+                data[i] = (UINT8)(i * 7 + i / 4096);
+
+        CHECK(!EFI_ERROR(fake_file_init(&ff, data, RA_FILE_SIZE, RA_LATENCY_US, FALSE)));
+        sync_ms = read_ahead_run(&ff, buf);
+        fake_file_free(&ff);
+
+        CHECK(!EFI_ERROR(fake_file_init(&ff, data, RA_FILE_SIZE, RA_LATENCY_US, TRUE)));
+        async_ms = read_ahead_run(&ff, buf);
+        fake_file_free(&ff);
+
+        Print(L"%d KiB: synchronous %d ms, read-ahead %d ms\n",
+              RA_FILE_SIZE / 1024, sync_ms, async_ms);
+        CHECK(async_ms < sync_ms);
+
+out:
+        if (data)
+                FreePool(data);
+        for (i = 0; i < ARRAY_SIZE(buf); i++)
+                if (buf[i])
+                        FreePool(buf[i]);
+}
+
+static UINT64 test_rand_state = 0x2545F4914F6CDD1DULL;
+
+/* xorshift64 */
+static UINT64 test_rand(VOID)
+{
+        test_rand_state ^= test_rand_state << 13;
+        test_rand_state ^= test_rand_state >> 7;
+        test_rand_state ^= test_rand_state << 17;
+        return test_rand_state;
+}
+
+#define RSA_MAX_WORDS (8192 / 32)
+
+/* Reference RSA public exponentiation: the 32-bit Montgomery
+   multiplication libavb used before it switched to 64-bit limbs. */
+struct ref_rsa_key {
+        UINT32 len;
+        UINT32 n0inv;
+        UINT32 n[RSA_MAX_WORDS];
+        UINT32 rr[RSA_MAX_WORDS];
+};
+
+static VOID ref_subM(const struct ref_rsa_key *key, UINT32 *a)
+{
+        INT64 A = 0;
+        UINT32 i;
+
+        for (i = 0; i < key->len; ++i) {
+                A += (UINT64)a[i] - key->n[i];
+                a[i] = (UINT32)A;
+                A >>= 32;
+        }
+}
+
+static BOOLEAN ref_geM(const struct ref_rsa_key *key, UINT32 *a)
+{
+        UINT32 i;
+
+        for (i = key->len; i;) {
+                --i;
+                if (a[i] < key->n[i])
+                        return FALSE;
+                if (a[i] > key->n[i])
+                        return TRUE;
+        }
+        return TRUE;
+}
+
+static VOID ref_montMulAdd(const struct ref_rsa_key *key, UINT32 *c,
+                           const UINT32 a, const UINT32 *b)
+{
+        UINT64 A = (UINT64)a * b[0] + c[0];
+        UINT32 d0 = (UINT32)A * key->n0inv;
+        UINT64 B = (UINT64)d0 * key->n[0] + (UINT32)A;
+        UINT32 i;
+
+        for (i = 1; i < key->len; ++i) {
+                A = (A >> 32) + (UINT64)a * b[i] + c[i];
+                B = (B >> 32) + (UINT64)d0 * key->n[i] + (UINT32)A;
+                c[i - 1] = (UINT32)B;
+        }
+
+        A = (A >> 32) + (B >> 32);
+        c[i - 1] = (UINT32)A;
+
+        if (A >> 32)
+                ref_subM(key, c);
+}
+
+static VOID ref_montMul(const struct ref_rsa_key *key, UINT32 *c,
+                        UINT32 *a, UINT32 *b)
+{
+        UINT32 i;
+
+        for (i = 0; i < key->len; ++i)
+                c[i] = 0;
+        for (i = 0; i < key->len; ++i)
+                ref_montMulAdd(key, c, a[i], b);
+}
+
+static VOID ref_modpowF4(const struct ref_rsa_key *key, UINT8 *inout)
+{
+        static UINT32 a[RSA_MAX_WORDS], aR[RSA_MAX_WORDS], aaR[RSA_MAX_WORDS];
+        UINT32 *aaa = aaR;
+        UINT32 i;
+
+        for (i = 0; i < key->len; ++i) {
+                UINT8 *p = inout + (key->len - 1 - i) * 4;
+                a[i] = (UINT32)p[0] << 24 | (UINT32)p[1] << 16 |
+                        (UINT32)p[2] << 8 | p[3];
+        }
+
+        ref_montMul(key, aR, a, (UINT32 *)key->rr);
+        for (i = 0; i < 16; i += 2) {
+                ref_montMul(key, aaR, aR, aR);
+                ref_montMul(key, aR, aaR, aaR);
+        }
+        ref_montMul(key, aaa, aR, a);
+
+        if (ref_geM(key, aaa))
+                ref_subM(key, aaa);
+
+        for (i = key->len; i;) {
+                UINT32 v = aaa[--i];
+                *inout++ = (UINT8)(v >> 24);
+                *inout++ = (UINT8)(v >> 16);
+                *inout++ = (UINT8)(v >> 8);
+                *inout++ = (UINT8)v;
+        }
+}
+
+static VOID put_be32(UINT8 *p, UINT32 v)
+{
+        p[0] = (UINT8)(v >> 24);
+        p[1] = (UINT8)(v >> 16);
+        p[2] = (UINT8)(v >> 8);
+        p[3] = (UINT8)v;
+}
+
+/* Random odd modulus of BITS bits, R^2 mod n and -1 / n[0] mod 2^32,
+   serialized as an AVB public key in BLOB. */
+static UINTN rsa_make_key(struct ref_rsa_key *key, UINT32 bits, UINT8 *blob)
+{
+        UINT32 i, j, top, inv;
+        UINT32 *x = key->rr;
+        UINT64 t;
+
+        key->len = bits / 32;
+        for (i = 0; i < key->len; i++)
+                key->n[i] = (UINT32)test_rand();
+        key->n[0] |= 1;
+        key->n[key->len - 1] |= 0x80000000;
+
+        inv = key->n[0];
+        for (i = 0; i < 5; i++)
+                inv *= 2 - key->n[0] * inv;
+        key->n0inv = -inv;
+
+        /* R mod n = R - n since n > R / 2, then double it BITS times
+           modulo n to get R^2 mod n. */
+        for (i = 0, t = 1; i < key->len; i++) {
+                t += (UINT32)~key->n[i];
+                x[i] = (UINT32)t;
+                t >>= 32;
+        }
+        for (j = 0; j < bits; j++) {
+                top = x[key->len - 1] >> 31;
+                for (i = key->len - 1; i; i--)
+                        x[i] = x[i] << 1 | x[i - 1] >> 31;
+                x[0] <<= 1;
+                if (top || ref_geM(key, x))
+                        ref_subM(key, x);
+        }
+
+        put_be32(blob, bits);
+        put_be32(blob + 4, key->n0inv);
+        for (i = 0; i < key->len; i++) {
+                put_be32(blob + 8 + (key->len - 1 - i) * 4, key->n[i]);
+                put_be32(blob + 8 + bits / 8 + (key->len - 1 - i) * 4, key->rr[i]);
+        }
+
+        return 8 + 2 * bits / 8;
+}
+
+#define RSA_HASH_SIZE 32
+#define RSA_RUNS 8
+
+/* Verify SIG against EXPECTED, the expected result of the public
+   exponentiation, split into padding and hash. */
+static BOOLEAN rsa_verify_expected(UINT8 *blob, UINTN blob_size, UINT8 *sig,
+                                   UINT8 *expected, UINTN size)
+{
+        return avb_rsa_verify(blob, blob_size, sig, size,
+                              expected + size - RSA_HASH_SIZE, RSA_HASH_SIZE,
+                              expected, size - RSA_HASH_SIZE);
+}
+
+static VOID test_rsa(VOID)
+{
+        static const UINT32 BITS[] = { 2048, 4096, 8192 };
+        static struct ref_rsa_key key;
+        static UINT8 blob[8 + 2 * 8192 / 8];
+        static UINT8 sig[8192 / 8], expected[8192 / 8];
+        UINT32 start, ms;
+        UINTN i, j, k, size, blob_size;
+
+        for (i = 0; i < ARRAY_SIZE(BITS); i++) {
+                size = BITS[i] / 8;
+
+                for (j = 0; j < RSA_RUNS; j++) {
+                        blob_size = rsa_make_key(&key, BITS[i], blob);
+
+                        for (k = 0; k < size; k++)
+                                sig[k] = (UINT8)test_rand();
+                        sig[0] &= 0x7f;
+                        CopyMem(expected, sig, size);
+                        ref_modpowF4(&key, expected);
+                        CHECK(rsa_verify_expected(blob, blob_size, sig, expected, size));
+
+                        expected[test_rand() % size] ^= 1 << (test_rand() % 8);
+                        CHECK(!rsa_verify_expected(blob, blob_size, sig, expected, size));
+                }
+
+                /* 0^e = 0, 1^e = 1 and (n - 1)^e = n - 1 for odd e. */
+                memset_s(sig, size, 0, size);
+                CHECK(rsa_verify_expected(blob, blob_size, sig, sig, size));
+                sig[size - 1] = 1;
+                CHECK(rsa_verify_expected(blob, blob_size, sig, sig, size));
+                CopyMem(sig, blob + 8, size);
+                sig[size - 1] -= 1;
+                CHECK(rsa_verify_expected(blob, blob_size, sig, sig, size));
+
+                /* Truncated key and signature. */
+                CHECK(!rsa_verify_expected(blob, blob_size - 1, sig, sig, size));
+                CHECK(!avb_rsa_verify(blob, blob_size, sig, size - 1,
+                                      sig, RSA_HASH_SIZE, sig, size - 1 - RSA_HASH_SIZE));
+
+                CopyMem(expected, sig, size);
+                start = boottime_in_msec();
+                for (j = 0; j < 100; j++)
+                        CHECK(rsa_verify_expected(blob, blob_size, sig, expected, size));
+                ms = boottime_in_msec() - start;
+                Print(L"RSA-%d: %d us per verification\n", BITS[i], ms * 10);
+        }
+}
+
+/* Fake rollback index storage counting its accesses. */
+static struct {
+        UINT64 index[AVB_MAX_NUMBER_OF_ROLLBACK_INDEX_LOCATIONS];
+        BOOLEAN empty;
+        UINTN reads, writes, written;
+} rollback_storage;
+
+static EFI_STATUS fake_rollback_read(size_t first, size_t count, uint64_t *indexes)
+{
+        rollback_storage.reads++;
+        if (rollback_storage.empty)
+                return EFI_NOT_FOUND;
+        CopyMem(indexes, &rollback_storage.index[first], count * sizeof(*indexes));
+        return EFI_SUCCESS;
+}
+
+static EFI_STATUS fake_rollback_write(size_t first, size_t count, const uint64_t *indexes)
+{
+        rollback_storage.writes++;
+        rollback_storage.written += count;
+        CopyMem(&rollback_storage.index[first], indexes, count * sizeof(*indexes));
+        return EFI_SUCCESS;
+}
+
+static VOID test_rollback(VOID)
+{
+        static const UEFIAvbRollbackStorage BULK = {
+                .count = 8,
+                .read = fake_rollback_read,
+                .write = fake_rollback_write
+        };
+        static const UEFIAvbRollbackStorage PER_SLOT = {
+                .count = 0,
+                .read = fake_rollback_read,
+                .write = fake_rollback_write
+        };
+        AvbOps *ops;
+        uint64_t value;
+        UINTN i;
+
+        if (is_live_boot()) {
+                Print(L"Rollback indexes are not used in live boot\n");
+                return;
+        }
+
+        ops = uefi_avb_ops_new();
+        CHECK(ops != NULL);
+        if (!ops)
+                return;
+
+        /* All the slots are loaded by the first read. */
+        memset(&rollback_storage, 0, sizeof(rollback_storage));
+        for (i = 0; i < BULK.count; i++)
+                rollback_storage.index[i] = 100 + i;
+        uefi_avb_ops_set_rollback_storage(&BULK);
+        for (i = 0; i < 2 * BULK.count; i++) {
+                CHECK(ops->read_rollback_index(ops, i % BULK.count, &value) == AVB_IO_RESULT_OK);
+                CHECK(value == 100 + i % BULK.count);
+        }
+        CHECK(rollback_storage.reads == 1);
+        CHECK(ops->read_rollback_index(ops, BULK.count, &value) != AVB_IO_RESULT_OK);
+
+        /* Unchanged values are not written, the others are written
+           back as a single range at flush time. */
+        CHECK(ops->write_rollback_index(ops, 2, 102) == AVB_IO_RESULT_OK);
+        CHECK(uefi_avb_ops_flush_rollback_indexes() == AVB_IO_RESULT_OK);
+        CHECK(rollback_storage.writes == 0);
+        CHECK(ops->write_rollback_index(ops, 1, 200) == AVB_IO_RESULT_OK);
+        CHECK(ops->write_rollback_index(ops, 5, 205) == AVB_IO_RESULT_OK);
+        CHECK(ops->write_rollback_index(ops, 1, 201) == AVB_IO_RESULT_OK);
+        CHECK(ops->read_rollback_index(ops, 1, &value) == AVB_IO_RESULT_OK);
+        CHECK(value == 201);
+        CHECK(rollback_storage.writes == 0);
+        CHECK(uefi_avb_ops_flush_rollback_indexes() == AVB_IO_RESULT_OK);
+        CHECK(rollback_storage.writes == 1 && rollback_storage.written == 5);
+        CHECK(rollback_storage.index[1] == 201 && rollback_storage.index[5] == 205);
+        CHECK(rollback_storage.index[3] == 103);
+        CHECK(uefi_avb_ops_flush_rollback_indexes() == AVB_IO_RESULT_OK);
+        CHECK(rollback_storage.writes == 1);
+        CHECK(rollback_storage.reads == 1);
+
+        /* One read per slot and one write per dirty slot. */
+        memset(&rollback_storage, 0, sizeof(rollback_storage));
+        rollback_storage.index[3] = 3;
+        uefi_avb_ops_set_rollback_storage(&PER_SLOT);
+        CHECK(ops->read_rollback_index(ops, 0, &value) == AVB_IO_RESULT_OK);
+        CHECK(ops->read_rollback_index(ops, 3, &value) == AVB_IO_RESULT_OK);
+        CHECK(ops->read_rollback_index(ops, 3, &value) == AVB_IO_RESULT_OK);
+        CHECK(value == 3 && rollback_storage.reads == 2);
+        CHECK(ops->write_rollback_index(ops, 3, 4) == AVB_IO_RESULT_OK);
+        CHECK(ops->write_rollback_index(ops, 9, 9) == AVB_IO_RESULT_OK);
+        CHECK(rollback_storage.reads == 3);
+        CHECK(uefi_avb_ops_flush_rollback_indexes() == AVB_IO_RESULT_OK);
+        CHECK(rollback_storage.writes == 2 && rollback_storage.written == 2);
+        CHECK(rollback_storage.index[3] == 4 && rollback_storage.index[9] == 9);
+
+        /* A missing storage reads as zero. */
+        memset(&rollback_storage, 0, sizeof(rollback_storage));
+        rollback_storage.empty = TRUE;
+        uefi_avb_ops_set_rollback_storage(&BULK);
+        value = 1;
+        CHECK(ops->read_rollback_index(ops, 7, &value) == AVB_IO_RESULT_OK);
+        CHECK(value == 0 && rollback_storage.reads == 1);
+
+        uefi_avb_ops_set_rollback_storage(NULL);
+        uefi_avb_ops_free(ops);
+}
+
+/* Reference: the command line built by copying the whole string for
+   each new fragment, as it used to be. */
+static CHAR16 *ref_prepend(CHAR16 *cmdline, const CHAR16 *fragment)
+{
+        CHAR16 *res = PoolPrint(L"%s %s", fragment, cmdline);
+
+        FreePool(cmdline);
+        return res;
+}
+
+static CHAR16 *ref_append(CHAR16 *cmdline, const CHAR16 *fragment)
+{
+        CHAR16 *res = PoolPrint(L"%s %s", cmdline, fragment);
+
+        FreePool(cmdline);
+        return res;
+}
+
+#define CMDLINE_OUT_SIZE 8192
+
+/* Check that CMDLINE is written out as KERNEL and, if BOOTCONFIG is
+   not NULL, BOOTCONFIG with the androidboot.* parameters split. */
+static VOID check_cmdline(struct cmdline *cmdline, const CHAR8 *kernel,
+                          const CHAR8 *bootconfig)
+{
+        static CHAR8 kbuf[CMDLINE_OUT_SIZE], bbuf[CMDLINE_OUT_SIZE];
+        UINTN ksize = sizeof(kbuf), bsize = sizeof(bbuf);
+        EFI_STATUS ret;
+
+        ret = cmdline_finish(cmdline, kbuf, &ksize,
+                             bootconfig ? bbuf : NULL, bootconfig ? &bsize : NULL);
+        CHECK(ret == EFI_SUCCESS);
+        if (EFI_ERROR(ret))
+                return;
+
+        CHECK(ksize == strlen(kernel) + 1 && !strcmp(kbuf, kernel));
+        if (bootconfig)
+                CHECK(bsize == strlen(bootconfig) + 1 && !strcmp(bbuf, bootconfig));
+}
+
+static VOID test_cmdline(VOID)
+{
+        static const CHAR16 *FRAGMENTS[] = {
+                L"androidboot.serialno=0123456789",
+                L"console=ttyS0,115200n8",
+                L"androidboot.bootreason=\"reboot, by user\"",
+                L"quiet",
+                L"androidboot.verifiedbootstate=green",
+                L"dm=\"1 vroot none ro 1,0 5159992 verity 1\"",
+        };
+        static CHAR8 expected[CMDLINE_OUT_SIZE];
+        static CHAR8 kbuf[CMDLINE_OUT_SIZE];
+        struct cmdline cmdline;
+        CHAR16 *ref;
+        CHAR8 *cur;
+        UINTN i, ksize;
+        EFI_STATUS ret;
+
+        /* Same bytes as the copying implementation. */
+        ret = cmdline_init(&cmdline, L"root=/dev/ram0  init=/init");
+        CHECK(ret == EFI_SUCCESS);
+        ref = StrDuplicate(L"root=/dev/ram0  init=/init");
+        for (i = 0; i < ARRAY_SIZE(FRAGMENTS); i++) {
+                if (i % 3 == 2) {
+                        str_to_stra(expected, FRAGMENTS[i], sizeof(expected));
+                        ret = cmdline_append_stra(&cmdline, expected, sizeof(expected));
+                        ref = ref_append(ref, FRAGMENTS[i]);
+                } else {
+                        ret = cmdline_prepend(&cmdline, L"%s", FRAGMENTS[i]);
+                        ref = ref_prepend(ref, FRAGMENTS[i]);
+                }
+                CHECK(ret == EFI_SUCCESS);
+        }
+        ret = cmdline_prepend_stra(&cmdline, (CHAR8 *)"loglevel=4 trailing", 10);
+        CHECK(ret == EFI_SUCCESS);
+        ref = ref_prepend(ref, L"loglevel=4");
+        str_to_stra(expected, ref, sizeof(expected));
+        FreePool(ref);
+        check_cmdline(&cmdline, expected, NULL);
+
+        ksize = strlen(expected);
+        CHECK(cmdline_finish(&cmdline, kbuf, &ksize, NULL, NULL) == EFI_BUFFER_TOO_SMALL &&
+              ksize == strlen(expected) + 1);
+        cmdline_free(&cmdline);
+
+        /* Duplicated keys and bootconfig split. */
+        ret = cmdline_init(&cmdline, L"androidboot.a=2 quiet androidboot.b=");
+        CHECK(ret == EFI_SUCCESS);
+        ret = cmdline_prepend(&cmdline, L"androidboot.a=1 androidboot.c=\"x y\"");
+        CHECK(ret == EFI_SUCCESS);
+        ret = cmdline_append_stra(&cmdline, (CHAR8 *)"androidboot.c=z androidboot.ab=3", 64);
+        CHECK(ret == EFI_SUCCESS);
+        check_cmdline(&cmdline, (CHAR8 *)"androidboot.a=1 androidboot.c=\"x y\" quiet "
+                      "androidboot.b= androidboot.ab=3", NULL);
+        check_cmdline(&cmdline, (CHAR8 *)"quiet",
+                      (CHAR8 *)"androidboot.a=1\nandroidboot.c=\"x y\"\n"
+                      "androidboot.b=unknown\nandroidboot.ab=3");
+        cmdline_free(&cmdline);
+
+        /* Duplicates are still dropped past the keys index. */
+        ret = cmdline_init(&cmdline, L"quiet");
+        CHECK(ret == EFI_SUCCESS);
+        cur = expected + efi_snprintf(expected, sizeof(expected), (CHAR8 *)"quiet");
+        for (i = 0; i < 100; i++) {
+                efi_snprintf(kbuf, sizeof(kbuf), (CHAR8 *)"androidboot.k%d=%d", i, i);
+                ret = cmdline_append_stra(&cmdline, kbuf, sizeof(kbuf));
+                CHECK(ret == EFI_SUCCESS);
+                cur += efi_snprintf(cur, expected + sizeof(expected) - cur,
+                                    (CHAR8 *)" %a", kbuf);
+        }
+        for (i = 0; i < 100; i += 9) {
+                efi_snprintf(kbuf, sizeof(kbuf), (CHAR8 *)"androidboot.k%d=dup", i);
+                ret = cmdline_append_stra(&cmdline, kbuf, sizeof(kbuf));
+                CHECK(ret == EFI_SUCCESS);
+        }
+        check_cmdline(&cmdline, expected, NULL);
+        cmdline_free(&cmdline);
+}
+
+static UINT32 ref_sum_bytes(const UINT8 *data, UINTN size)
+{
+        UINT32 sum = 0;
+
+        while (size--)
+                sum += *data++;
+        return sum;
+}
+
+#define BOOTCONFIG_BUF_SIZE 8192
+
+/* Check the trailer written at the end of the SIZE bytes of
+   parameters of BUF. */
+static VOID check_bootconfig_trailer(const CHAR8 *buf, UINT32 size)
+{
+        UINT32 value;
+
+        CopyMem(&value, buf + size, sizeof(value));
+        CHECK(value == size);
+        CopyMem(&value, buf + size + BOOTCONFIG_SIZE_SIZE, sizeof(value));
+        CHECK(value == ref_sum_bytes(buf, size));
+        CHECK(!memcmp(buf + size + BOOTCONFIG_SIZE_SIZE + BOOTCONFIG_CHECKSUM_SIZE,
+                      BOOTCONFIG_MAGIC, BOOTCONFIG_MAGIC_SIZE));
+}
+
+static VOID test_bootconfig(VOID)
+{
+        static const CHAR8 VENDOR[] = "androidboot.hardware=x\n"
+                "androidboot.a = v\nkernel.foo=1";
+        static const CHAR8 PARAMS[] = "androidboot.a=1\nandroidboot.b=2\n"
+                "androidboot.hardware+=y\nandroidboot.a:=3\ninvalid key=1\n"
+                "androidboot.b=4";
+        static const CHAR8 EXPECTED[] = "androidboot.hardware=x\n"
+                "androidboot.a = v\nkernel.foo=1\nandroidboot.b=2\n"
+                "androidboot.hardware+=y\nandroidboot.a:=3\n";
+        static CHAR8 buf[BOOTCONFIG_BUF_SIZE], line[64];
+        static UINT8 data[4096 + 64];
+        BootConfigWriter writer;
+        struct cmdline cmdline;
+        UINTN i, j, size;
+        UINT32 room;
+        INT32 total;
+        CHAR8 *params;
+        EFI_STATUS ret;
+
+        /* sum_bytes() against a byte loop, for all the alignments. */
+        for (i = 0; i < sizeof(data); i++)
+                data[i] = (UINT8)test_rand();
+        for (i = 0; i < 64; i++)
+                for (j = 0; j < 4096; j += 4096 / 8 + i)
+                        CHECK(sum_bytes(data + i, j) == ref_sum_bytes(data + i, j));
+        SetMem(data, sizeof(data), 0xFF);
+        CHECK(sum_bytes(data, sizeof(data)) == ref_sum_bytes(data, sizeof(data)));
+
+        /* Deduplication and "+=", ":=" operators. */
+        CopyMem(buf, VENDOR, sizeof(VENDOR) - 1);
+        CHECK(bootConfigWriterInit(&writer, (UINTN)buf, sizeof(VENDOR) - 1,
+                                   sizeof(buf)) == 0);
+        CHECK(bootConfigWriterAddParameters(&writer, (const char *)PARAMS, sizeof(PARAMS)) == 3);
+        CHECK(writer.size == sizeof(EXPECTED) - 1 &&
+              !memcmp(buf, EXPECTED, writer.size));
+        total = bootConfigWriterFinish(&writer);
+        CHECK(total == (INT32)(sizeof(EXPECTED) - 1 + BOOTCONFIG_TRAILER_SIZE));
+        check_bootconfig_trailer(buf, writer.size);
+
+        /* The trailer of an existing section is taken into account. */
+        CHECK(bootConfigWriterInit(&writer, (UINTN)buf, total, sizeof(buf)) == 0);
+        CHECK(writer.size == sizeof(EXPECTED) - 1);
+        CHECK(bootConfigWriterAddParameters(&writer, (const char *)PARAMS, sizeof(PARAMS)) == 2);
+        CHECK(bootConfigWriterAddParameters(&writer, "androidboot.c=5", 16) == 1);
+        total = bootConfigWriterFinish(&writer);
+        check_bootconfig_trailer(buf, writer.size);
+
+        /* Not enough room for the parameters and the trailer. */
+        CHECK(bootConfigWriterInit(&writer, (UINTN)buf, sizeof(VENDOR) - 1,
+                                   sizeof(VENDOR) + BOOTCONFIG_TRAILER_SIZE + 8) == 0);
+        CHECK(bootConfigWriterAddParameters(&writer, (const char *)PARAMS, sizeof(PARAMS)) < 0);
+
+        /* Duplicates are still skipped past the keys index. */
+        CHECK(bootConfigWriterInit(&writer, (UINTN)buf, 0, sizeof(buf)) == 0);
+        for (i = 0; i < BOOTCONFIG_MAX_KEYS + 16; i++) {
+                efi_snprintf(line, sizeof(line), (CHAR8 *)"k%d=%d", i, i);
+                CHECK(bootConfigWriterAddParameters(&writer, (char *)line, sizeof(line)) == 1);
+        }
+        size = writer.size;
+        for (i = 0; i < BOOTCONFIG_MAX_KEYS + 16; i += 7) {
+                efi_snprintf(line, sizeof(line), (CHAR8 *)"k%d=dup", i);
+                CHECK(bootConfigWriterAddParameters(&writer, (char *)line, sizeof(line)) == 0);
+        }
+        CHECK(writer.size == size);
+        bootConfigWriterFinish(&writer);
+        check_bootconfig_trailer(buf, writer.size);
+
+        /* androidboot.* parameters written in place from the command
+           line. */
+        ret = cmdline_init(&cmdline, L"quiet androidboot.a=1 androidboot.hardware=y "
+                           "androidboot.e= androidboot.a=2 androidboot.hardware+=z");
+        CHECK(ret == EFI_SUCCESS);
+        CopyMem(buf, VENDOR, sizeof(VENDOR) - 1);
+        CHECK(bootConfigWriterInit(&writer, (UINTN)buf, sizeof(VENDOR) - 1,
+                                   sizeof(buf)) == 0);
+        params = (CHAR8 *)bootConfigWriterRoom(&writer, &room);
+        CHECK(params == buf + sizeof(VENDOR));
+        size = room;
+        ret = cmdline_finish_bootconfig(&cmdline, params, &size);
+        CHECK(ret == EFI_SUCCESS);
+        CHECK(bootConfigWriterAddParameters(&writer, (char *)params, size) == 2);
+        total = bootConfigWriterFinish(&writer);
+        CHECK(writer.size == sizeof(VENDOR) - 1 + 47 &&
+              !memcmp(buf + sizeof(VENDOR) - 1,
+                      "\nandroidboot.e=unknown\nandroidboot.hardware+=z\n", 47));
+        check_bootconfig_trailer(buf, writer.size);
+        cmdline_free(&cmdline);
+}
+
+static VOID put_le(UINT8 *p, UINT64 v, UINTN size)
+{
+        UINTN i;
+
+        for (i = 0; i < size; i++, v >>= 8)
+                p[i] = (UINT8)v;
+}
+
+static UINT64 get_le(const UINT8 *p, UINTN size)
+{
+        UINT64 v = 0;
+
+        while (size--)
+                v = (v << 8) | p[size];
+        return v;
+}
+
+/* Synthetic position independent ELF image: a text segment holding the
+   headers, a data segment with the dynamic section, the relocations
+   and the symbol table, followed by BSS. */
+#define ELF_FILE_SIZE 0x1800
+#define ELF_DATA 0x1000
+#define ELF_DATA_FILESZ 0x800
+#define ELF_DATA_MEMSZ 0x3000
+#define ELF_IMAGE_SIZE (ELF_DATA + ELF_DATA_MEMSZ)
+#define ELF_DYNAMIC 0x1400
+#define ELF_RELOCS 0x1600
+#define ELF_SYMTAB 0x1700
+#define ELF_ENTRY 0x280
+#define ELF_SYM_VALUE 0x1234
+
+static const struct elf_reloc {
+        UINT64 offset;
+        BOOLEAN symbol;
+        UINT64 addend;
+} ELF_RELOCS_TABLE[] = {
+        { 0x300, FALSE, 0x123 },
+        { 0x310, TRUE, 0x10 },
+        { 0x1100, FALSE, ELF_DYNAMIC },
+        { 0x2000, FALSE, 0x40 },   /* in BSS */
+};
+
+/* Field sizes of the 32-bit and 64-bit ELF classes. */
+struct elf_class {
+        BOOLEAN is64;
+        UINTN word;             /* address size */
+        UINTN ehsize;
+        UINTN phentsize;
+        UINTN dynsize;
+        UINTN relsize;
+        UINTN symsize;
+};
+
+static const struct elf_class ELF32_CLASS = { FALSE, 4, 52, 32, 8, 8, 16 };
+static const struct elf_class ELF64_CLASS = { TRUE, 8, 64, 56, 16, 24, 24 };
+
+static VOID elf_put_phdr(const struct elf_class *c, UINT8 *p, UINT32 type,
+                         UINT64 offset, UINT64 addr, UINT64 filesz, UINT64 memsz)
+{
+        if (c->is64) {
+                put_le(p, type, 4);
+                put_le(p + 4, 7, 4);
+                put_le(p + 8, offset, 8);
+                put_le(p + 16, addr, 8);
+                put_le(p + 24, addr, 8);
+                put_le(p + 32, filesz, 8);
+                put_le(p + 40, memsz, 8);
+                put_le(p + 48, 0x1000, 8);
+        } else {
+                put_le(p, type, 4);
+                put_le(p + 4, offset, 4);
+                put_le(p + 8, addr, 4);
+                put_le(p + 12, addr, 4);
+                put_le(p + 16, filesz, 4);
+                put_le(p + 20, memsz, 4);
+                put_le(p + 24, 7, 4);
+                put_le(p + 28, 0x1000, 4);
+        }
+}
+
+static VOID elf_build(const struct elf_class *c, UINT8 *file)
+{
+        static const UINT8 IDENT[] = { 0x7f, 'E', 'L', 'F' };
+        UINT64 dyn[6][2];
+        UINT8 *p;
+        UINTN i;
+
+        for (i = 0; i < ELF_FILE_SIZE; i++)
+                file[i] = i < 0x200 ? 0 : (UINT8)test_rand();
+
+        CopyMem(file, IDENT, sizeof(IDENT));
+        file[4] = c->is64 ? 2 : 1;      /* EI_CLASS */
+        file[5] = 1;                    /* little endian */
+        file[6] = 1;                    /* EV_CURRENT */
+        put_le(file + 16, 3, 2);        /* ET_DYN */
+        put_le(file + 18, c->is64 ? 62 : 3, 2);
+        put_le(file + 20, 1, 4);
+        put_le(file + 24, ELF_ENTRY, c->word);
+        put_le(file + 24 + c->word, c->ehsize, c->word);        /* e_phoff */
+        p = file + 24 + 3 * c->word + 4;                        /* e_ehsize */
+        put_le(p, c->ehsize, 2);
+        put_le(p + 2, c->phentsize, 2);
+        put_le(p + 4, 3, 2);
+
+        p = file + c->ehsize;
+        elf_put_phdr(c, p, 1, 0, 0, ELF_DATA, ELF_DATA);
+        elf_put_phdr(c, p + c->phentsize, 1, ELF_DATA, ELF_DATA,
+                     ELF_DATA_FILESZ, ELF_DATA_MEMSZ);
+        elf_put_phdr(c, p + 2 * c->phentsize, 2, ELF_DYNAMIC, ELF_DYNAMIC,
+                     ARRAY_SIZE(dyn) * c->dynsize, ARRAY_SIZE(dyn) * c->dynsize);
+
+        /* x86_64 uses RELA, i386 REL relocations. */
+        dyn[0][0] = c->is64 ? 7 : 17;   /* DT_RELA, DT_REL */
+        dyn[0][1] = ELF_RELOCS;
+        dyn[1][0] = c->is64 ? 8 : 18;   /* DT_RELASZ, DT_RELSZ */
+        dyn[1][1] = ARRAY_SIZE(ELF_RELOCS_TABLE) * c->relsize;
+        dyn[2][0] = c->is64 ? 9 : 19;   /* DT_RELAENT, DT_RELENT */
+        dyn[2][1] = c->relsize;
+        dyn[3][0] = 6;                  /* DT_SYMTAB */
+        dyn[3][1] = ELF_SYMTAB;
+        dyn[4][0] = 11;                 /* DT_SYMENT */
+        dyn[4][1] = c->symsize;
+        dyn[5][0] = dyn[5][1] = 0;      /* DT_NULL */
+        for (i = 0; i < ARRAY_SIZE(dyn); i++) {
+                put_le(file + ELF_DYNAMIC + i * c->dynsize, dyn[i][0], c->word);
+                put_le(file + ELF_DYNAMIC + i * c->dynsize + c->word, dyn[i][1], c->word);
+        }
+
+        for (i = 0; i < ARRAY_SIZE(ELF_RELOCS_TABLE); i++) {
+                const struct elf_reloc *r = &ELF_RELOCS_TABLE[i];
+
+                p = file + ELF_RELOCS + i * c->relsize;
+                put_le(p, r->offset, c->word);
+                if (c->is64) {
+                        put_le(p + 8, r->symbol ? (1ULL << 32) | 1 : 8, 8);
+                        put_le(p + 16, r->addend, 8);
+                } else
+                        put_le(p + 4, r->symbol ? (1 << 8) | 1 : 8, 4);
+        }
+
+        SetMem(file + ELF_SYMTAB, 2 * c->symsize, 0);
+        put_le(file + ELF_SYMTAB + c->symsize + (c->is64 ? 8 : 4), ELF_SYM_VALUE,
+               c->word);
+}
+
+/* Expected runtime image of FILE relocated by OFFSET. */
+static VOID elf_expected(const struct elf_class *c, const UINT8 *file,
+                         UINT8 *image, UINT64 offset)
+{
+        UINT8 *p;
+        UINT64 v;
+        UINTN i;
+
+        SetMem(image, ELF_IMAGE_SIZE, 0);
+        CopyMem(image, file, ELF_DATA + ELF_DATA_FILESZ);
+
+        /* Segment addresses are relocated in the headers copy. */
+        for (i = 0; i < 3; i++) {
+                p = image + c->ehsize + i * c->phentsize + (c->is64 ? 16 : 8);
+                put_le(p, get_le(p, c->word) + offset, c->word);
+                put_le(p + c->word, get_le(p + c->word, c->word) + offset, c->word);
+        }
+
+        for (i = 0; i < ARRAY_SIZE(ELF_RELOCS_TABLE); i++) {
+                const struct elf_reloc *r = &ELF_RELOCS_TABLE[i];
+
+                /* REL relocations have their addend in place. */
+                v = c->is64 ? r->addend : get_le(image + r->offset, 4);
+                v += offset + (r->symbol ? ELF_SYM_VALUE : 0);
+                put_le(image + r->offset, v, c->word);
+        }
+}
+
+static BOOLEAN elf_relocate(const UINT8 *file, UINTN file_size, EFI_PHYSICAL_ADDRESS rt,
+                            UINTN rt_size, UINT64 *entry)
+{
+        return relocate_elf_image((UINTN)file, file_size, rt, rt_size, entry);
+}
+
+static VOID test_elf_class(const struct elf_class *c, UINT8 *file, UINT8 *expected,
+                           EFI_PHYSICAL_ADDRESS rt, UINTN rt_size)
+{
+        UINT8 *image = (UINT8 *)(UINTN)rt;
+        UINT64 entry = 0;
+        UINTN i;
+
+        elf_build(c, file);
+        elf_expected(c, file, expected, rt);
+
+        SetMem(image, rt_size, 0xA5);
+        CHECK(elf_relocate(file, ELF_FILE_SIZE, rt, rt_size, &entry));
+        CHECK(entry == rt + ELF_ENTRY);
+        CHECK(!memcmp(image, expected, ELF_IMAGE_SIZE));
+        for (i = ELF_IMAGE_SIZE; i < rt_size; i++)
+                if (image[i] != 0xA5)
+                        break;
+        CHECK(i == rt_size);
+
+        /* Truncated file, runtime memory too small, program header
+           table and relocation target out of the image. */
+        CHECK(!elf_relocate(file, ELF_FILE_SIZE - 1, rt, rt_size, &entry));
+        CHECK(!elf_relocate(file, ELF_FILE_SIZE, rt, ELF_IMAGE_SIZE - 1, &entry));
+
+        put_le(file + 24 + 3 * c->word + 8, 0x1000, 2);
+        CHECK(!elf_relocate(file, ELF_FILE_SIZE, rt, rt_size, &entry));
+        put_le(file + 24 + 3 * c->word + 8, 3, 2);
+
+        put_le(file + ELF_RELOCS, ELF_IMAGE_SIZE, c->word);
+        CHECK(!elf_relocate(file, ELF_FILE_SIZE, rt, rt_size, &entry));
+}
+
+static VOID test_elf(VOID)
+{
+        static UINT8 file[ELF_FILE_SIZE], expected[ELF_IMAGE_SIZE];
+        UINTN rt_size = ELF_IMAGE_SIZE + EFI_PAGE_SIZE;
+        EFI_PHYSICAL_ADDRESS rt = 0xFFFFFFFF;
+        EFI_STATUS ret;
+
+        /* The 32-bit loader needs a runtime address below 4 GiB. */
+        ret = allocate_pages(AllocateMaxAddress, EfiLoaderData,
+                             EFI_SIZE_TO_PAGES(rt_size), &rt);
+        CHECK(ret == EFI_SUCCESS);
+        if (EFI_ERROR(ret))
+                return;
+
+        test_elf_class(&ELF32_CLASS, file, expected, rt, rt_size);
+        test_elf_class(&ELF64_CLASS, file, expected, rt, rt_size);
+
+        free_pages(rt, EFI_SIZE_TO_PAGES(rt_size));
+}
+
+#ifdef USE_TRUSTY
+/* Gather REQ into BUF as the ql-tipc device does into the buffer
+   shared with Trusty. */
+static UINTN km_gather(const struct km_sg_req *req, UINT8 *buf)
+{
+        UINTN i, size = 0;
+
+        for (i = 0; i < req->iovs_cnt; i++) {
+                CopyMem(buf + size, req->iovs[i].base, req->iovs[i].len);
+                size += req->iovs[i].len;
+        }
+        return size;
+}
+
+/* Reference: the request encoded field by field. */
+static UINT8 *km_put_sized(UINT8 *p, const uint8_t *data, UINT32 size)
+{
+        put_le(p, size, 4);
+        CopyMem(p + 4, data, size);
+        return p + 4 + size;
+}
+
+static VOID test_keymaster(VOID)
+{
+        static const uint8_t KEY_HASH[32] = { 0xa5, 0x5a, [31] = 0x11 };
+        static const uint8_t VBMETA_HASH[32] = { 0x01, 0x02, [31] = 0xff };
+        static const uint8_t CERT[700] = { 0x30, 0x82, [699] = 0x42 };
+        static UINT8 buf[1024], ref[1024];
+        struct km_boot_params params = {
+                .os_version = 110000,
+                .os_patchlevel = 202310,
+                .device_locked = 1,
+                .verified_boot_state = 2,
+                .verified_boot_key_hash_size = sizeof(KEY_HASH),
+                .verified_boot_key_hash = KEY_HASH,
+                .verified_boot_hash_size = sizeof(VBMETA_HASH),
+                .verified_boot_hash = VBMETA_HASH
+        };
+        struct km_attestation_ids ids = {
+                .brand_size = 5, .brand = (const uint8_t *)"Intel",
+                .device_size = 3, .device = (const uint8_t *)"dev",
+                .serial_size = 10, .serial = (const uint8_t *)"0123456789",
+                .model_size = 1, .model = (const uint8_t *)"m"
+        };
+        struct km_attestation_data data = {
+                .algorithm = 3, .data_size = sizeof(CERT), .data = (uint8_t *)CERT
+        };
+        struct km_sg_req req;
+        UINT8 *p;
+        UINTN i;
+
+        /* The header and the four fixed fields share one iovec, the
+           hashes are referenced in place. */
+        km_sg_req_init(&req, KM_SET_BOOT_PARAMS);
+        CHECK(km_boot_params_serialize_sg(&params, &req) == TRUSTY_ERR_NONE);
+        CHECK(req.iovs_cnt == 4 && req.iovs[1].base == KEY_HASH);
+        p = ref;
+        put_le(p, KM_SET_BOOT_PARAMS, 4);
+        put_le(p + 4, params.os_version, 4);
+        put_le(p + 8, params.os_patchlevel, 4);
+        put_le(p + 12, params.device_locked, 4);
+        put_le(p + 16, params.verified_boot_state, 4);
+        p = km_put_sized(p + 20, KEY_HASH, sizeof(KEY_HASH));
+        p = km_put_sized(p, VBMETA_HASH, sizeof(VBMETA_HASH));
+        CHECK(km_gather(&req, buf) == (UINTN)(p - ref) && !memcmp(buf, ref, p - ref));
+
+        km_sg_req_init(&req, KM_CONFIGURE_BOOT_PATCHLEVEL);
+        CHECK(km_boot_patchlevel_serialize_sg(&(struct km_boot_patchlevel){ 20231005 }, &req) ==
+              TRUSTY_ERR_NONE);
+        put_le(ref, KM_CONFIGURE_BOOT_PATCHLEVEL, 4);
+        put_le(ref + 4, 20231005, 4);
+        CHECK(req.iovs_cnt == 1 && km_gather(&req, buf) == 8 && !memcmp(buf, ref, 8));
+
+        /* Empty identifiers are sent as a zero size only. */
+        km_sg_req_init(&req, KM_SET_ATTESTATION_IDS);
+        CHECK(km_attestation_ids_serialize_sg(&ids, &req) == TRUSTY_ERR_NONE);
+        p = ref;
+        put_le(p, KM_SET_ATTESTATION_IDS, 4);
+        p = km_put_sized(p + 4, ids.brand, ids.brand_size);
+        p = km_put_sized(p, ids.device, ids.device_size);
+        p = km_put_sized(p, NULL, 0);
+        p = km_put_sized(p, ids.serial, ids.serial_size);
+        p = km_put_sized(p, NULL, 0);
+        p = km_put_sized(p, NULL, 0);
+        p = km_put_sized(p, NULL, 0);
+        p = km_put_sized(p, ids.model, ids.model_size);
+        CHECK(km_gather(&req, buf) == (UINTN)(p - ref) && !memcmp(buf, ref, p - ref));
+
+        km_sg_req_init(&req, KM_APPEND_ATTESTATION_CERT_CHAIN);
+        CHECK(km_attestation_data_serialize_sg(&data, &req) == TRUSTY_ERR_NONE);
+        put_le(ref, KM_APPEND_ATTESTATION_CERT_CHAIN, 4);
+        put_le(ref + 4, data.algorithm, 4);
+        p = km_put_sized(ref + 8, CERT, sizeof(CERT));
+        CHECK(req.iovs_cnt == 2 && req.iovs[1].base == CERT);
+        CHECK(km_gather(&req, buf) == (UINTN)(p - ref) && !memcmp(buf, ref, p - ref));
+
+        /* Overflows are reported, not written past the request. */
+        km_sg_req_init(&req, KM_SET_ATTESTATION_IDS);
+        for (i = 0; i < KM_SG_REQ_MAX_WORDS; i++)
+                km_sg_append_uint32(&req, i);
+        CHECK(req.error == TRUSTY_ERR_MSG_TOO_BIG && req.words_cnt == KM_SG_REQ_MAX_WORDS);
+        km_sg_req_init(&req, KM_SET_ATTESTATION_IDS);
+        for (i = 0; i < KM_SG_REQ_MAX_IOVS; i++)
+                km_sg_append(&req, CERT, 1);
+        CHECK(req.error == TRUSTY_ERR_MSG_TOO_BIG && req.iovs_cnt == KM_SG_REQ_MAX_IOVS);
+}
+#endif
+
+static const struct crc32_vector {
+        const char *data;
+        UINT32 crc;
+} CRC32_VECTORS[] = {
+        { "", 0 },
+        { "a", 0xe8b7be43 },
+        { "123456789", 0xcbf43926 },
+        { "The quick brown fox jumps over the lazy dog", 0x414fa339 }
+};
+
+static VOID test_crc32(VOID)
+{
+        static const UINT8 zero[4096];
+        UINT8 buf[64], ff[4096];
+        const UINT32 pattern = 0xdeadbeef;
+        UINT32 crc;
+        UINTN i, j, len;
+
+        for (i = 0; i < ARRAY_SIZE(CRC32_VECTORS); i++) {
+                len = strlen((CHAR8 *)CRC32_VECTORS[i].data);
+                CHECK(crc32_update(0, CRC32_VECTORS[i].data, len) == CRC32_VECTORS[i].crc);
+
+                /* Split updates and unaligned buffers.  */
+                for (j = 0; j <= len; j++) {
+                        crc = crc32_update(0, CRC32_VECTORS[i].data, j);
+                        crc = crc32_update(crc, CRC32_VECTORS[i].data + j, len - j);
+                        CHECK(crc == CRC32_VECTORS[i].crc);
+                }
+                for (j = 1; j < 8; j++) {
+                        memcpy(buf + j, CRC32_VECTORS[i].data, len);
+                        CHECK(crc32_update(0, buf + j, len) == CRC32_VECTORS[i].crc);
+                }
+        }
+
+        CHECK(crc32_update(0, zero, sizeof(zero)) == 0xc71c0011);
+        memset(ff, 0xff, sizeof(ff));
+        CHECK(crc32_repeat(0, ff, sizeof(ff), 256) == 0x956bac74);
+        CHECK(crc32_repeat(0, &pattern, sizeof(pattern), 1000) == 0xc7165c09);
+        CHECK(crc32_repeat(0xcbf43926, &pattern, sizeof(pattern), 3) == 0xc9b7d175);
+        /* 1 GiB of zeros.  */
+        CHECK(crc32_repeat(0, zero, sizeof(zero), 256 * 1024) == 0x5b64c2b0);
+
+        CHECK(crc32_repeat(0xcbf43926, &pattern, sizeof(pattern), 0) == 0xcbf43926);
+        CHECK(crc32_repeat(0xcbf43926, &pattern, 0, 10) == 0xcbf43926);
+        crc = 0xcbf43926;
+        for (i = 1; i < 100; i++) {
+                crc = crc32_update(crc, &pattern, sizeof(pattern));
+                CHECK(crc32_repeat(0xcbf43926, &pattern, sizeof(pattern), i) == crc);
+        }
+}
+
+/* Memory-backed block device, the I/O operations are counted.  When
+   CORRUPT is set, the byte at CORRUPT_AT is flipped by the next
+   flush.  BUSY_US accumulates the simulated device time: each command
+   costs LATENCY_US plus the transfer at BANDWIDTH bytes per second,
+   if set.  */
+static struct ram_disk {
+        EFI_BLOCK_IO bio;
+        EFI_BLOCK_IO_MEDIA media;
+        EFI_DISK_IO dio;
+        EFI_BLOCK_IO2_PROTOCOL bio2;
+        EFI_HANDLE handle;
+        UINT8 *data;
+        UINT64 size;
+        UINTN reads, writes, flushes, async_reads;
+        UINT64 read_bytes, written_bytes, erased_blocks;
+        BOOLEAN corrupt;
+        UINT64 corrupt_at;
+        UINT32 latency_us;
+        UINT64 bandwidth;
+        UINT64 busy_us;
+} ram_disk;
+
+static EFI_GUID ram_disk_bio2_guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
+
+static BOOLEAN ram_disk_inside(UINT64 offset, UINTN size)
+{
+        return offset <= ram_disk.size && size <= ram_disk.size - offset;
+}
+
+static VOID ram_disk_charge(UINT64 size)
+{
+        ram_disk.busy_us += ram_disk.latency_us;
+        if (ram_disk.bandwidth)
+                ram_disk.busy_us += size * 1000000 / ram_disk.bandwidth;
+}
+
+static EFIAPI EFI_STATUS ram_disk_read(__attribute__((__unused__)) EFI_DISK_IO *dio,
+                                       __attribute__((__unused__)) UINT32 media_id,
+                                       UINT64 offset, UINTN size, VOID *buf)
+{
+        if (!ram_disk_inside(offset, size))
+                return EFI_INVALID_PARAMETER;
+
+        CopyMem(buf, ram_disk.data + offset, size);
+        ram_disk.reads++;
+        ram_disk.read_bytes += size;
+        ram_disk_charge(size);
+        return EFI_SUCCESS;
+}
+
+static EFIAPI EFI_STATUS ram_disk_write(__attribute__((__unused__)) EFI_DISK_IO *dio,
+                                        __attribute__((__unused__)) UINT32 media_id,
+                                        UINT64 offset, UINTN size, VOID *buf)
+{
+        if (!ram_disk_inside(offset, size))
+                return EFI_INVALID_PARAMETER;
+
+        CopyMem(ram_disk.data + offset, buf, size);
+        ram_disk.writes++;
+        ram_disk.written_bytes += size;
+        ram_disk_charge(size);
+        return EFI_SUCCESS;
+}
+
+/* Erase, unmap or deallocation command of the storage device stand-ins,
+   the blocks read back as zeros.  It takes no transfer time.  */
+static EFI_STATUS ram_disk_erase(EFI_LBA lba, UINT64 blocks)
+{
+        UINT64 offset = lba * ram_disk.media.BlockSize;
+        UINT64 size = blocks * ram_disk.media.BlockSize;
+
+        if (!ram_disk.data)
+                return EFI_SUCCESS;
+        if (!ram_disk_inside(offset, size))
+                return EFI_INVALID_PARAMETER;
+
+        ZeroMem(ram_disk.data + offset, size);
+        ram_disk.erased_blocks += blocks;
+        return EFI_SUCCESS;
+}
+
+static EFIAPI EFI_STATUS ram_disk_read_blocks(EFI_BLOCK_IO *bio, UINT32 media_id,
+                                              EFI_LBA lba, UINTN size, VOID *buf)
+{
+        if (size % bio->Media->BlockSize)
+                return EFI_BAD_BUFFER_SIZE;
+        return ram_disk_read(&ram_disk.dio, media_id,
+                             lba * bio->Media->BlockSize, size, buf);
+}
+
+static EFIAPI EFI_STATUS ram_disk_write_blocks(EFI_BLOCK_IO *bio, UINT32 media_id,
+                                               EFI_LBA lba, UINTN size, VOID *buf)
+{
+        if (size % bio->Media->BlockSize)
+                return EFI_BAD_BUFFER_SIZE;
+        return ram_disk_write(&ram_disk.dio, media_id,
+                              lba * bio->Media->BlockSize, size, buf);
+}
+
+static EFIAPI EFI_STATUS ram_disk_flush_blocks(__attribute__((__unused__)) EFI_BLOCK_IO *bio)
+{
+        ram_disk.flushes++;
+        if (ram_disk.corrupt) {
+                ram_disk.data[ram_disk.corrupt_at] ^= 0xff;
+                ram_disk.corrupt = FALSE;
+        }
+        return EFI_SUCCESS;
+}
+
+/* The read completes before the function returns, the event is
+   signaled right away.  */
+static EFIAPI EFI_STATUS ram_disk_read_blocks_ex(EFI_BLOCK_IO2_PROTOCOL *bio2, UINT32 media_id,
+                                                 EFI_LBA lba, EFI_BLOCK_IO2_TOKEN *token,
+                                                 UINTN size, VOID *buf)
+{
+        EFI_STATUS ret;
+
+        ret = ram_disk_read_blocks(&ram_disk.bio, media_id, lba, size, buf);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        ram_disk.async_reads++;
+        token->TransactionStatus = EFI_SUCCESS;
+        if (token->Event)
+                uefi_call_wrapper(BS->SignalEvent, 1, token->Event);
+        return EFI_SUCCESS;
+}
+
+static VOID ram_disk_reset_counters(VOID)
+{
+        ram_disk.reads = ram_disk.writes = ram_disk.flushes = ram_disk.async_reads = 0;
+        ram_disk.read_bytes = ram_disk.written_bytes = 0;
+        ram_disk.erased_blocks = ram_disk.busy_us = 0;
+}
+
+static EFI_STATUS ram_disk_init(UINT64 size, UINT32 block_size)
+{
+        ZeroMem(&ram_disk, sizeof(ram_disk));
+        ram_disk.data = AllocateZeroPool(size);
+        if (!ram_disk.data)
+                return EFI_OUT_OF_RESOURCES;
+        ram_disk.size = size;
+
+        ram_disk.media.MediaPresent = TRUE;
+        ram_disk.media.BlockSize = block_size;
+        ram_disk.media.LastBlock = size / block_size - 1;
+        ram_disk.bio.Media = &ram_disk.media;
+        ram_disk.bio.ReadBlocks = ram_disk_read_blocks;
+        ram_disk.bio.WriteBlocks = ram_disk_write_blocks;
+        ram_disk.bio.FlushBlocks = ram_disk_flush_blocks;
+        ram_disk.dio.ReadDisk = ram_disk_read;
+        ram_disk.dio.WriteDisk = ram_disk_write;
+        ram_disk.bio2.Media = &ram_disk.media;
+        ram_disk.bio2.ReadBlocksEx = ram_disk_read_blocks_ex;
+        return EFI_SUCCESS;
+}
+
+/* Install EFI_BLOCK_IO2 on a new handle, partitions of the RAM disk
+   then support asynchronous reads.  */
+static EFI_STATUS ram_disk_install_bio2(VOID)
+{
+        return uefi_call_wrapper(BS->InstallProtocolInterface, 4, &ram_disk.handle,
+                                 &ram_disk_bio2_guid, EFI_NATIVE_INTERFACE,
+                                 &ram_disk.bio2);
+}
+
+static VOID ram_disk_free(VOID)
+{
+        if (ram_disk.handle)
+                uefi_call_wrapper(BS->UninstallProtocolInterface, 3, ram_disk.handle,
+                                  &ram_disk_bio2_guid, &ram_disk.bio2);
+        FreePool(ram_disk.data);
+        ZeroMem(&ram_disk, sizeof(ram_disk));
+}
+
+/* Partition of the RAM disk starting at LBA START.  */
+static VOID ram_disk_partition(struct gpt_partition_interface *parti,
+                               EFI_LBA start, EFI_LBA end)
+{
+        ZeroMem(parti, sizeof(*parti));
+        parti->handle = ram_disk.handle;
+        parti->bio = &ram_disk.bio;
+        parti->dio = &ram_disk.dio;
+        parti->part.starting_lba = start;
+        parti->part.ending_lba = end;
+}
+
+#define DELTA_BLOCK_SIZE 512
+#define DELTA_PART_START 64
+#define DELTA_PART_SIZE (1024 * 1024)
+#define DELTA_IMAGE_SIZE (512 * 1024)
+#define DELTA_HASH_BLOCK 4096
+#define DELTA_LABEL L"unittest"
+
+/* Byte offsets, in the image, of the changes between the on-disk
+   content and the new image.  */
+static const UINTN DELTA_CHANGES[] = { 5000, 200000, DELTA_IMAGE_SIZE - 1 };
+
+static struct flash_manifest *delta_manifest(const UINT8 *content, const char *label,
+                                             UINT64 block_count, UINTN *size)
+{
+        struct flash_manifest *m;
+        UINT64 i;
+
+        *size = sizeof(*m) + block_count * FLASH_MANIFEST_HASH_SIZE;
+        m = AllocateZeroPool(*size);
+        if (!m)
+                return NULL;
+
+        m->magic = FLASH_MANIFEST_MAGIC;
+        m->version = FLASH_MANIFEST_VERSION;
+        strncpy((CHAR8 *)m->label, (CHAR8 *)label, sizeof(m->label) - 1);
+        m->block_size = DELTA_HASH_BLOCK;
+        m->block_count = block_count;
+        for (i = 0; i < block_count; i++)
+                SHA256(content + i * DELTA_HASH_BLOCK, DELTA_HASH_BLOCK, m->hashes[i]);
+
+        return m;
+}
+
+/* Restore the OLD content, flash IMAGE and check the result.  */
+static VOID delta_flash(struct gpt_partition_interface *parti, const UINT8 *old,
+                        UINT8 *image, const CHAR16 *label)
+{
+        UINT8 *part = ram_disk.data + DELTA_PART_START * DELTA_BLOCK_SIZE;
+
+        CopyMem(part, old, DELTA_IMAGE_SIZE);
+        ram_disk_reset_counters();
+        CHECK(!EFI_ERROR(flash_partition_interface(parti, image, DELTA_IMAGE_SIZE, label)));
+        CHECK(!memcmp(part, image, DELTA_IMAGE_SIZE));
+}
+
+static VOID check_delta_report(UINT64 written)
+{
+        char expected[MAX_FLASH_REPORT];
+
+        efi_snprintf((CHAR8 *)expected, sizeof(expected),
+                     (CHAR8 *)"delta: %ld bytes skipped, %ld bytes written",
+                     DELTA_IMAGE_SIZE - written, written);
+        CHECK(!strcmp((CHAR8 *)flash_get_report(), (CHAR8 *)expected));
+        CHECK(ram_disk.written_bytes == written);
+}
+
+static VOID test_delta(VOID)
+{
+        struct gpt_partition_interface parti;
+        struct flash_manifest *m = NULL;
+        BOOLEAN delta = flash_get_delta_mode(), verify = flash_get_verify(),
+                discard = flash_get_discard();
+        UINT8 *old = NULL, *image = NULL;
+        UINTN i, size;
+
+        old = AllocatePool(DELTA_IMAGE_SIZE);
+        image = AllocatePool(DELTA_IMAGE_SIZE);
+        CHECK(old && image);
+        if (!old || !image ||
+            EFI_ERROR(ram_disk_init(DELTA_PART_START * DELTA_BLOCK_SIZE * 2 + DELTA_PART_SIZE,
+                                    DELTA_BLOCK_SIZE)))
+                goto out;
+        ram_disk_partition(&parti, DELTA_PART_START,
+                           DELTA_PART_START + DELTA_PART_SIZE / DELTA_BLOCK_SIZE - 1);
+
+        for (i = 0; i < DELTA_IMAGE_SIZE; i++)
+                old[i] = (UINT8)test_rand();
+        CopyMem(image, old, DELTA_IMAGE_SIZE);
+        for (i = 0; i < ARRAY_SIZE(DELTA_CHANGES); i++)
+                image[DELTA_CHANGES[i]] ^= 0xff;
+
+        flash_set_verify(FALSE);
+        flash_set_discard(FALSE);
+
+        /* Plain write.  */
+        flash_set_delta_mode(FALSE);
+        delta_flash(&parti, old, image, DELTA_LABEL);
+        CHECK(ram_disk.reads == 0);
+        CHECK(ram_disk.written_bytes == DELTA_IMAGE_SIZE);
+        CHECK(!flash_get_report()[0]);
+
+        /* Read-back comparison: only the changed device blocks are
+           written.  */
+        flash_set_delta_mode(TRUE);
+        delta_flash(&parti, old, image, DELTA_LABEL);
+        CHECK(ram_disk.read_bytes == DELTA_IMAGE_SIZE);
+        check_delta_report(ARRAY_SIZE(DELTA_CHANGES) * DELTA_BLOCK_SIZE);
+
+        /* Manifest: nothing is read back, the changed manifest blocks
+           are written.  The manifest is dropped once used.  */
+        m = delta_manifest(old, "unittest", DELTA_IMAGE_SIZE / DELTA_HASH_BLOCK, &size);
+        CHECK(m != NULL);
+        if (!m)
+                goto out;
+        CHECK(!EFI_ERROR(flash_set_manifest(m, size)));
+        delta_flash(&parti, old, image, DELTA_LABEL);
+        CHECK(ram_disk.reads == 0);
+        check_delta_report(ARRAY_SIZE(DELTA_CHANGES) * DELTA_HASH_BLOCK);
+        delta_flash(&parti, old, image, DELTA_LABEL);
+        CHECK(ram_disk.read_bytes == DELTA_IMAGE_SIZE);
+
+        /* The manifest of another partition is ignored.  */
+        CHECK(!EFI_ERROR(flash_set_manifest(m, size)));
+        delta_flash(&parti, old, image, L"other");
+        CHECK(ram_disk.read_bytes == DELTA_IMAGE_SIZE);
+        check_delta_report(ARRAY_SIZE(DELTA_CHANGES) * DELTA_BLOCK_SIZE);
+        flash_set_manifest(NULL, 0);
+
+        /* The blocks beyond the manifest are written.  */
+        FreePool(m);
+        m = delta_manifest(old, "unittest", DELTA_IMAGE_SIZE / DELTA_HASH_BLOCK / 2, &size);
+        CHECK(m != NULL);
+        if (!m)
+                goto out;
+        CHECK(!EFI_ERROR(flash_set_manifest(m, size)));
+        delta_flash(&parti, old, image, DELTA_LABEL);
+        CHECK(ram_disk.reads == 0);
+        check_delta_report(DELTA_IMAGE_SIZE / 2 + 2 * DELTA_HASH_BLOCK);
+
+        /* Invalid manifests.  */
+        CHECK(flash_set_manifest(m, size - 1) == EFI_INVALID_PARAMETER);
+        CHECK(flash_set_manifest(m, sizeof(*m) - 1) == EFI_INVALID_PARAMETER);
+        m->magic = 0;
+        CHECK(flash_set_manifest(m, size) == EFI_INVALID_PARAMETER);
+        m->magic = FLASH_MANIFEST_MAGIC;
+        m->block_size = 0;
+        CHECK(flash_set_manifest(m, size) == EFI_INVALID_PARAMETER);
+        m->block_size = DELTA_BLOCK_SIZE + 1;
+        CHECK(!EFI_ERROR(flash_set_manifest(m, size)));
+        delta_flash(&parti, old, image, DELTA_LABEL);
+        CHECK(ram_disk.read_bytes == DELTA_IMAGE_SIZE);
+        flash_set_manifest(NULL, 0);
+
+out:
+        flash_set_delta_mode(delta);
+        flash_set_verify(verify);
+        flash_set_discard(discard);
+        if (ram_disk.data)
+                ram_disk_free();
+        if (m)
+                FreePool(m);
+        if (image)
+                FreePool(image);
+        if (old)
+                FreePool(old);
+}
+
+#define VERIFY_BLOCK_SIZE 4096
+#define VERIFY_PART_START 64
+#define VERIFY_PART_SIZE (16 * 1024 * 1024)
+#define VERIFY_FILL 0xdeadbeef
+
+/* Sparse image: 4 raw blocks, 8 fill blocks, 2048 don't care blocks
+   and 4 raw blocks.  */
+static const struct verify_chunk {
+        UINT16 type;
+        UINT32 blocks;
+} VERIFY_CHUNKS[] = {
+        { CHUNK_TYPE_RAW, 4 },
+        { CHUNK_TYPE_FILL, 8 },
+        { CHUNK_TYPE_DONT_CARE, 2048 },
+        { CHUNK_TYPE_RAW, 4 }
+};
+
+static UINTN verify_sparse_image(UINT8 *image)
+{
+        struct sparse_header *sph = (struct sparse_header *)image;
+        struct chunk_header *ckh;
+        UINT8 *p = image + sizeof(*sph);
+        UINT32 fill = VERIFY_FILL;
+        UINTN i, j, data_size;
+
+        ZeroMem(sph, sizeof(*sph));
+        sph->magic = SPARSE_HEADER_MAGIC;
+        sph->major_version = 1;
+        sph->file_hdr_sz = sizeof(*sph);
+        sph->chunk_hdr_sz = sizeof(*ckh);
+        sph->blk_sz = VERIFY_BLOCK_SIZE;
+        sph->total_chunks = ARRAY_SIZE(VERIFY_CHUNKS);
+
+        for (i = 0; i < ARRAY_SIZE(VERIFY_CHUNKS); i++) {
+                ckh = (struct chunk_header *)p;
+                p += sizeof(*ckh);
+                switch (VERIFY_CHUNKS[i].type) {
+                case CHUNK_TYPE_RAW:
+                        data_size = VERIFY_CHUNKS[i].blocks * VERIFY_BLOCK_SIZE;
+                        for (j = 0; j < data_size; j++)
+                                p[j] = (UINT8)test_rand();
+                        break;
+                case CHUNK_TYPE_FILL:
+                        data_size = sizeof(fill);
+                        memcpy(p, &fill, sizeof(fill));
+                        break;
+                default:
+                        data_size = 0;
+                }
+                ckh->chunk_type = VERIFY_CHUNKS[i].type;
+                ckh->reserved1 = 0;
+                ckh->chunk_sz = VERIFY_CHUNKS[i].blocks;
+                ckh->total_sz = sizeof(*ckh) + data_size;
+                sph->total_blks += VERIFY_CHUNKS[i].blocks;
+                p += data_size;
+        }
+
+        return p - image;
+}
+
+/* Flash IMAGE with the byte at image offset CORRUPT_AT, if any,
+   corrupted right before the read-back.  */
+static EFI_STATUS verify_flash(struct gpt_partition_interface *parti, UINT8 *image,
+                               UINTN size, INT64 corrupt_at)
+{
+        ram_disk_reset_counters();
+        ram_disk.corrupt = corrupt_at >= 0;
+        ram_disk.corrupt_at = VERIFY_PART_START * DELTA_BLOCK_SIZE + corrupt_at;
+        return flash_partition_interface(parti, image, size, L"unittest");
+}
+
+static VOID test_verify(VOID)
+{
+        struct gpt_partition_interface parti;
+        BOOLEAN delta = flash_get_delta_mode(), verify = flash_get_verify(),
+                discard = flash_get_discard();
+        const UINT64 image_bytes = (4 + 8 + 2048 + 4) * VERIFY_BLOCK_SIZE;
+        const UINT64 dont_care = 2048 * VERIFY_BLOCK_SIZE;
+        char expected[MAX_FLASH_REPORT];
+        UINT8 *image;
+        UINTN size;
+
+        image = AllocatePool(sizeof(struct sparse_header) +
+                             ARRAY_SIZE(VERIFY_CHUNKS) * sizeof(struct chunk_header) +
+                             8 * VERIFY_BLOCK_SIZE + sizeof(UINT32));
+        CHECK(image != NULL);
+        if (!image || EFI_ERROR(ram_disk_init(VERIFY_PART_START * DELTA_BLOCK_SIZE * 2 +
+                                              VERIFY_PART_SIZE, DELTA_BLOCK_SIZE)))
+                goto out;
+        ram_disk_partition(&parti, VERIFY_PART_START,
+                           VERIFY_PART_START + VERIFY_PART_SIZE / DELTA_BLOCK_SIZE - 1);
+        size = verify_sparse_image(image);
+
+        flash_set_delta_mode(FALSE);
+        flash_set_discard(FALSE);
+        flash_set_verify(TRUE);
+
+        /* The don't care range is read before the write and the whole
+           image range is read back.  */
+        CHECK(!EFI_ERROR(verify_flash(&parti, image, size, -1)));
+        CHECK(ram_disk.read_bytes == dont_care + image_bytes);
+        CHECK(ram_disk.flushes == 1);
+        CHECK(!flash_get_report()[0]);
+
+        /* Corrupted raw, fill and don't care blocks are reported,
+           blocks beyond the image are not checked.  */
+        efi_snprintf((CHAR8 *)expected, sizeof(expected),
+                     (CHAR8 *)"verify: mismatch at LBA %d-%d", VERIFY_PART_START,
+                     VERIFY_PART_START + (4 * 1024 * 1024) / DELTA_BLOCK_SIZE - 1);
+        CHECK(verify_flash(&parti, image, size, 100) == EFI_CRC_ERROR);
+        CHECK(!strcmp((CHAR8 *)flash_get_report(), (CHAR8 *)expected));
+        CHECK(verify_flash(&parti, image, size, 6 * VERIFY_BLOCK_SIZE) == EFI_CRC_ERROR);
+        CHECK(!strcmp((CHAR8 *)flash_get_report(), (CHAR8 *)expected));
+        CHECK(verify_flash(&parti, image, size, 100 * VERIFY_BLOCK_SIZE) == EFI_CRC_ERROR);
+        CHECK(!strcmp((CHAR8 *)flash_get_report(), (CHAR8 *)expected));
+        CHECK(verify_flash(&parti, image, size, image_bytes - 1) == EFI_CRC_ERROR);
+        CHECK(!EFI_ERROR(verify_flash(&parti, image, size, image_bytes)));
+
+        /* Delta mode: nothing is written, everything is checked.  */
+        flash_set_delta_mode(TRUE);
+        CHECK(verify_flash(&parti, image, size, 8 * VERIFY_BLOCK_SIZE) == EFI_CRC_ERROR);
+        CHECK(ram_disk.written_bytes == 0);
+        flash_set_delta_mode(FALSE);
+
+        /* With EFI_BLOCK_IO2, the 4 MiB extents are read back
+           asynchronously.  */
+        CHECK(!EFI_ERROR(ram_disk_install_bio2()));
+        parti.handle = ram_disk.handle;
+        CHECK(!EFI_ERROR(verify_flash(&parti, image, size, -1)));
+        CHECK(ram_disk.async_reads == (image_bytes + 4 * 1024 * 1024 - 1) / (4 * 1024 * 1024));
+        CHECK(ram_disk.read_bytes == dont_care + image_bytes);
+        CHECK(verify_flash(&parti, image, size, image_bytes - 1) == EFI_CRC_ERROR);
+
+out:
+        flash_set_delta_mode(delta);
+        flash_set_verify(verify);
+        flash_set_discard(discard);
+        if (ram_disk.data)
+                ram_disk_free();
+        if (image)
+                FreePool(image);
+}
+
+/* Recording stand-ins of the SCSI and NVMe pass-thru protocols.  The
+   descriptors of the first DISCARD_MAX_CMDS discard commands are
+   recorded, up to DISCARD_MAX_DESC of them, and all are applied to the
+   RAM disk if any.  */
+#define DISCARD_MAX_CMDS 8
+#define DISCARD_MAX_DESC 8
+#define FAKE_SCSI_TARGET 3
+#define FAKE_SCSI_LUN 5
+#define FAKE_UNMAP_MAX_BLOCKS 1000
+#define FAKE_UNMAP_MAX_DESC 4
+#define FAKE_NVME_NSID 1
+#define FAKE_NVME_ONCS_DSM (1 << 2)
+#define FAKE_NVME_ONCS_WRITE_ZEROES (1 << 3)
+
+static struct discard_cmd {
+        UINTN count;
+        struct discard_range desc[DISCARD_MAX_DESC];
+} discard_cmds[DISCARD_MAX_CMDS];
+static UINTN discard_cmd_count, discard_probes;
+static EFI_STATUS discard_status;
+
+static VOID discard_record(UINT64 lba, UINT64 blocks)
+{
+        struct discard_cmd *cmd;
+
+        ram_disk_erase(lba, blocks);
+        if (discard_cmd_count > DISCARD_MAX_CMDS)
+                return;
+        cmd = &discard_cmds[discard_cmd_count - 1];
+        if (cmd->count < DISCARD_MAX_DESC) {
+                cmd->desc[cmd->count].start = lba;
+                cmd->desc[cmd->count].end = lba + blocks - 1;
+        }
+        cmd->count++;
+}
+
+static VOID discard_new_cmd(VOID)
+{
+        if (discard_cmd_count < DISCARD_MAX_CMDS)
+                ZeroMem(&discard_cmds[discard_cmd_count], sizeof(*discard_cmds));
+        discard_cmd_count++;
+        ram_disk_charge(0);
+}
+
+static EFIAPI EFI_STATUS fake_scsi_pass_thru(__attribute__((__unused__)) EFI_EXT_SCSI_PASS_THRU_PROTOCOL *scsi,
+                                             UINT8 *target, UINT64 lun,
+                                             EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET *req,
+                                             __attribute__((__unused__)) EFI_EVENT event)
+{
+        UINT8 *cdb = req->Cdb;
+        struct vpd_block_limits *vpd;
+        struct unmap_parameter_header *header;
+        struct unmap_block_descriptor *desc;
+        UINTN i, n;
+
+        CHECK(target[0] == FAKE_SCSI_TARGET && lun == FAKE_SCSI_LUN);
+
+        switch (cdb[0]) {
+        case UFS_INQUIRY:
+                discard_probes++;
+                CHECK(req->InTransferLength >= sizeof(*vpd));
+                vpd = req->InDataBuffer;
+                ZeroMem(vpd, sizeof(*vpd));
+                vpd->page_code = UFS_VPD_BLOCK_LIMITS;
+                vpd->max_unmap_lba_count = htobe32(FAKE_UNMAP_MAX_BLOCKS);
+                vpd->max_unmap_desc_count = htobe32(FAKE_UNMAP_MAX_DESC);
+                return EFI_SUCCESS;
+        case UFS_UNMAP:
+                header = req->OutDataBuffer;
+                desc = (struct unmap_block_descriptor *)(header + 1);
+                n = be16toh(header->block_desc_length) / sizeof(*desc);
+                CHECK(req->DataDirection == EFI_EXT_SCSI_DATA_DIRECTION_WRITE);
+                CHECK(req->OutTransferLength == sizeof(*header) + n * sizeof(*desc));
+                CHECK(be16toh(header->data_length) ==
+                      req->OutTransferLength - sizeof(header->data_length));
+                discard_new_cmd();
+                for (i = 0; i < n; i++)
+                        discard_record(be64toh(desc[i].lba), be32toh(desc[i].count));
+                return discard_status;
+        default:
+                return EFI_UNSUPPORTED;
+        }
+}
+
+static EFIAPI EFI_STATUS fake_scsi_get_target_lun(__attribute__((__unused__)) EFI_EXT_SCSI_PASS_THRU_PROTOCOL *scsi,
+                                                  __attribute__((__unused__)) EFI_DEVICE_PATH *dp,
+                                                  UINT8 **target, UINT64 *lun)
+{
+        ZeroMem(*target, TARGET_MAX_BYTES);
+        (*target)[0] = FAKE_SCSI_TARGET;
+        *lun = FAKE_SCSI_LUN;
+        return EFI_SUCCESS;
+}
+
+static EFIAPI EFI_STATUS fake_nvme_pass_thru(__attribute__((__unused__)) EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *nvme,
+                                             UINT32 nsid,
+                                             EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET *packet,
+                                             __attribute__((__unused__)) EFI_EVENT event)
+{
+        EFI_NVM_EXPRESS_COMMAND *cmd = packet->NvmeCmd;
+        NVME_ADMIN_CONTROLLER_DATA *ctrl;
+        struct {
+                UINT32 attributes;
+                UINT32 blocks;
+                UINT64 lba;
+        } *range = packet->TransferBuffer;
+        UINTN i, n;
+
+        if (packet->QueueType == NVME_ADMIN_QUEUE &&
+            cmd->Cdw0.Opcode == NVME_ADMIN_IDENTIFY_CMD) {
+                discard_probes++;
+                CHECK(packet->TransferLength == sizeof(*ctrl));
+                ctrl = packet->TransferBuffer;
+                ZeroMem(ctrl, sizeof(*ctrl));
+                ctrl->Oncs = FAKE_NVME_ONCS_DSM | FAKE_NVME_ONCS_WRITE_ZEROES;
+                return EFI_SUCCESS;
+        }
+
+        if (packet->QueueType != NVME_IO_QUEUE)
+                return EFI_UNSUPPORTED;
+
+        /* Write Zeroes, recorded as a single range command.  */
+        if (cmd->Cdw0.Opcode == 0x08) {
+                CHECK(nsid == FAKE_NVME_NSID && cmd->Nsid == FAKE_NVME_NSID);
+                discard_new_cmd();
+                discard_record(cmd->Cdw10 | (UINT64)cmd->Cdw11 << 32,
+                               (cmd->Cdw12 & 0xffff) + 1);
+                return discard_status;
+        }
+
+        /* Dataset Management, deallocate attribute.  */
+        if (cmd->Cdw0.Opcode != 0x09)
+                return EFI_UNSUPPORTED;
+
+        n = cmd->Cdw10 + 1;
+        CHECK(nsid == FAKE_NVME_NSID && cmd->Nsid == FAKE_NVME_NSID);
+        CHECK(cmd->Cdw11 == (1 << 2));
+        CHECK(packet->TransferLength == n * sizeof(*range));
+        discard_new_cmd();
+        for (i = 0; i < n; i++)
+                discard_record(range[i].lba, range[i].blocks);
+        return discard_status;
+}
+
+static EFIAPI EFI_STATUS fake_nvme_get_namespace(__attribute__((__unused__)) EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *nvme,
+                                                 __attribute__((__unused__)) EFI_DEVICE_PATH_PROTOCOL *dp,
+                                                 UINT32 *nsid)
+{
+        *nsid = FAKE_NVME_NSID;
+        return EFI_SUCCESS;
+}
+
+static EFI_GUID fake_scsi_guid = EFI_EXT_SCSI_PASS_THRU_PROTOCOL_GUID;
+static EFI_EXT_SCSI_PASS_THRU_PROTOCOL fake_scsi = {
+        .PassThru = fake_scsi_pass_thru,
+        .GetTargetLun = fake_scsi_get_target_lun
+};
+
+static EFI_GUID fake_nvme_guid = EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL_GUID;
+static EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL fake_nvme = {
+        .PassThru = fake_nvme_pass_thru,
+        .GetNamespace = fake_nvme_get_namespace
+};
+
+/* Controller handle, with the pass-thru protocol if any, and block
+   device handle below it.  */
+static struct fake_controller {
+        EFI_HANDLE controller, disk;
+        UINT8 controller_dp[sizeof(VENDOR_DEVICE_PATH) + sizeof(EFI_DEVICE_PATH)];
+        UINT8 disk_dp[sizeof(VENDOR_DEVICE_PATH) + 16 + sizeof(EFI_DEVICE_PATH)];
+        EFI_GUID *guid;
+        VOID *interface;
+} fake_controller;
+
+static EFI_GUID fake_controller_vendor = { 0x1b7e8a2d, 0x6b1a, 0x4c55,
+                                           { 0x9a, 0x3e, 0x70, 0x12, 0xc4, 0x5d, 0x0f, 0x61 } };
+
+static EFI_DEVICE_PATH *fake_dp_node(EFI_DEVICE_PATH *p, UINT8 type, UINT8 subtype, UINT16 len)
+{
+        p->Type = type;
+        p->SubType = subtype;
+        SetDevicePathNodeLength(p, len);
+        return NextDevicePathNode(p);
+}
+
+static EFI_DEVICE_PATH *fake_dp_vendor(UINT8 *buf)
+{
+        VENDOR_DEVICE_PATH *vendor = (VENDOR_DEVICE_PATH *)buf;
+
+        CopyMem(&vendor->Guid, &fake_controller_vendor, sizeof(vendor->Guid));
+        return fake_dp_node((EFI_DEVICE_PATH *)buf, HARDWARE_DEVICE_PATH, HW_VENDOR_DP,
+                            sizeof(*vendor));
+}
+
+/* Install the controller with INTERFACE and a disk whose device path
+   ends with a SUBTYPE messaging node of NODE_SIZE bytes.  */
+static EFI_STATUS fake_controller_install(EFI_GUID *guid, VOID *interface,
+                                          UINT8 subtype, UINT16 node_size)
+{
+        struct fake_controller *fc = &fake_controller;
+        EFI_DEVICE_PATH *p;
+        EFI_STATUS ret;
+
+        ZeroMem(fc, sizeof(*fc));
+        fc->guid = guid;
+        fc->interface = interface;
+
+        p = fake_dp_vendor(fc->controller_dp);
+        SetDevicePathEndNode(p);
+        p = fake_dp_vendor(fc->disk_dp);
+        p = fake_dp_node(p, MESSAGING_DEVICE_PATH, subtype, node_size);
+        SetDevicePathEndNode(p);
+
+        ret = uefi_call_wrapper(BS->InstallProtocolInterface, 4, &fc->controller,
+                                &DevicePathProtocol, EFI_NATIVE_INTERFACE, fc->controller_dp);
+        if (EFI_ERROR(ret))
+                return ret;
+        if (guid) {
+                ret = uefi_call_wrapper(BS->InstallProtocolInterface, 4, &fc->controller,
+                                        guid, EFI_NATIVE_INTERFACE, interface);
+                if (EFI_ERROR(ret))
+                        return ret;
+        }
+        return uefi_call_wrapper(BS->InstallProtocolInterface, 4, &fc->disk,
+                                 &DevicePathProtocol, EFI_NATIVE_INTERFACE, fc->disk_dp);
+}
+
+static VOID fake_controller_uninstall(VOID)
+{
+        struct fake_controller *fc = &fake_controller;
+
+        if (fc->disk)
+                uefi_call_wrapper(BS->UninstallProtocolInterface, 3, fc->disk,
+                                  &DevicePathProtocol, fc->disk_dp);
+        if (fc->controller) {
+                if (fc->guid)
+                        uefi_call_wrapper(BS->UninstallProtocolInterface, 3, fc->controller,
+                                          fc->guid, fc->interface);
+                uefi_call_wrapper(BS->UninstallProtocolInterface, 3, fc->controller,
+                                  &DevicePathProtocol, fc->controller_dp);
+        }
+        ZeroMem(fc, sizeof(*fc));
+}
+
+static VOID check_discard_cmd(UINTN i, const struct discard_range *expected, UINTN count)
+{
+        UINTN j;
+
+        CHECK(i < discard_cmd_count && discard_cmds[i].count == count);
+        if (i >= discard_cmd_count || discard_cmds[i].count != count)
+                return;
+        for (j = 0; j < min(count, (UINTN)DISCARD_MAX_DESC); j++)
+                CHECK(discard_cmds[i].desc[j].start == expected[j].start &&
+                      discard_cmds[i].desc[j].end == expected[j].end);
+}
+
+/* Discarded ranges, and the resulting UNMAP commands for the limits
+   of the fake UFS device: at most 4 descriptors and 1000 blocks per
+   command.  */
+static const struct discard_range DISCARD_RANGES[] = {
+        { 0, 99 }, { 200, 2699 }, { 5000, 5000 }
+};
+static const struct discard_range UNMAP_CMD0[] = { { 0, 99 }, { 200, 1099 } };
+static const struct discard_range UNMAP_CMD1[] = { { 1100, 2099 } };
+static const struct discard_range UNMAP_CMD2[] = { { 2100, 2699 }, { 5000, 5000 } };
+static const struct discard_range UNMAP_SMALL[] = {
+        { 10, 10 }, { 20, 20 }, { 30, 30 }, { 40, 40 }
+};
+
+static VOID discard_reset(EFI_STATUS status)
+{
+        discard_cmd_count = discard_probes = 0;
+        discard_status = status;
+}
+
+static VOID test_discard_ufs(VOID)
+{
+        struct storage *ufs = &STORAGE(STORAGE_UFS);
+        struct discard_range ranges[5];
+        UINTN i;
+
+        CHECK(!EFI_ERROR(fake_controller_install(&fake_scsi_guid, &fake_scsi, 0x19 /* MSG_UFS_DP */, 6)));
+        if (!fake_controller.disk)
+                goto out;
+
+        /* Split by the device limits, the Block Limits VPD page is
+           read once.  */
+        discard_reset(EFI_SUCCESS);
+        CopyMem(ranges, DISCARD_RANGES, sizeof(DISCARD_RANGES));
+        CHECK(!EFI_ERROR(ufs->discard_ranges(fake_controller.disk, NULL, ranges,
+                                             ARRAY_SIZE(DISCARD_RANGES))));
+        CHECK(discard_probes == 1 && discard_cmd_count == 3);
+        check_discard_cmd(0, UNMAP_CMD0, ARRAY_SIZE(UNMAP_CMD0));
+        check_discard_cmd(1, UNMAP_CMD1, ARRAY_SIZE(UNMAP_CMD1));
+        check_discard_cmd(2, UNMAP_CMD2, ARRAY_SIZE(UNMAP_CMD2));
+
+        /* The pass-thru access is cached, 5 ranges make 2 commands.  */
+        discard_reset(EFI_SUCCESS);
+        for (i = 0; i < ARRAY_SIZE(ranges); i++)
+                ranges[i].start = ranges[i].end = 10 * (i + 1);
+        CHECK(!EFI_ERROR(ufs->discard_ranges(fake_controller.disk, NULL, ranges,
+                                             ARRAY_SIZE(ranges))));
+        CHECK(discard_probes == 0 && discard_cmd_count == 2);
+        check_discard_cmd(0, UNMAP_SMALL, ARRAY_SIZE(UNMAP_SMALL));
+        check_discard_cmd(1, &ranges[4], 1);
+
+        /* erase_blocks() is a single range discard.  */
+        discard_reset(EFI_SUCCESS);
+        CHECK(!EFI_ERROR(ufs->erase_blocks(fake_controller.disk, NULL, 1100, 2099)));
+        CHECK(discard_cmd_count == 1);
+        check_discard_cmd(0, UNMAP_CMD1, ARRAY_SIZE(UNMAP_CMD1));
+
+        /* A failure drops the cached access.  */
+        discard_reset(EFI_DEVICE_ERROR);
+        CHECK(ufs->discard_ranges(fake_controller.disk, NULL, ranges, 1) == EFI_DEVICE_ERROR);
+        discard_reset(EFI_SUCCESS);
+        CHECK(!EFI_ERROR(ufs->discard_ranges(fake_controller.disk, NULL, ranges, 1)));
+        CHECK(discard_probes == 1);
+
+        /* Leave no cached access to the handle about to be freed.  */
+        discard_reset(EFI_DEVICE_ERROR);
+        ufs->discard_ranges(fake_controller.disk, NULL, ranges, 1);
+
+out:
+        fake_controller_uninstall();
+}
+
+static VOID test_discard_nvme(VOID)
+{
+        struct storage *nvme_storage = &STORAGE(STORAGE_NVME);
+        struct discard_range ranges[3], *many;
+        static const struct discard_range split[] = {
+                { 0, 0xfffffffe }, { 0xffffffff, 0x100000063 }
+        };
+        UINTN i;
+
+        CHECK(!EFI_ERROR(fake_controller_install(&fake_nvme_guid, &fake_nvme, 0x17 /* MSG_NVME_NAMESPACE_DP */, 16)));
+        many = AllocatePool(300 * sizeof(*many));
+        CHECK(many != NULL);
+        if (!fake_controller.disk || !many)
+                goto out;
+
+        /* All the ranges in a single Dataset Management command.  */
+        discard_reset(EFI_SUCCESS);
+        CopyMem(ranges, DISCARD_RANGES, sizeof(DISCARD_RANGES));
+        CHECK(!EFI_ERROR(nvme_storage->discard_ranges(fake_controller.disk, NULL, ranges,
+                                                      ARRAY_SIZE(ranges))));
+        CHECK(discard_probes == 1 && discard_cmd_count == 1);
+        check_discard_cmd(0, DISCARD_RANGES, ARRAY_SIZE(DISCARD_RANGES));
+
+        /* Ranges are split at 2^32 - 1 blocks.  */
+        discard_reset(EFI_SUCCESS);
+        ranges[0].start = 0;
+        ranges[0].end = 0x100000063;
+        CHECK(!EFI_ERROR(nvme_storage->discard_ranges(fake_controller.disk, NULL, ranges, 1)));
+        CHECK(discard_probes == 0 && discard_cmd_count == 1);
+        check_discard_cmd(0, split, ARRAY_SIZE(split));
+
+        /* At most 256 ranges per command.  */
+        discard_reset(EFI_SUCCESS);
+        for (i = 0; i < 300; i++)
+                many[i].start = many[i].end = 2 * i;
+        CHECK(!EFI_ERROR(nvme_storage->discard_ranges(fake_controller.disk, NULL, many, 300)));
+        CHECK(discard_cmd_count == 2);
+        check_discard_cmd(0, many, 256);
+        check_discard_cmd(1, many + 256, 44);
+
+        /* A failure drops the cached access, which leaves nothing
+           cached about the handle about to be freed.  */
+        discard_reset(EFI_DEVICE_ERROR);
+        CHECK(nvme_storage->discard_ranges(fake_controller.disk, NULL, ranges, 1) == EFI_DEVICE_ERROR);
+
+out:
+        if (many)
+                FreePool(many);
+        fake_controller_uninstall();
+}
+
+static VOID test_discard(VOID)
+{
+        test_discard_ufs();
+        test_discard_nvme();
+}
+
+/* Stand-in of EFI_ERASE_BLOCK_PROTOCOL erasing the RAM disk, the last
+   request is recorded.  */
+static EFI_GUID fake_erase_block_guid = EFI_ERASE_BLOCK_PROTOCOL_GUID;
+static struct fake_erase_block {
+        EFI_ERASE_BLOCK_PROTOCOL protocol;
+        UINTN calls;
+        EFI_LBA lba;
+        UINTN size;
+} fake_erase_block;
+
+static EFIAPI EFI_STATUS fake_erase_blocks(__attribute__((__unused__)) EFI_ERASE_BLOCK_PROTOCOL *erase_block,
+                                           __attribute__((__unused__)) UINT32 media_id,
+                                           EFI_LBA lba,
+                                           __attribute__((__unused__)) EFI_ERASE_BLOCK_TOKEN *token,
+                                           UINTN size)
+{
+        fake_erase_block.calls++;
+        fake_erase_block.lba = lba;
+        fake_erase_block.size = size;
+        ram_disk_charge(0);
+        return ram_disk_erase(lba, size / ram_disk.media.BlockSize);
+}
+
+#define BENCH_DISK_SIZE (8 * 1024 * 1024)
+#define BENCH_BLOCK_SIZE 512
+#define BENCH_START 5
+#define BENCH_END 12000
+#define BENCH_PATTERN 0xa5
+
+/* Blocks START to END read as zeros, their neighbours are left
+   untouched.  */
+static BOOLEAN bench_erased(EFI_LBA start, EFI_LBA end)
+{
+        UINT64 i;
+
+        if (ram_disk.data[start * BENCH_BLOCK_SIZE - 1] != BENCH_PATTERN ||
+            ram_disk.data[(end + 1) * BENCH_BLOCK_SIZE] != BENCH_PATTERN)
+                return FALSE;
+
+        for (i = start * BENCH_BLOCK_SIZE; i < (end + 1) * BENCH_BLOCK_SIZE; i++)
+                if (ram_disk.data[i])
+                        return FALSE;
+        return TRUE;
+}
+
+static VOID bench_reset(VOID)
+{
+        SetMem(ram_disk.data, ram_disk.size, BENCH_PATTERN);
+        ram_disk_reset_counters();
+        discard_reset(EFI_SUCCESS);
+        fake_erase_block.calls = 0;
+}
+
+static UINT64 bench_kib_per_s(EFI_LBA blocks)
+{
+        UINT64 kib = blocks * BENCH_BLOCK_SIZE / 1024;
+
+        return ram_disk.busy_us ? kib * 1000000 / ram_disk.busy_us : 0;
+}
+
+static EFI_STATUS bench_ufs_erase(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+{
+        return STORAGE(STORAGE_UFS).erase_blocks(handle, bio, start, end);
+}
+
+static EFI_STATUS bench_nvme_erase(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+{
+        return STORAGE(STORAGE_NVME).erase_blocks(handle, bio, start, end);
+}
+
+static EFI_STATUS bench_general_block_erase(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+                                            EFI_LBA start, EFI_LBA end)
+{
+        return STORAGE(STORAGE_GENERAL_BLOCK).erase_blocks(handle, bio, start, end);
+}
+
+/* Simulated storage devices: the controller protocol, the disk device
+   path messaging node, the erase operation, the storage operations
+   caching the controller access, if any, and the latency and
+   bandwidth model.  */
+static const struct storage_bench {
+        const CHAR16 *name;
+        EFI_GUID *guid;
+        VOID *interface;
+        UINT8 subtype;
+        UINT16 node_size;
+        EFI_STATUS (*erase)(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end);
+        struct storage *storage;
+        UINT32 latency_us;
+        UINT64 bandwidth;
+} STORAGE_BENCHES[] = {
+        { L"UFS", &fake_scsi_guid, &fake_scsi, 0x19 /* MSG_UFS_DP */, 6,
+          bench_ufs_erase, &STORAGE(STORAGE_UFS), 100, 500 * 1024 * 1024 },
+        { L"NVMe", &fake_nvme_guid, &fake_nvme, 0x17 /* MSG_NVME_NAMESPACE_DP */, 16,
+          bench_nvme_erase, &STORAGE(STORAGE_NVME), 20, 2000 * 1024 * 1024ULL },
+        { L"Erase block", &fake_erase_block_guid, &fake_erase_block.protocol,
+          0x1d /* MSG_EMMC_DP */, 5, storage_erase_blocks, NULL, 300, 150 * 1024 * 1024 },
+        { L"General block", NULL, NULL, 0x12 /* MSG_SATA_DP */, 10,
+          bench_general_block_erase, NULL, 200, 100 * 1024 * 1024 }
+};
+
+/* Erase then zero fill the same range.  An unsupported erase falls
+   back to zero filling, as flash.c does.  */
+static VOID bench_storage(const struct storage_bench *b)
+{
+        const EFI_LBA blocks = BENCH_END - BENCH_START + 1;
+        struct discard_range range = { BENCH_START, BENCH_START };
+        UINT64 erase_kib_s;
+        BOOLEAN fallback = FALSE;
+        EFI_STATUS ret;
+
+        CHECK(!EFI_ERROR(fake_controller_install(b->guid, b->interface,
+                                                 b->subtype, b->node_size)));
+        if (!fake_controller.disk)
+                goto out;
+        ram_disk.latency_us = b->latency_us;
+        ram_disk.bandwidth = b->bandwidth;
+
+        bench_reset();
+        ret = b->erase(fake_controller.disk, &ram_disk.bio, BENCH_START, BENCH_END);
+        if (ret == EFI_UNSUPPORTED) {
+                fallback = TRUE;
+                ret = fill_zero(&ram_disk.bio, BENCH_START, BENCH_END);
+        }
+        CHECK(!EFI_ERROR(ret));
+        CHECK(bench_erased(BENCH_START, BENCH_END));
+        CHECK(ram_disk.erased_blocks + ram_disk.written_bytes / BENCH_BLOCK_SIZE == blocks);
+        erase_kib_s = bench_kib_per_s(blocks);
+
+        bench_reset();
+        CHECK(!EFI_ERROR(fill_zero(&ram_disk.bio, BENCH_START, BENCH_END)));
+        CHECK(bench_erased(BENCH_START, BENCH_END));
+        CHECK(ram_disk.writes == (blocks + N_BLOCK - 1) / N_BLOCK);
+        CHECK(ram_disk.written_bytes == blocks * BENCH_BLOCK_SIZE);
+
+        Print(L"%s: erase %ld KiB/s%s, zero fill %ld KiB/s\n", b->name, erase_kib_s,
+              fallback ? L" (zero fill)" : L"", bench_kib_per_s(blocks));
+
+        /* Leave no cached access to the handle about to be freed.  */
+        if (b->storage) {
+                discard_reset(EFI_DEVICE_ERROR);
+                b->storage->discard_ranges(fake_controller.disk, &ram_disk.bio, &range, 1);
+        }
+
+out:
+        fake_controller_uninstall();
+}
+
+static VOID test_storage_fill(VOID)
+{
+        UINT8 pattern[3 * BENCH_BLOCK_SIZE];
+
+        /* A single block range, as the erase granularity alignment
+           produces.  */
+        bench_reset();
+        CHECK(!EFI_ERROR(fill_zero(&ram_disk.bio, 7, 7)));
+        CHECK(bench_erased(7, 7));
+        CHECK(ram_disk.writes == 1 && ram_disk.written_bytes == BENCH_BLOCK_SIZE);
+        CHECK(fill_zero(&ram_disk.bio, 8, 7) == EFI_INVALID_PARAMETER);
+
+        /* The last write is truncated to the range.  */
+        SetMem(pattern, sizeof(pattern), 0x3c);
+        bench_reset();
+        CHECK(!EFI_ERROR(fill_with(&ram_disk.bio, 20, 26, pattern, 3)));
+        CHECK(ram_disk.writes == 3 && ram_disk.written_bytes == 7 * BENCH_BLOCK_SIZE);
+        CHECK(ram_disk.data[20 * BENCH_BLOCK_SIZE - 1] == BENCH_PATTERN);
+        CHECK(ram_disk.data[20 * BENCH_BLOCK_SIZE] == 0x3c);
+        CHECK(ram_disk.data[27 * BENCH_BLOCK_SIZE - 1] == 0x3c);
+        CHECK(ram_disk.data[27 * BENCH_BLOCK_SIZE] == BENCH_PATTERN);
+}
+
+/* storage_erase_blocks() zero fills the head and tail of the range not
+   aligned on the erase granularity.  */
+static VOID test_storage_erase_block(VOID)
+{
+        EFI_STATUS ret;
+
+        CHECK(!EFI_ERROR(fake_controller_install(&fake_erase_block_guid,
+                                                 &fake_erase_block.protocol,
+                                                 0x1d /* MSG_EMMC_DP */, 5)));
+        if (!fake_controller.disk)
+                goto out;
+
+        bench_reset();
+        ret = storage_erase_blocks(fake_controller.disk, &ram_disk.bio, 3, 45);
+        if (ret == EFI_UNSUPPORTED && !fake_erase_block.calls && !ram_disk.writes) {
+                Print(L"No boot storage identified, storage_erase_blocks() not tested\n");
+                goto out;
+        }
+        CHECK(!EFI_ERROR(ret));
+        CHECK(bench_erased(3, 45));
+        CHECK(fake_erase_block.calls == 1 && fake_erase_block.lba == 8);
+        CHECK(fake_erase_block.size == 32 * BENCH_BLOCK_SIZE);
+        CHECK(ram_disk.writes == 2);
+
+        /* Smaller than the erase granularity.  */
+        bench_reset();
+        CHECK(!EFI_ERROR(storage_erase_blocks(fake_controller.disk, &ram_disk.bio, 16, 16)));
+        CHECK(bench_erased(16, 16));
+        CHECK(!fake_erase_block.calls && ram_disk.writes == 1);
+
+out:
+        fake_controller_uninstall();
+}
+
+static VOID test_storage(VOID)
+{
+        UINTN i;
+
+        CHECK(!EFI_ERROR(ram_disk_init(BENCH_DISK_SIZE, BENCH_BLOCK_SIZE)));
+        if (!ram_disk.data)
+                return;
+        fake_erase_block.protocol.Revision = EFI_ERASE_BLOCK_PROTOCOL_REVISION;
+        fake_erase_block.protocol.EraseLengthGranularity = 8;
+        fake_erase_block.protocol.EraseBlocks = fake_erase_blocks;
+
+        test_storage_fill();
+        test_storage_erase_block();
+        for (i = 0; i < ARRAY_SIZE(STORAGE_BENCHES); i++)
+                bench_storage(&STORAGE_BENCHES[i]);
+
+        ram_disk_free();
+}
+
+#define PREFETCH_BLOCK_SIZE 512
+#define PREFETCH_PART_START 64
+#define PREFETCH_PART_SIZE (256 * 1024)
+/* Not a multiple of the block size.  */
+#define PREFETCH_IMAGE_SIZE (100 * 1024 + 100)
+
+/* Vendor boot image of PREFETCH_IMAGE_SIZE bytes, which
+   android_image_plan() accepts, at the beginning of the partition.  */
+static UINT8 *prefetch_vendor_boot(VOID)
+{
+        UINT8 *part = ram_disk.data + PREFETCH_PART_START * PREFETCH_BLOCK_SIZE;
+        struct vendor_boot_img_hdr_v3 *hdr = (struct vendor_boot_img_hdr_v3 *)part;
+        UINTN i;
+
+        for (i = 0; i < PREFETCH_IMAGE_SIZE; i++)
+                part[i] = (UINT8)test_rand();
+        ZeroMem(hdr, BOOT_IMG_HEADER_SIZE_V3);
+        memcpy(hdr->magic, VENDOR_BOOT_MAGIC, VENDOR_BOOT_MAGIC_SIZE);
+        hdr->header_version = 3;
+        hdr->page_size = 4096;
+        hdr->vendor_ramdisk_size = PREFETCH_IMAGE_SIZE - BOOT_IMG_HEADER_SIZE_V3;
+        block_cache_invalidate_all();
+
+        return part;
+}
+
+/* Planned images are read in place and handed over without copy.  */
+static VOID test_prefetch_planned(struct gpt_partition_interface *parti)
+{
+        UINT8 *part = prefetch_vendor_boot();
+        UINT8 *data;
+        UINTN reads;
+
+        ram_disk_reset_counters();
+        CHECK(!EFI_ERROR(prefetch_partition_interface(parti, L"vendor_boot_a",
+                                                      PREFETCH_IMAGE_SIZE)));
+        CHECK(ram_disk.async_reads == 1);
+        reads = ram_disk.reads;
+
+        data = prefetch_get_planned(L"vendor_boot_a", PREFETCH_IMAGE_SIZE);
+        CHECK(data && !memcmp(data, part, PREFETCH_IMAGE_SIZE));
+        CHECK(ram_disk.reads == reads && ram_disk.async_reads == 1);
+        /* Handed over only once.  */
+        CHECK(!prefetch_get_planned(L"vendor_boot_a", PREFETCH_IMAGE_SIZE));
+        CHECK(prefetch_read(L"vendor_boot_a", 0, 16, part) == EFI_NOT_FOUND);
+        android_image_plan_free(data);
+
+        /* Planning the image again, from another slot, drops the
+           prefetched one.  */
+        CHECK(!EFI_ERROR(prefetch_partition_interface(parti, L"vendor_boot_a",
+                                                      PREFETCH_IMAGE_SIZE)));
+        data = android_image_plan("vendor_boot_b", part, ANDROID_IMAGE_PLAN_HEADER_SIZE,
+                                  PREFETCH_IMAGE_SIZE);
+        CHECK(data != NULL);
+        CHECK(!prefetch_get_planned(L"vendor_boot_a", PREFETCH_IMAGE_SIZE));
+        android_image_plan_free(data);
+}
+
+/* Other images are copied out of the prefetch buffer, which is
+   released once the end of the image has been read.  */
+static VOID test_prefetch_copy(struct gpt_partition_interface *parti)
+{
+        UINT8 *part = prefetch_vendor_boot();
+        UINT8 *buf;
+
+        buf = AllocatePool(PREFETCH_IMAGE_SIZE);
+        CHECK(buf != NULL);
+        if (!buf)
+                return;
+
+        ram_disk_reset_counters();
+        CHECK(!EFI_ERROR(prefetch_partition_interface(parti, L"acpi_a",
+                                                      PREFETCH_IMAGE_SIZE)));
+        CHECK(ram_disk.async_reads == 1 && ram_disk.reads == 1);
+        CHECK(!prefetch_get_planned(L"acpi_a", PREFETCH_IMAGE_SIZE));
+
+        CHECK(!EFI_ERROR(prefetch_read(L"acpi_a", 0, 16, buf)));
+        CHECK(!memcmp(buf, part, 16));
+        CHECK(!EFI_ERROR(prefetch_read(L"acpi_a", 0, PREFETCH_IMAGE_SIZE, buf)));
+        CHECK(!memcmp(buf, part, PREFETCH_IMAGE_SIZE));
+        CHECK(prefetch_read(L"acpi_a", 0, 16, buf) == EFI_NOT_FOUND);
+        CHECK(ram_disk.async_reads == 1 && ram_disk.reads == 1);
+
+        /* Past the end of the partition.  */
+        CHECK(!EFI_ERROR(prefetch_partition_interface(parti, L"acpi_a",
+                                                      PREFETCH_PART_SIZE + 1)));
+        CHECK(prefetch_read(L"acpi_a", 0, 16, buf) == EFI_NOT_FOUND);
+
+        FreePool(buf);
+}
+
+static VOID test_prefetch(VOID)
+{
+        struct gpt_partition_interface parti;
+        UINT8 buf[16];
+
+        if (EFI_ERROR(ram_disk_init(PREFETCH_PART_START * PREFETCH_BLOCK_SIZE * 2 +
+                                    PREFETCH_PART_SIZE, PREFETCH_BLOCK_SIZE))) {
+                CHECK(FALSE);
+                return;
+        }
+
+        /* No EFI_BLOCK_IO2, nothing is prefetched.  */
+        ram_disk_partition(&parti, PREFETCH_PART_START,
+                           PREFETCH_PART_START + PREFETCH_PART_SIZE / PREFETCH_BLOCK_SIZE - 1);
+        CHECK(prefetch_partition_interface(&parti, L"acpi_a",
+                                           PREFETCH_IMAGE_SIZE) == EFI_UNSUPPORTED);
+        CHECK(prefetch_read(L"acpi_a", 0, sizeof(buf), buf) == EFI_NOT_FOUND);
+
+        CHECK(!EFI_ERROR(ram_disk_install_bio2()));
+        ram_disk_partition(&parti, PREFETCH_PART_START,
+                           PREFETCH_PART_START + PREFETCH_PART_SIZE / PREFETCH_BLOCK_SIZE - 1);
+        test_prefetch_planned(&parti);
+        test_prefetch_copy(&parti);
+
+        prefetch_release();
+        android_image_plan_release();
+        block_cache_invalidate_all();
+        ram_disk_free();
+}
+
+#define CACHE_BLOCK_SIZE 512
+#define CACHE_DISK_SIZE (256 * 1024)
+/* Size of the lines the block cache reads.  */
+#define CACHE_LINE_SIZE 4096
+
+static struct block_cache_stats cache_stats;
+
+/* Check the counters changes since the previous call.  */
+static VOID check_cache_stats(UINT64 hits, UINT64 misses, UINT64 invalidations)
+{
+        struct block_cache_stats stats;
+
+        block_cache_get_stats(&stats);
+        CHECK(stats.hits - cache_stats.hits == hits);
+        CHECK(stats.misses - cache_stats.misses == misses);
+        CHECK(stats.invalidations - cache_stats.invalidations == invalidations);
+        cache_stats = stats;
+}
+
+static BOOLEAN cache_read(UINT64 offset, UINTN size, UINT8 *buf)
+{
+        return !EFI_ERROR(block_cache_read(&ram_disk.bio, &ram_disk.dio, offset, size, buf)) &&
+                !memcmp(buf, ram_disk.data + offset, size);
+}
+
+static VOID test_block_cache(VOID)
+{
+        struct block_cache_stats stats;
+        EFI_BLOCK_IO other_bio;
+        UINT8 *buf;
+        UINTN i;
+
+        buf = AllocatePool(CACHE_DISK_SIZE);
+        CHECK(buf != NULL);
+        if (!buf || EFI_ERROR(ram_disk_init(CACHE_DISK_SIZE, CACHE_BLOCK_SIZE))) {
+                CHECK(FALSE);
+                goto out;
+        }
+        for (i = 0; i < CACHE_DISK_SIZE; i++)
+                ram_disk.data[i] = (UINT8)test_rand();
+
+        block_cache_invalidate_all();
+        block_cache_get_stats(&cache_stats);
+
+        /* The whole line is read on a miss, the other reads in that
+           line are served from memory.  */
+        ram_disk_reset_counters();
+        CHECK(cache_read(CACHE_LINE_SIZE + 100, CACHE_BLOCK_SIZE, buf));
+        CHECK(ram_disk.reads == 1 && ram_disk.read_bytes == CACHE_LINE_SIZE);
+        CHECK(cache_read(CACHE_LINE_SIZE, 16, buf));
+        CHECK(cache_read(2 * CACHE_LINE_SIZE - 16, 16, buf));
+        CHECK(ram_disk.reads == 1);
+        check_cache_stats(2, 1, 0);
+
+        /* A read across two lines is a miss of its own.  */
+        ram_disk_reset_counters();
+        CHECK(cache_read(2 * CACHE_LINE_SIZE - 8, 16, buf));
+        CHECK(ram_disk.reads == 1 && ram_disk.read_bytes == 2 * CACHE_LINE_SIZE);
+        check_cache_stats(0, 1, 0);
+
+        /* Image loads bypass the cache.  */
+        ram_disk_reset_counters();
+        CHECK(cache_read(0, CACHE_DISK_SIZE / 2, buf));
+        CHECK(ram_disk.reads == 1 && ram_disk.read_bytes == CACHE_DISK_SIZE / 2);
+        check_cache_stats(0, 0, 0);
+
+        /* A write drops both entries it overlaps, the next read gets
+           the new data from the disk.  */
+        ram_disk.data[2 * CACHE_LINE_SIZE - 4] ^= 0xff;
+        block_cache_invalidate(&ram_disk.bio, 2 * CACHE_LINE_SIZE - 4, 1);
+        check_cache_stats(0, 0, 2);
+        ram_disk_reset_counters();
+        CHECK(cache_read(2 * CACHE_LINE_SIZE - 4, 1, buf));
+        CHECK(ram_disk.reads == 1);
+        check_cache_stats(0, 1, 0);
+
+        /* Writes elsewhere or on another device keep the entry.  */
+        block_cache_invalidate(&ram_disk.bio, 3 * CACHE_LINE_SIZE, CACHE_LINE_SIZE);
+        block_cache_invalidate(&other_bio, CACHE_LINE_SIZE, 1);
+        CHECK(cache_read(CACHE_LINE_SIZE + 1, 1, buf));
+        check_cache_stats(1, 0, 0);
+
+        /* So does a media change.  */
+        ram_disk.media.MediaId++;
+        CHECK(cache_read(CACHE_LINE_SIZE + 1, 1, buf));
+        check_cache_stats(0, 1, 0);
+
+        /* The last line is truncated to the end of the disk.  */
+        ram_disk_reset_counters();
+        ram_disk.media.LastBlock = (CACHE_DISK_SIZE - CACHE_LINE_SIZE / 2) / CACHE_BLOCK_SIZE - 1;
+        CHECK(cache_read(CACHE_DISK_SIZE - CACHE_LINE_SIZE, 16, buf));
+        CHECK(ram_disk.read_bytes == CACHE_LINE_SIZE / 2);
+        check_cache_stats(0, 1, 0);
+        ram_disk.media.LastBlock = CACHE_DISK_SIZE / CACHE_BLOCK_SIZE - 1;
+
+        /* Reading more lines than the cache holds evicts the least
+           recently used ones.  */
+        block_cache_invalidate_all();
+        block_cache_get_stats(&cache_stats);
+        ram_disk_reset_counters();
+        for (i = 0; i < CACHE_DISK_SIZE / CACHE_LINE_SIZE; i++)
+                CHECK(cache_read(i * CACHE_LINE_SIZE, 16, buf));
+        CHECK(cache_read((i - 1) * CACHE_LINE_SIZE, 16, buf));
+        CHECK(cache_read(0, 16, buf));
+        CHECK(ram_disk.reads == i + 1);
+        block_cache_get_stats(&stats);
+        CHECK(stats.evictions > cache_stats.evictions);
+        check_cache_stats(1, i + 1, 0);
+
+        block_cache_invalidate_all();
+        block_cache_get_stats(&stats);
+        CHECK(stats.invalidations > cache_stats.invalidations);
+        ram_disk_free();
+out:
+        if (buf)
+                FreePool(buf);
+}
+
+static struct test_suite {
+        CHAR16 *name;
+        VOID (*fun)(VOID);
+} TEST_SUITES[] = {
+#ifdef USE_UI
+        { L"ux", test_ux },
+#endif
+        { L"keys", test_keys },
+        { L"cmdline", test_cmdline },
+        { L"bootconfig", test_bootconfig },
+        { L"elf", test_elf },
+        { L"read-ahead", test_read_ahead },
+        { L"rsa", test_rsa },
+        { L"rollback", test_rollback },
+        { L"crc32", test_crc32 },
+        { L"delta", test_delta },
+        { L"verify", test_verify },
+        { L"discard", test_discard },
+        { L"storage", test_storage },
+        { L"prefetch", test_prefetch },
+        { L"block-cache", test_block_cache },
+#ifdef USE_TRUSTY
+        { L"keymaster", test_keymaster },
+#endif
         { L"watchdog", test_watchdog }
 };
 
@@ -128,8 +2637,10 @@ VOID unittest_main(CHAR16 *testname)
                     !StrCmp(TEST_SUITES[i].name, testname)) {
                         found = TRUE;
                         Print(L"'%s' test suite begins\n", TEST_SUITES[i].name);
+                        test_failures = 0;
                         TEST_SUITES[i].fun();
-                        Print(L"'%s' test suite terminated\n", TEST_SUITES[i].name);
+                        Print(L"'%s' test suite terminated, %d failure(s)\n",
+                              TEST_SUITES[i].name, test_failures);
                 }
 
         if (!found)